@@ -0,0 +1,151 @@
+/**
+ * @file A benchmark measuring channel throughput between threads: a ping-pong
+ * between two threads over unbuffered channels, and a pipeline of threads
+ * connected by buffered channels.
+ */
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/time.h>
+
+#include "interrupts.h"
+#include "thread.h"
+
+// Number of round trips in the ping-pong
+#define ROUND_TRIPS 200000
+// Number of stages in the pipeline
+#define STAGES 8
+// Number of messages sent through the pipeline
+#define PIPELINE_MESSAGES 200000
+// Capacity of each channel in the pipeline
+#define PIPELINE_CAPACITY 16
+
+ThreadChan* ping;
+ThreadChan* pong;
+ThreadChan* links[STAGES + 1];
+
+double
+elapsed_seconds(struct timeval* start)
+{
+  struct timeval end, diff;
+  gettimeofday(&end, NULL);
+  timersub(&end, start, &diff);
+  return diff.tv_sec + diff.tv_usec / 1000000.0;
+}
+
+void
+f_ponger(void)
+{
+  long message;
+  while (ThreadChanRecv(ping, &message) == 0) {
+    message++;
+    ThreadChanSend(pong, &message);
+  }
+}
+
+void
+run_ping_pong(void)
+{
+  struct timeval start;
+  ping = ThreadChanCreate(sizeof(long), 0);
+  pong = ThreadChanCreate(sizeof(long), 0);
+  assert(ping != NULL && pong != NULL);
+
+  Tid const tid = ThreadCreate((void (*)(void*))f_ponger, NULL);
+  assert(tid > 0);
+
+  gettimeofday(&start, NULL);
+  for (long i = 0; i < ROUND_TRIPS; i++) {
+    long message = i;
+    ThreadChanSend(ping, &message);
+    ThreadChanRecv(pong, &message);
+    assert(message == i + 1);
+  }
+  double const seconds = elapsed_seconds(&start);
+
+  ThreadChanClose(ping);
+  int exit_code;
+  ThreadJoin(tid, &exit_code);
+  ThreadChanDestroy(ping);
+  ThreadChanDestroy(pong);
+
+  InterruptsPrintf("%-10s %8.3f s %12.0f messages/s\n",
+                   "ping-pong",
+                   seconds,
+                   2 * ROUND_TRIPS / seconds);
+}
+
+void
+f_stage(long index)
+{
+  long message;
+  while (ThreadChanRecv(links[index], &message) == 0) {
+    message++;
+    ThreadChanSend(links[index + 1], &message);
+  }
+  ThreadChanClose(links[index + 1]);
+}
+
+void
+run_pipeline(void)
+{
+  struct timeval start;
+  Tid tids[STAGES];
+  for (int i = 0; i <= STAGES; i++) {
+    links[i] = ThreadChanCreate(sizeof(long), PIPELINE_CAPACITY);
+    assert(links[i] != NULL);
+  }
+  for (long i = 0; i < STAGES; i++) {
+    tids[i] = ThreadCreate((void (*)(void*))f_stage, (void*)i);
+    assert(tids[i] > 0);
+  }
+
+  // The main thread feeds the pipeline and drains its far end as it goes
+  gettimeofday(&start, NULL);
+  long received = 0;
+  for (long i = 0; i < PIPELINE_MESSAGES; i++) {
+    long message = i;
+    ThreadChanSend(links[0], &message);
+    while (received <= i - PIPELINE_CAPACITY &&
+           ThreadChanRecv(links[STAGES], &message) == 0) {
+      assert(message == received + STAGES);
+      received++;
+    }
+  }
+  ThreadChanClose(links[0]);
+  long message;
+  while (ThreadChanRecv(links[STAGES], &message) == 0) {
+    assert(message == received + STAGES);
+    received++;
+  }
+  double const seconds = elapsed_seconds(&start);
+  assert(received == PIPELINE_MESSAGES);
+
+  for (int i = 0; i < STAGES; i++) {
+    int exit_code;
+    ThreadJoin(tids[i], &exit_code);
+  }
+  for (int i = 0; i <= STAGES; i++) {
+    ThreadChanDestroy(links[i]);
+  }
+
+  InterruptsPrintf("%-10s %8.3f s %12.0f messages/s\n",
+                   "pipeline",
+                   seconds,
+                   PIPELINE_MESSAGES / seconds);
+}
+
+int
+main(void)
+{
+  // Initialize the user-level thread package
+  ThreadInit();
+  // Initialize and enable interrupts
+  InterruptsInit();
+  // Uninterrupted prints are expensive, keep the interrupts logging quiet
+  InterruptsSetLogLevel(INTERRUPTS_QUIET);
+
+  run_ping_pong();
+  run_pipeline();
+  return 0;
+}
@@ -0,0 +1,144 @@
+/**
+ * @file A benchmark of waiters parked on a wait queue as C++20 coroutines
+ * (thread_coro.hpp) against the same waiters as threads: the memory each one
+ * holds while it waits, and the cost of waking it and running it to the end.
+ *
+ * Heap use is read with mallinfo2 before and after the waiters park, so it
+ * includes a coroutine's frame and its queued wait, or a thread's stack and
+ * queue node. MAX_THREADS / 2 threads wait, leaving slots for the task
+ * workers.
+ *
+ * Usage: coro [COUNT]  parks COUNT coroutines, 100000 by default.
+ */
+#include <cassert>
+#include <cstdlib>
+#include <malloc.h>
+#include <sys/time.h>
+
+#include "interrupts.h"
+#include "thread.h"
+#include "thread_coro.hpp"
+
+WaitQueue* queue;
+long woken;
+long parked;
+
+thread_coro::task<void>
+coro_waiter()
+{
+  int const status = co_await thread_coro::sleep_on(queue);
+  assert(status == 0);
+  woken++;
+}
+
+void
+thread_waiter(void* unused)
+{
+  (void)unused;
+  // Count ourselves parked only once nothing can run before we are
+  InterruptsState enabled = InterruptsDisable();
+  parked++;
+  ThreadSleep(queue);
+  InterruptsSet(enabled);
+  woken++;
+}
+
+double
+elapsed_us(struct timeval* start)
+{
+  struct timeval end, diff;
+  gettimeofday(&end, NULL);
+  timersub(&end, start, &diff);
+  return diff.tv_sec * 1000000.0 + diff.tv_usec;
+}
+
+/**
+ * @return The bytes of heap in use, including chunks mapped on their own.
+ */
+long
+heap_in_use()
+{
+  InterruptsState enabled = InterruptsDisable();
+  struct mallinfo2 const info = mallinfo2();
+  InterruptsSet(enabled);
+  return (long)(info.uordblks + info.hblkhd);
+}
+
+void
+report(const char* kind, long count, long bytes, double us)
+{
+  InterruptsPrintf("%-10s %8ld waiters %8ld bytes/waiter %8.1f ns/wake\n",
+                   kind,
+                   count,
+                   bytes / count,
+                   us * 1000 / count);
+}
+
+void
+run_coroutines(long count)
+{
+  woken = 0;
+  long const before = heap_in_use();
+  for (long i = 0; i < count; i++) {
+    int const err = thread_coro::spawn(coro_waiter());
+    assert(err == 0);
+  }
+  // Every coroutine has run to its wait once its first task has returned
+  int err = TaskWaitAll();
+  assert(err == 0);
+  long const bytes = heap_in_use() - before;
+
+  struct timeval start;
+  gettimeofday(&start, NULL);
+  ThreadWakeAll(queue);
+  err = TaskWaitAll();
+  assert(err == 0);
+  double const us = elapsed_us(&start);
+  assert(woken == count);
+  report("coroutine", count, bytes, us);
+}
+
+void
+run_threads(long count)
+{
+  woken = 0;
+  parked = 0;
+  Tid tids[MAX_THREADS];
+  long const before = heap_in_use();
+  for (long i = 0; i < count; i++) {
+    tids[i] = ThreadCreate(thread_waiter, NULL);
+    assert(tids[i] > 0);
+  }
+  while (parked < count) {
+    ThreadYield();
+  }
+  long const bytes = heap_in_use() - before;
+
+  struct timeval start;
+  gettimeofday(&start, NULL);
+  ThreadWakeAll(queue);
+  for (long i = 0; i < count; i++) {
+    ThreadJoin(tids[i], NULL);
+  }
+  double const us = elapsed_us(&start);
+  assert(woken == count);
+  report("thread", count, bytes, us);
+}
+
+int
+main(int argc, char* argv[])
+{
+  long const count = argc > 1 ? atol(argv[1]) : 100000;
+
+  // Initialize the user-level thread package
+  ThreadInit();
+  // Initialize and enable interrupts
+  InterruptsInit();
+  // Uninterrupted prints are expensive, keep the interrupts logging quiet
+  InterruptsSetLogLevel(INTERRUPTS_QUIET);
+
+  queue = WaitQueueCreate();
+  run_coroutines(count);
+  run_threads(MAX_THREADS / 2);
+  return 0;
+}
@@ -0,0 +1,148 @@
+/**
+ * @file A benchmark of an echo server with one thread per connection, over
+ * non-blocking socket pairs, with threads parked on descriptor readiness by
+ * ThreadWaitFd.
+ *
+ * Each client thread opens its connections one after the other, spawning a
+ * server thread for each, so CONNECTIONS connections are served with at most
+ * CONCURRENCY of them open at a time.
+ */
+#include <assert.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "interrupts.h"
+#include "thread.h"
+
+// Number of connections served in total
+#define CONNECTIONS 10000
+// Number of connections open at a time, each with a client and a server thread
+#define CONCURRENCY 100
+// Number of round trips per connection
+#define MESSAGES 10
+// Size of each message, in bytes
+#define MESSAGE_SIZE 64
+
+// Round trips completed, to check that no message was lost
+long round_trips = 0;
+
+/**
+ * Read exactly size bytes from fd, waiting for it to be readable as needed.
+ *
+ * @return size, or 0 at end of file.
+ */
+ssize_t
+read_full(int fd, char* buf, size_t size)
+{
+  size_t done = 0;
+  while (done < size) {
+    ssize_t const n = read(fd, buf + done, size - done);
+    if (n > 0) {
+      done += n;
+    } else if (n == 0) {
+      return 0;
+    } else {
+      assert(errno == EAGAIN);
+      ThreadWaitFd(fd, THREAD_FD_READ, THREAD_SELECT_FOREVER);
+    }
+  }
+  return done;
+}
+
+void
+write_full(int fd, const char* buf, size_t size)
+{
+  size_t done = 0;
+  while (done < size) {
+    ssize_t const n = write(fd, buf + done, size - done);
+    if (n > 0) {
+      done += n;
+    } else {
+      assert(errno == EAGAIN);
+      ThreadWaitFd(fd, THREAD_FD_WRITE, THREAD_SELECT_FOREVER);
+    }
+  }
+}
+
+void
+f_server(long fd)
+{
+  char buf[MESSAGE_SIZE];
+  while (read_full(fd, buf, MESSAGE_SIZE) == MESSAGE_SIZE) {
+    write_full(fd, buf, MESSAGE_SIZE);
+  }
+  close(fd);
+}
+
+void
+f_client(long connections)
+{
+  char out[MESSAGE_SIZE], in[MESSAGE_SIZE];
+  for (long c = 0; c < connections; c++) {
+    int fds[2];
+    int const err = socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, fds);
+    assert(!err);
+    Tid const server =
+      ThreadCreate((void (*)(void*))f_server, (void*)(long)fds[1]);
+    assert(server > 0);
+
+    for (int m = 0; m < MESSAGES; m++) {
+      snprintf(out, MESSAGE_SIZE, "connection %ld message %d", c, m);
+      write_full(fds[0], out, MESSAGE_SIZE);
+      ssize_t const n = read_full(fds[0], in, MESSAGE_SIZE);
+      assert(n == MESSAGE_SIZE);
+      assert(memcmp(in, out, MESSAGE_SIZE) == 0);
+      round_trips++;
+    }
+    close(fds[0]);
+
+    int exit_code;
+    ThreadJoin(server, &exit_code);
+  }
+}
+
+int
+main(void)
+{
+  // Initialize the user-level thread package
+  ThreadInit();
+  // Initialize and enable interrupts
+  InterruptsInit();
+  // Uninterrupted prints are expensive, keep the interrupts logging quiet
+  InterruptsSetLogLevel(INTERRUPTS_QUIET);
+
+  struct timeval start, end, diff;
+  Tid tids[CONCURRENCY];
+
+  InterruptsPrintf("%d connections, %d open at a time, %d round trips of %d "
+                   "bytes each\n",
+                   CONNECTIONS,
+                   CONCURRENCY,
+                   MESSAGES,
+                   MESSAGE_SIZE);
+  gettimeofday(&start, NULL);
+  for (int i = 0; i < CONCURRENCY; i++) {
+    tids[i] = ThreadCreate((void (*)(void*))f_client,
+                           (void*)(long)(CONNECTIONS / CONCURRENCY));
+    assert(tids[i] > 0);
+  }
+  for (int i = 0; i < CONCURRENCY; i++) {
+    int exit_code;
+    ThreadJoin(tids[i], &exit_code);
+  }
+  gettimeofday(&end, NULL);
+  timersub(&end, &start, &diff);
+
+  double const seconds = diff.tv_sec + diff.tv_usec / 1000000.0;
+  assert(round_trips == (long)CONNECTIONS * MESSAGES);
+  InterruptsPrintf("%8.3f s %12.0f connections/s %12.0f round trips/s\n",
+                   seconds,
+                   CONNECTIONS / seconds,
+                   round_trips / seconds);
+  return 0;
+}
@@ -0,0 +1,150 @@
+/**
+ * @file A benchmark comparing the per-phase cost of a fork-join computation
+ * that re-creates its workers every phase, joining them one at a time or
+ * waiting for them all with a wait group, against one that keeps its workers
+ * and separates phases with a barrier.
+ */
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/time.h>
+
+#include "interrupts.h"
+#include "thread.h"
+
+// Number of worker threads per phase
+#define THREAD_COUNT 32
+// Number of phases to run
+#define PHASES 2000
+
+// Work done by each worker in the current phase
+long work[THREAD_COUNT];
+
+ThreadBarrier* barrier;
+
+void
+do_work(long index)
+{
+  work[index]++;
+}
+
+void
+f_one_phase(long index)
+{
+  do_work(index);
+}
+
+void
+f_all_phases(long index)
+{
+  for (int phase = 0; phase < PHASES; phase++) {
+    do_work(index);
+    ThreadBarrierWait(barrier);
+  }
+}
+
+double
+elapsed_us(struct timeval* start)
+{
+  struct timeval end, diff;
+  gettimeofday(&end, NULL);
+  timersub(&end, start, &diff);
+  return diff.tv_sec * 1000000.0 + diff.tv_usec;
+}
+
+void
+run_create_join(void)
+{
+  struct timeval start;
+  Tid tids[THREAD_COUNT];
+
+  gettimeofday(&start, NULL);
+  for (int phase = 0; phase < PHASES; phase++) {
+    for (long i = 0; i < THREAD_COUNT; i++) {
+      tids[i] = ThreadCreate((void (*)(void*))f_one_phase, (void*)i);
+      assert(tids[i] > 0);
+    }
+    for (int i = 0; i < THREAD_COUNT; i++) {
+      int exit_code;
+      ThreadJoin(tids[i], &exit_code);
+    }
+  }
+  InterruptsPrintf(
+    "%-12s %10.2f us/phase\n", "create/join", elapsed_us(&start) / PHASES);
+}
+
+void
+run_wait_group(void)
+{
+  struct timeval start;
+  ThreadWaitGroup* wg = ThreadWaitGroupCreate();
+  assert(wg != NULL);
+  Tid tids[THREAD_COUNT];
+  int exit_codes[THREAD_COUNT];
+
+  gettimeofday(&start, NULL);
+  for (int phase = 0; phase < PHASES; phase++) {
+    for (long i = 0; i < THREAD_COUNT; i++) {
+      Tid const tid =
+        ThreadWaitGroupSpawn(wg, (void (*)(void*))f_one_phase, (void*)i);
+      assert(tid > 0);
+    }
+    ThreadWaitGroupWait(wg);
+    int const exited =
+      ThreadWaitGroupExitCodes(wg, tids, exit_codes, THREAD_COUNT);
+    assert(exited == THREAD_COUNT);
+  }
+  InterruptsPrintf(
+    "%-12s %10.2f us/phase\n", "wait group", elapsed_us(&start) / PHASES);
+
+  ThreadWaitGroupDestroy(wg);
+}
+
+void
+run_barrier(void)
+{
+  struct timeval start;
+  Tid tids[THREAD_COUNT];
+
+  // The main thread takes part in every phase as well
+  barrier = ThreadBarrierCreate(THREAD_COUNT + 1);
+  assert(barrier != NULL);
+
+  gettimeofday(&start, NULL);
+  for (long i = 0; i < THREAD_COUNT; i++) {
+    tids[i] = ThreadCreate((void (*)(void*))f_all_phases, (void*)i);
+    assert(tids[i] > 0);
+  }
+  for (int phase = 0; phase < PHASES; phase++) {
+    ThreadBarrierWait(barrier);
+  }
+  for (int i = 0; i < THREAD_COUNT; i++) {
+    int exit_code;
+    ThreadJoin(tids[i], &exit_code);
+  }
+  InterruptsPrintf(
+    "%-12s %10.2f us/phase\n", "barrier", elapsed_us(&start) / PHASES);
+
+  ThreadBarrierDestroy(barrier);
+}
+
+int
+main(void)
+{
+  // Initialize the user-level thread package
+  ThreadInit();
+  // Initialize and enable interrupts
+  InterruptsInit();
+  // Uninterrupted prints are expensive, keep the interrupts logging quiet
+  InterruptsSetLogLevel(INTERRUPTS_QUIET);
+
+  InterruptsPrintf("%d workers, %d phases\n", THREAD_COUNT, PHASES);
+  run_create_join();
+  run_wait_group();
+  run_barrier();
+
+  for (int i = 0; i < THREAD_COUNT; i++) {
+    assert(work[i] == 3 * PHASES);
+  }
+  return 0;
+}
@@ -0,0 +1,123 @@
+/**
+ * @file A benchmark of a pipeline of dependent stages run as futures chained
+ * with ThreadFutureThen, inline and as tasks, against the same stages run as
+ * a thread each (ThreadCreate and ThreadJoin).
+ *
+ * Each stage adds one to the value of the stage before it. Chains are
+ * STAGE_COUNT stages long: they are built, started by setting their promise,
+ * waited for with ThreadFutureGet on their last stage and destroyed, until
+ * COUNT stages have run. The threads are created and joined one at a time,
+ * each taking its input from the one joined before it.
+ *
+ * Usage: futures [COUNT]  runs COUNT stages of each kind, 1 million by
+ * default.
+ */
+#include <assert.h>
+#include <stdlib.h>
+#include <sys/time.h>
+
+#include "interrupts.h"
+#include "thread.h"
+
+// Number of stages in each chain
+#define STAGE_COUNT 64
+
+long value;
+
+void
+then_increment(void* arg, const void* in, void* out)
+{
+  (void)arg;
+  *(long*)out = *(const long*)in + 1;
+}
+
+void
+f_increment(void* arg)
+{
+  (void)arg;
+  value++;
+}
+
+double
+elapsed_us(struct timeval* start)
+{
+  struct timeval end, diff;
+  gettimeofday(&end, NULL);
+  timersub(&end, start, &diff);
+  return diff.tv_sec * 1000000.0 + diff.tv_usec;
+}
+
+void
+report(const char* kind, long count, double us)
+{
+  InterruptsPrintf(
+    "%-8s %10ld stages %8.1f ns/stage\n", kind, count, us * 1000 / count);
+}
+
+void
+run_chains(const char* kind, ThreadThenPolicy policy, long count)
+{
+  ThreadFuture* stages[STAGE_COUNT];
+  struct timeval start;
+  gettimeofday(&start, NULL);
+  for (long done = 0; done < count; done += STAGE_COUNT) {
+    ThreadPromise* const promise = ThreadPromiseCreate(sizeof(long));
+    assert(promise != NULL);
+    ThreadFuture* from = ThreadPromiseFuture(promise);
+    for (int i = 0; i < STAGE_COUNT; i++) {
+      stages[i] =
+        ThreadFutureThen(from, sizeof(long), then_increment, NULL, policy);
+      assert(stages[i] != NULL);
+      from = stages[i];
+    }
+
+    long result = 0;
+    int err = ThreadPromiseSet(promise, &result);
+    assert(err == 0);
+    err = ThreadFutureGet(stages[STAGE_COUNT - 1], &result);
+    assert(err == 0);
+    assert(result == STAGE_COUNT);
+
+    ThreadFutureDestroy(ThreadPromiseFuture(promise));
+    ThreadPromiseDestroy(promise);
+    for (int i = 0; i < STAGE_COUNT; i++) {
+      ThreadFutureDestroy(stages[i]);
+    }
+  }
+  double const us = elapsed_us(&start);
+  report(kind, count, us);
+}
+
+void
+run_threads(long count)
+{
+  value = 0;
+  struct timeval start;
+  gettimeofday(&start, NULL);
+  for (long i = 0; i < count; i++) {
+    Tid const tid = ThreadCreate(f_increment, NULL);
+    assert(tid > 0);
+    ThreadJoin(tid, NULL);
+  }
+  double const us = elapsed_us(&start);
+  assert(value == count);
+  report("thread", count, us);
+}
+
+int
+main(int argc, char* argv[])
+{
+  long const count = argc > 1 ? atol(argv[1]) : 1000000;
+
+  // Initialize the user-level thread package
+  ThreadInit();
+  // Initialize and enable interrupts
+  InterruptsInit();
+  // Uninterrupted prints are expensive, keep the interrupts logging quiet
+  InterruptsSetLogLevel(INTERRUPTS_QUIET);
+
+  run_chains("inline", THREAD_THEN_INLINE, count);
+  run_chains("task", THREAD_THEN_TASK, count);
+  run_threads(count);
+  return 0;
+}
@@ -0,0 +1,445 @@
+/**
+ * @file Microbenchmarks of context switches and the basic primitives,
+ * reporting nanoseconds per operation with percentiles.
+ *
+ * Each benchmark is run as SAMPLES timed samples of a fixed number of
+ * operations, after WARMUP untimed ones. Results are printed as CSV, one row
+ * per benchmark, so runs can be compared by a script:
+ *
+ *   benchmark,threads,samples,ops_per_sample,mean_ns,p50_ns,p90_ns,p99_ns,max_ns
+ *
+ * where the nanosecond columns are per operation, across samples. Preemption
+ * is enabled throughout, as it is for any program using the library, so its
+ * ticks show up in the upper percentiles.
+ *
+ * Usage: micro [NAME]  runs only the benchmarks whose name contains NAME.
+ */
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "interrupts.h"
+#include "thread.h"
+
+// Timed samples per benchmark
+#define SAMPLES 1000
+// Untimed samples run first, to warm up caches and the allocator
+#define WARMUP 50
+
+/**
+ * A benchmark: run runs ops operations and returns the nanoseconds they took.
+ */
+typedef struct
+{
+  const char* name;
+  int threads;
+  int ops;
+  void (*set_up)(int threads);
+  double (*run)(int ops);
+  void (*tear_down)(void);
+} Bench;
+
+// Shared state for the functions passed to ThreadCreate
+volatile int done;
+volatile int asleep;
+WaitQueue* queue;
+Tid partners[MAX_THREADS];
+int partner_count;
+// When the last woken thread ran, or 0 if none has yet
+volatile double woken_at;
+
+double
+now_ns(void)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1e9 + now.tv_nsec;
+}
+
+int
+compare_doubles(const void* a, const void* b)
+{
+  double const x = *(const double*)a;
+  double const y = *(const double*)b;
+  return (x > y) - (x < y);
+}
+
+//****************************************************************************
+// Thread bodies
+//****************************************************************************
+
+void
+f_nop(void)
+{
+}
+
+void
+f_yield(void)
+{
+  while (!done) {
+    ThreadYield();
+  }
+}
+
+void
+f_yield_to_main(void)
+{
+  while (!done) {
+    ThreadYieldTo(0);
+  }
+}
+
+void
+f_sleep(void)
+{
+  // Not preempted, so once it has run it is asleep again before anyone checks
+  InterruptsDisable();
+  while (!done) {
+    asleep++;
+    ThreadSleep(queue);
+    woken_at = now_ns();
+  }
+  InterruptsEnable();
+}
+
+//****************************************************************************
+// Set up and tear down
+//****************************************************************************
+
+void
+start_partners(void (*f)(void), int count)
+{
+  done = 0;
+  asleep = 0;
+  partner_count = count;
+  for (int i = 0; i < count; i++) {
+    partners[i] = ThreadCreate((void (*)(void*))f, NULL);
+    assert(partners[i] > 0);
+  }
+}
+
+void
+set_up_yield(int threads)
+{
+  start_partners(f_yield, threads - 1);
+}
+
+void
+set_up_yield_to(int threads)
+{
+  (void)threads;
+  start_partners(f_yield_to_main, 1);
+}
+
+void
+set_up_sleep(int threads)
+{
+  queue = WaitQueueCreate();
+  assert(queue != NULL);
+  start_partners(f_sleep, threads - 1);
+  while (asleep < partner_count) {
+    ThreadYield();
+  }
+}
+
+/**
+ * One thread asleep on the queue, and the rest yielding, so that a thread
+ * woken onto the ready queue waits behind all of them.
+ */
+void
+set_up_sleep_among_yielders(int threads)
+{
+  set_up_sleep(2);
+  for (int i = 2; i < threads; i++) {
+    partners[partner_count] = ThreadCreate((void (*)(void*))f_yield, NULL);
+    assert(partners[partner_count] > 0);
+    partner_count++;
+  }
+}
+
+void
+set_up_nothing(int threads)
+{
+  (void)threads;
+}
+
+void
+stop_partners(void)
+{
+  done = 1;
+  if (queue != NULL) {
+    ThreadWakeAll(queue);
+  }
+  for (int i = 0; i < partner_count; i++) {
+    int exit_code;
+    ThreadJoin(partners[i], &exit_code);
+  }
+  partner_count = 0;
+  if (queue != NULL) {
+    WaitQueueDestroy(queue);
+    queue = NULL;
+  }
+}
+
+void
+tear_down_nothing(void)
+{
+}
+
+//****************************************************************************
+// Benchmarks
+//****************************************************************************
+
+/**
+ * One operation is one switch between the running threads.
+ */
+double
+run_yield(int ops)
+{
+  int const threads = partner_count + 1;
+  // Every yield by this thread lets each of the others run once
+  int const rounds = ops / threads;
+  double const start = now_ns();
+  for (int i = 0; i < rounds; i++) {
+    ThreadYield();
+  }
+  return (now_ns() - start) * ops / (rounds * threads);
+}
+
+/**
+ * One operation is one direct switch with ThreadYieldTo.
+ */
+double
+run_yield_to(int ops)
+{
+  double const start = now_ns();
+  for (int i = 0; i < ops / 2; i++) {
+    ThreadYieldTo(partners[0]);
+  }
+  return now_ns() - start;
+}
+
+/**
+ * One operation is creating a thread that returns at once, and joining it.
+ */
+double
+run_create_join(int ops)
+{
+  double const start = now_ns();
+  for (int i = 0; i < ops; i++) {
+    Tid const tid = ThreadCreate((void (*)(void*))f_nop, NULL);
+    assert(tid > 0);
+    int exit_code;
+    ThreadJoin(tid, &exit_code);
+  }
+  return now_ns() - start;
+}
+
+/**
+ * One operation is the time from ThreadWakeNext to the woken thread running.
+ */
+double
+run_sleep_wake(int ops)
+{
+  double total = 0;
+  for (int i = 0; i < ops; i++) {
+    woken_at = 0;
+    double const start = now_ns();
+    ThreadWakeNext(queue);
+    while (woken_at == 0) {
+      ThreadYield();
+    }
+    total += woken_at - start;
+  }
+  return total;
+}
+
+/**
+ * One operation is the time from ThreadWakeNextAndSwitch to the woken thread
+ * running, which puts this thread back at the head of the ready queue.
+ */
+double
+run_wake_switch(int ops)
+{
+  double total = 0;
+  for (int i = 0; i < ops; i++) {
+    woken_at = 0;
+    double const start = now_ns();
+    ThreadWakeNextAndSwitch(queue, THREAD_SWITCH_CALLER_FIRST);
+    while (woken_at == 0) {
+      ThreadYield();
+    }
+    total += woken_at - start;
+  }
+  return total;
+}
+
+/**
+ * One operation is the time from ThreadWakeAll to the last woken thread
+ * running.
+ */
+double
+run_wake_all(int ops)
+{
+  double total = 0;
+  for (int i = 0; i < ops; i++) {
+    asleep = 0;
+    double const start = now_ns();
+    ThreadWakeAll(queue);
+    // Woken in order, so the waiter that sleeps again last ran last
+    while (asleep < partner_count) {
+      ThreadYield();
+    }
+    total += woken_at - start;
+  }
+  return total;
+}
+
+// Iterations of the compute loop per microsecond, measured with interrupts
+// disabled
+double spins_per_us;
+
+/**
+ * Busy work that neither blocks nor makes system calls.
+ */
+void
+compute(long iterations)
+{
+  for (volatile long i = 0; i < iterations; i++)
+    ;
+}
+
+void
+set_up_compute(int threads)
+{
+  (void)threads;
+  long const iterations = 10000000;
+  InterruptsState enabled = InterruptsDisable();
+  double const start = now_ns();
+  compute(iterations);
+  spins_per_us = iterations / ((now_ns() - start) / 1000);
+  InterruptsSet(enabled);
+}
+
+/**
+ * One operation is one preemption tick with no other thread to run, measured
+ * as the extra time a fixed amount of work takes with interrupts enabled.
+ */
+double
+run_preempt_idle(int ops)
+{
+  // Enough work to span ops ticks
+  double const work_us = (double)ops * INTERRUPTS_SIGNAL_INTERVAL;
+  double const start = now_ns();
+  compute((long)(work_us * spins_per_us));
+  double const extra = now_ns() - start - work_us * 1000;
+  // Scale to exactly ops ticks, however many arrived
+  double const ticks = (work_us + extra / 1000) / INTERRUPTS_SIGNAL_INTERVAL;
+  return extra > 0 ? extra * ops / ticks : 0;
+}
+
+/**
+ * Run bench and print its row.
+ */
+void
+run_bench(const Bench* bench)
+{
+  static double samples[SAMPLES];
+
+  bench->set_up(bench->threads);
+  for (int i = 0; i < WARMUP; i++) {
+    bench->run(bench->ops);
+  }
+  double total = 0;
+  for (int i = 0; i < SAMPLES; i++) {
+    samples[i] = bench->run(bench->ops) / bench->ops;
+    total += samples[i];
+  }
+  bench->tear_down();
+
+  qsort(samples, SAMPLES, sizeof(samples[0]), compare_doubles);
+  InterruptsPrintf("%s,%d,%d,%d,%.1f,%.1f,%.1f,%.1f,%.1f\n",
+                   bench->name,
+                   bench->threads,
+                   SAMPLES,
+                   bench->ops,
+                   total / SAMPLES,
+                   samples[SAMPLES / 2],
+                   samples[SAMPLES * 90 / 100],
+                   samples[SAMPLES * 99 / 100],
+                   samples[SAMPLES - 1]);
+}
+
+int
+main(int argc, char* argv[])
+{
+  const char* filter = argc > 1 ? argv[1] : "";
+  static const int thread_counts[] = { 2, 4, 16, 64, MAX_THREADS };
+  int const sizes = sizeof(thread_counts) / sizeof(thread_counts[0]);
+  static Bench benches[32];
+  int count = 0;
+
+  benches[count++] = (Bench){
+    "yield_pingpong", 2, 1000, set_up_yield, run_yield, stop_partners
+  };
+  for (int i = 0; i < sizes; i++) {
+    int const threads = thread_counts[i];
+    benches[count++] = (Bench){
+      "yield_round_robin", threads, 4 * threads,
+      set_up_yield,        run_yield, stop_partners
+    };
+  }
+  benches[count++] = (Bench){
+    "yield_to", 2, 1000, set_up_yield_to, run_yield_to, stop_partners
+  };
+  benches[count++] = (Bench){
+    "create_join", 2, 100, set_up_nothing, run_create_join, tear_down_nothing
+  };
+  benches[count++] = (Bench){
+    "sleep_wake", 2, 100, set_up_sleep, run_sleep_wake, stop_partners
+  };
+  // The same wake, behind other ready threads or switched to directly
+  for (int i = 0; i < sizes; i++) {
+    int const threads = thread_counts[i];
+    benches[count++] = (Bench){ "sleep_wake_behind_ready",
+                                threads,
+                                100,
+                                set_up_sleep_among_yielders,
+                                run_sleep_wake,
+                                stop_partners };
+    benches[count++] = (Bench){ "wake_switch",
+                                threads,
+                                100,
+                                set_up_sleep_among_yielders,
+                                run_wake_switch,
+                                stop_partners };
+  }
+  for (int i = 0; i < sizes; i++) {
+    int const threads = thread_counts[i];
+    benches[count++] = (Bench){
+      "wake_all", threads, 1, set_up_sleep, run_wake_all, stop_partners
+    };
+  }
+  benches[count++] = (Bench){
+    "preempt_idle_tick", 1, 5, set_up_compute, run_preempt_idle,
+    tear_down_nothing
+  };
+
+  // Initialize the user-level thread package
+  ThreadInit();
+  // Initialize and enable interrupts
+  InterruptsInit();
+  // Uninterrupted prints are expensive, keep the interrupts logging quiet
+  InterruptsSetLogLevel(INTERRUPTS_QUIET);
+
+  InterruptsPrintf("benchmark,threads,samples,ops_per_sample,mean_ns,p50_ns,"
+                   "p90_ns,p99_ns,max_ns\n");
+  for (int i = 0; i < count; i++) {
+    if (strstr(benches[i].name, filter) != NULL) {
+      run_bench(&benches[i]);
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,114 @@
+/**
+ * @file A benchmark comparing ThreadMutex against the compare-and-swap spin
+ * lock used by the hot potato example, with preemption enabled.
+ */
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/time.h>
+
+#include "interrupts.h"
+#include "thread.h"
+
+// Number of threads contending for the lock
+#define THREAD_COUNT 16
+// Number of critical sections each thread runs
+#define ITERATIONS 2000
+// How long, in microseconds, a thread holds the lock
+#define CRITICAL_SECTION 20
+// How long, in microseconds, a thread works between critical sections
+#define NON_CRITICAL_SECTION 20
+
+// The shared state protected by the lock
+long counter = 0;
+// The spin lock, as in hot_potato.c
+int spin_lock = 0;
+// The blocking mutex
+ThreadMutex* mutex;
+
+void
+f_spin_lock(void)
+{
+  for (int i = 0; i < ITERATIONS; i++) {
+    while (!__sync_bool_compare_and_swap(&spin_lock, 0, 1))
+      ; // Could not acquire the lock, try again
+
+    counter++;
+    ThreadSpin(CRITICAL_SECTION);
+
+    int const err = __sync_bool_compare_and_swap(&spin_lock, 1, 0);
+    assert(err);
+
+    ThreadSpin(NON_CRITICAL_SECTION);
+  }
+}
+
+void
+f_mutex(void)
+{
+  for (int i = 0; i < ITERATIONS; i++) {
+    int err = ThreadMutexLock(mutex);
+    assert(!err);
+
+    counter++;
+    ThreadSpin(CRITICAL_SECTION);
+
+    err = ThreadMutexUnlock(mutex);
+    assert(!err);
+
+    ThreadSpin(NON_CRITICAL_SECTION);
+  }
+}
+
+void
+run_benchmark(const char* name, void (*f)(void))
+{
+  struct timeval start, end, diff;
+  Tid tids[THREAD_COUNT];
+
+  counter = 0;
+  gettimeofday(&start, NULL);
+
+  for (int i = 0; i < THREAD_COUNT; i++) {
+    tids[i] = ThreadCreate((void (*)(void*))f, NULL);
+    assert(tids[i] > 0);
+  }
+  for (int i = 0; i < THREAD_COUNT; i++) {
+    int exit_code;
+    ThreadJoin(tids[i], &exit_code);
+  }
+
+  gettimeofday(&end, NULL);
+  timersub(&end, &start, &diff);
+
+  double const seconds = diff.tv_sec + diff.tv_usec / 1000000.0;
+  assert(counter == (long)THREAD_COUNT * ITERATIONS);
+  InterruptsPrintf("%-10s %8.3f s %12.0f acquisitions/s\n",
+                   name,
+                   seconds,
+                   counter / seconds);
+}
+
+int
+main(void)
+{
+  // Initialize the user-level thread package
+  ThreadInit();
+  // Initialize and enable interrupts
+  InterruptsInit();
+  // Uninterrupted prints are expensive, keep the interrupts logging quiet
+  InterruptsSetLogLevel(INTERRUPTS_QUIET);
+
+  mutex = ThreadMutexCreate();
+  assert(mutex != NULL);
+
+  InterruptsPrintf("%d threads, %d critical sections of %d us each\n",
+                   THREAD_COUNT,
+                   ITERATIONS,
+                   CRITICAL_SECTION);
+  run_benchmark("spin lock", f_spin_lock);
+  run_benchmark("mutex", f_mutex);
+
+  ThreadMutexDestroy(mutex);
+  return 0;
+}
@@ -0,0 +1,131 @@
+/**
+ * @file A benchmark of threads making blocking calls, directly or through
+ * ThreadOffload, while another thread does CPU work. Reports how much of the
+ * CPU work got done, and the offload queue depth and latency.
+ */
+#include <assert.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/time.h>
+#include <time.h>
+
+#include "interrupts.h"
+#include "thread.h"
+
+// Number of threads making blocking calls
+#define THREAD_COUNT 32
+// Number of blocking calls each thread makes
+#define CALLS_PER_THREAD 50
+// How long, in microseconds, each blocking call takes
+#define CALL_DURATION 500
+
+// Whether to make the calls through ThreadOffload
+int offload;
+// Set once the callers are done, to stop the CPU-bound thread
+volatile int done = 0;
+// Units of work done by the CPU-bound thread
+volatile long work = 0;
+
+/**
+ * Stands in for a blocking call such as stat or getaddrinfo.
+ */
+void
+blocking_call(void* unused)
+{
+  (void)unused;
+  struct timespec request = { 0, CALL_DURATION * 1000 };
+  // Made directly, the call is interrupted by preemption signals
+  while (nanosleep(&request, &request) == -1 && errno == EINTR)
+    ;
+}
+
+void
+f_caller(void)
+{
+  for (int i = 0; i < CALLS_PER_THREAD; i++) {
+    if (offload) {
+      int const err = ThreadOffload(blocking_call, NULL);
+      assert(!err);
+    } else {
+      blocking_call(NULL);
+    }
+  }
+}
+
+void
+f_worker(void)
+{
+  while (!done) {
+    work++;
+    ThreadSpin(10);
+  }
+}
+
+void
+run_benchmark(const char* name)
+{
+  struct timeval start, end, diff;
+  Tid tids[THREAD_COUNT];
+
+  done = 0;
+  work = 0;
+  Tid const worker = ThreadCreate((void (*)(void*))f_worker, NULL);
+  assert(worker > 0);
+
+  gettimeofday(&start, NULL);
+  for (int i = 0; i < THREAD_COUNT; i++) {
+    tids[i] = ThreadCreate((void (*)(void*))f_caller, NULL);
+    assert(tids[i] > 0);
+  }
+  for (int i = 0; i < THREAD_COUNT; i++) {
+    int exit_code;
+    ThreadJoin(tids[i], &exit_code);
+  }
+  gettimeofday(&end, NULL);
+  timersub(&end, &start, &diff);
+
+  done = 1;
+  int exit_code;
+  ThreadJoin(worker, &exit_code);
+
+  double const seconds = diff.tv_sec + diff.tv_usec / 1000000.0;
+  InterruptsPrintf("%-8s %8.3f s %12.0f calls/s %12.0f work units/s\n",
+                   name,
+                   seconds,
+                   THREAD_COUNT * CALLS_PER_THREAD / seconds,
+                   work / seconds);
+}
+
+int
+main(void)
+{
+  // Initialize the user-level thread package
+  ThreadInit();
+  // Initialize and enable interrupts
+  InterruptsInit();
+  // Uninterrupted prints are expensive, keep the interrupts logging quiet
+  InterruptsSetLogLevel(INTERRUPTS_QUIET);
+
+  InterruptsPrintf("%d threads, %d blocking calls of %d us each\n",
+                   THREAD_COUNT,
+                   CALLS_PER_THREAD,
+                   CALL_DURATION);
+  offload = 0;
+  run_benchmark("direct");
+  offload = 1;
+  run_benchmark("offload");
+
+  ThreadOffloadStats stats;
+  ThreadOffloadGetStats(&stats);
+  InterruptsPrintf("offload: %ld calls, max queue depth %d, mean queue wait "
+                   "%.1f us, mean run %.1f us, mean latency %.1f us, max "
+                   "latency %lld us\n",
+                   stats.completed,
+                   stats.max_queued,
+                   (double)stats.total_queue_us / stats.completed,
+                   (double)stats.total_run_us / stats.completed,
+                   (double)stats.total_latency_us / stats.completed,
+                   stats.max_latency_us);
+  return 0;
+}
@@ -0,0 +1,163 @@
+/**
+ * @file A benchmark measuring bounded-buffer throughput between producer and
+ * consumer threads, synchronized with condition variables or semaphores.
+ */
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/time.h>
+
+#include "interrupts.h"
+#include "thread.h"
+
+// Number of producer threads, and of consumer threads
+#define PAIR_COUNT 4
+// Number of items each producer produces
+#define ITEMS_PER_PRODUCER 50000
+// Capacity of the shared buffer
+#define BUFFER_SIZE 16
+
+// The shared buffer
+long buffer[BUFFER_SIZE];
+int head = 0;
+int tail = 0;
+int size = 0;
+// Sum of everything consumed, to check that no item was lost
+long consumed_sum = 0;
+
+ThreadMutex* mutex;
+ThreadCond* not_full;
+ThreadCond* not_empty;
+ThreadSem* empty_slots;
+ThreadSem* full_slots;
+
+void
+put(long item)
+{
+  buffer[tail] = item;
+  tail = (tail + 1) % BUFFER_SIZE;
+  size++;
+}
+
+long
+get(void)
+{
+  long const item = buffer[head];
+  head = (head + 1) % BUFFER_SIZE;
+  size--;
+  return item;
+}
+
+void
+f_cond_producer(void)
+{
+  for (long i = 1; i <= ITEMS_PER_PRODUCER; i++) {
+    ThreadMutexLock(mutex);
+    while (size == BUFFER_SIZE) {
+      ThreadCondWait(not_full, mutex);
+    }
+    put(i);
+    ThreadCondSignal(not_empty);
+    ThreadMutexUnlock(mutex);
+  }
+}
+
+void
+f_cond_consumer(void)
+{
+  for (long i = 1; i <= ITEMS_PER_PRODUCER; i++) {
+    ThreadMutexLock(mutex);
+    while (size == 0) {
+      ThreadCondWait(not_empty, mutex);
+    }
+    consumed_sum += get();
+    ThreadCondSignal(not_full);
+    ThreadMutexUnlock(mutex);
+  }
+}
+
+void
+f_sem_producer(void)
+{
+  for (long i = 1; i <= ITEMS_PER_PRODUCER; i++) {
+    ThreadSemWait(empty_slots);
+    ThreadMutexLock(mutex);
+    put(i);
+    ThreadMutexUnlock(mutex);
+    ThreadSemPost(full_slots);
+  }
+}
+
+void
+f_sem_consumer(void)
+{
+  for (long i = 1; i <= ITEMS_PER_PRODUCER; i++) {
+    ThreadSemWait(full_slots);
+    ThreadMutexLock(mutex);
+    consumed_sum += get();
+    ThreadMutexUnlock(mutex);
+    ThreadSemPost(empty_slots);
+  }
+}
+
+void
+run_benchmark(const char* name, void (*producer)(void), void (*consumer)(void))
+{
+  struct timeval start, end, diff;
+  Tid tids[2 * PAIR_COUNT];
+
+  consumed_sum = 0;
+  gettimeofday(&start, NULL);
+
+  for (int i = 0; i < PAIR_COUNT; i++) {
+    tids[2 * i] = ThreadCreate((void (*)(void*))producer, NULL);
+    tids[2 * i + 1] = ThreadCreate((void (*)(void*))consumer, NULL);
+    assert(tids[2 * i] > 0 && tids[2 * i + 1] > 0);
+  }
+  for (int i = 0; i < 2 * PAIR_COUNT; i++) {
+    int exit_code;
+    ThreadJoin(tids[i], &exit_code);
+  }
+
+  gettimeofday(&end, NULL);
+  timersub(&end, &start, &diff);
+
+  long const items = (long)PAIR_COUNT * ITEMS_PER_PRODUCER;
+  double const seconds = diff.tv_sec + diff.tv_usec / 1000000.0;
+  assert(consumed_sum ==
+         PAIR_COUNT * ((long)ITEMS_PER_PRODUCER * (ITEMS_PER_PRODUCER + 1) / 2));
+  InterruptsPrintf(
+    "%-10s %8.3f s %12.0f items/s\n", name, seconds, items / seconds);
+}
+
+int
+main(void)
+{
+  // Initialize the user-level thread package
+  ThreadInit();
+  // Initialize and enable interrupts
+  InterruptsInit();
+  // Uninterrupted prints are expensive, keep the interrupts logging quiet
+  InterruptsSetLogLevel(INTERRUPTS_QUIET);
+
+  mutex = ThreadMutexCreate();
+  not_full = ThreadCondCreate();
+  not_empty = ThreadCondCreate();
+  empty_slots = ThreadSemCreate(BUFFER_SIZE);
+  full_slots = ThreadSemCreate(0);
+  assert(mutex && not_full && not_empty && empty_slots && full_slots);
+
+  InterruptsPrintf("%d producers, %d consumers, buffer of %d\n",
+                   PAIR_COUNT,
+                   PAIR_COUNT,
+                   BUFFER_SIZE);
+  run_benchmark("condvar", f_cond_producer, f_cond_consumer);
+  run_benchmark("semaphore", f_sem_producer, f_sem_consumer);
+
+  ThreadSemDestroy(full_slots);
+  ThreadSemDestroy(empty_slots);
+  ThreadCondDestroy(not_empty);
+  ThreadCondDestroy(not_full);
+  ThreadMutexDestroy(mutex);
+  return 0;
+}
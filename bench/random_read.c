@@ -0,0 +1,134 @@
+/**
+ * @file A benchmark of random 4 KiB reads from a local file by many threads,
+ * comparing plain pread, which blocks every thread while it runs, against
+ * ThreadRead with each asynchronous I/O backend.
+ *
+ * Each variant runs in its own process, since the backend is picked once per
+ * process.
+ */
+#include <assert.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "interrupts.h"
+#include "thread.h"
+
+// Number of reading threads
+#define THREAD_COUNT 250
+// Number of reads each thread performs
+#define READS_PER_THREAD 400
+// Size of each read, in bytes
+#define BLOCK_SIZE 4096
+// Number of blocks in the file
+#define FILE_BLOCKS 16384
+
+int fd;
+// Whether to read with ThreadRead rather than pread
+int use_thread_read;
+long bytes_read = 0;
+
+void
+f_reader(long seed)
+{
+  char buf[BLOCK_SIZE];
+  unsigned int state = (unsigned int)seed;
+  for (int i = 0; i < READS_PER_THREAD; i++) {
+    off_t const offset = (off_t)(rand_r(&state) % FILE_BLOCKS) * BLOCK_SIZE;
+    ssize_t const n = use_thread_read
+                        ? ThreadRead(fd, buf, BLOCK_SIZE, offset)
+                        : pread(fd, buf, BLOCK_SIZE, offset);
+    assert(n == BLOCK_SIZE);
+    bytes_read += n;
+  }
+}
+
+void
+run_benchmark(const char* name)
+{
+  // Initialize the user-level thread package
+  ThreadInit();
+  // Initialize and enable interrupts
+  InterruptsInit();
+  // Uninterrupted prints are expensive, keep the interrupts logging quiet
+  InterruptsSetLogLevel(INTERRUPTS_QUIET);
+
+  struct timeval start, end, diff;
+  Tid tids[THREAD_COUNT];
+
+  gettimeofday(&start, NULL);
+  for (long i = 0; i < THREAD_COUNT; i++) {
+    tids[i] = ThreadCreate((void (*)(void*))f_reader, (void*)(i + 1));
+    assert(tids[i] > 0);
+  }
+  for (int i = 0; i < THREAD_COUNT; i++) {
+    int exit_code;
+    ThreadJoin(tids[i], &exit_code);
+  }
+  gettimeofday(&end, NULL);
+  timersub(&end, &start, &diff);
+
+  long const reads = (long)THREAD_COUNT * READS_PER_THREAD;
+  double const us = diff.tv_sec * 1000000.0 + diff.tv_usec;
+  assert(bytes_read == reads * BLOCK_SIZE);
+  InterruptsPrintf("%-16s %8.3f s %12.0f reads/s %8.2f us/read\n",
+                   name,
+                   us / 1000000,
+                   reads / (us / 1000000),
+                   us / reads);
+}
+
+/**
+ * Run the named variant in a child process.
+ */
+void
+run_variant(const char* name, int thread_read, const char* backend)
+{
+  pid_t const pid = fork();
+  assert(pid >= 0);
+  if (pid == 0) {
+    use_thread_read = thread_read;
+    if (backend != NULL) {
+      setenv("THREAD_IO_BACKEND", backend, 1);
+    }
+    run_benchmark(name);
+    exit(0);
+  }
+  int status;
+  waitpid(pid, &status, 0);
+  assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+}
+
+int
+main(void)
+{
+  char path[] = "/tmp/random_read_XXXXXX";
+  fd = mkstemp(path);
+  assert(fd >= 0);
+  unlink(path);
+
+  char block[BLOCK_SIZE];
+  for (int i = 0; i < FILE_BLOCKS; i++) {
+    for (int j = 0; j < BLOCK_SIZE; j++) {
+      block[j] = (char)(i + j);
+    }
+    ssize_t const n = write(fd, block, BLOCK_SIZE);
+    assert(n == BLOCK_SIZE);
+  }
+
+  printf("%d threads, %d random reads of %d bytes each from a %d MiB file\n",
+         THREAD_COUNT,
+         READS_PER_THREAD,
+         BLOCK_SIZE,
+         FILE_BLOCKS * BLOCK_SIZE / (1024 * 1024));
+  fflush(stdout);
+  run_variant("pread", 0, NULL);
+  run_variant("io_uring", 1, NULL);
+  run_variant("helper threads", 1, "threads");
+
+  close(fd);
+  return 0;
+}
@@ -0,0 +1,124 @@
+/**
+ * @file A benchmark comparing ThreadRWLock against ThreadMutex on read-mostly
+ * workloads, with preemption enabled.
+ */
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/time.h>
+
+#include "interrupts.h"
+#include "thread.h"
+
+// Number of threads accessing the table
+#define THREAD_COUNT 64
+// Number of operations each thread performs
+#define OPERATIONS 500
+// How long, in microseconds, a read or write computes while holding the lock.
+// Each critical section also yields once, as a lookup that blocks would.
+#define CRITICAL_SECTION 10
+
+// The shared table
+long table[THREAD_COUNT];
+
+ThreadRWLock* rwlock;
+ThreadMutex* mutex;
+// Percentage of operations that are writes in the current run
+int write_percent;
+
+void
+f_rwlock(long seed)
+{
+  unsigned int state = (unsigned int)seed;
+  for (int i = 0; i < OPERATIONS; i++) {
+    if (rand_r(&state) % 100 < write_percent) {
+      ThreadRWLockWriteLock(rwlock);
+      table[i % THREAD_COUNT]++;
+      ThreadSpin(CRITICAL_SECTION);
+      ThreadYield();
+      ThreadRWLockWriteUnlock(rwlock);
+    } else {
+      ThreadRWLockReadLock(rwlock);
+      volatile long value = table[i % THREAD_COUNT];
+      (void)value;
+      ThreadSpin(CRITICAL_SECTION);
+      ThreadYield();
+      ThreadRWLockReadUnlock(rwlock);
+    }
+  }
+}
+
+void
+f_mutex(long seed)
+{
+  unsigned int state = (unsigned int)seed;
+  for (int i = 0; i < OPERATIONS; i++) {
+    int const write = rand_r(&state) % 100 < write_percent;
+    ThreadMutexLock(mutex);
+    if (write) {
+      table[i % THREAD_COUNT]++;
+    } else {
+      volatile long value = table[i % THREAD_COUNT];
+      (void)value;
+    }
+    ThreadSpin(CRITICAL_SECTION);
+    ThreadYield();
+    ThreadMutexUnlock(mutex);
+  }
+}
+
+void
+run_benchmark(const char* name, void (*f)(long))
+{
+  struct timeval start, end, diff;
+  Tid tids[THREAD_COUNT];
+
+  gettimeofday(&start, NULL);
+
+  for (long i = 0; i < THREAD_COUNT; i++) {
+    tids[i] = ThreadCreate((void (*)(void*))f, (void*)(i + 1));
+    assert(tids[i] > 0);
+  }
+  for (int i = 0; i < THREAD_COUNT; i++) {
+    int exit_code;
+    ThreadJoin(tids[i], &exit_code);
+  }
+
+  gettimeofday(&end, NULL);
+  timersub(&end, &start, &diff);
+
+  long const operations = (long)THREAD_COUNT * OPERATIONS;
+  double const seconds = diff.tv_sec + diff.tv_usec / 1000000.0;
+  InterruptsPrintf("%2d/%-2d %-8s %8.3f s %12.0f ops/s\n",
+                   100 - write_percent,
+                   write_percent,
+                   name,
+                   seconds,
+                   operations / seconds);
+}
+
+int
+main(void)
+{
+  // Initialize the user-level thread package
+  ThreadInit();
+  // Initialize and enable interrupts
+  InterruptsInit();
+  // Uninterrupted prints are expensive, keep the interrupts logging quiet
+  InterruptsSetLogLevel(INTERRUPTS_QUIET);
+
+  rwlock = ThreadRWLockCreate();
+  mutex = ThreadMutexCreate();
+  assert(rwlock != NULL && mutex != NULL);
+
+  int const mixes[] = { 1, 10 };
+  for (int i = 0; i < 2; i++) {
+    write_percent = mixes[i];
+    run_benchmark("rwlock", f_rwlock);
+    run_benchmark("mutex", f_mutex);
+  }
+
+  ThreadMutexDestroy(mutex);
+  ThreadRWLockDestroy(rwlock);
+  return 0;
+}
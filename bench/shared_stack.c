@@ -0,0 +1,175 @@
+/**
+ * @file A benchmark of threads on shared stacks (ThreadCreateShared) against
+ * threads with stacks of their own: the memory each parked thread costs, and
+ * what a switch costs when every switch has to copy stacks out and in.
+ *
+ * Memory is reported as heap bytes allocated and as resident set growth, per
+ * parked thread. A stack of its own is all heap but mostly untouched, so the
+ * two differ; a shared stack thread costs its copied out stack either way.
+ * Resident growth undercounts memory that earlier runs already touched.
+ */
+#include <assert.h>
+#include <malloc.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "interrupts.h"
+#include "thread.h"
+
+// Threads parked by the memory benchmark
+#define PARKED (MAX_THREADS - 1)
+// Switches timed by the switch benchmark
+#define SWITCHES 200000
+
+WaitQueue* queue;
+volatile int parked;
+volatile int done;
+
+/**
+ * Use bytes of stack, as a thread with a small buffer would, then park.
+ */
+void
+f_park(long bytes)
+{
+  char buf[bytes];
+  memset(buf, 1, bytes);
+  __asm__ volatile("" : : "r"(buf) : "memory");
+  // Not preempted, so it is parked as soon as it has run
+  InterruptsDisable();
+  parked++;
+  ThreadSleep(queue);
+  InterruptsEnable();
+}
+
+void
+f_yield(void)
+{
+  while (!done) {
+    ThreadYield();
+  }
+}
+
+double
+elapsed_us(struct timeval* start)
+{
+  struct timeval end, diff;
+  gettimeofday(&end, NULL);
+  timersub(&end, start, &diff);
+  return diff.tv_sec * 1000000.0 + diff.tv_usec;
+}
+
+/**
+ * @return The resident set size, in bytes.
+ */
+long
+resident_bytes(void)
+{
+  long pages = 0;
+  FILE* statm = fopen("/proc/self/statm", "r");
+  if (statm != NULL) {
+    if (fscanf(statm, "%*s %ld", &pages) != 1) {
+      pages = 0;
+    }
+    fclose(statm);
+  }
+  return pages * sysconf(_SC_PAGESIZE);
+}
+
+Tid
+create(int shared, void (*f)(void*), void* arg)
+{
+  return shared ? ThreadCreateShared(f, arg) : ThreadCreate(f, arg);
+}
+
+void
+run_memory(int shared, long bytes)
+{
+  Tid tids[PARKED];
+  queue = WaitQueueCreate();
+  assert(queue != NULL);
+  parked = 0;
+
+  size_t const heap_before = mallinfo2().uordblks;
+  long const resident_before = resident_bytes();
+  for (int i = 0; i < PARKED; i++) {
+    tids[i] = create(shared, (void (*)(void*))f_park, (void*)bytes);
+    assert(tids[i] > 0);
+  }
+  while (parked < PARKED) {
+    ThreadYield();
+  }
+  double const heap =
+    (double)(mallinfo2().uordblks - heap_before) / PARKED;
+  double const resident =
+    (double)(resident_bytes() - resident_before) / PARKED;
+  InterruptsPrintf("%-10s %5ld B used %9.0f B heap %9.0f B resident\n",
+                   shared ? "shared" : "own",
+                   bytes,
+                   heap,
+                   resident);
+
+  ThreadWakeAll(queue);
+  for (int i = 0; i < PARKED; i++) {
+    int exit_code;
+    ThreadJoin(tids[i], &exit_code);
+  }
+  WaitQueueDestroy(queue);
+}
+
+void
+run_switches(int shared, int count)
+{
+  Tid tids[MAX_THREADS];
+  done = 0;
+  for (int i = 0; i < count; i++) {
+    tids[i] = create(shared, (void (*)(void*))f_yield, NULL);
+    assert(tids[i] > 0);
+  }
+  // Every yield by this thread lets each of the others run once
+  int const rounds = SWITCHES / (count + 1);
+  struct timeval start;
+  gettimeofday(&start, NULL);
+  for (int i = 0; i < rounds; i++) {
+    ThreadYield();
+  }
+  double const us = elapsed_us(&start);
+  done = 1;
+  for (int i = 0; i < count; i++) {
+    int exit_code;
+    ThreadJoin(tids[i], &exit_code);
+  }
+  InterruptsPrintf("%-10s %5d threads %9.1f ns/switch\n",
+                   shared ? "shared" : "own",
+                   count,
+                   us * 1000 / (rounds * (count + 1)));
+}
+
+int
+main(void)
+{
+  // Initialize the user-level thread package
+  ThreadInit();
+  // Initialize and enable interrupts
+  InterruptsInit();
+  // Uninterrupted prints are expensive, keep the interrupts logging quiet
+  InterruptsSetLogLevel(INTERRUPTS_QUIET);
+
+  InterruptsPrintf("memory per parked thread, %d threads\n", PARKED);
+  static const long used[] = { 256, 2048, 8192 };
+  for (int i = 0; i < 3; i++) {
+    run_memory(0, used[i]);
+    run_memory(1, used[i]);
+  }
+
+  // With one thread per shared stack, no switch copies; with more, each does
+  InterruptsPrintf("yield round robin\n");
+  static const int counts[] = { THREAD_SHARED_STACKS, 4 * THREAD_SHARED_STACKS,
+                                64 };
+  for (int i = 0; i < 3; i++) {
+    run_switches(0, counts[i]);
+    run_switches(1, counts[i]);
+  }
+  return 0;
+}
@@ -0,0 +1,192 @@
+/**
+ * @file A benchmark of data TLB misses on context switches with many threads,
+ * for each place ThreadSetStackArena can put their stacks.
+ *
+ * MAX_THREADS - 1 threads yield in round robin, each touching a few cache
+ * lines spread over its stack at every turn, as a thread with a few frames
+ * live would. The data TLB load and store misses of the process are counted
+ * with perf_event_open, in user and kernel mode where permitted and in user
+ * mode only otherwise, and reported per switch along with its time. Where
+ * perf events are not available at all, only times are reported.
+ *
+ * Whether the huge page arenas got huge pages is reported from
+ * /proc/self/smaps_rollup: with transparent huge pages disabled, or no
+ * hugetlbfs pages reserved, they fall back to small pages.
+ */
+#include <assert.h>
+#include <linux/perf_event.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "interrupts.h"
+#include "thread.h"
+
+// Threads yielding in round robin, with the main thread
+#define THREAD_COUNT (MAX_THREADS - 1)
+// Rounds timed, each one switch to every thread
+#define ROUNDS 2000
+// Stack each thread touches at every turn, one cache line per page
+#define TOUCHED 16384
+
+volatile int done;
+
+void
+f_touch(void)
+{
+  volatile char frame[TOUCHED];
+  while (!done) {
+    for (int i = 0; i < TOUCHED; i += 4096) {
+      frame[i]++;
+    }
+    ThreadYield();
+  }
+}
+
+double
+elapsed_us(struct timeval* start)
+{
+  struct timeval end, diff;
+  gettimeofday(&end, NULL);
+  timersub(&end, start, &diff);
+  return diff.tv_sec * 1000000.0 + diff.tv_usec;
+}
+
+/**
+ * Open a counter of data TLB misses of op, PERF_COUNT_HW_CACHE_OP_READ or
+ * PERF_COUNT_HW_CACHE_OP_WRITE, disabled until enabled with an ioctl.
+ *
+ * @return The counter's descriptor, or -1 if it is not available.
+ */
+int
+open_dtlb_counter(int op)
+{
+  struct perf_event_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = PERF_TYPE_HW_CACHE;
+  attr.config = PERF_COUNT_HW_CACHE_DTLB | (op << 8) |
+                (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+  attr.disabled = 1;
+  int fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+  if (fd < 0) {
+    // Counting in the kernel needs more privileges
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+  }
+  return fd;
+}
+
+/**
+ * @return The value of the counter fd, or -1 if it is not open.
+ */
+long long
+read_counter(int fd)
+{
+  long long value;
+  if (fd < 0 || read(fd, &value, sizeof(value)) != sizeof(value)) {
+    return -1;
+  }
+  return value;
+}
+
+/**
+ * @return The huge pages mapped by the process, in KiB, of both kinds.
+ */
+long
+huge_kb(void)
+{
+  FILE* rollup = fopen("/proc/self/smaps_rollup", "r");
+  if (rollup == NULL) {
+    return -1;
+  }
+  char line[256];
+  long total = 0;
+  while (fgets(line, sizeof(line), rollup) != NULL) {
+    long kb;
+    if (sscanf(line, "AnonHugePages: %ld kB", &kb) == 1 ||
+        sscanf(line, "Private_Hugetlb: %ld kB", &kb) == 1) {
+      total += kb;
+    }
+  }
+  fclose(rollup);
+  return total;
+}
+
+void
+run(const char* name, ThreadStackArena arena)
+{
+  int const status = ThreadSetStackArena(arena);
+  assert(status == 0);
+  long const huge_before = huge_kb();
+  Tid tids[THREAD_COUNT];
+  done = 0;
+  for (int i = 0; i < THREAD_COUNT; i++) {
+    tids[i] = ThreadCreate((void (*)(void*))f_touch, NULL);
+    assert(tids[i] > 0);
+  }
+  // Let every thread touch its stack before counting
+  ThreadYield();
+
+  int const loads = open_dtlb_counter(PERF_COUNT_HW_CACHE_OP_READ);
+  int const stores = open_dtlb_counter(PERF_COUNT_HW_CACHE_OP_WRITE);
+  for (int i = 0; i < 2; i++) {
+    int const fd = i == 0 ? loads : stores;
+    if (fd >= 0) {
+      ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+  }
+  struct timeval start;
+  gettimeofday(&start, NULL);
+  for (int i = 0; i < ROUNDS; i++) {
+    ThreadYield();
+  }
+  double const us = elapsed_us(&start);
+  long long const load_misses = read_counter(loads);
+  long long const store_misses = read_counter(stores);
+  long const huge = huge_kb() - huge_before;
+
+  done = 1;
+  for (int i = 0; i < THREAD_COUNT; i++) {
+    int exit_code;
+    ThreadJoin(tids[i], &exit_code);
+  }
+  close(loads);
+  close(stores);
+
+  double const switches = (double)ROUNDS * (THREAD_COUNT + 1);
+  InterruptsPrintf("%-8s %8.1f ns/switch", name, us * 1000 / switches);
+  if (load_misses >= 0 && store_misses >= 0) {
+    InterruptsPrintf(" %7.2f dTLB load misses %7.2f store misses",
+                     load_misses / switches,
+                     store_misses / switches);
+  } else {
+    InterruptsPrintf(" dTLB misses not available");
+  }
+  InterruptsPrintf(" %6ld KiB huge pages\n", huge);
+}
+
+int
+main(void)
+{
+  // Initialize the user-level thread package
+  ThreadInit();
+  // Initialize and enable interrupts
+  InterruptsInit();
+  // Uninterrupted prints are expensive, keep the interrupts logging quiet
+  InterruptsSetLogLevel(INTERRUPTS_QUIET);
+
+  InterruptsPrintf("%d threads, %d rounds, %d bytes touched per turn\n",
+                   THREAD_COUNT,
+                   ROUNDS,
+                   TOUCHED);
+  run("heap", THREAD_STACK_ARENA_NONE);
+  run("guarded", THREAD_STACK_ARENA_GUARDED);
+  run("thp", THREAD_STACK_ARENA_HUGE);
+  run("hugetlb", THREAD_STACK_ARENA_HUGETLB);
+  return 0;
+}
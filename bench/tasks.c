@@ -0,0 +1,91 @@
+/**
+ * @file A benchmark of tiny units of work run as tasks (TaskSpawn) against
+ * the same work run as threads (ThreadCreate and ThreadJoin).
+ *
+ * Each unit adds its argument to a counter. Tasks are all spawned by the main
+ * thread and waited for with TaskWaitAll; they run whenever the main thread
+ * is preempted, and at the end. Threads are created and joined one at a time,
+ * as the most threads that can exist at once is MAX_THREADS.
+ *
+ * Usage: tasks [COUNT]  runs COUNT units of each kind, 10 million by default.
+ */
+#include <assert.h>
+#include <stdlib.h>
+#include <sys/time.h>
+
+#include "interrupts.h"
+#include "thread.h"
+
+volatile long sum;
+
+void
+f_add(void* arg)
+{
+  sum += (long)arg;
+}
+
+double
+elapsed_us(struct timeval* start)
+{
+  struct timeval end, diff;
+  gettimeofday(&end, NULL);
+  timersub(&end, start, &diff);
+  return diff.tv_sec * 1000000.0 + diff.tv_usec;
+}
+
+void
+run_tasks(long count)
+{
+  sum = 0;
+  struct timeval start;
+  gettimeofday(&start, NULL);
+  for (long i = 0; i < count; i++) {
+    int const err = TaskSpawn(f_add, (void*)1);
+    assert(err == 0);
+  }
+  int const err = TaskWaitAll();
+  assert(err == 0);
+  double const us = elapsed_us(&start);
+  assert(sum == count);
+  InterruptsPrintf("%-8s %10ld units %8.1f ns/unit\n",
+                   "task",
+                   count,
+                   us * 1000 / count);
+}
+
+void
+run_threads(long count)
+{
+  sum = 0;
+  struct timeval start;
+  gettimeofday(&start, NULL);
+  for (long i = 0; i < count; i++) {
+    Tid const tid = ThreadCreate(f_add, (void*)1);
+    assert(tid > 0);
+    int exit_code;
+    ThreadJoin(tid, &exit_code);
+  }
+  double const us = elapsed_us(&start);
+  assert(sum == count);
+  InterruptsPrintf("%-8s %10ld units %8.1f ns/unit\n",
+                   "thread",
+                   count,
+                   us * 1000 / count);
+}
+
+int
+main(int argc, char* argv[])
+{
+  long const count = argc > 1 ? atol(argv[1]) : 10000000;
+
+  // Initialize the user-level thread package
+  ThreadInit();
+  // Initialize and enable interrupts
+  InterruptsInit();
+  // Uninterrupted prints are expensive, keep the interrupts logging quiet
+  InterruptsSetLogLevel(INTERRUPTS_QUIET);
+
+  run_tasks(count);
+  run_threads(count);
+  return 0;
+}
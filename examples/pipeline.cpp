@@ -0,0 +1,62 @@
+/**
+ * @file An application that passes words down a pipeline of fibers with the
+ * C++ interface: each stage receives from one channel and sends to the next.
+ *
+ * The strings are boxed by their channels, while the word counts, being
+ * trivially copyable, are copied straight into the receiver.
+ */
+#include <cassert>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "interrupts.h"
+#include "thread.h"
+#include "thread.hpp"
+
+// Number of stages between the source and the sink
+#define STAGE_COUNT 8
+
+int
+main()
+{
+  // Initialize the user-level thread package
+  ThreadInit();
+  // Initialize and enable interrupts
+  InterruptsInit();
+
+  std::vector<std::string> const words = { "the", "quick", "brown", "fox" };
+  thread::Channel<std::string> channels[STAGE_COUNT + 1];
+  thread::Channel<long> counts;
+
+  std::vector<thread::Fiber> stages;
+  for (int i = 0; i < STAGE_COUNT; i++) {
+    // Captures live at the top of each fiber's stack, not on the heap
+    stages.push_back(thread::Fiber::spawn(
+      [i](thread::Channel<std::string>& in, thread::Channel<std::string>& out) {
+        while (auto word = in.recv()) {
+          out.send(*word + "!");
+        }
+        out.close();
+        InterruptsPrintf("stage %d done\n", i);
+      },
+      std::ref(channels[i]),
+      std::ref(channels[i + 1])));
+  }
+  thread::Fiber sink = thread::Fiber::spawn([&] {
+    long count = 0;
+    while (auto word = channels[STAGE_COUNT].recv()) {
+      InterruptsPrintf("%s\n", word->c_str());
+      count++;
+    }
+    counts.send(count);
+  });
+
+  for (const std::string& word : words) {
+    channels[0].send(word);
+  }
+  channels[0].close();
+  auto const count = counts.recv();
+  assert(count && *count == (long)words.size());
+  return 0;
+}
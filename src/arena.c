@@ -0,0 +1,167 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+
+#include "interrupts.h"
+#include "thread.h"
+#include "thread_private.h"
+
+// Arena regions are this size and, but for hugetlbfs, aligned to it, so that
+// each can be backed by one huge page
+#define ARENA_REGION (2 * 1024 * 1024)
+// The most regions mapped, enough for MAX_THREADS stacks of each kind
+#define ARENA_REGIONS 32
+#define ARENA_PAGE 4096
+
+/**
+ * A region of stack slots, all of one kind.
+ */
+typedef struct arena_region
+{
+  char* base;
+  ThreadStackArena kind;
+} ArenaRegion;
+
+static ThreadStackArena stack_arena = THREAD_STACK_ARENA_NONE;
+static ArenaRegion regions[ARENA_REGIONS];
+static int region_count = 0;
+// The free slots of each kind, linked through their first word
+static void* free_slots[THREAD_STACK_ARENA_HUGETLB + 1];
+
+/**
+ * @return The distance between slots in a region of kind.
+ */
+static size_t
+slot_stride(ThreadStackArena kind)
+{
+  // A guard page below each stack
+  size_t const guard = kind == THREAD_STACK_ARENA_GUARDED ? ARENA_PAGE : 0;
+  return THREAD_STACK_SIZE + guard;
+}
+
+/**
+ * Map a region of kind and add its slots to the free list.
+ *
+ * @return 0 if successful, -1 otherwise.
+ */
+static int
+map_region(ThreadStackArena kind)
+{
+  if (region_count == ARENA_REGIONS) {
+    return -1;
+  }
+  char* base;
+  if (kind == THREAD_STACK_ARENA_HUGETLB) {
+    base = mmap(NULL,
+                ARENA_REGION,
+                PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB,
+                -1,
+                0);
+    if (base == MAP_FAILED) {
+      return -1;
+    }
+  } else {
+    // Map twice the size and trim it to an aligned region
+    char* const mapped = mmap(NULL,
+                              2 * ARENA_REGION,
+                              PROT_READ | PROT_WRITE,
+                              MAP_PRIVATE | MAP_ANONYMOUS,
+                              -1,
+                              0);
+    if (mapped == MAP_FAILED) {
+      return -1;
+    }
+    base = (char*)(((uintptr_t)mapped + ARENA_REGION - 1) &
+                   ~(uintptr_t)(ARENA_REGION - 1));
+    if (base > mapped) {
+      munmap(mapped, base - mapped);
+    }
+    munmap(base + ARENA_REGION, mapped + ARENA_REGION - base);
+    if (kind == THREAD_STACK_ARENA_HUGE) {
+      // Without transparent huge pages, the region is just small pages
+      madvise(base, ARENA_REGION, MADV_HUGEPAGE);
+    }
+  }
+
+  size_t const stride = slot_stride(kind);
+  int const slots = ARENA_REGION / stride;
+  for (int i = slots - 1; i >= 0; i--) {
+    char* slot = base + i * stride;
+    if (kind == THREAD_STACK_ARENA_GUARDED) {
+      // Failing that, the stack is just unguarded
+      mprotect(slot, ARENA_PAGE, PROT_NONE);
+      slot += ARENA_PAGE;
+    }
+    *(void**)slot = free_slots[kind];
+    free_slots[kind] = slot;
+  }
+  regions[region_count].base = base;
+  regions[region_count].kind = kind;
+  region_count++;
+  return 0;
+}
+
+/**
+ * @return A free slot of kind, mapping a region for it if needed, or NULL.
+ */
+static void*
+take_slot(ThreadStackArena kind)
+{
+  if (free_slots[kind] == NULL && map_region(kind) < 0) {
+    return NULL;
+  }
+  void* const slot = free_slots[kind];
+  free_slots[kind] = *(void**)slot;
+  return slot;
+}
+
+void*
+arena_alloc(size_t size)
+{
+  if (stack_arena == THREAD_STACK_ARENA_NONE || size > THREAD_STACK_SIZE) {
+    return malloc(size);
+  }
+  char* slot = take_slot(stack_arena);
+  if (slot == NULL && stack_arena == THREAD_STACK_ARENA_HUGETLB) {
+    // No huge pages reserved, or no hugetlbfs: fall back to transparent ones
+    slot = take_slot(THREAD_STACK_ARENA_HUGE);
+  }
+  if (slot == NULL) {
+    return malloc(size);
+  }
+  // A smaller, learned stack takes the top of the slot, next to the one above
+  return slot + THREAD_STACK_SIZE - size;
+}
+
+void
+arena_free(void* stack)
+{
+  for (int i = 0; i < region_count; i++) {
+    char* const base = regions[i].base;
+    if ((char*)stack >= base && (char*)stack < base + ARENA_REGION) {
+      ThreadStackArena const kind = regions[i].kind;
+      size_t const stride = slot_stride(kind);
+      char* slot = base + ((char*)stack - base) / stride * stride;
+      if (kind == THREAD_STACK_ARENA_GUARDED) {
+        slot += ARENA_PAGE;
+      }
+      *(void**)slot = free_slots[kind];
+      free_slots[kind] = slot;
+      return;
+    }
+  }
+  free(stack);
+}
+
+int
+ThreadSetStackArena(ThreadStackArena arena)
+{
+  if (arena < THREAD_STACK_ARENA_NONE || arena > THREAD_STACK_ARENA_HUGETLB) {
+    return ERROR_OTHER;
+  }
+  InterruptsState enabled = InterruptsDisable();
+  stack_arena = arena;
+  InterruptsSet(enabled);
+  return 0;
+}
@@ -0,0 +1,121 @@
+#include <stdlib.h>
+
+#include "interrupts.h"
+#include "thread.h"
+#include "thread_private.h"
+
+Await*
+await_new(void (*resume)(void* arg, int status), void* arg)
+{
+  Await* const await = malloc(sizeof(Await));
+  if (await == NULL) {
+    return NULL;
+  }
+  await->waiter = (Waiter){ .elem = &await->events,
+                            .size = sizeof(await->events) };
+  await->resume = resume;
+  await->arg = arg;
+  await->joined = -1;
+  await->events = 0;
+  return await;
+}
+
+/**
+ * Call the callback of a completed wait, and free the wait.
+ */
+static void
+await_run(void* arg)
+{
+  Await* const await = arg;
+  await->resume(await->arg, await->waiter.status);
+  InterruptsState enabled = InterruptsDisable();
+  free(await);
+  InterruptsSet(enabled);
+}
+
+/**
+ * Set the status of a join to the exit code of the thread joined, which is
+ * exiting or being killed.
+ */
+static void
+await_take_status(Await* await)
+{
+  if (await->joined >= 0) {
+    await->waiter.status = threads[await->joined].exit_code;
+  }
+}
+
+/**
+ * Spawn the task that runs the callback of a completed wait.
+ */
+static void
+await_spawn(Await* await)
+{
+  if (TaskSpawn(await_run, await) < 0) {
+    // Rather than lose the wake-up, run the callback on the waking thread
+    await_run(await);
+  }
+}
+
+void
+await_fire(Waiter* waiter)
+{
+  await_take_status((Await*)waiter);
+  await_spawn((Await*)waiter);
+}
+
+void
+await_fire_all(WaitQueue* awaits)
+{
+  // Spawning may create a worker, which reaps the thread joined
+  for (node* curr = awaits->head; curr != NULL; curr = curr->next) {
+    await_take_status((Await*)curr->waiter);
+  }
+  while (awaits->head != NULL) {
+    Await* const await = (Await*)awaits->head->waiter;
+    unlink_node(awaits, awaits->head);
+    await_spawn(await);
+  }
+}
+
+int
+ThreadSleepAsync(WaitQueue* queue, void (*resume)(void*, int), void* arg)
+{
+  InterruptsState enabled = InterruptsDisable();
+  Await* const await = await_new(resume, arg);
+  if (await == NULL) {
+    InterruptsSet(enabled);
+    return ERROR_SYS_MEM;
+  }
+  enqueue_waiter(queue, NULL, &await->waiter);
+  InterruptsSet(enabled);
+  return 0;
+}
+
+int
+ThreadJoinAsync(Tid tid, void (*resume)(void*, int), void* arg)
+{
+  InterruptsState enabled = InterruptsDisable();
+  if (tid < 0 || tid >= MAX_THREADS) {
+    InterruptsSet(enabled);
+    return ERROR_TID_INVALID;
+  }
+  State const state = threads[tid].state;
+  if (state == EMPTY || state == KILLED || state == EXITED) {
+    InterruptsSet(enabled);
+    return ERROR_SYS_THREAD;
+  }
+  if (tid == running_thread->thread_id) {
+    InterruptsSet(enabled);
+    return ERROR_THREAD_BAD;
+  }
+  Await* const await = await_new(resume, arg);
+  if (await == NULL) {
+    InterruptsSet(enabled);
+    return ERROR_SYS_MEM;
+  }
+  await->joined = tid;
+  enqueue_waiter(&wait_queues[tid], NULL, &await->waiter);
+  InterruptsSet(enabled);
+  return 0;
+}
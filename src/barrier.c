@@ -0,0 +1,166 @@
+#include <assert.h>
+#include <stdlib.h>
+
+#include "interrupts.h"
+#include "thread.h"
+#include "thread_private.h"
+
+/**
+ * A barrier.
+ */
+typedef struct thread_barrier_t
+{
+  int count;
+  // Threads that have arrived in the current generation
+  int arrived;
+  unsigned int generation;
+  WaitQueue* waiters;
+} ThreadBarrier;
+
+/**
+ * A latch.
+ */
+typedef struct thread_latch_t
+{
+  volatile int count;
+  WaitQueue* waiters;
+} ThreadLatch;
+
+ThreadBarrier*
+ThreadBarrierCreate(int count)
+{
+  assert(count > 0);
+  ThreadBarrier* barrier = malloc(sizeof(ThreadBarrier));
+  if (barrier == NULL) {
+    return NULL;
+  }
+  barrier->waiters = WaitQueueCreate();
+  if (barrier->waiters == NULL) {
+    free(barrier);
+    return NULL;
+  }
+  barrier->count = count;
+  barrier->arrived = 0;
+  barrier->generation = 0;
+  return barrier;
+}
+
+int
+ThreadBarrierDestroy(ThreadBarrier* barrier)
+{
+  assert(barrier != NULL);
+  InterruptsState enabled = InterruptsDisable();
+  if (barrier->waiters->head != NULL) {
+    InterruptsSet(enabled);
+    return ERROR_OTHER;
+  }
+  WaitQueueDestroy(barrier->waiters);
+  free(barrier);
+  InterruptsSet(enabled);
+  return 0;
+}
+
+int
+ThreadBarrierWait(ThreadBarrier* barrier)
+{
+  assert(barrier != NULL);
+  InterruptsState enabled = InterruptsDisable();
+  if (++barrier->arrived == barrier->count) {
+    barrier->arrived = 0;
+    barrier->generation++;
+    splice_queue(&rq, barrier->waiters);
+    InterruptsSet(enabled);
+    return THREAD_BARRIER_SERIAL;
+  }
+
+  unsigned int const generation = barrier->generation;
+  int const ret = sleep_with_waiter(barrier->waiters, NULL);
+  if (ret < 0) {
+    barrier->arrived--;
+    InterruptsSet(enabled);
+    return ret;
+  }
+
+  // Only the last arrival of our generation wakes the waiters
+  assert(barrier->generation != generation);
+  InterruptsSet(enabled);
+  return 0;
+}
+
+ThreadLatch*
+ThreadLatchCreate(int count)
+{
+  assert(count >= 0);
+  ThreadLatch* latch = malloc(sizeof(ThreadLatch));
+  if (latch == NULL) {
+    return NULL;
+  }
+  latch->waiters = WaitQueueCreate();
+  if (latch->waiters == NULL) {
+    free(latch);
+    return NULL;
+  }
+  latch->count = count;
+  return latch;
+}
+
+int
+ThreadLatchDestroy(ThreadLatch* latch)
+{
+  assert(latch != NULL);
+  InterruptsState enabled = InterruptsDisable();
+  if (latch->waiters->head != NULL) {
+    InterruptsSet(enabled);
+    return ERROR_OTHER;
+  }
+  WaitQueueDestroy(latch->waiters);
+  free(latch);
+  InterruptsSet(enabled);
+  return 0;
+}
+
+int
+ThreadLatchCountDown(ThreadLatch* latch)
+{
+  assert(latch != NULL);
+  // Not cancelled between opening the latch and waking its waiters
+  cancel_defer();
+  int count = latch->count;
+  while (count > 0) {
+    int const seen =
+      __sync_val_compare_and_swap(&latch->count, count, count - 1);
+    if (seen == count) {
+      break;
+    }
+    count = seen;
+  }
+  if (count != 1) {
+    // Either the latch is still closed or it was already open
+    cancel_resume();
+    return 0;
+  }
+
+  InterruptsState enabled = InterruptsDisable();
+  cancel_resume();
+  int const woken = splice_queue(&rq, latch->waiters);
+  InterruptsSet(enabled);
+  return woken;
+}
+
+int
+ThreadLatchWait(ThreadLatch* latch)
+{
+  assert(latch != NULL);
+  if (latch->count == 0) {
+    return 0;
+  }
+
+  InterruptsState enabled = InterruptsDisable();
+  if (latch->count == 0) {
+    InterruptsSet(enabled);
+    return 0;
+  }
+  int const ret = sleep_with_waiter(latch->waiters, NULL);
+  InterruptsSet(enabled);
+  return ret < 0 ? ret : 0;
+}
@@ -0,0 +1,106 @@
+#include <stddef.h>
+#include <stdlib.h>
+
+#include "interrupts.h"
+#include "thread.h"
+#include "thread_private.h"
+
+// Every allocation is aligned to this
+#define BUMP_ALIGN _Alignof(max_align_t)
+#define BUMP_ROUND(n) (((n) + BUMP_ALIGN - 1) & ~(size_t)(BUMP_ALIGN - 1))
+
+/**
+ * A chunk of a thread's arena, allocated from between top and end.
+ */
+typedef struct bump_chunk
+{
+  struct bump_chunk* next;
+  char* top;
+  char* end;
+} BumpChunk;
+
+#define BUMP_HEADER BUMP_ROUND(sizeof(BumpChunk))
+
+// Chunks of THREAD_ARENA_CHUNK_SIZE no arena holds, linked through next
+static BumpChunk* free_chunks = NULL;
+static int free_count = 0;
+
+/**
+ * @return A chunk of size bytes, from the pool if it is of the usual size, or
+ * NULL if out of memory.
+ *
+ * @pre interrupts are disabled
+ */
+static BumpChunk*
+take_chunk(size_t size)
+{
+  BumpChunk* chunk;
+  if (size == THREAD_ARENA_CHUNK_SIZE && free_chunks != NULL) {
+    chunk = free_chunks;
+    free_chunks = chunk->next;
+    free_count--;
+  } else {
+    chunk = malloc(size);
+    if (chunk == NULL) {
+      return NULL;
+    }
+    chunk->end = (char*)chunk + size;
+  }
+  chunk->top = (char*)chunk + BUMP_HEADER;
+  return chunk;
+}
+
+void*
+ThreadArenaAlloc(size_t size)
+{
+  size = BUMP_ROUND(size == 0 ? 1 : size);
+  // Only this thread allocates from its arena, and no other thread frees it
+  // while this one runs, so nothing needs disabling interrupts
+  TCB* const self = running_thread;
+  BumpChunk* chunk = self->arena;
+  if (chunk != NULL && (size_t)(chunk->end - chunk->top) >= size) {
+    void* const allocated = chunk->top;
+    chunk->top += size;
+    return allocated;
+  }
+
+  size_t const needed = BUMP_HEADER + size;
+  int const own = needed > THREAD_ARENA_CHUNK_SIZE;
+  InterruptsState enabled = InterruptsDisable();
+  BumpChunk* const fresh =
+    take_chunk(own ? needed : THREAD_ARENA_CHUNK_SIZE);
+  InterruptsSet(enabled);
+  if (fresh == NULL) {
+    return NULL;
+  }
+  if (own && chunk != NULL) {
+    // A chunk of its own is full, so the current chunk stays first
+    fresh->next = chunk->next;
+    chunk->next = fresh;
+  } else {
+    fresh->next = chunk;
+    self->arena = fresh;
+  }
+  void* const allocated = fresh->top;
+  fresh->top += size;
+  return allocated;
+}
+
+void
+bump_release(TCB* thread)
+{
+  BumpChunk* chunk = thread->arena;
+  thread->arena = NULL;
+  while (chunk != NULL) {
+    BumpChunk* const next = chunk->next;
+    if (chunk->end - (char*)chunk == THREAD_ARENA_CHUNK_SIZE &&
+        free_count < THREAD_ARENA_POOL_MAX) {
+      chunk->next = free_chunks;
+      free_chunks = chunk;
+      free_count++;
+    } else {
+      free(chunk);
+    }
+    chunk = next;
+  }
+}
@@ -0,0 +1,80 @@
+#include "interrupts.h"
+#include "thread.h"
+#include "thread_private.h"
+
+Tid
+ThreadCancel(Tid tid)
+{
+  InterruptsState enabled = InterruptsDisable();
+  if (tid < 0 || tid >= MAX_THREADS) {
+    InterruptsSet(enabled);
+    return ERROR_TID_INVALID;
+  }
+  TCB* const thread = &threads[tid];
+  if (thread->state == EMPTY || thread->state == KILLED ||
+      thread->state == EXITED) {
+    InterruptsSet(enabled);
+    return ERROR_SYS_THREAD;
+  }
+  if (thread->cancel != CANCEL_NONE) {
+    InterruptsSet(enabled);
+    return tid;
+  }
+
+  thread->cancel = CANCEL_PENDING;
+  if (thread->state == BLOCKED && thread->sleep_cancellable) {
+    // It exits from ThreadSleep rather than return to its caller
+    remove_from_queue(thread->waiting_on, tid);
+    thread->waiting_on = NULL;
+    thread->state = READY;
+    stats_wakeup(thread, stats_clock());
+    insert_into_queue(&rq, thread);
+  }
+  InterruptsSet(enabled);
+  return tid;
+}
+
+void
+cancel_exit(void)
+{
+  // Preempted or not, the thread now leaves of its own accord
+  stats_preempting = 0;
+  ThreadExit(EXIT_CODE_KILL);
+}
+
+int
+ThreadCleanupPush(void (*routine)(void*), void* arg)
+{
+  TCB* const self = running_thread;
+  if (self->cleanup_count == THREAD_CLEANUP_MAX) {
+    return ERROR_OTHER;
+  }
+  self->cleanup[self->cleanup_count].routine = routine;
+  self->cleanup[self->cleanup_count].arg = arg;
+  self->cleanup_count++;
+  return 0;
+}
+
+int
+ThreadCleanupPop(int execute)
+{
+  TCB* const self = running_thread;
+  if (self->cleanup_count == 0) {
+    return ERROR_OTHER;
+  }
+  CleanupHandler const handler = self->cleanup[--self->cleanup_count];
+  if (execute) {
+    handler.routine(handler.arg);
+  }
+  return 0;
+}
+
+void
+cleanup_run(void)
+{
+  TCB* const self = running_thread;
+  while (self->cleanup_count > 0) {
+    CleanupHandler const handler = self->cleanup[--self->cleanup_count];
+    handler.routine(handler.arg);
+  }
+}
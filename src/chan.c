@@ -0,0 +1,220 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "interrupts.h"
+#include "thread.h"
+#include "thread_private.h"
+
+ThreadChan*
+ThreadChanCreate(int elem_size, int capacity)
+{
+  assert(elem_size > 0);
+  assert(capacity >= 0);
+  ThreadChan* chan = malloc(sizeof(ThreadChan));
+  if (chan == NULL) {
+    return NULL;
+  }
+  chan->buffer = NULL;
+  if (capacity > 0) {
+    chan->buffer = malloc((size_t)elem_size * capacity);
+    if (chan->buffer == NULL) {
+      free(chan);
+      return NULL;
+    }
+  }
+  chan->senders = WaitQueueCreate();
+  chan->receivers = WaitQueueCreate();
+  if (chan->senders == NULL || chan->receivers == NULL) {
+    if (chan->senders != NULL) {
+      WaitQueueDestroy(chan->senders);
+    }
+    if (chan->receivers != NULL) {
+      WaitQueueDestroy(chan->receivers);
+    }
+    free(chan->buffer);
+    free(chan);
+    return NULL;
+  }
+  chan->site = profile_site("chan", __builtin_return_address(0));
+  chan->elem_size = elem_size;
+  chan->capacity = capacity;
+  chan->head = 0;
+  chan->count = 0;
+  chan->closed = 0;
+  return chan;
+}
+
+int
+ThreadChanDestroy(ThreadChan* chan)
+{
+  assert(chan != NULL);
+  InterruptsState enabled = InterruptsDisable();
+  if (chan->senders->head != NULL || chan->receivers->head != NULL) {
+    InterruptsSet(enabled);
+    return ERROR_OTHER;
+  }
+  WaitQueueDestroy(chan->senders);
+  WaitQueueDestroy(chan->receivers);
+  free(chan->buffer);
+  free(chan);
+  InterruptsSet(enabled);
+  return 0;
+}
+
+/**
+ * @return The address of the i-th buffered message, counting from the oldest.
+ */
+static char*
+chan_slot(ThreadChan* chan, int i)
+{
+  return chan->buffer + (size_t)((chan->head + i) % chan->capacity) *
+                          chan->elem_size;
+}
+
+/**
+ * @return What the first thread in queue waits for.
+ *
+ * @pre queue is not empty
+ */
+static Waiter*
+chan_first_waiter(WaitQueue* queue)
+{
+  return queue->head->waiter;
+}
+
+/**
+ * Wake up the first thread in queue, telling it the outcome of its wait.
+ *
+ * @return 1 if a thread was woken up, 0 if queue was empty.
+ */
+static int
+chan_wake(WaitQueue* queue, int status)
+{
+  if (queue->head == NULL) {
+    return 0;
+  }
+  chan_first_waiter(queue)->status = status;
+  wake_first(queue);
+  return 1;
+}
+
+/**
+ * Suspend the calling thread on queue until a peer completes its transfer.
+ *
+ * @pre interrupts are disabled
+ *
+ * @return The status the waking thread left, or the error from sleeping.
+ */
+static int
+chan_wait(WaitQueue* queue, void* elem, int elem_size)
+{
+  Waiter waiter = { elem, 0, NULL, 0, elem_size };
+  int const ret = sleep_with_waiter(queue, &waiter);
+  return ret < 0 ? ret : waiter.status;
+}
+
+int
+chan_try_send(ThreadChan* chan, const void* elem)
+{
+  if (chan->closed) {
+    return ERROR_CLOSED;
+  }
+
+  // A waiting receiver implies an empty buffer: hand the message over directly
+  if (chan->receivers->head != NULL) {
+    memcpy(chan_first_waiter(chan->receivers)->elem, elem, chan->elem_size);
+    chan_wake(chan->receivers, 0);
+    return 0;
+  }
+
+  if (chan->count < chan->capacity) {
+    memcpy(chan_slot(chan, chan->count), elem, chan->elem_size);
+    chan->count++;
+    return 0;
+  }
+  return ERROR_OTHER;
+}
+
+int
+chan_try_recv(ThreadChan* chan, void* elem)
+{
+  if (chan->count > 0) {
+    memcpy(elem, chan_slot(chan, 0), chan->elem_size);
+    chan->head = (chan->head + 1) % chan->capacity;
+    chan->count--;
+
+    // Refill the freed slot from the first blocked sender, keeping FIFO order
+    if (chan->senders->head != NULL) {
+      memcpy(chan_slot(chan, chan->count),
+             chan_first_waiter(chan->senders)->elem,
+             chan->elem_size);
+      chan->count++;
+      chan_wake(chan->senders, 0);
+    }
+    return 0;
+  }
+
+  if (chan->senders->head != NULL) {
+    memcpy(elem, chan_first_waiter(chan->senders)->elem, chan->elem_size);
+    chan_wake(chan->senders, 0);
+    return 0;
+  }
+  return chan->closed ? ERROR_CLOSED : ERROR_OTHER;
+}
+
+int
+ThreadChanSend(ThreadChan* chan, const void* elem)
+{
+  assert(chan != NULL);
+  assert(elem != NULL);
+  InterruptsState enabled = InterruptsDisable();
+  int ret = chan_try_send(chan, elem);
+  if (ret == ERROR_OTHER) {
+    long long const wait_start = profile_wait_start(chan->site);
+    // The receiver that takes our message copies it straight from elem
+    ret = chan_wait(chan->senders, (void*)elem, chan->elem_size);
+    profile_waited(chan->site, wait_start);
+  } else if (ret == 0) {
+    profile_acquired(chan->site);
+  }
+  InterruptsSet(enabled);
+  return ret;
+}
+
+int
+ThreadChanRecv(ThreadChan* chan, void* elem)
+{
+  assert(chan != NULL);
+  assert(elem != NULL);
+  InterruptsState enabled = InterruptsDisable();
+  int ret = chan_try_recv(chan, elem);
+  if (ret == ERROR_OTHER) {
+    long long const wait_start = profile_wait_start(chan->site);
+    // The sender that fills elem wakes us up
+    ret = chan_wait(chan->receivers, elem, chan->elem_size);
+    profile_waited(chan->site, wait_start);
+  } else if (ret == 0) {
+    profile_acquired(chan->site);
+  }
+  InterruptsSet(enabled);
+  return ret;
+}
+
+int
+ThreadChanClose(ThreadChan* chan)
+{
+  assert(chan != NULL);
+  InterruptsState enabled = InterruptsDisable();
+  if (chan->closed) {
+    InterruptsSet(enabled);
+    return ERROR_CLOSED;
+  }
+  chan->closed = 1;
+  while (chan_wake(chan->receivers, ERROR_CLOSED))
+    ;
+  while (chan_wake(chan->senders, ERROR_CLOSED))
+    ;
+  InterruptsSet(enabled);
+  return 0;
+}
@@ -0,0 +1,133 @@
+#include <assert.h>
+#include <stdlib.h>
+
+#include "interrupts.h"
+#include "thread.h"
+#include "thread_private.h"
+
+/**
+ * A condition variable.
+ */
+typedef struct thread_cond_t
+{
+  ProfileSite* site;
+  WaitQueue* waiters;
+  // The mutex the current waiters released, or NULL when there are none
+  ThreadMutex* mutex;
+} ThreadCond;
+
+ThreadCond*
+ThreadCondCreate(void)
+{
+  ThreadCond* cond = malloc(sizeof(ThreadCond));
+  if (cond == NULL) {
+    return NULL;
+  }
+  cond->waiters = WaitQueueCreate();
+  if (cond->waiters == NULL) {
+    free(cond);
+    return NULL;
+  }
+  cond->site = profile_site("cond", __builtin_return_address(0));
+  cond->mutex = NULL;
+  return cond;
+}
+
+int
+ThreadCondDestroy(ThreadCond* cond)
+{
+  assert(cond != NULL);
+  InterruptsState enabled = InterruptsDisable();
+  if (cond->waiters->head != NULL) {
+    InterruptsSet(enabled);
+    return ERROR_OTHER;
+  }
+  WaitQueueDestroy(cond->waiters);
+  free(cond);
+  InterruptsSet(enabled);
+  return 0;
+}
+
+int
+ThreadCondWait(ThreadCond* cond, ThreadMutex* mutex)
+{
+  assert(cond != NULL);
+  assert(mutex != NULL);
+  InterruptsState enabled = InterruptsDisable();
+  if (mutex->owner != running_thread->thread_id) {
+    InterruptsSet(enabled);
+    return ERROR_THREAD_BAD;
+  }
+  if (cond->waiters->head != NULL && cond->mutex != mutex) {
+    InterruptsSet(enabled);
+    return ERROR_OTHER;
+  }
+
+  // Interrupts stay disabled from the release until we are on the wait queue,
+  // so a signal cannot be lost in between
+  long long const wait_start = profile_wait_start(cond->site);
+  cond->mutex = mutex;
+  mutex_release(mutex);
+  int const ret = sleep_with_waiter(cond->waiters, NULL);
+  if (ret < 0) {
+    // Nothing else could run, so nothing took the mutex after we released it
+    assert(mutex->state == MUTEX_UNLOCKED);
+    mutex->state = MUTEX_LOCKED;
+    mutex->owner = running_thread->thread_id;
+    InterruptsSet(enabled);
+    return ret;
+  }
+
+  // Whoever woke us up made us the owner of the mutex before we could run
+  assert(mutex->owner == running_thread->thread_id);
+  profile_waited(cond->site, wait_start);
+  InterruptsSet(enabled);
+  return 0;
+}
+
+int
+ThreadCondSignal(ThreadCond* cond)
+{
+  assert(cond != NULL);
+  InterruptsState enabled = InterruptsDisable();
+  if (cond->waiters->head == NULL) {
+    InterruptsSet(enabled);
+    return 0;
+  }
+
+  TCB* next = extract_from_queue(cond->waiters);
+  next->waiting_on = NULL;
+  mutex_requeue(cond->mutex, next);
+  if (cond->waiters->head == NULL) {
+    cond->mutex = NULL;
+  }
+  InterruptsSet(enabled);
+  return 1;
+}
+
+int
+ThreadCondBroadcast(ThreadCond* cond)
+{
+  assert(cond != NULL);
+  InterruptsState enabled = InterruptsDisable();
+  if (cond->waiters->head == NULL) {
+    InterruptsSet(enabled);
+    return 0;
+  }
+
+  ThreadMutex* mutex = cond->mutex;
+  cond->mutex = NULL;
+
+  // The first waiter may take the mutex if it is free; everyone else would
+  // only block on it again, so they go straight onto its wait queue
+  TCB* first = extract_from_queue(cond->waiters);
+  first->waiting_on = NULL;
+  mutex_requeue(mutex, first);
+
+  int const moved = splice_queue(mutex->waiters, cond->waiters);
+  if (moved > 0) {
+    mutex->state = MUTEX_CONTENDED;
+  }
+  InterruptsSet(enabled);
+  return moved + 1;
+}
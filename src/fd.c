@@ -0,0 +1,359 @@
+#include <assert.h>
+#include <errno.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/epoll.h>
+#include <unistd.h>
+
+#include "interrupts.h"
+#include "thread.h"
+#include "thread_private.h"
+
+// Number of readiness events collected per poll
+#define FD_POLL_EVENTS 64
+// Maximum number of poll sources
+#define POLL_SOURCES_MAX 4
+// Added to a poll source's index to tell its events from a descriptor's
+#define POLL_SOURCE_TAG ((uint64_t)1 << 32)
+
+/**
+ * The waiting state of one file descriptor.
+ *
+ * Descriptors are registered with EPOLLONESHOT, so a report disarms them until
+ * they are re-armed for the threads still waiting. That keeps the poller
+ * level-triggered, whether or not waiters drain the descriptor, without
+ * reporting descriptors nobody waits on.
+ */
+typedef struct fd_state
+{
+  // Threads and asynchronous waits on the descriptor, each with a Waiter
+  // whose elem points to the events it waits for
+  WaitQueue waiters;
+  // The events the descriptor is armed for, or 0 if it is disarmed
+  int armed;
+  // Whether the descriptor was ever added to the poller
+  int registered;
+} FdState;
+
+// The poller, created on first use
+static int epoll_fd = -1;
+// Per-descriptor state, indexed by descriptor. Each entry is allocated on
+// first use and never moves, since waiting threads point to its queue.
+static FdState** fd_states = NULL;
+static int fd_states_size = 0;
+// Number of armed descriptors
+static int armed_fds = 0;
+// The registered poll sources
+static PollSource* poll_sources[POLL_SOURCES_MAX];
+static int poll_source_count = 0;
+int poll_busy = 0;
+
+/**
+ * Create the poller if needed.
+ *
+ * @return 1 if successful, 0 otherwise.
+ */
+static int
+poller_init(void)
+{
+  if (epoll_fd == -1) {
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  }
+  return epoll_fd != -1;
+}
+
+int
+poll_source_add(PollSource* source)
+{
+  assert(poll_source_count < POLL_SOURCES_MAX);
+  if (!poller_init()) {
+    return ERROR_SYS_MEM;
+  }
+  struct epoll_event event = { .events = EPOLLIN,
+                               .data.u64 = POLL_SOURCE_TAG +
+                                           poll_source_count };
+  if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, source->fd, &event) == -1) {
+    return ERROR_SYS_MEM;
+  }
+  poll_sources[poll_source_count++] = source;
+  return 0;
+}
+
+/**
+ * @return The state of fd, allocated if needed, or NULL if out of memory.
+ */
+static FdState*
+fd_state(int fd)
+{
+  if (fd >= fd_states_size) {
+    int size = fd_states_size == 0 ? 64 : fd_states_size;
+    while (size <= fd) {
+      size *= 2;
+    }
+    FdState** states = realloc(fd_states, size * sizeof(FdState*));
+    if (states == NULL) {
+      return NULL;
+    }
+    for (int i = fd_states_size; i < size; i++) {
+      states[i] = NULL;
+    }
+    fd_states = states;
+    fd_states_size = size;
+  }
+  if (fd_states[fd] == NULL) {
+    fd_states[fd] = calloc(1, sizeof(FdState));
+  }
+  return fd_states[fd];
+}
+
+static int
+to_epoll(int events)
+{
+  return ((events & THREAD_FD_READ) ? EPOLLIN : 0) |
+         ((events & THREAD_FD_WRITE) ? EPOLLOUT : 0);
+}
+
+static int
+from_epoll(int events)
+{
+  if (events & (EPOLLERR | EPOLLHUP)) {
+    // Let the next read or write report what happened
+    return THREAD_FD_READ | THREAD_FD_WRITE;
+  }
+  return ((events & EPOLLIN) ? THREAD_FD_READ : 0) |
+         ((events & EPOLLOUT) ? THREAD_FD_WRITE : 0);
+}
+
+/**
+ * @return The union of the events the threads waiting on state wait for.
+ */
+static int
+fd_interest(FdState* state)
+{
+  int events = 0;
+  for (node* curr = state->waiters.head; curr != NULL; curr = curr->next) {
+    events |= *(int*)curr->waiter->elem;
+  }
+  return events;
+}
+
+/**
+ * Arm fd for events, unless it is already armed for all of them.
+ *
+ * @return 0 if successful, or the errno of the failed epoll_ctl.
+ */
+static int
+fd_arm(int fd, FdState* state, int events)
+{
+  if ((state->armed & events) == events) {
+    return 0;
+  }
+  events |= state->armed;
+  struct epoll_event event = { .events = to_epoll(events) | EPOLLONESHOT,
+                               .data.u64 = (uint64_t)fd };
+  int op = state->registered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+  if (epoll_ctl(epoll_fd, op, fd, &event) == -1) {
+    // The descriptor number may have been closed and reused since
+    op = errno == ENOENT ? EPOLL_CTL_ADD : errno == EEXIST ? EPOLL_CTL_MOD : -1;
+    if (op == -1 || epoll_ctl(epoll_fd, op, fd, &event) == -1) {
+      return errno;
+    }
+  }
+  state->registered = 1;
+  if (state->armed == 0) {
+    armed_fds++;
+  }
+  state->armed = events;
+  return 0;
+}
+
+/**
+ * Wake the threads waiting on fd for any of the ready events, and re-arm fd
+ * for the others.
+ */
+static void
+fd_ready(int fd, int ready)
+{
+  FdState* state = fd_states[fd];
+  state->armed = 0;
+  armed_fds--;
+
+  node* curr = state->waiters.head;
+  while (curr != NULL) {
+    node* next = curr->next;
+    Waiter* waiter = curr->waiter;
+    int const events = *(int*)waiter->elem & ready;
+    if (events && curr->thread == NULL) {
+      waiter->status = events;
+      unlink_node(&state->waiters, curr);
+      await_fire(waiter);
+    } else if (events) {
+      waiter->status = events;
+      select_fire(waiter);
+    }
+    curr = next;
+  }
+
+  int const interest = fd_interest(state);
+  if (interest) {
+    fd_arm(fd, state, interest);
+  }
+}
+
+/**
+ * @return 1 if a thread waits on an armed descriptor, 0 otherwise.
+ */
+static int
+fds_waited_on(void)
+{
+  for (int fd = 0; fd < fd_states_size; fd++) {
+    if (fd_states[fd] != NULL && fd_states[fd]->armed &&
+        fd_states[fd]->waiters.head != NULL) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+int
+fds_poll(long long timeout)
+{
+  if (armed_fds == 0 && poll_busy == 0) {
+    return 0;
+  }
+  for (int i = 0; i < poll_source_count; i++) {
+    poll_sources[i]->poll(poll_sources[i], 0);
+  }
+  if (rq.head != NULL) {
+    timeout = 0;
+  }
+  if (timeout == 0 && armed_fds == 0) {
+    // The sources were polled without a system call; don't make one
+    return 1;
+  }
+  // Killed or timed out waiters can leave descriptors armed that nobody waits
+  // on; only block for those that someone does
+  if (timeout < 0 && poll_busy == 0 && !fds_waited_on()) {
+    return 0;
+  }
+
+  struct epoll_event events[FD_POLL_EVENTS];
+  int const ms = timeout < 0 ? -1 : (int)((timeout + 999) / 1000);
+  // A preemption signal stays pending while interrupts are disabled, so this
+  // wait is only ever cut short by other signals
+  int const n = epoll_wait(epoll_fd, events, FD_POLL_EVENTS, ms);
+  for (int i = 0; i < n; i++) {
+    uint64_t const data = events[i].data.u64;
+    if (data >= POLL_SOURCE_TAG) {
+      PollSource* source = poll_sources[data - POLL_SOURCE_TAG];
+      source->poll(source, 1);
+    } else {
+      fd_ready((int)data, from_epoll(events[i].events));
+    }
+  }
+  return 1;
+}
+
+/**
+ * Check whether fd is ready for events without waiting.
+ *
+ * @return The events fd is ready for, which can be 0.
+ */
+static int
+fd_check(int fd, int events)
+{
+  struct pollfd pfd = { .fd = fd,
+                        .events = ((events & THREAD_FD_READ) ? POLLIN : 0) |
+                                  ((events & THREAD_FD_WRITE) ? POLLOUT : 0) };
+  if (poll(&pfd, 1, 0) != 1) {
+    return 0;
+  }
+  if (pfd.revents & (POLLERR | POLLHUP | POLLNVAL)) {
+    return events;
+  }
+  return ((pfd.revents & POLLIN) ? THREAD_FD_READ : 0) |
+         ((pfd.revents & POLLOUT) ? THREAD_FD_WRITE : 0);
+}
+
+int
+ThreadWaitFd(int fd, int events, int timeout)
+{
+  events &= THREAD_FD_READ | THREAD_FD_WRITE;
+  if (fd < 0 || events == 0) {
+    return ERROR_OTHER;
+  }
+  if (timeout == 0) {
+    int const ready = fd_check(fd, events);
+    return ready ? ready : ERROR_TIMEOUT;
+  }
+
+  InterruptsState enabled = InterruptsDisable();
+  if (!poller_init()) {
+    InterruptsSet(enabled);
+    return ERROR_SYS_MEM;
+  }
+  FdState* state = fd_state(fd);
+  if (state == NULL) {
+    InterruptsSet(enabled);
+    return ERROR_SYS_MEM;
+  }
+  int const err = fd_arm(fd, state, events);
+  if (err == EPERM) {
+    // Regular files and directories are always ready
+    InterruptsSet(enabled);
+    return events;
+  }
+  if (err) {
+    InterruptsSet(enabled);
+    return ERROR_OTHER;
+  }
+
+  Waiter waiter = { .elem = &events, .size = sizeof(events) };
+  WaitQueue* queue = &state->waiters;
+  node* self_node;
+  SelectState select = {
+    .count = 1, .waiters = &waiter, .queues = &queue, .nodes = &self_node
+  };
+  int const ret = select_block(&select, timeout);
+  InterruptsSet(enabled);
+  return ret < 0 ? ret : waiter.status;
+}
+
+int
+ThreadWaitFdAsync(int fd, int events, void (*resume)(void*, int), void* arg)
+{
+  events &= THREAD_FD_READ | THREAD_FD_WRITE;
+  if (fd < 0 || events == 0) {
+    return ERROR_OTHER;
+  }
+
+  InterruptsState enabled = InterruptsDisable();
+  if (!poller_init()) {
+    InterruptsSet(enabled);
+    return ERROR_SYS_MEM;
+  }
+  FdState* state = fd_state(fd);
+  Await* await = state != NULL ? await_new(resume, arg) : NULL;
+  if (await == NULL) {
+    InterruptsSet(enabled);
+    return ERROR_SYS_MEM;
+  }
+  await->events = events;
+  int const err = fd_arm(fd, state, events);
+  if (err == EPERM) {
+    // Regular files and directories are always ready
+    await->waiter.status = events;
+    await_fire(&await->waiter);
+    InterruptsSet(enabled);
+    return 0;
+  }
+  if (err) {
+    free(await);
+    InterruptsSet(enabled);
+    return ERROR_OTHER;
+  }
+  enqueue_waiter(&state->waiters, NULL, &await->waiter);
+  InterruptsSet(enabled);
+  return 0;
+}
@@ -0,0 +1,360 @@
+#include <assert.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "interrupts.h"
+#include "thread.h"
+#include "thread_private.h"
+
+/**
+ * How far a promise is from being settled.
+ */
+typedef enum
+{
+  FUTURE_PENDING = 0,
+  FUTURE_SET = 1,
+  // The promise was destroyed without a value
+  FUTURE_BROKEN = 2
+} FutureState;
+
+/**
+ * A continuation added by ThreadFutureThen: fn computes the value of to from
+ * the value of from.
+ */
+typedef struct continuation
+{
+  void (*fn)(void* arg, const void* in, void* out);
+  void* arg;
+  ThreadThenPolicy policy;
+  struct thread_promise_t* from;
+  struct thread_promise_t* to;
+  struct continuation* next;
+} Continuation;
+
+/**
+ * The state a promise shares with its future. A ThreadFuture points to the
+ * same object as its ThreadPromise.
+ */
+typedef struct thread_promise_t
+{
+  volatile FutureState state;
+  int elem_size;
+  // The promise and future handles, and continuations from this promise,
+  // that are not yet destroyed or run
+  int refs;
+  // Whether the promise is settled by a continuation rather than a handle
+  int chained;
+  WaitQueue waiters;
+  // The continuations to run once settled, in the order they were added
+  Continuation* continuations;
+  Continuation** last;
+  // The next promise to settle after this one, while settling a chain
+  struct thread_promise_t* settle_next;
+  _Alignas(max_align_t) char value[];
+} Promise;
+
+/**
+ * Drop a reference to promise, freeing it with the last one.
+ *
+ * @pre interrupts are disabled
+ */
+static void
+promise_release(Promise* promise)
+{
+  if (--promise->refs == 0) {
+    free(promise);
+  }
+}
+
+/**
+ * @return A pending promise, referenced by both its handles, or NULL if out of
+ * memory.
+ *
+ * @pre interrupts are disabled
+ */
+static Promise*
+promise_new(int elem_size)
+{
+  Promise* const promise = malloc(sizeof(Promise) + elem_size);
+  if (promise == NULL) {
+    return NULL;
+  }
+  promise->state = FUTURE_PENDING;
+  promise->elem_size = elem_size;
+  promise->refs = 2;
+  promise->chained = 0;
+  promise->waiters.head = NULL;
+  promise->waiters.tail = NULL;
+  promise->continuations = NULL;
+  promise->last = &promise->continuations;
+  promise->settle_next = NULL;
+  return promise;
+}
+
+/**
+ * Free a list of continuations that have run, linked by next, dropping their
+ * references to the promises they were chained from.
+ *
+ * @pre interrupts are disabled
+ */
+static void
+continuations_free(Continuation* c)
+{
+  while (c != NULL) {
+    Continuation* const next = c->next;
+    promise_release(c->from);
+    free(c);
+    c = next;
+  }
+}
+
+static void promise_settle(Promise* promise, FutureState outcome);
+
+/**
+ * Run a continuation spawned as a task, and settle the promise it feeds.
+ */
+static void
+continuation_task(void* arg)
+{
+  Continuation* const c = arg;
+  c->fn(c->arg, c->from->value, c->to->value);
+  promise_settle(c->to, FUTURE_SET);
+  c->next = NULL;
+  InterruptsState enabled = InterruptsDisable();
+  continuations_free(c);
+  InterruptsSet(enabled);
+}
+
+/**
+ * Spawn continuation c of a promise settled with outcome as a task, if it asks
+ * to be and the promise is set, or run it on the calling thread.
+ *
+ * @return Whether c was run on the calling thread, in which case the promise
+ * it feeds is left for the caller to settle and c to free.
+ */
+static int
+continuation_run(Continuation* c, FutureState outcome)
+{
+  if (outcome == FUTURE_SET && c->policy == THREAD_THEN_TASK &&
+      TaskSpawn(continuation_task, c) == 0) {
+    return 0;
+  }
+  if (outcome == FUTURE_SET) {
+    c->fn(c->arg, c->from->value, c->to->value);
+  }
+  return 1;
+}
+
+/**
+ * Settle promise, whose value is in place if outcome is FUTURE_SET: wake its
+ * waiters with one splice and run its continuations. The promises fed by
+ * continuations run on this thread are settled in turn, in a loop rather than
+ * recursively, so that a chain of any length runs in constant stack. A broken
+ * promise breaks the promises its continuations feed.
+ *
+ * The continuations that have run are freed while interrupts are disabled to
+ * settle the next promise, so that a stage of an inline chain takes a single
+ * pair of calls to disable and restore them.
+ */
+static void
+promise_settle(Promise* promise, FutureState outcome)
+{
+  promise->settle_next = NULL;
+  Promise* settling = promise;
+  Continuation* done = NULL;
+  // A chained promise settled, whose promise handle is to be dropped
+  Promise* finished = NULL;
+  while (settling != NULL) {
+    Promise* const current = settling;
+    settling = current->settle_next;
+
+    InterruptsState const enabled = InterruptsDisable();
+    continuations_free(done);
+    done = NULL;
+    if (finished != NULL) {
+      promise_release(finished);
+      finished = NULL;
+    }
+    current->state = outcome;
+    ThreadWakeAll(&current->waiters);
+    Continuation* c = current->continuations;
+    current->continuations = NULL;
+    current->last = &current->continuations;
+    InterruptsSet(enabled);
+
+    while (c != NULL) {
+      Continuation* const next = c->next;
+      if (continuation_run(c, outcome)) {
+        c->to->settle_next = settling;
+        settling = c->to;
+        c->next = done;
+        done = c;
+      }
+      c = next;
+    }
+    if (current->chained) {
+      // Nothing else settles it, so its promise handle is gone
+      finished = current;
+    }
+  }
+  InterruptsState const enabled = InterruptsDisable();
+  continuations_free(done);
+  if (finished != NULL) {
+    promise_release(finished);
+  }
+  InterruptsSet(enabled);
+}
+
+ThreadPromise*
+ThreadPromiseCreate(int elem_size)
+{
+  assert(elem_size >= 0);
+  InterruptsState enabled = InterruptsDisable();
+  Promise* const promise = promise_new(elem_size);
+  InterruptsSet(enabled);
+  return promise;
+}
+
+ThreadFuture*
+ThreadPromiseFuture(ThreadPromise* promise)
+{
+  assert(promise != NULL);
+  return (ThreadFuture*)promise;
+}
+
+int
+ThreadPromiseSet(ThreadPromise* promise, const void* value)
+{
+  assert(promise != NULL);
+  InterruptsState enabled = InterruptsDisable();
+  if (promise->state != FUTURE_PENDING) {
+    InterruptsSet(enabled);
+    return ERROR_OTHER;
+  }
+  if (promise->elem_size > 0) {
+    assert(value != NULL);
+    memcpy(promise->value, value, promise->elem_size);
+  }
+  // Taken now, so that no other thread sets it while it is settled
+  promise->state = FUTURE_SET;
+  InterruptsSet(enabled);
+  promise_settle(promise, FUTURE_SET);
+  return 0;
+}
+
+int
+ThreadPromiseDestroy(ThreadPromise* promise)
+{
+  assert(promise != NULL);
+  InterruptsState enabled = InterruptsDisable();
+  FutureState const state = promise->state;
+  if (state == FUTURE_PENDING) {
+    promise->state = FUTURE_BROKEN;
+  }
+  InterruptsSet(enabled);
+  if (state == FUTURE_PENDING) {
+    promise_settle(promise, FUTURE_BROKEN);
+  }
+  enabled = InterruptsDisable();
+  promise_release(promise);
+  InterruptsSet(enabled);
+  return 0;
+}
+
+int
+ThreadFutureGet(ThreadFuture* future, void* value)
+{
+  assert(future != NULL);
+  Promise* const promise = (Promise*)future;
+  InterruptsState enabled = InterruptsDisable();
+  // A set promise is only FUTURE_SET for its waiters once its value is in
+  // place, which it is before the state changes
+  while (promise->state == FUTURE_PENDING) {
+    int const ret = sleep_with_waiter(&promise->waiters, NULL);
+    if (ret < 0) {
+      InterruptsSet(enabled);
+      return ret;
+    }
+  }
+  InterruptsSet(enabled);
+  if (promise->state == FUTURE_BROKEN) {
+    return ERROR_CLOSED;
+  }
+  if (value != NULL && promise->elem_size > 0) {
+    memcpy(value, promise->value, promise->elem_size);
+  }
+  return 0;
+}
+
+int
+ThreadFutureIsReady(ThreadFuture* future)
+{
+  assert(future != NULL);
+  return ((Promise*)future)->state != FUTURE_PENDING;
+}
+
+ThreadFuture*
+ThreadFutureThen(ThreadFuture* future,
+                 int elem_size,
+                 void (*fn)(void* arg, const void* in, void* out),
+                 void* arg,
+                 ThreadThenPolicy policy)
+{
+  assert(future != NULL);
+  assert(fn != NULL);
+  assert(elem_size >= 0);
+  Promise* const from = (Promise*)future;
+  InterruptsState enabled = InterruptsDisable();
+  Promise* const to = promise_new(elem_size);
+  Continuation* const c = malloc(sizeof(Continuation));
+  if (to == NULL || c == NULL) {
+    free(to);
+    free(c);
+    InterruptsSet(enabled);
+    return NULL;
+  }
+  to->chained = 1;
+  from->refs++;
+  c->fn = fn;
+  c->arg = arg;
+  c->policy = policy;
+  c->from = from;
+  c->to = to;
+  c->next = NULL;
+
+  FutureState const state = from->state;
+  if (state == FUTURE_PENDING || from->continuations != NULL) {
+    // Still pending, or being settled by another thread, which fires the
+    // continuations it finds in order
+    *from->last = c;
+    from->last = &c->next;
+    InterruptsSet(enabled);
+    return (ThreadFuture*)to;
+  }
+  InterruptsSet(enabled);
+
+  // Already settled: run it now, and settle what it feeds like a chain
+  if (continuation_run(c, state)) {
+    promise_settle(to, state);
+    enabled = InterruptsDisable();
+    continuations_free(c);
+    InterruptsSet(enabled);
+  }
+  return (ThreadFuture*)to;
+}
+
+int
+ThreadFutureDestroy(ThreadFuture* future)
+{
+  assert(future != NULL);
+  Promise* const promise = (Promise*)future;
+  InterruptsState enabled = InterruptsDisable();
+  if (promise->waiters.head != NULL) {
+    InterruptsSet(enabled);
+    return ERROR_OTHER;
+  }
+  promise_release(promise);
+  InterruptsSet(enabled);
+  return 0;
+}
@@ -1,10 +1,12 @@
 #include <assert.h>
+#include <errno.h>
 #include <signal.h>
 #include <stdarg.h>
 #include <sys/time.h>
 
 #include "interrupts.h"
 #include "thread.h"
+#include "thread_private.h"
 
 #define UNUSED(x) (void)(x)
 
@@ -62,10 +64,17 @@ HandleSignal(int sig, siginfo_t* sip, void* contextVP)
            diff.tv_sec * 1000000 + diff.tv_usec);
   }
 
+  // errno is shared by all threads, so the preempted thread's value must
+  // survive the other threads' system calls
+  int const saved_errno = errno;
   // Set up the next interrupt
   ScheduleAlarmSignal();
   // Yield to "preempt" the current thread and switch to another
+  trace_event(THREAD_TRACE_PREEMPT, ThreadId(), 0);
+  stats_preempting = 1;
   ThreadYield();
+  stats_preempting = 0;
+  errno = saved_errno;
 }
 
 void
@@ -7,6 +7,10 @@
 #include <signal.h>
 #include <stdio.h>
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 /**
  * How frequently this process will be interrupted.
  */
@@ -84,4 +88,8 @@ InterruptsSetLogLevel(InterruptsOutput level);
 int
 InterruptsPrintf(const char* fmt, ...);
 
+#ifdef __cplusplus
+}
+#endif
+
 #endif // INTERRUPTS_H
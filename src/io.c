@@ -0,0 +1,382 @@
+#include <assert.h>
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "interrupts.h"
+#include "thread.h"
+#include "thread_private.h"
+
+// Number of submission queue entries. Each operation suspends its thread, so
+// no more than MAX_THREADS can be in flight.
+#define IO_RING_ENTRIES MAX_THREADS
+
+/**
+ * The operations.
+ */
+typedef enum
+{
+  IO_READ,
+  IO_WRITE,
+  IO_READV,
+  IO_FSYNC
+} IoOpcode;
+
+/**
+ * An operation in flight, on the stack of the thread that waits for it.
+ */
+typedef struct io_op
+{
+  // How the helper thread backend runs the operation
+  PoolJob job;
+  IoOpcode opcode;
+  int fd;
+  // The buffer, or for IO_READV the iovec array
+  void* buf;
+  // The buffer size, or for IO_READV the iovec count
+  size_t count;
+  off_t offset;
+  // The number of bytes transferred, or a negated errno
+  ssize_t result;
+  AsyncWait wait;
+} IoOp;
+
+/**
+ * The io_uring instance and the rings it shares with the kernel.
+ */
+typedef struct io_ring
+{
+  PollSource source;
+  unsigned* sq_head;
+  unsigned* sq_tail;
+  unsigned sq_mask;
+  unsigned sq_entries;
+  unsigned* sq_array;
+  struct io_uring_sqe* sqes;
+  // Entries queued since the last io_uring_enter
+  unsigned to_submit;
+  unsigned* cq_head;
+  unsigned* cq_tail;
+  unsigned cq_mask;
+  struct io_uring_cqe* cqes;
+} IoRing;
+
+typedef enum
+{
+  IO_BACKEND_NONE,
+  IO_BACKEND_URING,
+  IO_BACKEND_THREADS
+} IoBackend;
+
+static IoBackend io_backend = IO_BACKEND_NONE;
+static IoRing ring;
+
+void
+async_begin(AsyncWait* wait)
+{
+  wait->thread = running_thread;
+  wait->waiters.head = NULL;
+  wait->waiters.tail = NULL;
+  wait->completed = 0;
+  running_thread->io_pending++;
+}
+
+void
+async_wait(AsyncWait* wait)
+{
+  // The operation keeps the poller busy, so the scheduler waits for it rather
+  // than fail to find a thread to run
+  while (!wait->completed) {
+    sleep_with_waiter(&wait->waiters, NULL);
+  }
+}
+
+void
+async_complete(AsyncWait* wait)
+{
+  wait->completed = 1;
+  wake_first(&wait->waiters);
+  // From here on, the thread's stack, and wait with it, may be freed
+  wait->thread->io_pending--;
+}
+
+/**
+ * Record the result of op and wake the thread waiting for it.
+ */
+static void
+io_complete(IoOp* op, ssize_t result)
+{
+  op->result = result;
+  async_complete(&op->wait);
+}
+
+/**
+ * Submit the queued entries and complete the operations the kernel finished.
+ */
+static void
+ring_poll(PollSource* source, int signalled)
+{
+  (void)source;
+  (void)signalled;
+  if (ring.to_submit > 0) {
+    long const n = syscall(
+      __NR_io_uring_enter, ring.source.fd, ring.to_submit, 0, 0, NULL, 0);
+    if (n > 0) {
+      ring.to_submit -= n;
+    }
+  }
+
+  unsigned head = *ring.cq_head;
+  unsigned const tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+  if (head == tail) {
+    return;
+  }
+  while (head != tail) {
+    struct io_uring_cqe* cqe = &ring.cqes[head & ring.cq_mask];
+    poll_busy--;
+    io_complete((IoOp*)(uintptr_t)cqe->user_data, cqe->res);
+    head++;
+  }
+  __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+}
+
+/**
+ * Set up the io_uring instance.
+ *
+ * @return 1 if successful, 0 otherwise.
+ */
+static int
+ring_init(void)
+{
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  int const fd = syscall(__NR_io_uring_setup, IO_RING_ENTRIES, &params);
+  if (fd == -1) {
+    return 0;
+  }
+
+  size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  size_t cq_size =
+    params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  int const single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+  if (single_mmap) {
+    sq_size = cq_size = sq_size > cq_size ? sq_size : cq_size;
+  }
+  char* sq = mmap(NULL,
+                  sq_size,
+                  PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_POPULATE,
+                  fd,
+                  IORING_OFF_SQ_RING);
+  char* cq = single_mmap ? sq
+                         : mmap(NULL,
+                                cq_size,
+                                PROT_READ | PROT_WRITE,
+                                MAP_SHARED | MAP_POPULATE,
+                                fd,
+                                IORING_OFF_CQ_RING);
+  struct io_uring_sqe* sqes =
+    mmap(NULL,
+         params.sq_entries * sizeof(struct io_uring_sqe),
+         PROT_READ | PROT_WRITE,
+         MAP_SHARED | MAP_POPULATE,
+         fd,
+         IORING_OFF_SQES);
+  // The rings live as long as the process, so nothing is unmapped on failure
+  if (sq == MAP_FAILED || cq == MAP_FAILED || sqes == MAP_FAILED) {
+    close(fd);
+    return 0;
+  }
+
+  ring.source.fd = fd;
+  ring.source.poll = ring_poll;
+  ring.sq_head = (unsigned*)(sq + params.sq_off.head);
+  ring.sq_tail = (unsigned*)(sq + params.sq_off.tail);
+  ring.sq_mask = *(unsigned*)(sq + params.sq_off.ring_mask);
+  ring.sq_entries = params.sq_entries;
+  ring.sq_array = (unsigned*)(sq + params.sq_off.array);
+  ring.sqes = sqes;
+  ring.to_submit = 0;
+  ring.cq_head = (unsigned*)(cq + params.cq_off.head);
+  ring.cq_tail = (unsigned*)(cq + params.cq_off.tail);
+  ring.cq_mask = *(unsigned*)(cq + params.cq_off.ring_mask);
+  ring.cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+  if (poll_source_add(&ring.source) < 0) {
+    close(fd);
+    return 0;
+  }
+  return 1;
+}
+
+/**
+ * Queue op on the submission ring, for the next tick to submit.
+ */
+static void
+ring_submit(IoOp* op)
+{
+  unsigned const tail = *ring.sq_tail;
+  // At most one operation per thread is in flight, so the ring never fills
+  assert(tail - __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE) <
+         ring.sq_entries);
+  unsigned const index = tail & ring.sq_mask;
+  struct io_uring_sqe* sqe = &ring.sqes[index];
+  memset(sqe, 0, sizeof(*sqe));
+  switch (op->opcode) {
+    case IO_READ:
+      sqe->opcode = IORING_OP_READ;
+      break;
+    case IO_WRITE:
+      sqe->opcode = IORING_OP_WRITE;
+      break;
+    case IO_READV:
+      sqe->opcode = IORING_OP_READV;
+      break;
+    case IO_FSYNC:
+      sqe->opcode = IORING_OP_FSYNC;
+      break;
+  }
+  sqe->fd = op->fd;
+  sqe->addr = (uintptr_t)op->buf;
+  sqe->len = op->count;
+  // An offset of -1 uses and advances the file position
+  sqe->off = (uint64_t)op->offset;
+  sqe->user_data = (uintptr_t)op;
+  ring.sq_array[index] = index;
+  __atomic_store_n(ring.sq_tail, tail + 1, __ATOMIC_RELEASE);
+  ring.to_submit++;
+  poll_busy++;
+}
+
+/**
+ * Run op on a helper thread.
+ */
+static void
+io_run(PoolJob* job)
+{
+  IoOp* op = (IoOp*)job;
+  ssize_t n = 0;
+  switch (op->opcode) {
+    case IO_READ:
+      n = op->offset < 0 ? read(op->fd, op->buf, op->count)
+                         : pread(op->fd, op->buf, op->count, op->offset);
+      break;
+    case IO_WRITE:
+      n = op->offset < 0 ? write(op->fd, op->buf, op->count)
+                         : pwrite(op->fd, op->buf, op->count, op->offset);
+      break;
+    case IO_READV:
+      n = op->offset < 0 ? readv(op->fd, op->buf, op->count)
+                         : preadv(op->fd, op->buf, op->count, op->offset);
+      break;
+    case IO_FSYNC:
+      n = fsync(op->fd);
+      break;
+  }
+  // errno belongs to this helper thread
+  op->result = n < 0 ? -errno : n;
+}
+
+static void
+io_done(PoolJob* job)
+{
+  IoOp* op = (IoOp*)job;
+  io_complete(op, op->result);
+}
+
+/**
+ * Pick the backend on first use.
+ */
+static void
+io_init(void)
+{
+  const char* backend = getenv("THREAD_IO_BACKEND");
+  if ((backend == NULL || strcmp(backend, "threads") != 0) && ring_init()) {
+    io_backend = IO_BACKEND_URING;
+  } else {
+    io_backend = IO_BACKEND_THREADS;
+  }
+}
+
+/**
+ * Submit op and suspend the calling thread until it completes.
+ *
+ * @return The result of the operation, POSIX style.
+ */
+static ssize_t
+io_submit_and_wait(IoOp* op)
+{
+  InterruptsState enabled = InterruptsDisable();
+  if (running_thread->shared != NULL) {
+    // Neither the kernel nor a helper thread may be handed a buffer on a stack
+    // that is copied out while its thread waits, so do the operation here
+    io_run(&op->job);
+  } else {
+    if (io_backend == IO_BACKEND_NONE) {
+      io_init();
+    }
+
+    if (io_backend == IO_BACKEND_URING) {
+      ring_submit(op);
+    } else {
+      op->job.run = io_run;
+      op->job.done = io_done;
+      if (pool_submit(&op->job) < 0) {
+        InterruptsSet(enabled);
+        errno = ENOMEM;
+        return -1;
+      }
+    }
+    async_begin(&op->wait);
+    async_wait(&op->wait);
+  }
+  InterruptsSet(enabled);
+
+  if (op->result < 0) {
+    errno = -op->result;
+    return -1;
+  }
+  return op->result;
+}
+
+ssize_t
+ThreadRead(int fd, void* buf, size_t count, off_t offset)
+{
+  IoOp op = {
+    .opcode = IO_READ, .fd = fd, .buf = buf, .count = count, .offset = offset
+  };
+  return io_submit_and_wait(&op);
+}
+
+ssize_t
+ThreadWrite(int fd, const void* buf, size_t count, off_t offset)
+{
+  IoOp op = { .opcode = IO_WRITE,
+              .fd = fd,
+              .buf = (void*)buf,
+              .count = count,
+              .offset = offset };
+  return io_submit_and_wait(&op);
+}
+
+ssize_t
+ThreadReadv(int fd, const struct iovec* iov, int iovcnt, off_t offset)
+{
+  IoOp op = { .opcode = IO_READV,
+              .fd = fd,
+              .buf = (void*)iov,
+              .count = iovcnt,
+              .offset = offset };
+  return io_submit_and_wait(&op);
+}
+
+int
+ThreadFsync(int fd)
+{
+  IoOp op = { .opcode = IO_FSYNC, .fd = fd };
+  return io_submit_and_wait(&op);
+}
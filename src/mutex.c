@@ -0,0 +1,197 @@
+#include <assert.h>
+#include <stdlib.h>
+
+#include "interrupts.h"
+#include "thread.h"
+#include "thread_private.h"
+
+ThreadMutex*
+ThreadMutexCreate(void)
+{
+  ThreadMutex* mutex = malloc(sizeof(ThreadMutex));
+  if (mutex == NULL) {
+    return NULL;
+  }
+  mutex->waiters = WaitQueueCreate();
+  if (mutex->waiters == NULL) {
+    free(mutex);
+    return NULL;
+  }
+  mutex->site = profile_site("mutex", __builtin_return_address(0));
+  mutex->state = MUTEX_UNLOCKED;
+  mutex->owner = MUTEX_NO_OWNER;
+  return mutex;
+}
+
+int
+ThreadMutexDestroy(ThreadMutex* mutex)
+{
+  assert(mutex != NULL);
+  if (mutex->state != MUTEX_UNLOCKED) {
+    return ERROR_OTHER;
+  }
+  WaitQueueDestroy(mutex->waiters);
+  free(mutex);
+  return 0;
+}
+
+/**
+ * Try to take an unlocked mutex with a single atomic operation.
+ *
+ * Safe to call with interrupts enabled: the compare-and-swap cannot be split by
+ * the preemption signal, and a cancellation is not acted on before the owner
+ * is recorded.
+ *
+ * @return 1 if the caller now owns the mutex, 0 otherwise.
+ */
+static int
+mutex_try_acquire(ThreadMutex* mutex)
+{
+  cancel_defer();
+  int const acquired =
+    __sync_bool_compare_and_swap(&mutex->state, MUTEX_UNLOCKED, MUTEX_LOCKED);
+  if (acquired) {
+    mutex->owner = running_thread->thread_id;
+  }
+  cancel_resume();
+  return acquired;
+}
+
+/**
+ * Yield directly to the owner of the mutex while it is runnable, giving it a
+ * chance to leave its critical section before we sleep.
+ *
+ * The owner is read without masking interrupts, so it is only a hint.
+ *
+ * @return 1 if the caller now owns the mutex, 0 otherwise.
+ */
+static int
+mutex_spin(ThreadMutex* mutex)
+{
+  for (int i = 0; i < THREAD_MUTEX_SPIN; i++) {
+    Tid const owner = mutex->owner;
+    if (owner < 0 || owner >= MAX_THREADS || threads[owner].state != READY) {
+      return 0;
+    }
+    thread_yield_to(owner);
+    if (mutex_try_acquire(mutex)) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+int
+ThreadMutexLock(ThreadMutex* mutex)
+{
+  assert(mutex != NULL);
+  if (mutex_try_acquire(mutex)) {
+    profile_acquired(mutex->site);
+    return 0;
+  }
+  if (mutex->owner == running_thread->thread_id) {
+    return ERROR_THREAD_BAD;
+  }
+  long long const wait_start = profile_wait_start(mutex->site);
+  if (mutex_spin(mutex)) {
+    profile_waited(mutex->site, wait_start);
+    return 0;
+  }
+
+  InterruptsState enabled = InterruptsDisable();
+  if (mutex->state == MUTEX_UNLOCKED) {
+    // Released between the spin and masking interrupts
+    mutex->state = MUTEX_LOCKED;
+    mutex->owner = running_thread->thread_id;
+    profile_waited(mutex->site, wait_start);
+    InterruptsSet(enabled);
+    return 0;
+  }
+
+  // Tell the owner it must take the slow path on unlock
+  mutex->state = MUTEX_CONTENDED;
+  int const ret = sleep_with_waiter(mutex->waiters, NULL);
+  if (ret < 0) {
+    InterruptsSet(enabled);
+    return ret;
+  }
+
+  // The unlocking thread handed ownership to us before waking us up
+  assert(mutex->owner == running_thread->thread_id);
+  profile_waited(mutex->site, wait_start);
+  InterruptsSet(enabled);
+  return 0;
+}
+
+int
+ThreadMutexTryLock(ThreadMutex* mutex)
+{
+  assert(mutex != NULL);
+  if (!mutex_try_acquire(mutex)) {
+    return ERROR_OTHER;
+  }
+  profile_acquired(mutex->site);
+  return 0;
+}
+
+int
+ThreadMutexUnlock(ThreadMutex* mutex)
+{
+  assert(mutex != NULL);
+  if (mutex->owner != running_thread->thread_id) {
+    return ERROR_THREAD_BAD;
+  }
+
+  // Not cancelled between giving up ownership and releasing the lock word
+  cancel_defer();
+  mutex->owner = MUTEX_NO_OWNER;
+  if (__sync_bool_compare_and_swap(&mutex->state, MUTEX_LOCKED, MUTEX_UNLOCKED)) {
+    cancel_resume();
+    return 0;
+  }
+
+  InterruptsState enabled = InterruptsDisable();
+  cancel_resume();
+  mutex_release(mutex);
+  InterruptsSet(enabled);
+  return 0;
+}
+
+void
+mutex_release(ThreadMutex* mutex)
+{
+  mutex->owner = MUTEX_NO_OWNER;
+  if (mutex->waiters->head == NULL) {
+    mutex->state = MUTEX_UNLOCKED;
+    return;
+  }
+
+  // Hand the lock over without ever marking it unlocked, so no other thread
+  // can barge in ahead of the waiter
+  TCB* next = extract_from_queue(mutex->waiters);
+  next->waiting_on = NULL;
+  mutex->owner = next->thread_id;
+  mutex->state =
+    mutex->waiters->head == NULL ? MUTEX_LOCKED : MUTEX_CONTENDED;
+  next->state = READY;
+  stats_wakeup(next, stats_clock());
+  insert_into_queue(&rq, next);
+}
+
+void
+mutex_requeue(ThreadMutex* mutex, TCB* thread)
+{
+  if (mutex->state == MUTEX_UNLOCKED) {
+    mutex->state = MUTEX_LOCKED;
+    mutex->owner = thread->thread_id;
+    thread->state = READY;
+    stats_wakeup(thread, stats_clock());
+    insert_into_queue(&rq, thread);
+    return;
+  }
+
+  mutex->state = MUTEX_CONTENDED;
+  thread->state = BLOCKED;
+  thread->waiting_on = mutex->waiters;
+  insert_into_queue(mutex->waiters, thread);
+}
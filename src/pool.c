@@ -0,0 +1,257 @@
+#include <assert.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include "interrupts.h"
+#include "thread.h"
+#include "thread_private.h"
+
+// Number of helper kernel threads
+#define POOL_THREADS 4
+
+static void
+pool_poll(PollSource* source, int signalled);
+
+// Jobs handed to the helpers, in FIFO order, protected by pool_lock
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_work = PTHREAD_COND_INITIALIZER;
+static PoolJob* queue_head = NULL;
+static PoolJob** queue_tail = &queue_head;
+
+// Jobs submitted since the last tick, only touched by the scheduler
+static PoolJob* pending_head = NULL;
+static PoolJob** pending_tail = &pending_head;
+static int pending_count = 0;
+
+// Jobs the helpers finished, pushed without a lock, newest first
+static PoolJob* volatile finished = NULL;
+
+// An eventfd the helpers signal when finished becomes non-empty
+static PollSource pool_source = { .fd = -1, .poll = pool_poll };
+// Whether starting the helpers was attempted, and how that failed if it did
+static int pool_started = 0;
+static int pool_error = 0;
+
+// Jobs the helpers took from the queue, and of those, the ones they finished
+static volatile long jobs_taken = 0;
+static volatile long jobs_finished = 0;
+// Everything else in the statistics is only touched by the scheduler
+static ThreadOffloadStats stats;
+
+/**
+ * A call offloaded by ThreadOffload.
+ */
+typedef struct offload
+{
+  PoolJob job;
+  void (*f)(void*);
+  void* arg;
+  AsyncWait wait;
+} Offload;
+
+static void*
+pool_main(void* unused)
+{
+  (void)unused;
+  for (;;) {
+    pthread_mutex_lock(&pool_lock);
+    while (queue_head == NULL) {
+      pthread_cond_wait(&pool_work, &pool_lock);
+    }
+    PoolJob* job = queue_head;
+    queue_head = job->next;
+    if (queue_head == NULL) {
+      queue_tail = &queue_head;
+    }
+    pthread_mutex_unlock(&pool_lock);
+    __sync_fetch_and_add(&jobs_taken, 1);
+
+    job->started_at = timer_now();
+    job->run(job);
+    job->finished_at = timer_now();
+    __sync_fetch_and_add(&jobs_finished, 1);
+
+    PoolJob* head;
+    do {
+      head = finished;
+      job->next = head;
+    } while (!__sync_bool_compare_and_swap(&finished, head, job));
+    if (head == NULL) {
+      // Later pushes are collected along with this one
+      uint64_t const one = 1;
+      ssize_t const n = write(pool_source.fd, &one, sizeof(one));
+      (void)n;
+    }
+  }
+  return NULL;
+}
+
+/**
+ * Hand the pending jobs to the helpers and complete the finished ones.
+ */
+static void
+pool_poll(PollSource* source, int signalled)
+{
+  if (signalled) {
+    uint64_t count;
+    ssize_t const n = read(source->fd, &count, sizeof(count));
+    (void)n;
+  }
+
+  if (pending_head != NULL) {
+    pthread_mutex_lock(&pool_lock);
+    *queue_tail = pending_head;
+    queue_tail = pending_tail;
+    pthread_mutex_unlock(&pool_lock);
+    if (pending_count == 1) {
+      pthread_cond_signal(&pool_work);
+    } else {
+      pthread_cond_broadcast(&pool_work);
+    }
+    pending_head = NULL;
+    pending_tail = &pending_head;
+    pending_count = 0;
+  }
+
+  if (finished == NULL) {
+    return;
+  }
+  PoolJob* job = __sync_lock_test_and_set(&finished, NULL);
+  // Complete jobs in the order they finished
+  PoolJob* ordered = NULL;
+  while (job != NULL) {
+    PoolJob* next = job->next;
+    job->next = ordered;
+    ordered = job;
+    job = next;
+  }
+  long long const now = timer_now();
+  while (ordered != NULL) {
+    PoolJob* next = ordered->next;
+    long long const latency = now - ordered->submitted_at;
+    stats.completed++;
+    stats.total_queue_us += ordered->started_at - ordered->submitted_at;
+    stats.total_run_us += ordered->finished_at - ordered->started_at;
+    stats.total_latency_us += latency;
+    if (latency > stats.max_latency_us) {
+      stats.max_latency_us = latency;
+    }
+    poll_busy--;
+    ordered->done(ordered);
+    ordered = next;
+  }
+}
+
+/**
+ * Start the helper threads.
+ *
+ * @return 0 if successful, ERROR_SYS_MEM otherwise.
+ */
+static int
+pool_start(void)
+{
+  pool_source.fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  if (pool_source.fd == -1) {
+    return ERROR_SYS_MEM;
+  }
+  if (poll_source_add(&pool_source) < 0) {
+    close(pool_source.fd);
+    return ERROR_SYS_MEM;
+  }
+
+  // Helpers inherit the signal mask. They must never take the preemption
+  // signal, which would run the scheduler on the wrong kernel thread.
+  sigset_t all, old;
+  sigfillset(&all);
+  pthread_sigmask(SIG_SETMASK, &all, &old);
+  int started = 0;
+  for (int i = 0; i < POOL_THREADS; i++) {
+    pthread_t helper;
+    if (pthread_create(&helper, NULL, pool_main, NULL) == 0) {
+      pthread_detach(helper);
+      started++;
+    }
+  }
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+  return started > 0 ? 0 : ERROR_SYS_MEM;
+}
+
+int
+pool_submit(PoolJob* job)
+{
+  if (!pool_started) {
+    // Starting is only attempted once
+    pool_error = pool_start();
+    pool_started = 1;
+  }
+  if (pool_error < 0) {
+    return pool_error;
+  }
+  job->next = NULL;
+  job->submitted_at = timer_now();
+  *pending_tail = job;
+  pending_tail = &job->next;
+  pending_count++;
+  poll_busy++;
+
+  stats.submitted++;
+  int const queued = (int)(stats.submitted - jobs_taken);
+  if (queued > stats.max_queued) {
+    stats.max_queued = queued;
+  }
+  return 0;
+}
+
+static void
+offload_run(PoolJob* job)
+{
+  Offload* offload = (Offload*)job;
+  offload->f(offload->arg);
+}
+
+static void
+offload_done(PoolJob* job)
+{
+  async_complete(&((Offload*)job)->wait);
+}
+
+int
+ThreadOffload(void (*f)(void*), void* arg)
+{
+  assert(f != NULL);
+  Offload offload = {
+    .job = { .run = offload_run, .done = offload_done }, .f = f, .arg = arg
+  };
+  InterruptsState enabled = InterruptsDisable();
+  if (running_thread->shared != NULL) {
+    // arg may be on a stack that is copied out while its thread waits
+    f(arg);
+    InterruptsSet(enabled);
+    return 0;
+  }
+  int const ret = pool_submit(&offload.job);
+  if (ret < 0) {
+    InterruptsSet(enabled);
+    return ret;
+  }
+  async_begin(&offload.wait);
+  async_wait(&offload.wait);
+  InterruptsSet(enabled);
+  return 0;
+}
+
+void
+ThreadOffloadGetStats(ThreadOffloadStats* out)
+{
+  assert(out != NULL);
+  InterruptsState enabled = InterruptsDisable();
+  *out = stats;
+  long const taken = jobs_taken;
+  long const finished_jobs = jobs_finished;
+  out->queued = (int)(stats.submitted - taken);
+  out->running = (int)(taken - finished_jobs);
+  InterruptsSet(enabled);
+}
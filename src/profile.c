@@ -0,0 +1,245 @@
+#include <assert.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "interrupts.h"
+#include "thread.h"
+#include "thread_private.h"
+
+// The most call sites and names the profiler tracks
+#define PROFILE_SITES 128
+
+static int profile_on = 0;
+static ProfileSite* sites[PROFILE_SITES];
+static int site_count = 0;
+volatile sig_atomic_t profile_dump_pending = 0;
+
+/**
+ * Find the site with the given key, adding it if there is none.
+ *
+ * @pre interrupts are disabled
+ *
+ * @return The site, or NULL if there is no room for it.
+ */
+static ProfileSite*
+find_site(const char* kind, const void* caller, const char* name)
+{
+  for (int i = 0; i < site_count; i++) {
+    ProfileSite* site = sites[i];
+    if (name != NULL ? site->name != NULL && strcmp(site->name, name) == 0
+                     : site->caller == caller && site->kind == kind) {
+      return site;
+    }
+  }
+  if (site_count == PROFILE_SITES) {
+    return NULL;
+  }
+  ProfileSite* site = calloc(1, sizeof(ProfileSite));
+  if (site == NULL) {
+    return NULL;
+  }
+  site->kind = kind;
+  site->caller = name != NULL ? NULL : caller;
+  site->name = name;
+  sites[site_count++] = site;
+  return site;
+}
+
+ProfileSite*
+profile_site(const char* kind, const void* caller)
+{
+  if (!profile_on) {
+    return NULL;
+  }
+  InterruptsState enabled = InterruptsDisable();
+  ProfileSite* site = find_site(kind, caller, NULL);
+  InterruptsSet(enabled);
+  return site;
+}
+
+void
+profile_record_wait(ProfileSite* site, long long start)
+{
+  long long const wait = stats_clock() - start;
+  InterruptsState enabled = InterruptsDisable();
+  site->acquisitions++;
+  site->contended++;
+  site->total_wait += wait;
+  if (wait > site->max_wait) {
+    site->max_wait = wait;
+  }
+  site->thread_wait[running_thread->thread_id] += wait;
+  InterruptsSet(enabled);
+}
+
+static void
+profile_signal(int signal)
+{
+  (void)signal;
+  profile_dump_pending = 1;
+}
+
+int
+ThreadProfileStart(int signal)
+{
+  if (signal != 0) {
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = profile_signal;
+    sigemptyset(&action.sa_mask);
+    action.sa_flags = SA_RESTART;
+    if (sigaction(signal, &action, NULL) != 0) {
+      return ERROR_OTHER;
+    }
+  }
+  profile_on = 1;
+  return 0;
+}
+
+int
+ThreadProfileSetName(void* primitive, const char* name)
+{
+  assert(primitive != NULL);
+  assert(name != NULL);
+  ProfileSite** site = (ProfileSite**)primitive;
+  InterruptsState enabled = InterruptsDisable();
+  if (*site == NULL) {
+    InterruptsSet(enabled);
+    return ERROR_OTHER;
+  }
+  ProfileSite* named = find_site((*site)->kind, NULL, name);
+  if (named == NULL) {
+    InterruptsSet(enabled);
+    return ERROR_SYS_MEM;
+  }
+  *site = named;
+  InterruptsSet(enabled);
+  return 0;
+}
+
+/**
+ * Sort the sites, those with the most total wait first.
+ *
+ * @pre interrupts are disabled
+ */
+static void
+sort_sites(void)
+{
+  for (int i = 1; i < site_count; i++) {
+    ProfileSite* site = sites[i];
+    int j = i;
+    for (; j > 0 && sites[j - 1]->total_wait < site->total_wait; j--) {
+      sites[j] = sites[j - 1];
+    }
+    sites[j] = site;
+  }
+}
+
+/**
+ * Fill entry from site.
+ *
+ * @pre interrupts are disabled
+ */
+static void
+fill_entry(ThreadProfileEntry* entry, const ProfileSite* site, long long now)
+{
+  entry->kind = site->kind;
+  entry->name = site->name;
+  entry->caller = site->caller;
+  entry->acquisitions = site->acquisitions;
+  entry->contended = site->contended;
+  entry->total_wait_ns = stats_ns(site->total_wait, now);
+  entry->max_wait_ns = stats_ns(site->max_wait, now);
+  for (int i = 0; i < THREAD_PROFILE_TOP_WAITERS; i++) {
+    entry->top_waiters[i] = THREAD_NONE;
+    entry->top_wait_ns[i] = 0;
+  }
+  for (int tid = 0; tid < MAX_THREADS; tid++) {
+    long long const wait = site->thread_wait[tid];
+    if (wait == 0) {
+      continue;
+    }
+    // Insert into the top list, which is sorted longest first
+    int i = THREAD_PROFILE_TOP_WAITERS;
+    while (i > 0 && (entry->top_waiters[i - 1] == THREAD_NONE ||
+                     entry->top_wait_ns[i - 1] < wait)) {
+      i--;
+    }
+    if (i == THREAD_PROFILE_TOP_WAITERS) {
+      continue;
+    }
+    for (int j = THREAD_PROFILE_TOP_WAITERS - 1; j > i; j--) {
+      entry->top_waiters[j] = entry->top_waiters[j - 1];
+      entry->top_wait_ns[j] = entry->top_wait_ns[j - 1];
+    }
+    entry->top_waiters[i] = tid;
+    // Converted below, once the order is settled
+    entry->top_wait_ns[i] = wait;
+  }
+  for (int i = 0; i < THREAD_PROFILE_TOP_WAITERS; i++) {
+    entry->top_wait_ns[i] = stats_ns(entry->top_wait_ns[i], now);
+  }
+}
+
+int
+ThreadProfileGet(ThreadProfileEntry* entries, int max)
+{
+  assert(entries != NULL);
+  InterruptsState enabled = InterruptsDisable();
+  sort_sites();
+  long long const now = stats_clock();
+  int count = 0;
+  for (int i = 0; count < max && i < site_count; i++) {
+    if (sites[i]->acquisitions > 0) {
+      fill_entry(&entries[count++], sites[i], now);
+    }
+  }
+  InterruptsSet(enabled);
+  return count;
+}
+
+void
+ThreadProfileDump(int fd)
+{
+  InterruptsState enabled = InterruptsDisable();
+  sort_sites();
+  long long const now = stats_clock();
+  char line[512];
+  for (int i = 0; i < site_count; i++) {
+    if (sites[i]->acquisitions == 0) {
+      continue;
+    }
+    ThreadProfileEntry entry;
+    fill_entry(&entry, sites[i], now);
+    int n;
+    if (entry.name != NULL) {
+      n = snprintf(line, sizeof(line), "%-6s %-24s", entry.kind, entry.name);
+    } else {
+      n = snprintf(line, sizeof(line), "%-6s %-24p", entry.kind, entry.caller);
+    }
+    n += snprintf(line + n,
+                  sizeof(line) - n,
+                  " acquired %ld contended %ld wait total %lld ns max %lld "
+                  "ns top",
+                  entry.acquisitions,
+                  entry.contended,
+                  entry.total_wait_ns,
+                  entry.max_wait_ns);
+    for (int j = 0;
+         j < THREAD_PROFILE_TOP_WAITERS && entry.top_waiters[j] != THREAD_NONE;
+         j++) {
+      n += snprintf(line + n,
+                    sizeof(line) - n,
+                    " %d:%lld",
+                    entry.top_waiters[j],
+                    entry.top_wait_ns[j]);
+    }
+    n += snprintf(line + n, sizeof(line) - n, "\n");
+    ssize_t const written = write(fd, line, n);
+    (void)written;
+  }
+  InterruptsSet(enabled);
+}
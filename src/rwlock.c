@@ -0,0 +1,260 @@
+#include <assert.h>
+#include <stdlib.h>
+
+#include "interrupts.h"
+#include "thread.h"
+#include "thread_private.h"
+
+/**
+ * Set in the lock word while a writer holds the lock or is queued for it,
+ * which keeps new readers out.
+ */
+#define RWLOCK_WRITER (1 << 30)
+
+/**
+ * Set in the lock word while a writer holds the lock. It is claimed together
+ * with RWLOCK_WRITER, so the lock is never seen free between a writer's claim
+ * and its recording itself as the writer.
+ */
+#define RWLOCK_HELD (1 << 29)
+
+/**
+ * The bits of the lock word counting the readers holding the lock.
+ */
+#define RWLOCK_READERS (RWLOCK_HELD - 1)
+
+/**
+ * Tid stored as the writer of a lock no thread holds for writing.
+ */
+#define RWLOCK_NO_WRITER -1
+
+/**
+ * A reader-writer lock.
+ */
+typedef struct thread_rwlock_t
+{
+  ProfileSite* site;
+  volatile int word;
+  // The writer holding the lock, once it has recorded itself
+  Tid writer;
+  WaitQueue* readers;
+  WaitQueue* writers;
+} ThreadRWLock;
+
+ThreadRWLock*
+ThreadRWLockCreate(void)
+{
+  ThreadRWLock* rwlock = malloc(sizeof(ThreadRWLock));
+  if (rwlock == NULL) {
+    return NULL;
+  }
+  rwlock->readers = WaitQueueCreate();
+  rwlock->writers = WaitQueueCreate();
+  if (rwlock->readers == NULL || rwlock->writers == NULL) {
+    if (rwlock->readers != NULL) {
+      WaitQueueDestroy(rwlock->readers);
+    }
+    if (rwlock->writers != NULL) {
+      WaitQueueDestroy(rwlock->writers);
+    }
+    free(rwlock);
+    return NULL;
+  }
+  rwlock->site = profile_site("rwlock", __builtin_return_address(0));
+  rwlock->word = 0;
+  rwlock->writer = RWLOCK_NO_WRITER;
+  return rwlock;
+}
+
+int
+ThreadRWLockDestroy(ThreadRWLock* rwlock)
+{
+  assert(rwlock != NULL);
+  InterruptsState enabled = InterruptsDisable();
+  if (rwlock->word != 0 || rwlock->readers->head != NULL ||
+      rwlock->writers->head != NULL) {
+    InterruptsSet(enabled);
+    return ERROR_OTHER;
+  }
+  WaitQueueDestroy(rwlock->readers);
+  WaitQueueDestroy(rwlock->writers);
+  free(rwlock);
+  InterruptsSet(enabled);
+  return 0;
+}
+
+/**
+ * Admit every queued reader at once, counting them as holders on their behalf
+ * and splicing them onto the ready queue. New readers stay blocked if a writer
+ * is still queued.
+ *
+ * @pre interrupts are disabled and no writer holds the lock
+ */
+static void
+rwlock_release_readers(ThreadRWLock* rwlock)
+{
+  int const count = splice_queue(&rq, rwlock->readers);
+  __sync_fetch_and_add(&rwlock->word, count);
+  if (rwlock->writers->head == NULL) {
+    __sync_fetch_and_and(&rwlock->word, ~RWLOCK_WRITER);
+  }
+}
+
+/**
+ * Pass an idle lock to the first queued writer, or, if no writer is queued,
+ * open it to readers again.
+ *
+ * @pre interrupts are disabled
+ */
+static void
+rwlock_grant(ThreadRWLock* rwlock)
+{
+  if ((rwlock->word & (RWLOCK_HELD | RWLOCK_READERS)) != 0) {
+    return;
+  }
+  if (rwlock->writers->head == NULL) {
+    rwlock_release_readers(rwlock);
+    return;
+  }
+
+  TCB* next = extract_from_queue(rwlock->writers);
+  next->waiting_on = NULL;
+  __sync_fetch_and_or(&rwlock->word, RWLOCK_HELD);
+  rwlock->writer = next->thread_id;
+  next->state = READY;
+  stats_wakeup(next, stats_clock());
+  insert_into_queue(&rq, next);
+}
+
+int
+ThreadRWLockReadLock(ThreadRWLock* rwlock)
+{
+  assert(rwlock != NULL);
+  // Not cancelled while counted as a reader that does not hold the lock
+  cancel_defer();
+  if (!(__sync_fetch_and_add(&rwlock->word, 1) & RWLOCK_WRITER)) {
+    cancel_resume();
+    profile_acquired(rwlock->site);
+    return 0;
+  }
+
+  long long const wait_start = profile_wait_start(rwlock->site);
+  InterruptsState enabled = InterruptsDisable();
+  cancel_resume();
+  // Back out the optimistic increment; we may have been the reader a waiting
+  // writer was draining for
+  if (!(__sync_sub_and_fetch(&rwlock->word, 1) & RWLOCK_WRITER)) {
+    __sync_fetch_and_add(&rwlock->word, 1);
+    profile_waited(rwlock->site, wait_start);
+    InterruptsSet(enabled);
+    return 0;
+  }
+  rwlock_grant(rwlock);
+  if (!(rwlock->word & RWLOCK_WRITER)) {
+    // No writer was actually left to wait for
+    __sync_fetch_and_add(&rwlock->word, 1);
+    profile_waited(rwlock->site, wait_start);
+    InterruptsSet(enabled);
+    return 0;
+  }
+
+  // Whoever wakes us up counts us as a holder first
+  int const ret = sleep_with_waiter(rwlock->readers, NULL);
+  if (ret == 0) {
+    profile_waited(rwlock->site, wait_start);
+  }
+  InterruptsSet(enabled);
+  return ret < 0 ? ret : 0;
+}
+
+int
+ThreadRWLockReadUnlock(ThreadRWLock* rwlock)
+{
+  assert(rwlock != NULL);
+  // Not cancelled before handing the lock to a queued writer
+  cancel_defer();
+  int const old = __sync_fetch_and_sub(&rwlock->word, 1);
+  assert((old & RWLOCK_READERS) > 0);
+  if (old != (RWLOCK_WRITER | 1)) {
+    cancel_resume();
+    return 0;
+  }
+
+  // We were the last reader and a writer is queued
+  InterruptsState enabled = InterruptsDisable();
+  cancel_resume();
+  rwlock_grant(rwlock);
+  InterruptsSet(enabled);
+  return 0;
+}
+
+int
+ThreadRWLockWriteLock(ThreadRWLock* rwlock)
+{
+  assert(rwlock != NULL);
+  // Not cancelled between claiming the lock and recording the writer
+  cancel_defer();
+  if (__sync_bool_compare_and_swap(
+        &rwlock->word, 0, RWLOCK_WRITER | RWLOCK_HELD)) {
+    rwlock->writer = running_thread->thread_id;
+    cancel_resume();
+    profile_acquired(rwlock->site);
+    return 0;
+  }
+  cancel_resume();
+
+  long long const wait_start = profile_wait_start(rwlock->site);
+  InterruptsState enabled = InterruptsDisable();
+  if (rwlock->writer == running_thread->thread_id) {
+    InterruptsSet(enabled);
+    return ERROR_THREAD_BAD;
+  }
+
+  // Keep new readers out while we wait for the current ones to leave
+  __sync_fetch_and_or(&rwlock->word, RWLOCK_WRITER);
+  if (rwlock->word == RWLOCK_WRITER && rwlock->writers->head == NULL) {
+    __sync_fetch_and_or(&rwlock->word, RWLOCK_HELD);
+    rwlock->writer = running_thread->thread_id;
+    profile_waited(rwlock->site, wait_start);
+    InterruptsSet(enabled);
+    return 0;
+  }
+
+  int const ret = sleep_with_waiter(rwlock->writers, NULL);
+  if (ret < 0) {
+    // Undo our claim so that queued readers are not stranded
+    if (rwlock->writers->head == NULL && !(rwlock->word & RWLOCK_HELD)) {
+      rwlock_release_readers(rwlock);
+    }
+    InterruptsSet(enabled);
+    return ret;
+  }
+
+  // The last thread to leave handed the lock to us
+  assert(rwlock->writer == running_thread->thread_id);
+  profile_waited(rwlock->site, wait_start);
+  InterruptsSet(enabled);
+  return 0;
+}
+
+int
+ThreadRWLockWriteUnlock(ThreadRWLock* rwlock)
+{
+  assert(rwlock != NULL);
+  InterruptsState enabled = InterruptsDisable();
+  if (rwlock->writer != running_thread->thread_id) {
+    InterruptsSet(enabled);
+    return ERROR_THREAD_BAD;
+  }
+
+  rwlock->writer = RWLOCK_NO_WRITER;
+  __sync_fetch_and_and(&rwlock->word, ~RWLOCK_HELD);
+  if (rwlock->readers->head != NULL) {
+    // Readers queued behind us go first; a queued writer follows them
+    rwlock_release_readers(rwlock);
+  } else {
+    rwlock_grant(rwlock);
+  }
+  InterruptsSet(enabled);
+  return 0;
+}
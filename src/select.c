@@ -0,0 +1,210 @@
+#include <assert.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "interrupts.h"
+#include "thread.h"
+#include "thread_private.h"
+
+/**
+ * Remove the selecting thread from all its queues and disarm its timer.
+ */
+static void
+select_unlink(SelectState* select)
+{
+  for (int i = 0; i < select->count; i++) {
+    unlink_node(select->queues[i], select->nodes[i]);
+  }
+  if (select->timer_armed) {
+    timer_cancel(&select->timer);
+    select->timer_armed = 0;
+  }
+  select->thread->select = NULL;
+}
+
+/**
+ * Complete the select with the given case and make its thread ready.
+ */
+static void
+select_finish(SelectState* select, int index)
+{
+  select_unlink(select);
+  select->fired = index;
+  select->thread->state = READY;
+  stats_wakeup(select->thread, stats_clock());
+  insert_into_queue(&rq, select->thread);
+}
+
+static void
+select_timer_fire(Timer* timer)
+{
+  SelectState* select =
+    (SelectState*)((char*)timer - offsetof(SelectState, timer));
+  // The timer is no longer armed once it fires
+  select->timer_armed = 0;
+  select_finish(select, SELECT_TIMED_OUT);
+}
+
+void
+select_fire(Waiter* waiter)
+{
+  select_finish(waiter->select, waiter->index);
+}
+
+void
+select_cancel(TCB* thread)
+{
+  SelectState* const select = thread->select;
+  select_unlink(select);
+  free(select->owned);
+  if (select->on_heap) {
+    free(select->waiters);
+    free(select);
+  }
+}
+
+/**
+ * Try to complete one case without blocking.
+ *
+ * @return 1 if the case completed, 0 otherwise.
+ */
+static int
+select_try(ThreadSelectCase* c)
+{
+  int ret;
+  switch (c->op) {
+    case THREAD_SELECT_RECV:
+      ret = chan_try_recv(c->chan, c->elem);
+      break;
+    case THREAD_SELECT_SEND:
+      ret = chan_try_send(c->chan, c->elem);
+      break;
+    default:
+      // Only a wake-up that happens while we wait counts
+      return 0;
+  }
+  if (ret == ERROR_OTHER) {
+    return 0;
+  }
+  c->result = ret;
+  return 1;
+}
+
+/**
+ * select_block for a thread whose stack is its own.
+ */
+static int
+select_wait(SelectState* select, int timeout)
+{
+  select->thread = running_thread;
+  select->timer_armed = 0;
+  select->fired = SELECT_TIMED_OUT;
+  for (int i = 0; i < select->count; i++) {
+    Waiter* waiter = &select->waiters[i];
+    waiter->status = 0;
+    waiter->select = select;
+    waiter->index = i;
+    select->nodes[i] =
+      enqueue_waiter(select->queues[i], running_thread, waiter);
+  }
+  if (timeout > 0) {
+    select->timer.deadline = timer_now() + timeout;
+    select->timer.fire = select_timer_fire;
+    timer_add(&select->timer);
+    select->timer_armed = 1;
+  }
+  running_thread->state = BLOCKED;
+  running_thread->select = select;
+
+  int const ret = thread_block();
+  if (ret < 0) {
+    select_unlink(select);
+    running_thread->state = RUNNING;
+    return ret;
+  }
+  return select->fired == SELECT_TIMED_OUT ? ERROR_TIMEOUT : select->fired;
+}
+
+int
+select_block(SelectState* select, int timeout)
+{
+  if (running_thread->shared == NULL) {
+    return select_wait(select, timeout);
+  }
+  // The threads and timer that complete the select use all of it while the
+  // shared stack is copied out, so it waits on the heap
+  int const count = select->count;
+  SelectState* moved =
+    malloc(sizeof(SelectState) + count * (sizeof(WaitQueue*) + sizeof(node*)));
+  Waiter* waiters = stack_waiters_to_heap(select->waiters, count);
+  if (moved == NULL || waiters == NULL) {
+    free(moved);
+    free(waiters);
+    return ERROR_SYS_MEM;
+  }
+  *moved = *select;
+  moved->on_heap = 1;
+  moved->waiters = waiters;
+  moved->queues = (WaitQueue**)(moved + 1);
+  moved->nodes = (node**)(moved->queues + count);
+  memcpy(moved->queues, select->queues, count * sizeof(WaitQueue*));
+
+  int const ret = select_wait(moved, timeout);
+  stack_waiters_from_heap(select->waiters, waiters, count);
+  free(moved);
+  return ret;
+}
+
+int
+ThreadSelect(ThreadSelectCase* cases, int count, int timeout)
+{
+  assert(cases != NULL);
+  if (count < 1 || count > THREAD_SELECT_MAX_CASES) {
+    return ERROR_OTHER;
+  }
+
+  InterruptsState enabled = InterruptsDisable();
+  for (int i = 0; i < count; i++) {
+    if (select_try(&cases[i])) {
+      InterruptsSet(enabled);
+      return i;
+    }
+  }
+  if (timeout == 0) {
+    InterruptsSet(enabled);
+    return ERROR_TIMEOUT;
+  }
+
+  Waiter waiters[THREAD_SELECT_MAX_CASES];
+  WaitQueue* queues[THREAD_SELECT_MAX_CASES];
+  node* nodes[THREAD_SELECT_MAX_CASES];
+  SelectState select = { .count = count,
+                         .waiters = waiters,
+                         .queues = queues,
+                         .nodes = nodes };
+  for (int i = 0; i < count; i++) {
+    waiters[i].elem = cases[i].elem;
+    switch (cases[i].op) {
+      case THREAD_SELECT_RECV:
+        queues[i] = cases[i].chan->receivers;
+        waiters[i].size = cases[i].chan->elem_size;
+        break;
+      case THREAD_SELECT_SEND:
+        queues[i] = cases[i].chan->senders;
+        waiters[i].size = cases[i].chan->elem_size;
+        break;
+      default:
+        queues[i] = cases[i].queue;
+        waiters[i].size = 0;
+        break;
+    }
+  }
+
+  int const ret = select_block(&select, timeout);
+  if (ret >= 0) {
+    cases[ret].result = waiters[ret].status;
+  }
+  InterruptsSet(enabled);
+  return ret;
+}
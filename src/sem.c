@@ -0,0 +1,126 @@
+#include <assert.h>
+#include <stdlib.h>
+
+#include "interrupts.h"
+#include "thread.h"
+#include "thread_private.h"
+
+/**
+ * A semaphore.
+ *
+ * A negative count is the number of threads that have claimed a unit they do
+ * not yet have. A post that finds such a thread not yet on the wait queue
+ * leaves it a wakeup instead.
+ */
+typedef struct thread_sem_t
+{
+  ProfileSite* site;
+  volatile int count;
+  int wakeups;
+  WaitQueue* waiters;
+} ThreadSem;
+
+ThreadSem*
+ThreadSemCreate(int value)
+{
+  assert(value >= 0);
+  ThreadSem* sem = malloc(sizeof(ThreadSem));
+  if (sem == NULL) {
+    return NULL;
+  }
+  sem->waiters = WaitQueueCreate();
+  if (sem->waiters == NULL) {
+    free(sem);
+    return NULL;
+  }
+  sem->site = profile_site("sem", __builtin_return_address(0));
+  sem->count = value;
+  sem->wakeups = 0;
+  return sem;
+}
+
+int
+ThreadSemDestroy(ThreadSem* sem)
+{
+  assert(sem != NULL);
+  InterruptsState enabled = InterruptsDisable();
+  if (sem->waiters->head != NULL) {
+    InterruptsSet(enabled);
+    return ERROR_OTHER;
+  }
+  WaitQueueDestroy(sem->waiters);
+  free(sem);
+  InterruptsSet(enabled);
+  return 0;
+}
+
+int
+ThreadSemWait(ThreadSem* sem)
+{
+  assert(sem != NULL);
+  // Not cancelled while counted as a waiter that is not queued
+  cancel_defer();
+  if (__sync_fetch_and_sub(&sem->count, 1) > 0) {
+    cancel_resume();
+    profile_acquired(sem->site);
+    return 0;
+  }
+
+  long long const wait_start = profile_wait_start(sem->site);
+  InterruptsState enabled = InterruptsDisable();
+  cancel_resume();
+  if (sem->wakeups > 0) {
+    // A post arrived before we could get onto the wait queue
+    sem->wakeups--;
+    profile_waited(sem->site, wait_start);
+    InterruptsSet(enabled);
+    return 0;
+  }
+
+  int const ret = sleep_with_waiter(sem->waiters, NULL);
+  if (ret < 0) {
+    __sync_fetch_and_add(&sem->count, 1);
+    InterruptsSet(enabled);
+    return ret;
+  }
+  profile_waited(sem->site, wait_start);
+  InterruptsSet(enabled);
+  return 0;
+}
+
+int
+ThreadSemTryWait(ThreadSem* sem)
+{
+  assert(sem != NULL);
+  int count = sem->count;
+  while (count > 0) {
+    int const seen = __sync_val_compare_and_swap(&sem->count, count, count - 1);
+    if (seen == count) {
+      profile_acquired(sem->site);
+      return 0;
+    }
+    count = seen;
+  }
+  return ERROR_OTHER;
+}
+
+int
+ThreadSemPost(ThreadSem* sem)
+{
+  assert(sem != NULL);
+  // Not cancelled before waking the waiter the count was handed to
+  cancel_defer();
+  if (__sync_fetch_and_add(&sem->count, 1) >= 0) {
+    cancel_resume();
+    return 0;
+  }
+
+  InterruptsState enabled = InterruptsDisable();
+  cancel_resume();
+  int const woken = ThreadWakeNext(sem->waiters);
+  if (woken == 0) {
+    sem->wakeups++;
+  }
+  InterruptsSet(enabled);
+  return woken;
+}
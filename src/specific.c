@@ -0,0 +1,109 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "interrupts.h"
+#include "thread.h"
+#include "thread_private.h"
+
+static void (*destructors[THREAD_KEYS_MAX])(void*);
+static int key_count = 0;
+
+ThreadKey
+ThreadKeyCreate(void (*destructor)(void*))
+{
+  InterruptsState enabled = InterruptsDisable();
+  if (key_count == THREAD_KEYS_MAX) {
+    InterruptsSet(enabled);
+    return ERROR_OTHER;
+  }
+  destructors[key_count] = destructor;
+  ThreadKey const key = key_count++;
+  InterruptsSet(enabled);
+  return key;
+}
+
+void*
+ThreadGetSpecific(ThreadKey key)
+{
+  // Should the caller be preempted in between, it is still the running thread
+  // when it resumes, so nothing needs disabling interrupts
+  TCB* const self = running_thread;
+  if ((unsigned)key < THREAD_KEYS_INLINE) {
+    return self->specific[key];
+  }
+  if ((unsigned)key >= THREAD_KEYS_MAX || self->specific_overflow == NULL) {
+    return NULL;
+  }
+  return self->specific_overflow[key - THREAD_KEYS_INLINE];
+}
+
+int
+ThreadSetSpecific(ThreadKey key, void* value)
+{
+  if (key < 0 || key >= key_count) {
+    return ERROR_OTHER;
+  }
+  TCB* const self = running_thread;
+  if (key < THREAD_KEYS_INLINE) {
+    self->specific[key] = value;
+    return 0;
+  }
+  if (self->specific_overflow == NULL) {
+    InterruptsState enabled = InterruptsDisable();
+    void** overflow =
+      calloc(THREAD_KEYS_MAX - THREAD_KEYS_INLINE, sizeof(void*));
+    InterruptsSet(enabled);
+    if (overflow == NULL) {
+      return ERROR_SYS_MEM;
+    }
+    self->specific_overflow = overflow;
+  }
+  self->specific_overflow[key - THREAD_KEYS_INLINE] = value;
+  return 0;
+}
+
+/**
+ * @return Where thread holds its value for key, or NULL if it has set no
+ * value for any key past the inline ones.
+ */
+static void**
+specific_slot(TCB* thread, int key)
+{
+  if (key < THREAD_KEYS_INLINE) {
+    return &thread->specific[key];
+  }
+  if (thread->specific_overflow == NULL) {
+    return NULL;
+  }
+  return &thread->specific_overflow[key - THREAD_KEYS_INLINE];
+}
+
+void
+specific_release(TCB* thread)
+{
+  for (int pass = 0; pass < THREAD_KEY_DESTRUCTOR_PASSES; pass++) {
+    int destroyed = 0;
+    for (int key = 0; key < key_count; key++) {
+      // Looked up again for every key, as a destructor may release thread's
+      // values itself by reclaiming threads
+      void** slot = specific_slot(thread, key);
+      if (slot == NULL || *slot == NULL || destructors[key] == NULL) {
+        continue;
+      }
+      void* const value = *slot;
+      *slot = NULL;
+      destructors[key](value);
+      destroyed = 1;
+    }
+    if (!destroyed) {
+      break;
+    }
+  }
+
+  InterruptsState enabled = InterruptsDisable();
+  memset(thread->specific, 0, sizeof(thread->specific));
+  void** const overflow = thread->specific_overflow;
+  thread->specific_overflow = NULL;
+  free(overflow);
+  InterruptsSet(enabled);
+}
@@ -0,0 +1,359 @@
+#include <assert.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ucontext.h>
+
+#include "interrupts.h"
+#include "thread.h"
+#include "thread_private.h"
+
+// The byte painted stacks are filled with
+#define STACK_CANARY 0xa5
+// Stack added to the most a function's threads used, on top of half as much
+// again, for signal frames that landed at a shallower point in the measured
+// threads
+#define STACK_MARGIN 4096
+#define STACK_PAGE 4096
+// The most functions whose stack use is tracked
+#define STACK_FUNCTIONS 64
+// The stack stack_switch moves shared stacks on
+#define SWAP_STACK_SIZE 16384
+
+/**
+ * The stack use of the threads running one function.
+ */
+typedef struct stack_function
+{
+  ThreadStackProfile profile;
+  // Whether one of them filled its stack
+  int overflowed;
+} StackFunction;
+
+static ThreadStackMode stack_mode = THREAD_STACK_FIXED;
+static StackFunction functions[STACK_FUNCTIONS];
+static int function_count = 0;
+
+static SharedStack shared_stacks[THREAD_SHARED_STACKS];
+// The context that runs stack_swap on swap_stack, set up with the first shared
+// stack, and the thread it is to resume
+static int swap_ready = 0;
+static ucontext_t swap_context;
+static char swap_stack[SWAP_STACK_SIZE] __attribute__((aligned(16)));
+static TCB* swap_target = NULL;
+
+/**
+ * @return The record for f, adding it if add is set and there is room, or
+ * NULL.
+ */
+static StackFunction*
+find_function(void (*f)(void*), int add)
+{
+  for (int i = 0; i < function_count; i++) {
+    if (functions[i].profile.f == f) {
+      return &functions[i];
+    }
+  }
+  if (!add || function_count == STACK_FUNCTIONS) {
+    return NULL;
+  }
+  StackFunction* function = &functions[function_count++];
+  memset(function, 0, sizeof(*function));
+  function->profile.f = f;
+  function->profile.stack_size = THREAD_STACK_SIZE;
+  return function;
+}
+
+size_t
+stack_size_for(void (*f)(void*), size_t reserved)
+{
+  if (stack_mode != THREAD_STACK_LEARN) {
+    return THREAD_STACK_SIZE;
+  }
+  StackFunction* function = find_function(f, 0);
+  size_t size =
+    function != NULL ? function->profile.stack_size : THREAD_STACK_SIZE;
+  // Leave f at least as much stack as the bytes reserved at its top
+  if (size < 2 * reserved) {
+    size = (2 * reserved + STACK_PAGE - 1) / STACK_PAGE * STACK_PAGE;
+  }
+  return size < THREAD_STACK_SIZE ? size : THREAD_STACK_SIZE;
+}
+
+void
+stack_paint(TCB* thread)
+{
+  // A shared stack holds other threads' stacks too, so it is never measured
+  thread->stack_painted =
+    stack_mode != THREAD_STACK_FIXED && thread->shared == NULL;
+  if (thread->stack_painted) {
+    memset(thread->sp, STACK_CANARY, thread->stack_size);
+  }
+}
+
+long
+stack_measure(const TCB* thread)
+{
+  assert(thread->stack_painted);
+  // The stack grows down, so the untouched canary is at the low end
+  uint64_t canary;
+  memset(&canary, STACK_CANARY, sizeof(canary));
+  const uint64_t* word = thread->sp;
+  const uint64_t* const end =
+    (const uint64_t*)((const char*)thread->sp + thread->stack_size);
+  while (word < end && *word == canary) {
+    word++;
+  }
+  return (const char*)end - (const char*)word;
+}
+
+void
+stack_retire(TCB* thread)
+{
+  if (!thread->stack_painted) {
+    return;
+  }
+  long const used = stack_measure(thread);
+  thread->stack_painted = 0;
+  StackFunction* function = find_function(thread->entry, 1);
+  if (function == NULL) {
+    return;
+  }
+  ThreadStackProfile* profile = &function->profile;
+  profile->threads++;
+  if (used > profile->max_used) {
+    profile->max_used = used;
+  }
+  int bucket = 0;
+  while (bucket < THREAD_STACK_BUCKETS - 1 && used > (1024L << bucket)) {
+    bucket++;
+  }
+  profile->histogram[bucket]++;
+
+  if (used >= (long)thread->stack_size) {
+    function->overflowed = 1;
+  }
+  if (function->overflowed) {
+    profile->stack_size = THREAD_STACK_SIZE;
+  } else if (profile->threads >= THREAD_STACK_LEARN_SAMPLES) {
+    size_t size = profile->max_used + profile->max_used / 2 + STACK_MARGIN;
+    size = (size + STACK_PAGE - 1) / STACK_PAGE * STACK_PAGE;
+    profile->stack_size = size < THREAD_STACK_SIZE ? size : THREAD_STACK_SIZE;
+  }
+}
+
+/**
+ * Copy the live part of the stack of thread, which is on its shared stack but
+ * not running, out to its buffer, which is resized to fit when it is too small
+ * or less than half full.
+ */
+static void
+stack_save(TCB* thread)
+{
+  char* const top = thread->shared->base + THREAD_SHARED_STACK_SIZE;
+  // Nothing below the stack pointer saved by getcontext is live, since the
+  // caller of getcontext keeps nothing in the red zone across a call
+  char* const sp = (char*)thread->context.uc_mcontext.gregs[REG_RSP];
+  size_t const size = top - sp;
+  if (size > thread->saved_capacity || size < thread->saved_capacity / 2) {
+    void* saved = realloc(thread->saved, size);
+    if (saved == NULL && size > thread->saved_capacity) {
+      // Too late to fail the switch, and the thread cannot run again
+      abort();
+    }
+    if (saved != NULL) {
+      thread->saved = saved;
+      thread->saved_capacity = size;
+    }
+  }
+  memcpy(thread->saved, sp, size);
+  thread->saved_size = size;
+}
+
+/**
+ * Put the stack of swap_target in place of whatever is on its shared stack, and
+ * resume it. Runs on swap_stack, so that the code switching away may have been
+ * on the same shared stack.
+ */
+static void
+stack_swap(void)
+{
+  TCB* const next = swap_target;
+  SharedStack* const stack = next->shared;
+  TCB* const owner = stack->owner;
+  // The stack of a thread that will never run again is just dropped
+  if (owner != NULL && owner->state != EXITED && owner->state != KILLED) {
+    stack_save(owner);
+  }
+  char* const top = stack->base + THREAD_SHARED_STACK_SIZE;
+  if (next->saved_size > 0) {
+    memcpy(top - next->saved_size, next->saved, next->saved_size);
+  }
+  stack->owner = next;
+  setcontext(&next->context);
+}
+
+/**
+ * Set up swap_context.
+ *
+ * @pre interrupts are disabled, so that they stay disabled in stack_swap
+ *
+ * @return 0 if successful, -1 otherwise.
+ */
+static int
+swap_init(void)
+{
+  if (getcontext(&swap_context)) {
+    return -1;
+  }
+  swap_context.uc_mcontext.gregs[REG_RSP] =
+    (unsigned long)(swap_stack + SWAP_STACK_SIZE - 8);
+  swap_context.uc_mcontext.gregs[REG_RIP] = (unsigned long)stack_swap;
+  swap_ready = 1;
+  return 0;
+}
+
+int
+stack_share(TCB* thread)
+{
+  SharedStack* stack = &shared_stacks[0];
+  for (int i = 1; i < THREAD_SHARED_STACKS; i++) {
+    if (shared_stacks[i].threads < stack->threads) {
+      stack = &shared_stacks[i];
+    }
+  }
+  if (stack->base == NULL) {
+    stack->base = malloc(THREAD_SHARED_STACK_SIZE);
+    if (stack->base == NULL) {
+      return ERROR_SYS_MEM;
+    }
+  }
+  if (!swap_ready && swap_init()) {
+    return ERROR_OTHER;
+  }
+  stack->threads++;
+  thread->shared = stack;
+  thread->sp = stack->base;
+  thread->stack_size = THREAD_SHARED_STACK_SIZE;
+  thread->saved = NULL;
+  thread->saved_size = 0;
+  thread->saved_capacity = 0;
+  return 0;
+}
+
+void
+stack_free(TCB* thread)
+{
+  stack_retire(thread);
+  if (thread->shared == NULL) {
+    arena_free(thread->sp);
+    return;
+  }
+  if (thread->shared->owner == thread) {
+    thread->shared->owner = NULL;
+  }
+  thread->shared->threads--;
+  thread->shared = NULL;
+  free(thread->saved);
+  thread->saved = NULL;
+}
+
+int
+stack_switch(TCB* next)
+{
+  if (next->shared == NULL || next->shared->owner == next) {
+    return setcontext(&next->context);
+  }
+  swap_target = next;
+  return setcontext(&swap_context);
+}
+
+/**
+ * @return size rounded up to a multiple of the strictest alignment.
+ */
+static size_t
+align_up(size_t size)
+{
+  size_t const alignment = __alignof__(max_align_t);
+  return (size + alignment - 1) / alignment * alignment;
+}
+
+Waiter*
+stack_waiters_to_heap(const Waiter* waiters, int count)
+{
+  size_t size = align_up(count * sizeof(Waiter));
+  for (int i = 0; i < count; i++) {
+    size += align_up(waiters[i].size);
+  }
+  Waiter* copies = malloc(size);
+  if (copies == NULL) {
+    return NULL;
+  }
+  char* elem = (char*)copies + align_up(count * sizeof(Waiter));
+  for (int i = 0; i < count; i++) {
+    copies[i] = waiters[i];
+    if (waiters[i].size > 0) {
+      memcpy(elem, waiters[i].elem, waiters[i].size);
+      copies[i].elem = elem;
+      elem += align_up(waiters[i].size);
+    }
+  }
+  return copies;
+}
+
+void
+stack_waiters_from_heap(Waiter* waiters, Waiter* copies, int count)
+{
+  for (int i = 0; i < count; i++) {
+    waiters[i].status = copies[i].status;
+    // A message being sent is only read, and may be in read-only memory, so
+    // only what a peer wrote is copied back
+    if (waiters[i].size > 0 &&
+        memcmp(waiters[i].elem, copies[i].elem, waiters[i].size) != 0) {
+      memcpy(waiters[i].elem, copies[i].elem, waiters[i].size);
+    }
+  }
+  free(copies);
+}
+
+void
+ThreadSetStackMode(ThreadStackMode mode)
+{
+  InterruptsState enabled = InterruptsDisable();
+  stack_mode = mode;
+  InterruptsSet(enabled);
+}
+
+long
+ThreadStackHighWater(Tid tid)
+{
+  if (tid < 0 || tid >= MAX_THREADS) {
+    return ERROR_TID_INVALID;
+  }
+  InterruptsState enabled = InterruptsDisable();
+  TCB* thread = &threads[tid];
+  long ret;
+  if (thread->state == EMPTY) {
+    ret = ERROR_SYS_THREAD;
+  } else if (!thread->stack_painted) {
+    ret = ERROR_OTHER;
+  } else {
+    ret = stack_measure(thread);
+  }
+  InterruptsSet(enabled);
+  return ret;
+}
+
+int
+ThreadStackGetProfiles(ThreadStackProfile* profiles, int max)
+{
+  assert(profiles != NULL);
+  InterruptsState enabled = InterruptsDisable();
+  int count = 0;
+  for (; count < max && count < function_count; count++) {
+    profiles[count] = functions[count].profile;
+  }
+  InterruptsSet(enabled);
+  return count;
+}
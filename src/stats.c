@@ -0,0 +1,146 @@
+#include <assert.h>
+#include <string.h>
+
+#include "interrupts.h"
+#include "thread.h"
+#include "thread_private.h"
+
+long stats_voluntary_switches = 0;
+long stats_preempted_switches = 0;
+long stats_wakeups = 0;
+long long stats_idle = 0;
+int stats_preempting = 0;
+
+// A reading of stats_clock and of the monotonic clock, in nanoseconds, taken
+// together when the first thread was created, to convert ticks to nanoseconds
+static long long calibration_ticks = 0;
+static long long calibration_ns = 0;
+
+static long long
+monotonic_ns(void)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (long long)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+long long
+stats_ns(long long ticks, long long now)
+{
+  long long const elapsed_ticks = now - calibration_ticks;
+  if (elapsed_ticks <= 0) {
+    return 0;
+  }
+  double const ns_per_tick =
+    (double)(monotonic_ns() - calibration_ns) / elapsed_ticks;
+  return (long long)(ticks * ns_per_tick);
+}
+
+void
+stats_start(TCB* thread, long long now)
+{
+  if (calibration_ns == 0) {
+    calibration_ticks = now;
+    calibration_ns = monotonic_ns();
+  }
+  memset(&thread->acct, 0, sizeof(thread->acct));
+  thread->acct.switched_in_at = now;
+  thread->acct.switched_out_at = now;
+  thread->acct.ready_since = now;
+}
+
+void
+stats_switch(TCB* next)
+{
+  long long const now = stats_clock();
+  TCB* prev = running_thread;
+  Accounting* acct = &prev->acct;
+
+  acct->run += now - acct->switched_in_at;
+  acct->switched_out_at = now;
+  if (prev->state == READY) {
+    acct->ready_since = now;
+  }
+  if (stats_preempting) {
+    stats_preempting = 0;
+    acct->preempted_switches++;
+    stats_preempted_switches++;
+  } else {
+    acct->voluntary_switches++;
+    stats_voluntary_switches++;
+  }
+  if (prev->sp != NULL) {
+    // Only a sample of the stack depth, taken in the deepest scheduler frame
+    long const depth =
+      (char*)prev->sp + prev->stack_size - (char*)__builtin_frame_address(0);
+    if (depth > acct->stack_high_water) {
+      acct->stack_high_water = depth;
+    }
+  }
+
+  acct = &next->acct;
+  if (acct->ready_since > acct->switched_out_at) {
+    acct->blocked += acct->ready_since - acct->switched_out_at;
+  }
+  acct->ready += now - acct->ready_since;
+  acct->switched_in_at = now;
+  trace_event_at(now, THREAD_TRACE_SWITCH, prev->thread_id, next->thread_id);
+}
+
+int
+ThreadGetStats(Tid tid, ThreadStats* stats)
+{
+  assert(stats != NULL);
+  if (tid < 0 || tid >= MAX_THREADS) {
+    return ERROR_TID_INVALID;
+  }
+
+  InterruptsState enabled = InterruptsDisable();
+  TCB* thread = &threads[tid];
+  if (thread->state == EMPTY) {
+    InterruptsSet(enabled);
+    return ERROR_SYS_THREAD;
+  }
+  long long const now = stats_clock();
+  Accounting acct = thread->acct;
+  // Account for the current state up to now
+  switch (thread->state) {
+    case RUNNING:
+      acct.run += now - acct.switched_in_at;
+      break;
+    case READY:
+      if (acct.ready_since > acct.switched_out_at) {
+        acct.blocked += acct.ready_since - acct.switched_out_at;
+      }
+      acct.ready += now - acct.ready_since;
+      break;
+    case BLOCKED:
+      acct.blocked += now - acct.switched_out_at;
+      break;
+    default:
+      break;
+  }
+
+  stats->voluntary_switches = acct.voluntary_switches;
+  stats->preempted_switches = acct.preempted_switches;
+  stats->wakeups = acct.wakeups;
+  stats->run_ns = stats_ns(acct.run, now);
+  stats->ready_ns = stats_ns(acct.ready, now);
+  stats->blocked_ns = stats_ns(acct.blocked, now);
+  stats->stack_high_water =
+    thread->stack_painted ? stack_measure(thread) : acct.stack_high_water;
+  InterruptsSet(enabled);
+  return 0;
+}
+
+void
+ThreadGetGlobalStats(ThreadGlobalStats* stats)
+{
+  assert(stats != NULL);
+  InterruptsState enabled = InterruptsDisable();
+  stats->voluntary_switches = stats_voluntary_switches;
+  stats->preempted_switches = stats_preempted_switches;
+  stats->wakeups = stats_wakeups;
+  stats->idle_ns = stats_ns(stats_idle, stats_clock());
+  InterruptsSet(enabled);
+}
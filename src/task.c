@@ -0,0 +1,282 @@
+#include <assert.h>
+#include <stdlib.h>
+
+#include "interrupts.h"
+#include "thread.h"
+#include "thread_private.h"
+
+// Task records allocated at once when none are free. They are never freed.
+#define TASK_BLOCK 256
+// The most workers kept asleep for more tasks rather than exiting
+#define TASK_IDLE_WORKERS 2
+
+/**
+ * A task spawned and not yet run, or a free record.
+ */
+typedef struct task
+{
+  void (*fn)(void*);
+  void* arg;
+  struct task* next;
+} Task;
+
+// Tasks spawned since workers last took them, most recent first. Spawning
+// threads push with compare-and-swap, so that preempting one mid-push is
+// harmless, and workers take all of them at once.
+static Task* volatile spawned = NULL;
+// Tasks handed back by a worker whose task blocked, oldest first. Only touched
+// with interrupts disabled.
+static Task* returned = NULL;
+// Free records, pushed with compare-and-swap and taken all at once
+static Task* volatile free_tasks = NULL;
+
+// Tasks spawned and not yet returned from
+static volatile long pending = 0;
+// Worker threads, those whose task blocked, and those asleep for more tasks
+static int workers = 0;
+static int promoted = 0;
+static int idle = 0;
+static WaitQueue idle_workers = { NULL, NULL };
+// Threads in TaskWaitAll
+static WaitQueue waiting = { NULL, NULL };
+
+/**
+ * Push the chain of records from first to last onto list.
+ */
+static void
+push_chain(Task* volatile* list, Task* first, Task* last)
+{
+  Task* head;
+  do {
+    head = *list;
+    last->next = head;
+  } while (!__sync_bool_compare_and_swap(list, head, first));
+}
+
+/**
+ * @return A free record for the running thread, or NULL if out of memory.
+ */
+static Task*
+take_record(void)
+{
+  TCB* const self = running_thread;
+  if (self->task_cache == NULL) {
+    self->task_cache = __sync_lock_test_and_set(&free_tasks, NULL);
+  }
+  if (self->task_cache == NULL) {
+    InterruptsState enabled = InterruptsDisable();
+    Task* block = malloc(TASK_BLOCK * sizeof(Task));
+    InterruptsSet(enabled);
+    if (block == NULL) {
+      return NULL;
+    }
+    for (int i = 0; i < TASK_BLOCK - 1; i++) {
+      block[i].next = &block[i + 1];
+    }
+    block[TASK_BLOCK - 1].next = NULL;
+    self->task_cache = block;
+  }
+  Task* const task = self->task_cache;
+  self->task_cache = task->next;
+  return task;
+}
+
+/**
+ * @return The tasks to run next, oldest first, or NULL if there are none.
+ */
+static Task*
+take_tasks(void)
+{
+  if (returned != NULL) {
+    InterruptsState enabled = InterruptsDisable();
+    Task* const tasks = returned;
+    returned = NULL;
+    InterruptsSet(enabled);
+    if (tasks != NULL) {
+      return tasks;
+    }
+  }
+  Task* newest = __sync_lock_test_and_set(&spawned, NULL);
+  Task* oldest = NULL;
+  while (newest != NULL) {
+    Task* const next = newest->next;
+    newest->next = oldest;
+    oldest = newest;
+    newest = next;
+  }
+  return oldest;
+}
+
+/**
+ * Run tasks until there are none, then sleep until more are spawned, for as
+ * long as few enough other workers are asleep.
+ */
+static void
+task_worker(void* unused)
+{
+  (void)unused;
+  TCB* const self = running_thread;
+  while (1) {
+    Task* batch = take_tasks();
+    if (batch == NULL) {
+      InterruptsState enabled = InterruptsDisable();
+      if (spawned != NULL || returned != NULL) {
+        InterruptsSet(enabled);
+        continue;
+      }
+      if (idle == TASK_IDLE_WORKERS) {
+        workers--;
+        InterruptsSet(enabled);
+        return;
+      }
+      // Whoever wakes us up takes us off the idle count
+      idle++;
+      sleep_with_waiter(&idle_workers, NULL);
+      InterruptsSet(enabled);
+      continue;
+    }
+
+    // Run records are kept until the batch is done and recycled together
+    Task* done = NULL;
+    Task* done_last = batch;
+    self->tasks = &batch;
+    while (batch != NULL) {
+      Task* const task = batch;
+      batch = task->next;
+      task->next = done;
+      done = task;
+      task->fn(task->arg);
+      if (__sync_sub_and_fetch(&pending, 1) == 0 && waiting.head != NULL) {
+        ThreadWakeAll(&waiting);
+      }
+    }
+    self->tasks = NULL;
+    push_chain(&free_tasks, done, done_last);
+    if (self->task_promoted) {
+      InterruptsState enabled = InterruptsDisable();
+      self->task_promoted = 0;
+      promoted--;
+      InterruptsSet(enabled);
+    }
+  }
+}
+
+/**
+ * Make sure a worker is awake to run spawned tasks: wake one that is asleep,
+ * or create one if every worker is blocked in a task.
+ *
+ * @pre interrupts are disabled
+ *
+ * @return 0 if successful, or the error from ThreadCreate.
+ */
+static int
+task_kick(void)
+{
+  if (idle > 0) {
+    idle--;
+    wake_first(&idle_workers);
+    return 0;
+  }
+  if (workers > promoted) {
+    return 0;
+  }
+  Tid const tid = ThreadCreate(task_worker, NULL);
+  if (tid < 0) {
+    return tid;
+  }
+  workers++;
+  return 0;
+}
+
+int
+TaskSpawn(void (*fn)(void*), void* arg)
+{
+  assert(fn != NULL);
+  Task* const task = take_record();
+  if (task == NULL) {
+    return ERROR_SYS_MEM;
+  }
+  if (__builtin_expect(workers == 0, 0)) {
+    InterruptsState enabled = InterruptsDisable();
+    int const err = task_kick();
+    InterruptsSet(enabled);
+    if (err < 0) {
+      task->next = running_thread->task_cache;
+      running_thread->task_cache = task;
+      return err;
+    }
+  }
+  task->fn = fn;
+  task->arg = arg;
+  // Not cancelled between counting the task, queueing it and waking a worker
+  // for it
+  cancel_defer();
+  __sync_fetch_and_add(&pending, 1);
+  push_chain(&spawned, task, task);
+  // Read after the push without masking interrupts: a worker only goes to
+  // sleep after finding no tasks with interrupts disabled, so either it saw
+  // this task or it is counted idle by now
+  if (__builtin_expect(idle > 0 || workers == promoted, 0)) {
+    InterruptsState enabled = InterruptsDisable();
+    task_kick();
+    InterruptsSet(enabled);
+  }
+  cancel_resume();
+  return 0;
+}
+
+int
+TaskWaitAll(void)
+{
+  if (running_thread->tasks != NULL) {
+    return ERROR_THREAD_BAD;
+  }
+  InterruptsState enabled = InterruptsDisable();
+  while (pending > 0) {
+    int const ret = sleep_with_waiter(&waiting, NULL);
+    if (ret < 0) {
+      InterruptsSet(enabled);
+      return ret;
+    }
+  }
+  InterruptsSet(enabled);
+  return 0;
+}
+
+void
+task_blocking(TCB* thread)
+{
+  // The rest of the batch goes ahead of anything spawned since
+  Task* const rest = *thread->tasks;
+  if (rest != NULL) {
+    *thread->tasks = NULL;
+    Task* last = rest;
+    while (last->next != NULL) {
+      last = last->next;
+    }
+    last->next = returned;
+    returned = rest;
+  }
+  if (!thread->task_promoted) {
+    thread->task_promoted = 1;
+    promoted++;
+  }
+  if (returned != NULL || spawned != NULL) {
+    // Failing that, the tasks run once a worker returns
+    task_kick();
+  }
+}
+
+void
+task_release(TCB* thread)
+{
+  Task* const cache = thread->task_cache;
+  if (cache != NULL) {
+    thread->task_cache = NULL;
+    Task* last = cache;
+    while (last->next != NULL) {
+      last = last->next;
+    }
+    push_chain(&free_tasks, cache, last);
+  }
+}
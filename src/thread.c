@@ -2,6 +2,7 @@
   
 #include <ucontext.h>  
 #include <stdlib.h>  
+#include <string.h>
 #include <assert.h>  
 #include <sys/time.h>  
   
@@ -12,50 +13,8 @@
 #endif  
   
 #include "interrupts.h"  
+#include "thread_private.h"
 
-/**         
- * The Thread States      
- */      
-    
-typedef enum {          
-  READY = 1,          
-  RUNNING = 2,          
-  EXITED = 3,          
-  EMPTY = 4,          
-  KILLED = 5,
-  BLOCKED = 6  
-} State;          
-        
-/**       
- * The Thread Control Block.       
- */          
-       
-typedef struct          
-{          
-  Tid thread_id;          
-  ucontext_t context;          
-  State state;          
-  void *sp;    
-  ExitCode exit_code;   
-} TCB;          
-        
-/**      
- * The Node in a Queue.      
- */          
-          
-typedef struct node {          
-  TCB *thread;          
-  struct node *next;          
-} node;       
-  
-/** 
- * A wait queue. 
- */  
-typedef struct wait_queue_t  
-{  
-  node* head;  
-} WaitQueue;  
-  
   
 // Current Running Thread          
 TCB *running_thread;          
@@ -69,6 +28,9 @@ WaitQueue rq;
 // Static Global Array of Waiting Queues          
 WaitQueue wait_queues[MAX_THREADS];      
 
+// The serial of the thread created last
+static long last_serial = 0;
+
 /**    
  * Stub function to be used for the newly created thread.     
  * The function is called before the thread exits.    
@@ -83,6 +45,37 @@ void thread_stub(void (*f)(void *), void *arg)
     ThreadExit(running_thread->exit_code);     
 }  
     
+/**
+ * Add the thread with argument thread to the tail of queue, attaching the
+ * record of what it waits for.
+ *
+ * @param queue the pointer to the queue of threads
+ * @param thread the thread we intend to add to queue, or NULL for an
+ * asynchronous wait
+ * @param waiter the thread's wait record for this queue, or NULL
+ *
+ * @return The node holding thread, for unlink_node.
+ *
+ * @pre interrupts are disabled
+ */
+node *enqueue_waiter(WaitQueue *queue, TCB *thread, Waiter *waiter) {
+  assert(queue != NULL);
+  assert(thread != NULL || waiter != NULL);
+  node *thread_node = (node *) malloc(sizeof(node));
+  thread_node->thread = thread;
+  thread_node->waiter = waiter;
+  thread_node->next = NULL;
+  thread_node->prev = queue->tail;
+
+  if (queue->head == NULL) {
+    queue->head = thread_node;
+  } else {
+    queue->tail->next = thread_node;
+  }
+  queue->tail = thread_node;
+  return thread_node;
+}
+
 /**  
  * Add the thread with argument thread to the tail of the   
  * ready_queue queue.  
@@ -91,25 +84,34 @@ void thread_stub(void (*f)(void *), void *arg)
  * @param thread the thread we intend to add to queue  
  */           
 void insert_into_queue(WaitQueue *queue, TCB* thread) {  
-  InterruptsState enabled = InterruptsDisable();   
-  assert(queue != NULL);  
-  assert(thread != NULL);  
-  struct node* thread_node = (struct node*) malloc(sizeof(struct node));        
-  thread_node->thread = thread;        
-  thread_node->next = NULL;  
-  
-  struct node* curr = queue->head;        
-  if (curr == NULL){        
-    queue->head = thread_node;  
-    InterruptsSet(enabled);        
-    return;        
-  }        
-  while (curr->next != NULL){        
-    curr = curr->next;        
-  }        
-  curr->next = thread_node;  
-  InterruptsSet(enabled);        
+  InterruptsState enabled = InterruptsDisable();
+  enqueue_waiter(queue, thread, NULL);
+  InterruptsSet(enabled);
 }    
+
+/**
+ * Remove a node from queue in constant time and free it.
+ *
+ * @param queue the pointer to the queue holding thread_node
+ * @param thread_node the node to remove
+ *
+ * @pre interrupts are disabled
+ */
+void unlink_node(WaitQueue *queue, node *thread_node) {
+  assert(queue != NULL);
+  assert(thread_node != NULL);
+  if (thread_node->prev == NULL) {
+    queue->head = thread_node->next;
+  } else {
+    thread_node->prev->next = thread_node->next;
+  }
+  if (thread_node->next == NULL) {
+    queue->tail = thread_node->prev;
+  } else {
+    thread_node->next->prev = thread_node->prev;
+  }
+  free(thread_node);
+}
     
 /**  
  * Dequeue the thread at the head of the ready_queue queue and   
@@ -122,9 +124,7 @@ void insert_into_queue(WaitQueue *queue, TCB* thread) {
 TCB *extract_from_queue(WaitQueue *queue) {   
   InterruptsState enabled = InterruptsDisable();       
   TCB *thread = queue->head->thread;        
-  node *temp = queue->head;        
-  queue->head = queue->head->next;        
-  free(temp);  
+  unlink_node(queue, queue->head);
   InterruptsSet(enabled);        
   return thread;        
 }      
@@ -138,27 +138,13 @@ TCB *extract_from_queue(WaitQueue *queue) {
 void remove_from_queue(WaitQueue *queue, Tid tid) { 
   InterruptsState enabled = InterruptsDisable();
   assert(queue != NULL);      
-  node *curr_node = queue->head;      
-      
-  if (curr_node != NULL) {      
-    if (curr_node->thread->thread_id == tid) {      
-      node *temp = curr_node;      
-      queue->head = queue->head->next;      
-      free(temp);  
-      InterruptsSet(enabled);      
-      return;      
-    }      
-    while (curr_node->next != NULL && curr_node->next->thread->thread_id != tid) {  
-      curr_node = curr_node->next;      
-    }      
-    if (curr_node->next != NULL) {      
-      node *temp = curr_node->next;      
-      curr_node->next = curr_node->next->next;      
-      free(temp);  
-      InterruptsSet(enabled);      
-      return;      
-    }      
-  }       
+  for (node *curr_node = queue->head; curr_node != NULL; curr_node = curr_node->next) {
+    if (curr_node->thread != NULL && curr_node->thread->thread_id == tid) {
+      unlink_node(queue, curr_node);
+      break;
+    }
+  }
+  InterruptsSet(enabled);
 }       
   
 /**  
@@ -183,15 +169,126 @@ void free_exited_threads() {
   InterruptsState enabled = InterruptsDisable();      
   for (int i = 0; i < CSC369_MAX_THREADS; i++) {        
     if (threads[i].state == EXITED || threads[i].state == KILLED) {     
-      if (running_thread != &threads[i]) {    
+      if (running_thread != &threads[i] && threads[i].io_pending == 0) {    
+        // The values of a killed thread are still set
+        specific_release(&threads[i]);
+        bump_release(&threads[i]);
+        task_release(&threads[i]);
         threads[i].state = EMPTY;  
-        free(threads[i].sp);       
+        stack_free(&threads[i]);
       }    
     }        
   }  
   InterruptsSet(enabled);  
 }
 
+/**
+ * Move every thread in src to the tail of dst, leaving src empty.
+ *
+ * @param dst the queue to append to
+ * @param src the queue to empty
+ *
+ * @return The number of threads moved.
+ */
+int splice_queue(WaitQueue *dst, WaitQueue *src) {
+  InterruptsState enabled = InterruptsDisable();
+  assert(dst != NULL);
+  assert(src != NULL);
+  int count = 0;
+  for (node *curr = src->head; curr != NULL; curr = curr->next) {
+    if (curr->thread == NULL ||
+        (curr->waiter != NULL && curr->waiter->select != NULL)) {
+      // A selecting thread must also leave its other queues, and an
+      // asynchronous wait has no thread to move, so wake the waiters one at a
+      // time instead
+      assert(dst == &rq);
+      // Firing an asynchronous wait may create a worker, which reaps exited
+      // threads and may reset a join queue, so those are fired last
+      WaitQueue awaits = { NULL, NULL };
+      node *next;
+      for (node *curr_node = src->head; curr_node != NULL; curr_node = next) {
+        next = curr_node->next;
+        if (curr_node->thread == NULL) {
+          Waiter *waiter = curr_node->waiter;
+          unlink_node(src, curr_node);
+          enqueue_waiter(&awaits, NULL, waiter);
+          count++;
+        }
+      }
+      while (src->head != NULL) {
+        wake_first(src);
+        count++;
+      }
+      await_fire_all(&awaits);
+      InterruptsSet(enabled);
+      return count;
+    }
+  }
+  long long const now = stats_clock();
+  for (node *curr = src->head; curr != NULL; curr = curr->next) {
+    curr->thread->state = (dst == &rq) ? READY : BLOCKED;
+    curr->thread->waiting_on = (dst == &rq) ? NULL : dst;
+    if (dst == &rq) {
+      curr->waiter = NULL;
+      stats_wakeup(curr->thread, now);
+    }
+    count++;
+  }
+  if (count == 0) {
+    InterruptsSet(enabled);
+    return 0;
+  }
+
+  src->head->prev = dst->tail;
+  if (dst->head == NULL) {
+    dst->head = src->head;
+  } else {
+    dst->tail->next = src->head;
+  }
+  dst->tail = src->tail;
+  src->head = NULL;
+  src->tail = NULL;
+  InterruptsSet(enabled);
+  return count;
+}
+
+/**
+ * Dequeue the thread at the head of queue and move it to the ready queue.
+ *
+ * @param queue the queue to dequeue
+ *
+ * @return The woken thread, or NULL if queue was empty or its head was an
+ * asynchronous wait.
+ */
+TCB *wake_first(WaitQueue *queue) {
+  InterruptsState enabled = InterruptsDisable();
+  assert(queue != NULL);
+  if (queue->head == NULL) {
+    InterruptsSet(enabled);
+    return NULL;
+  }
+  Waiter *waiter = queue->head->waiter;
+  if (queue->head->thread == NULL) {
+    unlink_node(queue, queue->head);
+    await_fire(waiter);
+    InterruptsSet(enabled);
+    return NULL;
+  }
+  if (waiter != NULL && waiter->select != NULL) {
+    TCB *thread = queue->head->thread;
+    select_fire(waiter);
+    InterruptsSet(enabled);
+    return thread;
+  }
+  TCB *thread = extract_from_queue(queue);
+  thread->waiting_on = NULL;
+  thread->state = READY;
+  stats_wakeup(thread, stats_clock());
+  insert_into_queue(&rq, thread);
+  InterruptsSet(enabled);
+  return thread;
+}
+
 void print_queue(WaitQueue *queue) {
   InterruptsState enabled = InterruptsDisable(); 
   struct node* curr = queue->head;        
@@ -201,7 +298,7 @@ void print_queue(WaitQueue *queue) {
     return;        
   }        
   while (curr != NULL){
-    printf("%d ->", curr->thread->thread_id);
+    printf("%d ->", curr->thread != NULL ? curr->thread->thread_id : -1);
     curr = curr->next;        
   }
   printf("\n");
@@ -215,15 +312,39 @@ ThreadInit(void)
 {  
   InterruptsState enabled = InterruptsDisable();  
   threads[0].thread_id = 0;          
+  threads[0].serial = ++last_serial;
   threads[0].state = RUNNING;          
   threads[0].sp = NULL;  
+  threads[0].entry = NULL;
+  threads[0].stack_size = 0;
+  threads[0].stack_painted = 0;
+  threads[0].shared = NULL;
+  memset(threads[0].specific, 0, sizeof(threads[0].specific));
+  threads[0].specific_overflow = NULL;
+  threads[0].arena = NULL;
+  threads[0].cancel = CANCEL_NONE;
+  threads[0].sleep_cancellable = 0;
+  threads[0].cancel_deferred = 0;
+  threads[0].cleanup_count = 0;
+  threads[0].tasks = NULL;
+  threads[0].task_promoted = 0;
+  threads[0].task_cache = NULL;
   threads[0].exit_code = 0;  
+  threads[0].waiting_on = NULL;
+  threads[0].select = NULL;
+  threads[0].group = NULL;
+  threads[0].io_pending = 0;
+  stats_start(&threads[0], stats_clock());
   wait_queues[0].head = NULL;  
+  wait_queues[0].tail = NULL;
     
   rq.head = NULL;         
+  rq.tail = NULL;
     
   for (int i = 1; i < CSC369_MAX_THREADS; i++){          
       threads[i].state = EMPTY;          
+      threads[i].io_pending = 0;
+      threads[i].serial = 0;
   }          
     
   int err = getcontext(&threads[0].context);          
@@ -244,15 +365,22 @@ ThreadId(void)
   return running_thread->thread_id;        
 }          
         
-Tid        
-ThreadCreate(void (*f)(void*), void* arg)        
+/**
+ * Create a thread running f(arg), on a shared stack if shared is set. If size
+ * is not 0, f is passed size bytes at the top of the thread's stack instead,
+ * which init fills in from arg.
+ */
+static Tid
+create_thread(void (*f)(void*), void* arg, int shared, size_t size,
+              void (*init)(void*, void*))
 {      
   InterruptsState enabled = InterruptsDisable();    
   free_exited_threads();        
         
   int i = 0;        
     
-  while (i < MAX_THREADS && threads[i].state != EMPTY && threads[i].state != EXITED && threads[i].state != KILLED){        
+  // A thread with I/O in flight keeps its slot and stack until the I/O completes
+  while (i < MAX_THREADS && threads[i].state != EMPTY && ((threads[i].state != EXITED && threads[i].state != KILLED) || threads[i].io_pending > 0)){        
     i++;        
   }        
     
@@ -263,45 +391,131 @@ ThreadCreate(void (*f)(void*), void* arg)
     return ERROR_SYS_THREAD;       
   }  
         
-  void *sp = malloc(THREAD_STACK_SIZE);       
-    
-  if (sp == NULL){        
-      free(sp);  
-      InterruptsSet(enabled);        
-      return ERROR_SYS_MEM;        
-  }        
+  threads[i].shared = NULL;
+  size_t stack_size;
+  void *sp;
+  if (shared) {
+    int err = stack_share(&threads[i]);
+    if (err) {
+      InterruptsSet(enabled);
+      return err;
+    }
+    sp = threads[i].sp;
+    stack_size = threads[i].stack_size;
+  } else {
+    stack_size = stack_size_for(f, size);
+    if (size > stack_size / 2) {
+      InterruptsSet(enabled);
+      return ERROR_OTHER;
+    }
+    sp = arena_alloc(stack_size);
+    if (sp == NULL){        
+        InterruptsSet(enabled);        
+        return ERROR_SYS_MEM;        
+    }        
+  }
     
   int err = getcontext(&(threads[i].context));        
   if (err) {  
+    if (shared) {
+      stack_free(&threads[i]);
+    } else {
+      arena_free(sp);
+    }
     InterruptsSet(enabled);  
     return ERROR_OTHER;  
   }  
     
   threads[i].thread_id = i;        
+  threads[i].serial = ++last_serial;
   threads[i].state = READY;        
   threads[i].sp = sp;        
+  threads[i].entry = f;
+  threads[i].stack_size = stack_size;
+  stack_paint(&threads[i]);
+  threads[i].waiting_on = NULL;
+  threads[i].select = NULL;
+  threads[i].group = NULL;
+  memset(threads[i].specific, 0, sizeof(threads[i].specific));
+  threads[i].specific_overflow = NULL;
+  threads[i].arena = NULL;
+  threads[i].cancel = CANCEL_NONE;
+  threads[i].sleep_cancellable = 0;
+  threads[i].cancel_deferred = 0;
+  threads[i].cleanup_count = 0;
+  threads[i].tasks = NULL;
+  threads[i].task_promoted = 0;
+  threads[i].task_cache = NULL;
+  stats_start(&threads[i], stats_clock());
+  trace_event(THREAD_TRACE_CREATE, running_thread->thread_id, i);
   // threads[i].exit_code = EXIT_CODE_NORMAL;  
   wait_queues[i].head = NULL;
+  wait_queues[i].tail = NULL;
+
+  // The thread's stack starts below its data, which is aligned like the stack
+  // pointer is at a call
+  char *top = (char *)sp + stack_size;
+  void *start_arg = arg;
+  if (size > 0) {
+    top = (char *)((uintptr_t)(top - size) & ~(uintptr_t)15);
+    init(top, arg);
+    start_arg = top;
+  }
         
-  threads[i].context.uc_mcontext.gregs[REG_RSP] = (unsigned long) (sp + THREAD_STACK_SIZE - 8);
+  threads[i].context.uc_mcontext.gregs[REG_RSP] = (unsigned long) (top - 8);
   threads[i].context.uc_mcontext.gregs[REG_RBP] = (unsigned long) sp;
   threads[i].context.uc_mcontext.gregs[REG_RDI] = (unsigned long) f;
-  threads[i].context.uc_mcontext.gregs[REG_RSI] = (unsigned long) arg;
+  threads[i].context.uc_mcontext.gregs[REG_RSI] = (unsigned long) start_arg;
   threads[i].context.uc_mcontext.gregs[REG_RIP] = (unsigned long) thread_stub;
     
   insert_into_queue(&rq, &threads[i]);
   InterruptsSet(enabled);
   return thread_id;
 }        
+
+Tid
+ThreadCreate(void (*f)(void*), void* arg)
+{
+  return create_thread(f, arg, 0, 0, NULL);
+}
+
+Tid
+ThreadCreateInPlace(void (*f)(void*), size_t size,
+                    void (*init)(void*, void*), void* ctx)
+{
+  assert(init != NULL);
+  return create_thread(f, ctx, 0, size == 0 ? 1 : size, init);
+}
+
+Tid
+ThreadCreateShared(void (*f)(void*), void* arg)
+{
+  return create_thread(f, arg, 1, 0, NULL);
+}
         
 void        
 ThreadExit(ExitCode exit_code)        
 {        
+  // Handlers and destructors run on the exiting thread, as it was when it
+  // called us, and cancelling it from here on does nothing
+  running_thread->cancel = CANCEL_EXITING;
+  cleanup_run();
+  specific_release(running_thread);
   InterruptsState enabled = InterruptsDisable();  
+  // Which the destructors may have used
+  bump_release(running_thread);
+  task_release(running_thread);
   running_thread->exit_code = exit_code;  
+  trace_event(THREAD_TRACE_EXIT, running_thread->thread_id, exit_code);
+  if (running_thread->group != NULL) {
+    wait_group_exited(running_thread);
+  }
   ThreadWakeAll(&wait_queues[running_thread->thread_id]);  
   remove_from_all_wait_queues(running_thread->thread_id);  
   free_exited_threads();     
+  // Threads waiting with a timeout are not ready yet, but will be
+  while (rq.head == NULL && timers_wait())
+    ;
     
   if (rq.head == NULL) {       
     running_thread->state = EXITED;  
@@ -314,9 +528,10 @@ ThreadExit(ExitCode exit_code)
     
   TCB *next_thread = extract_from_queue(&rq);        
   next_thread->state = RUNNING;        
+  stats_switch(next_thread);
   running_thread = next_thread;      
     
-  int err = setcontext(&(running_thread->context));        
+  int err = stack_switch(running_thread);        
   if (err) {  
     running_thread->exit_code = EXIT_CODE_FATAL;  
     InterruptsSet(enabled);  
@@ -344,10 +559,21 @@ ThreadKill(Tid tid)
     return ERROR_SYS_THREAD;  
   }  
         
+  trace_event(THREAD_TRACE_KILL, running_thread->thread_id, tid);
   threads[tid].state = KILLED;  
   threads[tid].exit_code = EXIT_CODE_KILL;    
+  if (threads[tid].group != NULL) {
+    wait_group_exited(&threads[tid]);
+  }
     
   remove_from_queue(&rq, tid);  
+  if (threads[tid].waiting_on != NULL) {
+    remove_from_queue(threads[tid].waiting_on, tid);
+    threads[tid].waiting_on = NULL;
+  }
+  if (threads[tid].select != NULL) {
+    select_cancel(&threads[tid]);
+  }
   remove_from_all_wait_queues(tid);    
   ThreadWakeAll(&wait_queues[tid]);   
   InterruptsSet(enabled);  
@@ -359,9 +585,13 @@ ThreadYield()
 {   
   InterruptsState enabled = InterruptsDisable();     
   free_exited_threads();    
+  timers_expire();
+  fds_poll(0);
+  profile_poll();
     
   if (rq.head == NULL) {  
     InterruptsSet(enabled);  
+    cancel_point();
     return running_thread->thread_id;    
   }  
     
@@ -378,6 +608,7 @@ ThreadYield()
   if (context_called) {     
     context_called = 0;  
     InterruptsSet(enabled);        
+    cancel_point();
     return id;        
     
   } else {        
@@ -392,8 +623,9 @@ ThreadYield()
   
     
     next_thread->state = RUNNING;        
+    stats_switch(next_thread);
     running_thread = next_thread;    
-    setcontext(&(next_thread->context));           
+    stack_switch(next_thread);
             
     }         
     InterruptsSet(enabled);  
@@ -401,7 +633,7 @@ ThreadYield()
 }        
         
 int        
-ThreadYieldTo(Tid tid)        
+thread_yield_to(Tid tid)        
 {      
   InterruptsState enabled = InterruptsDisable();  
   free_exited_threads();  
@@ -448,13 +680,22 @@ ThreadYieldTo(Tid tid)
     TCB *next_thread = &threads[tid];        
     next_thread->state = RUNNING;        
     
+    stats_switch(next_thread);
     running_thread = next_thread;    
-    setcontext(&(running_thread->context));    
+    stack_switch(running_thread);
     }        
   InterruptsSet(enabled);  
   return tid;        
         
 }       
+
+int
+ThreadYieldTo(Tid tid)
+{
+  int const ret = thread_yield_to(tid);
+  cancel_point();
+  return ret;
+}
   
 WaitQueue*  
 WaitQueueCreate(void)  
@@ -462,6 +703,7 @@ WaitQueueCreate(void)
   InterruptsState enabled = InterruptsDisable();  
   WaitQueue *queue = malloc(sizeof(WaitQueue));  
   queue->head = NULL;  
+  queue->tail = NULL;
   InterruptsSet(enabled);  
   return queue;  
 }  
@@ -498,54 +740,97 @@ ThreadSpin(int duration)
   }  
 }  
   
+int
+thread_block(void)
+{
+  TCB *self = running_thread;
+  trace_event(THREAD_TRACE_SLEEP, self->thread_id, 0);
+  if (__builtin_expect(self->tasks != NULL, 0)) {
+    // A task is blocking: it keeps this thread to itself from here on
+    task_blocking(self);
+  }
+  free_exited_threads();
+  timers_expire();
+  while (rq.head == NULL) {
+    if (!timers_wait()) {
+      return ERROR_SYS_THREAD;
+    }
+  }
+
+  volatile int context_called = 0;
+  volatile Tid id = rq.head->thread->thread_id;
+
+  int err = getcontext(&(self->context));
+  if (err) {
+    return ERROR_THREAD_BAD;
+  }
+
+  if (context_called) {
+    return id;
+  }
+  context_called = 1;
+
+  TCB *next_thread = extract_from_queue(&rq);
+  if (next_thread == self) {
+    // One of our own timers woke us up before we could switch away
+    self->state = RUNNING;
+    return self->thread_id;
+  }
+  next_thread->state = RUNNING;
+  stats_switch(next_thread);
+  running_thread = next_thread;
+  stack_switch(next_thread);
+  return id;
+}
+
+int
+sleep_with_waiter(WaitQueue *queue, Waiter *waiter)
+{
+  InterruptsState enabled = InterruptsDisable();
+  assert(queue != NULL);
+
+  // The thread that wakes us uses the waiter while a shared stack is copied out
+  Waiter *moved = NULL;
+  if (waiter != NULL && running_thread->shared != NULL) {
+    moved = stack_waiters_to_heap(waiter, 1);
+    if (moved == NULL) {
+      InterruptsSet(enabled);
+      return ERROR_SYS_MEM;
+    }
+  }
+
+  running_thread->state = BLOCKED;
+  running_thread->waiting_on = queue;
+  node *self_node =
+    enqueue_waiter(queue, running_thread, moved != NULL ? moved : waiter);
+
+  int id = thread_block();
+  if (id < 0) {
+    unlink_node(queue, self_node);
+    running_thread->waiting_on = NULL;
+    running_thread->state = RUNNING;
+  }
+  if (moved != NULL) {
+    stack_waiters_from_heap(waiter, moved, 1);
+  }
+  InterruptsSet(enabled);
+  return id;
+}
+
 int  
 ThreadSleep(WaitQueue* queue)  
 {  
-  InterruptsState enabled = InterruptsDisable();  
-  assert(queue != NULL);  
-  free_exited_threads();    
-    
-  if (rq.head == NULL) {  
-    InterruptsSet(enabled);  
-    return ERROR_SYS_THREAD;  
-  }  
-    
-  int id = rq.head->thread->thread_id;     
-    
-  volatile int context_called = 0;    
-    
-  int err = getcontext(&(running_thread->context));        
-  if (err) {  
-    InterruptsSet(enabled);  
-    return ERROR_THREAD_BAD;    
-  }  
-    
-    
-  if (context_called) {     
-    context_called = 0;  
-    InterruptsSet(enabled);        
-    return id;        
-    
-  } else {    
-    
-    context_called = 1;     
-    
-    running_thread->state = BLOCKED;  
-  
-    insert_into_queue(queue, running_thread);  
-  
-    TCB *next_thread = extract_from_queue(&rq);      
-    id = next_thread->thread_id;        
-    
-    next_thread->state = RUNNING;        
-    running_thread = next_thread;    
-    setcontext(&(next_thread->context));
-    InterruptsSet(enabled);  
-    return id;          
-            
-    }
-    InterruptsSet(enabled);  
-    return id;     
+  InterruptsState enabled = InterruptsDisable();
+  int id = running_thread->thread_id;
+  if (running_thread->cancel != CANCEL_PENDING) {
+    // Until it is woken, ThreadCancel may wake it early instead
+    running_thread->sleep_cancellable = 1;
+    id = sleep_with_waiter(queue, NULL);
+    running_thread->sleep_cancellable = 0;
+  }
+  InterruptsSet(enabled);
+  cancel_point();
+  return id;
 }  
   
 int  
@@ -558,13 +843,61 @@ ThreadWakeNext(WaitQueue* queue)
     InterruptsSet(enabled);  
     return 0;  
   }  
-  TCB *next_thread = extract_from_queue(queue);  
-  insert_into_queue(&rq, next_thread);  
-  next_thread->state = READY;  
+  wake_first(queue);
   InterruptsSet(enabled);  
   return 1;  
 }  
   
+int
+ThreadWakeNextAndSwitch(WaitQueue *queue, ThreadSwitchPolicy policy)
+{
+  InterruptsState enabled = InterruptsDisable();
+  assert(queue != NULL);
+  if (queue->head == NULL) {
+    InterruptsSet(enabled);
+    return 0;
+  }
+  // No reaping or polling here, unlike ThreadYield: the point is latency
+  TCB *next_thread = wake_first(queue);
+  if (next_thread == NULL) {
+    // An asynchronous wait was woken, which has no thread to switch to
+    InterruptsSet(enabled);
+    return 1;
+  }
+
+  volatile int context_called = 0;
+  int err = getcontext(&running_thread->context);
+  if (err) {
+    // The woken thread is still in the ready queue, and runs in turn
+    InterruptsSet(enabled);
+    return 1;
+  }
+  if (!context_called) {
+    context_called = 1;
+    // The woken thread's node at the tail of the ready queue is reused for the
+    // caller instead of allocating another
+    node *tail = rq.tail;
+    assert(tail->thread == next_thread);
+    tail->thread = running_thread;
+    if (policy == THREAD_SWITCH_CALLER_FIRST && tail->prev != NULL) {
+      tail->prev->next = NULL;
+      rq.tail = tail->prev;
+      tail->prev = NULL;
+      tail->next = rq.head;
+      rq.head->prev = tail;
+      rq.head = tail;
+    }
+    running_thread->state = READY;
+    next_thread->state = RUNNING;
+    stats_switch(next_thread);
+    running_thread = next_thread;
+    stack_switch(next_thread);
+  }
+  InterruptsSet(enabled);
+  cancel_point();
+  return 1;
+}
+
 int  
 ThreadWakeAll(WaitQueue* queue)  
 {  
@@ -575,14 +908,7 @@ ThreadWakeAll(WaitQueue* queue)
     InterruptsSet(enabled);  
     return 0;  
   }  
-  TCB *curr_thread;  
-  int count = 0;  
-  while (queue->head != NULL) {  
-    curr_thread = extract_from_queue(queue);  
-    insert_into_queue(&rq, curr_thread);  
-    curr_thread->state = READY;  
-    count++;   
-  }  
+  int count = splice_queue(&rq, queue);
   InterruptsSet(enabled);  
   return count;  
 }  
@@ -607,9 +933,107 @@ ThreadJoin(Tid tid, int* exit_code)
     return ERROR_THREAD_BAD;
   }  
    
+  trace_event(THREAD_TRACE_JOIN, running_thread->thread_id, tid);
   ThreadSleep(&wait_queues[tid]);
   if (exit_code != NULL) *exit_code = threads[tid].exit_code;
   
   InterruptsSet(enabled);
   return tid;
 }  
+
+long
+ThreadSerial(Tid tid)
+{
+  if (tid < 0 || tid >= MAX_THREADS) {
+    return ERROR_TID_INVALID;
+  }
+  return threads[tid].serial;
+}
+
+int
+ThreadJoinSerial(Tid tid, long serial, int* exit_code)
+{
+  InterruptsState enabled = InterruptsDisable();
+  if (tid < 0 || tid >= MAX_THREADS) {
+    InterruptsSet(enabled);
+    return ERROR_TID_INVALID;
+  }
+  if (threads[tid].serial != serial) {
+    // The thread was cleaned up, and its identifier given to another one
+    InterruptsSet(enabled);
+    return ERROR_SYS_THREAD;
+  }
+  int const ret = ThreadJoin(tid, exit_code);
+  InterruptsSet(enabled);
+  return ret;
+}
+
+int
+ThreadJoinAny(const Tid* tids, int count, Tid* which, int* exit_code)
+{
+  assert(tids != NULL);
+  assert(which != NULL);
+  assert(exit_code != NULL);
+  if (count < 1) {
+    return ERROR_OTHER;
+  }
+
+  InterruptsState enabled = InterruptsDisable();
+  int joinable = 0;
+  for (int i = 0; i < count; i++) {
+    if (tids[i] < 0 || tids[i] >= MAX_THREADS) {
+      InterruptsSet(enabled);
+      return ERROR_TID_INVALID;
+    }
+    if (tids[i] == running_thread->thread_id) {
+      InterruptsSet(enabled);
+      return ERROR_THREAD_BAD;
+    }
+    State const state = threads[tids[i]].state;
+    if (state != EMPTY && state != KILLED && state != EXITED) {
+      joinable++;
+    }
+  }
+  if (joinable == 0) {
+    InterruptsSet(enabled);
+    return ERROR_SYS_THREAD;
+  }
+
+  // Park once on the wait queue of every joinable thread, remembering which
+  // entry of tids each case stands for. The cases share one block, which the
+  // select owns in case the calling thread is killed while it waits
+  Waiter* waiters = malloc(joinable * (sizeof(Waiter) + sizeof(WaitQueue*) +
+                                       sizeof(node*) + sizeof(int)));
+  if (waiters == NULL) {
+    InterruptsSet(enabled);
+    return ERROR_SYS_MEM;
+  }
+  WaitQueue** queues = (WaitQueue**)(waiters + joinable);
+  node** nodes = (node**)(queues + joinable);
+  int* indices = (int*)(nodes + joinable);
+  SelectState select = { .count = 0,
+                          .waiters = waiters,
+                          .queues = queues,
+                          .nodes = nodes,
+                          .owned = waiters };
+  for (int i = 0; i < count; i++) {
+    State const state = threads[tids[i]].state;
+    if (state != EMPTY && state != KILLED && state != EXITED) {
+      waiters[select.count].elem = NULL;
+      waiters[select.count].size = 0;
+      queues[select.count] = &wait_queues[tids[i]];
+      indices[select.count] = i;
+      select.count++;
+    }
+  }
+
+  int ret = select_block(&select, THREAD_SELECT_FOREVER);
+  if (ret >= 0) {
+    ret = indices[ret];
+    *which = tids[ret];
+    *exit_code = threads[tids[ret]].exit_code;
+  }
+  free(waiters);
+  InterruptsSet(enabled);
+  return ret;
+}
@@ -5,6 +5,14 @@
 #ifndef THREAD_H
 #define THREAD_H
 
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 /**
  * Error codes for the Thread Library
  */
@@ -14,7 +22,9 @@ typedef enum
   ERROR_THREAD_BAD = -2,
   ERROR_SYS_THREAD = -3,
   ERROR_SYS_MEM = -4,
-  ERROR_OTHER = -5
+  ERROR_OTHER = -5,
+  ERROR_CLOSED = -6,
+  ERROR_TIMEOUT = -7
 } ThreadError;
 
 /**
@@ -78,6 +88,33 @@ ThreadId(void);
 Tid
 ThreadCreate(void (*f)(void*), void* arg);
 
+/**
+ * Create a new thread that runs the function f with a pointer to size bytes
+ * reserved at the top of the thread's own stack, so that whatever f needs can
+ * be passed without allocating it. Before the thread can run, init is called
+ * with that pointer and ctx to fill the bytes in, with interrupts disabled.
+ * The bytes are aligned to 16 and stay in place until the thread exits.
+ *
+ * This function may fail if:
+ *  - no more threads can be created (ERROR_SYS_THREAD), or
+ *  - there is no more memory available (ERROR_SYS_MEM), or
+ *  - size is more than half of THREAD_STACK_SIZE, or something unexpected
+ *    failed (ERROR_OTHER)
+ *
+ * @param f A pointer to the function that this thread will execute.
+ * @param size The number of bytes to reserve for f.
+ * @param init Called to fill the bytes in before the thread runs.
+ * @param ctx The argument passed to init.
+ *
+ * @return If successful, the new thread's identifier. Otherwise, the
+ * appropriate error code.
+ *
+ * @pre init is not NULL
+ */
+Tid
+ThreadCreateInPlace(void (*f)(void*), size_t size,
+                    void (*init)(void*, void*), void* ctx);
+
 /**
  * Suspend the calling thread and run the next ready thread. The calling thread
  * will be scheduled again after all *currently* ready threads have run.
@@ -154,7 +191,8 @@ ThreadKill(Tid tid);
  *
  * Representation Invariants:
  *  - None of the threads in the wait queue are currently running
- *  - A thread cannot be in more than one wait queue at a time
+ *  - A thread cannot be in more than one wait queue at a time, except while
+ *    it waits in ThreadSelect
  */
 typedef struct wait_queue_t WaitQueue;
 
@@ -236,6 +274,39 @@ ThreadWakeNext(WaitQueue* queue);
 int
 ThreadWakeAll(WaitQueue* queue);
 
+/**
+ * Where ThreadWakeNextAndSwitch puts the calling thread in the ready queue.
+ */
+typedef enum
+{
+  // Behind every other ready thread, as ThreadYield does
+  THREAD_SWITCH_CALLER_LAST = 0,
+  // Ahead of every other ready thread, to run again as soon as the woken
+  // thread yields or sleeps, as in a request-response exchange
+  THREAD_SWITCH_CALLER_FIRST = 1
+} ThreadSwitchPolicy;
+
+/**
+ * Wake up the first thread in queue and switch straight to it, skipping the
+ * ready queue it would otherwise wait at the tail of, as a ThreadWakeNext
+ * followed by a ThreadYield would. The calling thread is made ready, and is
+ * placed in the ready queue according to policy. If queue is empty, the
+ * calling thread continues to execute.
+ *
+ * Like ThreadYield, this is a point at which the calling thread acts on
+ * ThreadCancel.
+ *
+ * @param queue The wait queue to dequeue.
+ * @param policy Where to put the calling thread in the ready queue.
+ *
+ * @return The number of threads woken up, which can be 0, once the calling
+ * thread runs again.
+ *
+ * @pre queue is not NULL
+ */
+int
+ThreadWakeNextAndSwitch(WaitQueue* queue, ThreadSwitchPolicy policy);
+
 /**
  * Suspend the calling thread until the thread with identifier tid exits. If
  * the thread has already exited, this function returns immediately.
@@ -264,4 +335,1763 @@ ThreadWakeAll(WaitQueue* queue);
 int
 ThreadJoin(Tid tid, int* exit_code);
 
+/**
+ * Get the serial of the thread with identifier tid. Identifiers are reused once
+ * a thread exits and is cleaned up, but each thread created gets a serial no
+ * other thread shares, which stays with the identifier until it is reused.
+ *
+ * This function may fail if:
+ *  - the identifier is invalid (ERROR_TID_INVALID)
+ *
+ * @return If successful, the serial, or 0 if no thread was ever created with
+ * the identifier. Otherwise, the appropriate error code.
+ */
+long
+ThreadSerial(Tid tid);
+
+/**
+ * Like ThreadJoin, but only if the thread with identifier tid is still the one
+ * that was created with serial (see ThreadSerial), so that a handle to a thread
+ * never joins a later thread given the same identifier.
+ *
+ * This function may fail if:
+ *  - the identifier is invalid (ERROR_TID_INVALID), or
+ *  - the identifier is of the calling thread (ERROR_THREAD_BAD), or
+ *  - the thread is not valid, or its identifier was since given to another
+ *    thread (ERROR_SYS_THREAD)
+ *
+ * @return If successful, the identifier of the thread that exited. Otherwise,
+ * the appropriate error code.
+ */
+int
+ThreadJoinSerial(Tid tid, long serial, int* exit_code);
+
+/**
+ * Suspend the calling thread until any one of the count threads in tids exits.
+ * The calling thread parks once, on all of the threads, and is woken once by
+ * the first of them to exit.
+ *
+ * Threads that have already exited, or were never created, are skipped, as
+ * long as at least one thread in tids has not exited. An identifier out of
+ * range is not skipped, but fails the call.
+ *
+ * This function may fail if:
+ *  - count is not positive (ERROR_OTHER), or
+ *  - an identifier is invalid (ERROR_TID_INVALID), or
+ *  - an identifier is of the calling thread (ERROR_THREAD_BAD), or
+ *  - none of the threads is valid (ERROR_SYS_THREAD), or
+ *  - memory for the wait could not be allocated (ERROR_SYS_MEM)
+ *
+ * @param tids The identifiers of the threads to wait for.
+ * @param count The number of identifiers in tids.
+ * @param which Set to the identifier of the thread that exited.
+ * @param exit_code Set to the code the thread that exited exited with.
+ *
+ * @return If successful, the index in tids of the thread that exited.
+ * Otherwise, the appropriate error code.
+ *
+ * @pre tids, which and exit_code are not NULL
+ */
+int
+ThreadJoinAny(const Tid* tids, int count, Tid* which, int* exit_code);
+
+//****************************************************************************
+// Synchronization Primitives
+//****************************************************************************
+/**
+ * A blocking, non-recursive mutual exclusion lock.
+ *
+ * Locking an unowned mutex costs one atomic operation and does not touch the
+ * interrupt mask. A contended locker first yields directly to the owner a
+ * bounded number of times (THREAD_MUTEX_SPIN) and then sleeps on the mutex's
+ * internal wait queue. Unlocking a mutex with waiters hands ownership straight
+ * to the first waiter, so a woken thread never has to compete for the lock.
+ */
+typedef struct thread_mutex_t ThreadMutex;
+
+/**
+ * The number of times a contended locker yields to the owner before sleeping.
+ */
+#define THREAD_MUTEX_SPIN 4
+
+/**
+ * Create an unlocked mutex.
+ *
+ * The mutex created by this function must be freed using ThreadMutexDestroy.
+ *
+ * @return If successful, a pointer to the newly allocated mutex. Otherwise,
+ * NULL.
+ */
+ThreadMutex*
+ThreadMutexCreate(void);
+
+/**
+ * Destroy the mutex, freeing up allocated memory.
+ *
+ * This function may fail if:
+ *  - the mutex is locked (ERROR_OTHER)
+ *
+ * @return If successful, 0. Otherwise, the appropriate error code.
+ *
+ * @pre mutex is not NULL
+ */
+int
+ThreadMutexDestroy(ThreadMutex* mutex);
+
+/**
+ * Acquire the mutex, suspending the calling thread until it is available.
+ *
+ * This function may fail if:
+ *  - the calling thread already owns the mutex (ERROR_THREAD_BAD), or
+ *  - the mutex is held and there are no other threads that can run
+ * (ERROR_SYS_THREAD)
+ *
+ * @return If successful, 0. Otherwise, the appropriate error code.
+ *
+ * @pre mutex is not NULL
+ */
+int
+ThreadMutexLock(ThreadMutex* mutex);
+
+/**
+ * Acquire the mutex only if it is available, without suspending.
+ *
+ * This function may fail if:
+ *  - the mutex is held (ERROR_OTHER)
+ *
+ * @return If successful, 0. Otherwise, the appropriate error code.
+ *
+ * @pre mutex is not NULL
+ */
+int
+ThreadMutexTryLock(ThreadMutex* mutex);
+
+/**
+ * Release the mutex. If threads are waiting, ownership passes directly to the
+ * first of them, which is moved to the ready queue.
+ *
+ * The calling thread continues to execute (i.e., it is not suspended).
+ *
+ * This function may fail if:
+ *  - the calling thread does not own the mutex (ERROR_THREAD_BAD)
+ *
+ * @return If successful, 0. Otherwise, the appropriate error code.
+ *
+ * @pre mutex is not NULL
+ */
+int
+ThreadMutexUnlock(ThreadMutex* mutex);
+
+/**
+ * A condition variable, used together with a ThreadMutex.
+ *
+ * Waking a waiter does not make it compete for the mutex: if the mutex is
+ * held, the waiter is moved directly onto the mutex's wait queue and receives
+ * the mutex when it is released (wait morphing).
+ */
+typedef struct thread_cond_t ThreadCond;
+
+/**
+ * Create a condition variable with no waiters.
+ *
+ * The condition variable created by this function must be freed using
+ * ThreadCondDestroy.
+ *
+ * @return If successful, a pointer to the newly allocated condition variable.
+ * Otherwise, NULL.
+ */
+ThreadCond*
+ThreadCondCreate(void);
+
+/**
+ * Destroy the condition variable, freeing up allocated memory.
+ *
+ * This function may fail if:
+ *  - threads are waiting on the condition variable (ERROR_OTHER)
+ *
+ * @return If successful, 0. Otherwise, the appropriate error code.
+ *
+ * @pre cond is not NULL
+ */
+int
+ThreadCondDestroy(ThreadCond* cond);
+
+/**
+ * Atomically release mutex and suspend the calling thread on cond. The mutex
+ * is held again when this function returns, whether or not it succeeds.
+ *
+ * All threads waiting on a condition variable at the same time must use the
+ * same mutex.
+ *
+ * This function may fail if:
+ *  - the calling thread does not own mutex (ERROR_THREAD_BAD), or
+ *  - other threads are waiting on cond with a different mutex (ERROR_OTHER),
+ * or
+ *  - there are no other threads that can run (ERROR_SYS_THREAD)
+ *
+ * @return If successful, 0. Otherwise, the appropriate error code.
+ *
+ * @pre cond and mutex are not NULL
+ */
+int
+ThreadCondWait(ThreadCond* cond, ThreadMutex* mutex);
+
+/**
+ * Wake up the first thread waiting on cond.
+ *
+ * The calling thread continues to execute (i.e., it is not suspended).
+ *
+ * @return The number of threads woken up, which can be 0.
+ *
+ * @pre cond is not NULL
+ */
+int
+ThreadCondSignal(ThreadCond* cond);
+
+/**
+ * Wake up all threads waiting on cond in FIFO order. At most one of them is
+ * made ready; the rest are moved onto the mutex's wait queue in one step.
+ *
+ * The calling thread continues to execute (i.e., it is not suspended).
+ *
+ * @return The number of threads woken up, which can be 0.
+ *
+ * @pre cond is not NULL
+ */
+int
+ThreadCondBroadcast(ThreadCond* cond);
+
+/**
+ * A counting semaphore.
+ *
+ * Waiting on a positive semaphore, and posting to a semaphore no thread waits
+ * on, each cost one atomic operation. A post that wakes a waiter hands its
+ * unit directly to that waiter.
+ */
+typedef struct thread_sem_t ThreadSem;
+
+/**
+ * Create a semaphore with an initial count of value.
+ *
+ * The semaphore created by this function must be freed using ThreadSemDestroy.
+ *
+ * @param value The initial count, which must not be negative.
+ *
+ * @return If successful, a pointer to the newly allocated semaphore.
+ * Otherwise, NULL.
+ */
+ThreadSem*
+ThreadSemCreate(int value);
+
+/**
+ * Destroy the semaphore, freeing up allocated memory.
+ *
+ * This function may fail if:
+ *  - threads are waiting on the semaphore (ERROR_OTHER)
+ *
+ * @return If successful, 0. Otherwise, the appropriate error code.
+ *
+ * @pre sem is not NULL
+ */
+int
+ThreadSemDestroy(ThreadSem* sem);
+
+/**
+ * Decrement the semaphore, suspending the calling thread while the count is
+ * zero.
+ *
+ * This function may fail if:
+ *  - the count is zero and there are no other threads that can run
+ * (ERROR_SYS_THREAD)
+ *
+ * @return If successful, 0. Otherwise, the appropriate error code.
+ *
+ * @pre sem is not NULL
+ */
+int
+ThreadSemWait(ThreadSem* sem);
+
+/**
+ * Decrement the semaphore only if the count is positive, without suspending.
+ *
+ * This function may fail if:
+ *  - the count is zero (ERROR_OTHER)
+ *
+ * @return If successful, 0. Otherwise, the appropriate error code.
+ *
+ * @pre sem is not NULL
+ */
+int
+ThreadSemTryWait(ThreadSem* sem);
+
+/**
+ * Increment the semaphore, waking up the first waiting thread if there is one.
+ *
+ * The calling thread continues to execute (i.e., it is not suspended).
+ *
+ * @return The number of threads woken up, which can be 0. It is also 0 when
+ * the count goes to a waiting thread that is not yet suspended, which then
+ * returns from ThreadSemWait without being woken up.
+ *
+ * @pre sem is not NULL
+ */
+int
+ThreadSemPost(ThreadSem* sem);
+
+/**
+ * A reader-writer lock, allowing either many readers or one writer.
+ *
+ * Taking a read lock while no writer holds or waits for the lock costs one
+ * atomic increment. A waiting writer blocks new readers, so a steady stream of
+ * readers cannot starve it. When a writer unlocks, every queued reader is
+ * moved to the ready queue in one splice; if another writer is queued, it
+ * acquires the lock once those readers leave.
+ */
+typedef struct thread_rwlock_t ThreadRWLock;
+
+/**
+ * Create an unlocked reader-writer lock.
+ *
+ * The lock created by this function must be freed using ThreadRWLockDestroy.
+ *
+ * @return If successful, a pointer to the newly allocated lock. Otherwise,
+ * NULL.
+ */
+ThreadRWLock*
+ThreadRWLockCreate(void);
+
+/**
+ * Destroy the lock, freeing up allocated memory.
+ *
+ * This function may fail if:
+ *  - the lock is held or threads are waiting on it (ERROR_OTHER)
+ *
+ * @return If successful, 0. Otherwise, the appropriate error code.
+ *
+ * @pre rwlock is not NULL
+ */
+int
+ThreadRWLockDestroy(ThreadRWLock* rwlock);
+
+/**
+ * Acquire the lock for reading, suspending the calling thread while a writer
+ * holds or waits for it.
+ *
+ * This function may fail if:
+ *  - a writer holds the lock and there are no other threads that can run
+ * (ERROR_SYS_THREAD)
+ *
+ * @return If successful, 0. Otherwise, the appropriate error code.
+ *
+ * @pre rwlock is not NULL
+ */
+int
+ThreadRWLockReadLock(ThreadRWLock* rwlock);
+
+/**
+ * Release a read lock held by the calling thread.
+ *
+ * The calling thread continues to execute (i.e., it is not suspended).
+ *
+ * @return 0.
+ *
+ * @pre rwlock is not NULL and is held for reading by the calling thread
+ */
+int
+ThreadRWLockReadUnlock(ThreadRWLock* rwlock);
+
+/**
+ * Acquire the lock for writing, suspending the calling thread until no other
+ * thread holds it.
+ *
+ * This function may fail if:
+ *  - the calling thread already holds the lock for writing
+ * (ERROR_THREAD_BAD), or
+ *  - the lock is held and there are no other threads that can run
+ * (ERROR_SYS_THREAD)
+ *
+ * @return If successful, 0. Otherwise, the appropriate error code.
+ *
+ * @pre rwlock is not NULL
+ */
+int
+ThreadRWLockWriteLock(ThreadRWLock* rwlock);
+
+/**
+ * Release the write lock held by the calling thread.
+ *
+ * The calling thread continues to execute (i.e., it is not suspended).
+ *
+ * This function may fail if:
+ *  - the calling thread does not hold the lock for writing (ERROR_THREAD_BAD)
+ *
+ * @return If successful, 0. Otherwise, the appropriate error code.
+ *
+ * @pre rwlock is not NULL
+ */
+int
+ThreadRWLockWriteUnlock(ThreadRWLock* rwlock);
+
+/**
+ * A reusable barrier for a fixed number of threads.
+ *
+ * Threads block in ThreadBarrierWait until the last of them arrives, which
+ * moves all the others to the ready queue in one splice and starts a new
+ * generation, so the barrier can be used again immediately.
+ */
+typedef struct thread_barrier_t ThreadBarrier;
+
+/**
+ * Returned by ThreadBarrierWait to exactly one thread per generation: the last
+ * one to arrive.
+ */
+#define THREAD_BARRIER_SERIAL 1
+
+/**
+ * Create a barrier for count threads.
+ *
+ * The barrier created by this function must be freed using
+ * ThreadBarrierDestroy.
+ *
+ * @param count The number of threads that must arrive, which must be positive.
+ *
+ * @return If successful, a pointer to the newly allocated barrier. Otherwise,
+ * NULL.
+ */
+ThreadBarrier*
+ThreadBarrierCreate(int count);
+
+/**
+ * Destroy the barrier, freeing up allocated memory.
+ *
+ * This function may fail if:
+ *  - threads are waiting at the barrier (ERROR_OTHER)
+ *
+ * @return If successful, 0. Otherwise, the appropriate error code.
+ *
+ * @pre barrier is not NULL
+ */
+int
+ThreadBarrierDestroy(ThreadBarrier* barrier);
+
+/**
+ * Suspend the calling thread until count threads, including it, have called
+ * this function for the current generation of the barrier.
+ *
+ * This function may fail if:
+ *  - the caller is not the last to arrive and there are no other threads that
+ * can run (ERROR_SYS_THREAD)
+ *
+ * @return If successful, THREAD_BARRIER_SERIAL for the last thread to arrive
+ * and 0 for all others. Otherwise, the appropriate error code.
+ *
+ * @pre barrier is not NULL
+ */
+int
+ThreadBarrierWait(ThreadBarrier* barrier);
+
+/**
+ * A one-shot countdown latch.
+ *
+ * Threads block in ThreadLatchWait until the count reaches zero. The count
+ * down that reaches zero moves every waiter to the ready queue in one splice;
+ * after that, waiting returns immediately.
+ */
+typedef struct thread_latch_t ThreadLatch;
+
+/**
+ * Create a latch with an initial count of count.
+ *
+ * The latch created by this function must be freed using ThreadLatchDestroy.
+ *
+ * @param count The initial count, which must not be negative.
+ *
+ * @return If successful, a pointer to the newly allocated latch. Otherwise,
+ * NULL.
+ */
+ThreadLatch*
+ThreadLatchCreate(int count);
+
+/**
+ * Destroy the latch, freeing up allocated memory.
+ *
+ * This function may fail if:
+ *  - threads are waiting on the latch (ERROR_OTHER)
+ *
+ * @return If successful, 0. Otherwise, the appropriate error code.
+ *
+ * @pre latch is not NULL
+ */
+int
+ThreadLatchDestroy(ThreadLatch* latch);
+
+/**
+ * Decrement the latch's count. When the count reaches zero, wake up every
+ * thread waiting on the latch. Counting down an open latch has no effect.
+ *
+ * The calling thread continues to execute (i.e., it is not suspended).
+ *
+ * @return The number of threads woken up, which can be 0.
+ *
+ * @pre latch is not NULL
+ */
+int
+ThreadLatchCountDown(ThreadLatch* latch);
+
+/**
+ * Suspend the calling thread until the latch's count reaches zero. If it is
+ * already zero, this function returns immediately.
+ *
+ * This function may fail if:
+ *  - the count is not zero and there are no other threads that can run
+ * (ERROR_SYS_THREAD)
+ *
+ * @return If successful, 0. Otherwise, the appropriate error code.
+ *
+ * @pre latch is not NULL
+ */
+int
+ThreadLatchWait(ThreadLatch* latch);
+
+/**
+ * A wait group: a counter of outstanding work that threads can wait on.
+ *
+ * ThreadWaitGroupAdd and ThreadWaitGroupDone move the counter; waiters block
+ * until it reaches zero, which moves all of them to the ready queue in one
+ * splice. Threads created with ThreadWaitGroupSpawn or added with
+ * ThreadWaitGroupAddThread count as one unit of work
+ * each and are counted done when they exit or are killed, recording their exit
+ * code in the group for ThreadWaitGroupExitCodes to collect in bulk.
+ */
+typedef struct thread_wait_group_t ThreadWaitGroup;
+
+/**
+ * Create a wait group with a count of zero.
+ *
+ * The wait group created by this function must be freed using
+ * ThreadWaitGroupDestroy.
+ *
+ * @return If successful, a pointer to the newly allocated wait group.
+ * Otherwise, NULL.
+ */
+ThreadWaitGroup*
+ThreadWaitGroupCreate(void);
+
+/**
+ * Destroy the wait group, freeing up allocated memory and any exit codes not
+ * yet collected.
+ *
+ * This function may fail if:
+ *  - threads are waiting on the wait group, or threads added to it have not
+ * exited yet (ERROR_OTHER)
+ *
+ * @return If successful, 0. Otherwise, the appropriate error code.
+ *
+ * @pre wg is not NULL
+ */
+int
+ThreadWaitGroupDestroy(ThreadWaitGroup* wg);
+
+/**
+ * Add delta, which may be negative, to the wait group's count. When the count
+ * reaches zero, wake up every thread waiting on the wait group.
+ *
+ * The calling thread continues to execute (i.e., it is not suspended).
+ *
+ * This function may fail if:
+ *  - the count would become negative (ERROR_OTHER)
+ *
+ * @return If successful, the number of threads woken up, which can be 0.
+ * Otherwise, the appropriate error code.
+ *
+ * @pre wg is not NULL
+ */
+int
+ThreadWaitGroupAdd(ThreadWaitGroup* wg, int delta);
+
+/**
+ * Equivalent to ThreadWaitGroupAdd(wg, -1).
+ */
+int
+ThreadWaitGroupDone(ThreadWaitGroup* wg);
+
+/**
+ * Create a new thread, as ThreadCreate does, that belongs to the wait group
+ * from the start, incrementing its count. The count is decremented, and the
+ * thread's exit code recorded, when the thread exits or is killed.
+ *
+ * This function may fail for the same reasons as ThreadCreate.
+ *
+ * @return If successful, the new thread's identifier. Otherwise, the
+ * appropriate error code.
+ *
+ * @pre wg is not NULL
+ */
+Tid
+ThreadWaitGroupSpawn(ThreadWaitGroup* wg, void (*f)(void*), void* arg);
+
+/**
+ * Add the existing thread with identifier tid to the wait group, as if it had
+ * been created with ThreadWaitGroupSpawn. A thread that may exit before this
+ * call should be created with ThreadWaitGroupSpawn instead.
+ *
+ * This function may fail if:
+ *  - the identifier is invalid (ERROR_TID_INVALID), or
+ *  - the thread is not valid (ERROR_SYS_THREAD), or
+ *  - the thread already belongs to a wait group (ERROR_OTHER), or
+ *  - memory for its exit code could not be allocated (ERROR_SYS_MEM)
+ *
+ * @return If successful, 0. Otherwise, the appropriate error code.
+ *
+ * @pre wg is not NULL
+ */
+int
+ThreadWaitGroupAddThread(ThreadWaitGroup* wg, Tid tid);
+
+/**
+ * Suspend the calling thread until the wait group's count reaches zero. If it
+ * is already zero, this function returns immediately.
+ *
+ * This function may fail if:
+ *  - the count is not zero and there are no other threads that can run
+ * (ERROR_SYS_THREAD)
+ *
+ * @return If successful, 0. Otherwise, the appropriate error code.
+ *
+ * @pre wg is not NULL
+ */
+int
+ThreadWaitGroupWait(ThreadWaitGroup* wg);
+
+/**
+ * Collect up to max of the exit codes recorded by the wait group's threads, in
+ * the order they exited. Collected codes are removed from the wait group.
+ *
+ * @param tids Filled with the identifiers of the threads that exited.
+ * @param exit_codes Filled with the matching exit codes.
+ * @param max The capacity of tids and exit_codes.
+ *
+ * @return The number of exit codes collected, which can be 0.
+ *
+ * @pre wg, tids and exit_codes are not NULL
+ */
+int
+ThreadWaitGroupExitCodes(ThreadWaitGroup* wg,
+                         Tid* tids,
+                         int* exit_codes,
+                         int max);
+
+/**
+ * A channel carrying fixed-size messages between threads, in FIFO order.
+ *
+ * A channel with capacity 0 is unbuffered: each send waits until a receiver
+ * takes the message. Otherwise, up to capacity messages are buffered. When a
+ * receiver is already waiting, a sender copies the message straight into the
+ * receiver's destination and makes it ready, bypassing the buffer; likewise, a
+ * receiver takes a waiting sender's message directly from the sender.
+ */
+typedef struct thread_chan_t ThreadChan;
+
+/**
+ * Create an open channel.
+ *
+ * The channel created by this function must be freed using ThreadChanDestroy.
+ *
+ * @param elem_size The size, in bytes, of each message.
+ * @param capacity The number of messages buffered, or 0 for an unbuffered
+ * channel.
+ *
+ * @return If successful, a pointer to the newly allocated channel. Otherwise,
+ * NULL.
+ */
+ThreadChan*
+ThreadChanCreate(int elem_size, int capacity);
+
+/**
+ * Destroy the channel, freeing up allocated memory and any buffered messages.
+ *
+ * This function may fail if:
+ *  - threads are waiting on the channel (ERROR_OTHER)
+ *
+ * @return If successful, 0. Otherwise, the appropriate error code.
+ *
+ * @pre chan is not NULL
+ */
+int
+ThreadChanDestroy(ThreadChan* chan);
+
+/**
+ * Send the message at elem, suspending the calling thread until it is
+ * buffered or taken by a receiver.
+ *
+ * This function may fail if:
+ *  - the channel is closed, including while the caller waits (ERROR_CLOSED),
+ * or
+ *  - the message cannot be delivered and there are no other threads that can
+ * run (ERROR_SYS_THREAD)
+ *
+ * @return If successful, 0. Otherwise, the appropriate error code.
+ *
+ * @pre chan and elem are not NULL
+ */
+int
+ThreadChanSend(ThreadChan* chan, const void* elem);
+
+/**
+ * Receive a message into elem, suspending the calling thread until one is
+ * available.
+ *
+ * This function may fail if:
+ *  - the channel is closed and no messages remain (ERROR_CLOSED), or
+ *  - no message is available and there are no other threads that can run
+ * (ERROR_SYS_THREAD)
+ *
+ * @return If successful, 0. Otherwise, the appropriate error code.
+ *
+ * @pre chan and elem are not NULL
+ */
+int
+ThreadChanRecv(ThreadChan* chan, void* elem);
+
+/**
+ * Close the channel. Waiting receivers and senders are woken up and fail with
+ * ERROR_CLOSED; messages already buffered can still be received.
+ *
+ * The calling thread continues to execute (i.e., it is not suspended).
+ *
+ * This function may fail if:
+ *  - the channel is already closed (ERROR_CLOSED)
+ *
+ * @return If successful, 0. Otherwise, the appropriate error code.
+ *
+ * @pre chan is not NULL
+ */
+int
+ThreadChanClose(ThreadChan* chan);
+
+/**
+ * The operations ThreadSelect can wait for.
+ */
+typedef enum
+{
+  // Receive a message from chan into elem
+  THREAD_SELECT_RECV = 0,
+  // Send the message at elem on chan
+  THREAD_SELECT_SEND = 1,
+  // Be woken up from queue by ThreadWakeNext or ThreadWakeAll
+  THREAD_SELECT_WAKE = 2
+} ThreadSelectOp;
+
+/**
+ * One of the operations a ThreadSelect waits for.
+ */
+typedef struct
+{
+  ThreadSelectOp op;
+  // The channel, for THREAD_SELECT_RECV and THREAD_SELECT_SEND
+  ThreadChan* chan;
+  // The wait queue, for THREAD_SELECT_WAKE
+  WaitQueue* queue;
+  // The message buffer, for THREAD_SELECT_RECV and THREAD_SELECT_SEND
+  void* elem;
+  // Set for the case that completes: 0, or ERROR_CLOSED if its channel is
+  // closed
+  int result;
+} ThreadSelectCase;
+
+/**
+ * The maximum number of cases passed to ThreadSelect.
+ */
+#define THREAD_SELECT_MAX_CASES 16
+
+/**
+ * Passed as the timeout of ThreadSelect to wait without a time limit.
+ */
+#define THREAD_SELECT_FOREVER -1
+
+/**
+ * Wait until the first of several operations completes, performing exactly
+ * that one.
+ *
+ * Cases that can complete immediately are tried in order. Otherwise, the
+ * calling thread is enqueued on every case's wait queue at once and suspended;
+ * whichever case fires first removes it from all the others.
+ *
+ * A case on a closed channel completes immediately with result ERROR_CLOSED,
+ * unless it receives and messages are still buffered.
+ *
+ * This function may fail if:
+ *  - count is not between 1 and THREAD_SELECT_MAX_CASES (ERROR_OTHER), or
+ *  - no case completed within timeout microseconds (ERROR_TIMEOUT), or
+ *  - no case can complete and there are no other threads that can run
+ * (ERROR_SYS_THREAD)
+ *
+ * @param cases The operations to wait for.
+ * @param count The number of cases.
+ * @param timeout The time limit in microseconds, 0 to only try the cases that
+ * can complete immediately, or THREAD_SELECT_FOREVER.
+ *
+ * @return If successful, the index of the case that completed. Otherwise, the
+ * appropriate error code.
+ *
+ * @pre cases is not NULL
+ */
+int
+ThreadSelect(ThreadSelectCase* cases, int count, int timeout);
+
+//****************************************************************************
+// File Descriptors
+//****************************************************************************
+/**
+ * The readiness events a thread can wait for on a file descriptor.
+ */
+typedef enum
+{
+  THREAD_FD_READ = 1,
+  THREAD_FD_WRITE = 2
+} ThreadFdEvent;
+
+/**
+ * Suspend the calling thread until the file descriptor fd is ready for any of
+ * events, without blocking the other threads.
+ *
+ * This is meant for non-blocking descriptors: perform the operation, and wait
+ * when it fails with EAGAIN. Waiting threads are parked on fd's wait queue;
+ * the scheduler polls for readiness whenever it switches threads, and blocks in
+ * the poll when no thread is ready. An error or hang-up on fd makes it ready
+ * for every event. Descriptors that cannot be polled, such as regular files,
+ * are always ready.
+ *
+ * This function may fail if:
+ *  - fd is negative or events is empty (ERROR_OTHER), or
+ *  - fd was not ready within timeout microseconds (ERROR_TIMEOUT), or
+ *  - fd is not ready and there are no other threads that can run
+ * (ERROR_SYS_THREAD), or
+ *  - the poller could not be set up (ERROR_SYS_MEM)
+ *
+ * @param fd The file descriptor to wait for.
+ * @param events A combination of ThreadFdEvent values.
+ * @param timeout The time limit in microseconds, 0 to only check readiness,
+ * or THREAD_SELECT_FOREVER.
+ *
+ * @return If successful, the events fd is ready for. Otherwise, the
+ * appropriate error code.
+ */
+int
+ThreadWaitFd(int fd, int events, int timeout);
+
+/**
+ * The functions below perform file I/O asynchronously: the calling thread is
+ * suspended until the operation completes, while other threads keep running.
+ * Operations submitted by different threads between two scheduler ticks are
+ * handed to the kernel together, through io_uring when the kernel supports it
+ * and through a pool of helper kernel threads otherwise. Setting the
+ * environment variable THREAD_IO_BACKEND to "threads" before the first
+ * operation forces the helper threads.
+ *
+ * Like their POSIX counterparts, they return -1 and set errno on failure. The
+ * stack of a thread killed during an operation is kept until the operation
+ * completes, so buffers on it stay valid.
+ */
+
+/**
+ * Read up to count bytes from fd into buf, like pread, or like read if offset
+ * is -1.
+ *
+ * @return The number of bytes read, or -1 with errno set.
+ */
+ssize_t
+ThreadRead(int fd, void* buf, size_t count, off_t offset);
+
+/**
+ * Write up to count bytes from buf to fd, like pwrite, or like write if offset
+ * is -1.
+ *
+ * @return The number of bytes written, or -1 with errno set.
+ */
+ssize_t
+ThreadWrite(int fd, const void* buf, size_t count, off_t offset);
+
+/**
+ * Read from fd into the iovcnt buffers in iov, like preadv, or like readv if
+ * offset is -1.
+ *
+ * @return The number of bytes read, or -1 with errno set.
+ */
+ssize_t
+ThreadReadv(int fd, const struct iovec* iov, int iovcnt, off_t offset);
+
+/**
+ * Flush fd's data and metadata to storage, like fsync.
+ *
+ * @return 0 if successful, or -1 with errno set.
+ */
+int
+ThreadFsync(int fd);
+
+/**
+ * Run f(arg) on one of a small pool of helper kernel threads, suspending only
+ * the calling thread until it returns. Meant for blocking calls that have no
+ * asynchronous form, such as getaddrinfo or stat: made directly, they would
+ * stall every thread, including preemption.
+ *
+ * f runs outside the thread library and must not call any of its functions.
+ * Calls are handed to the helpers in batches at scheduler ticks, and their
+ * completions are collected through an eventfd the scheduler polls.
+ *
+ * This function may fail if:
+ *  - the helper threads could not be started (ERROR_SYS_MEM)
+ *
+ * @return If successful, 0. Otherwise, the appropriate error code.
+ */
+int
+ThreadOffload(void (*f)(void*), void* arg);
+
+/**
+ * Statistics of the helper thread pool, which runs ThreadOffload calls and,
+ * without io_uring, asynchronous I/O. Times are in microseconds.
+ */
+typedef struct
+{
+  // Calls submitted, and those whose caller was woken up
+  long submitted;
+  long completed;
+  // Calls waiting for a helper thread, and running on one, right now
+  int queued;
+  int running;
+  // The most calls ever waiting for a helper thread
+  int max_queued;
+  // Total time calls spent waiting for a helper, and running on one
+  long long total_queue_us;
+  long long total_run_us;
+  // Total and maximum time from submitting a call to waking its caller
+  long long total_latency_us;
+  long long max_latency_us;
+} ThreadOffloadStats;
+
+/**
+ * Copy the helper thread pool's statistics into stats.
+ *
+ * @pre stats is not NULL
+ */
+void
+ThreadOffloadGetStats(ThreadOffloadStats* stats);
+
+//****************************************************************************
+// Statistics
+//****************************************************************************
+
+/**
+ * Scheduler statistics of one thread. Times are in nanoseconds.
+ */
+typedef struct
+{
+  // Switches away from the thread because it yielded, blocked or exited, and
+  // because it was preempted
+  long voluntary_switches;
+  long preempted_switches;
+  // Times the thread was woken up after blocking
+  long wakeups;
+  // Time spent running, in the ready queue, and blocked
+  long long run_ns;
+  long long ready_ns;
+  long long blocked_ns;
+  // The most stack the thread has used, in bytes. Unless its stack was
+  // painted (see ThreadSetStackMode), this is sampled at switches away from
+  // the thread, so it can miss deeper calls made between switches.
+  long stack_high_water;
+} ThreadStats;
+
+/**
+ * Scheduler statistics of the whole process.
+ */
+typedef struct
+{
+  long voluntary_switches;
+  long preempted_switches;
+  long wakeups;
+  // Time spent with no thread to run, waiting for a timer or a descriptor
+  long long idle_ns;
+} ThreadGlobalStats;
+
+/**
+ * Copy the statistics of the thread identified by tid into stats, including
+ * the time spent so far in its current state.
+ *
+ * Accounting is always on. Each switch and wakeup reads the time stamp counter
+ * once, so it costs a few nanoseconds.
+ *
+ * This function may fail if:
+ *  - tid is invalid (ERROR_TID_INVALID), or
+ *  - no thread has the identifier tid (ERROR_SYS_THREAD)
+ *
+ * @return If successful, 0. Otherwise, the appropriate error code.
+ *
+ * @pre stats is not NULL
+ */
+int
+ThreadGetStats(Tid tid, ThreadStats* stats);
+
+/**
+ * Copy the process-wide scheduler statistics into stats.
+ *
+ * @pre stats is not NULL
+ */
+void
+ThreadGetGlobalStats(ThreadGlobalStats* stats);
+
+//****************************************************************************
+// Tracing
+//****************************************************************************
+
+/**
+ * The scheduler events a trace records. For each, tid is the thread that
+ * caused the event, and arg is:
+ */
+typedef enum
+{
+  // the new thread
+  THREAD_TRACE_CREATE = 0,
+  // the thread switched to
+  THREAD_TRACE_SWITCH = 1,
+  // 0; tid blocked
+  THREAD_TRACE_SLEEP = 2,
+  // the thread woken up
+  THREAD_TRACE_WAKE = 3,
+  // the thread joined
+  THREAD_TRACE_JOIN = 4,
+  // the thread killed
+  THREAD_TRACE_KILL = 5,
+  // the exit code
+  THREAD_TRACE_EXIT = 6,
+  // 0; a preemption tick interrupted tid
+  THREAD_TRACE_PREEMPT = 7
+} ThreadTraceEvent;
+
+/**
+ * One trace record, as written by ThreadTraceDump.
+ */
+typedef struct
+{
+  // Nanoseconds since ThreadTraceStart
+  uint64_t time;
+  // A ThreadTraceEvent
+  uint16_t event;
+  uint16_t tid;
+  int32_t arg;
+} ThreadTraceRecord;
+
+/**
+ * Start recording scheduler events into a ring of capacity records, rounded
+ * up to a power of two. Once the ring is full, each record replaces the
+ * oldest one. A previous trace is discarded.
+ *
+ * Tracing is always compiled in. While it is off, each event costs one
+ * predictable branch; while it is on, one time stamp counter read and a
+ * 16-byte store.
+ *
+ * This function may fail if:
+ *  - capacity is not positive (ERROR_OTHER), or
+ *  - the ring cannot be allocated (ERROR_SYS_MEM)
+ *
+ * @return If successful, 0. Otherwise, the appropriate error code.
+ */
+int
+ThreadTraceStart(int capacity);
+
+/**
+ * Stop recording scheduler events, keeping the trace for ThreadTraceDump.
+ */
+void
+ThreadTraceStop(void);
+
+/**
+ * Write the records in the trace to fd, oldest first, as an array of
+ * ThreadTraceRecord in host byte order. The trace_json tool converts them to
+ * the Chrome trace event format, which Perfetto and chrome://tracing open.
+ *
+ * This function may fail if:
+ *  - no trace was started (ERROR_OTHER), or
+ *  - writing to fd fails (ERROR_OTHER)
+ *
+ * @return If successful, the number of records written. Otherwise, the
+ * appropriate error code.
+ */
+int
+ThreadTraceDump(int fd);
+
+//****************************************************************************
+// Contention Profiling
+//****************************************************************************
+
+/**
+ * The number of threads that waited longest on a primitive that a profile
+ * entry lists.
+ */
+#define THREAD_PROFILE_TOP_WAITERS 4
+
+/**
+ * Tid padding ThreadProfileEntry.top_waiters.
+ */
+#define THREAD_NONE -1
+
+/**
+ * The contention on the mutexes, reader-writer locks, semaphores, condition
+ * variables or channels created at one call site, or given one name. Times are
+ * in nanoseconds.
+ */
+typedef struct
+{
+  // "mutex", "rwlock", "sem", "cond" or "chan"
+  const char* kind;
+  // The name given by ThreadProfileSetName, or NULL
+  const char* name;
+  // For unnamed entries, the return address of the create call
+  const void* caller;
+  // Acquisitions, and of those, the ones that had to wait. For condition
+  // variables, every wait counts as a contended acquisition.
+  long acquisitions;
+  long contended;
+  long long total_wait_ns;
+  long long max_wait_ns;
+  // The threads that waited longest in total, longest first, padded with
+  // THREAD_NONE
+  Tid top_waiters[THREAD_PROFILE_TOP_WAITERS];
+  long long top_wait_ns[THREAD_PROFILE_TOP_WAITERS];
+} ThreadProfileEntry;
+
+/**
+ * Start profiling contention on the primitives created from now on, grouped
+ * by the call site that creates them. Primitives created earlier are not
+ * profiled. Once started, the profiler stays on.
+ *
+ * An unprofiled primitive pays one branch per acquisition. A profiled one
+ * pays an atomic increment per acquisition, and two time stamp counter reads
+ * per acquisition that waits.
+ *
+ * If signal is not 0, receiving it writes ThreadProfileDump's report to
+ * standard error, from the next yield or preemption rather than from the
+ * signal handler.
+ *
+ * This function may fail if:
+ *  - the handler for signal cannot be installed (ERROR_OTHER)
+ *
+ * @return If successful, 0. Otherwise, the appropriate error code.
+ */
+int
+ThreadProfileStart(int signal);
+
+/**
+ * Move the profiled primitive to the entry for name, which is shared with
+ * every other primitive given the same name. Counts already recorded stay
+ * with its creation site.
+ *
+ * The primitive is any ThreadMutex, ThreadRWLock, ThreadSem, ThreadCond or
+ * ThreadChan. name must stay valid as long as the profile is read.
+ *
+ * This function may fail if:
+ *  - the primitive is not profiled (ERROR_OTHER), or
+ *  - the profiler has no room for another entry (ERROR_SYS_MEM)
+ *
+ * @return If successful, 0. Otherwise, the appropriate error code.
+ *
+ * @pre primitive and name are not NULL
+ */
+int
+ThreadProfileSetName(void* primitive, const char* name);
+
+/**
+ * Copy up to max profile entries into entries, those with the most total wait
+ * first. Entries for primitives that were never acquired are left out.
+ *
+ * @return The number of entries copied.
+ *
+ * @pre entries is not NULL
+ */
+int
+ThreadProfileGet(ThreadProfileEntry* entries, int max);
+
+/**
+ * Write a report of the profile to fd, one line per entry ThreadProfileGet
+ * would copy, in the same order. This only makes async-signal-safe calls besides
+ * formatting, so it is safe to call from a signal handler.
+ */
+void
+ThreadProfileDump(int fd);
+
+//****************************************************************************
+// Stack Sizing
+//****************************************************************************
+
+/**
+ * How ThreadCreate sizes and prepares stacks.
+ */
+typedef enum
+{
+  // Every stack is THREAD_STACK_SIZE bytes and is not painted
+  THREAD_STACK_FIXED = 0,
+  // Every stack is THREAD_STACK_SIZE bytes, painted with a canary pattern so
+  // its high-water mark can be measured, and measured when the thread exits
+  THREAD_STACK_PAINT = 1,
+  // As THREAD_STACK_PAINT, but the stack of a thread running a function
+  // whose threads have been measured is sized from their high-water marks
+  THREAD_STACK_LEARN = 2
+} ThreadStackMode;
+
+/**
+ * The number of buckets in a ThreadStackProfile histogram. Bucket i counts the
+ * threads whose high-water mark was at most 1 KiB << i, and the last bucket
+ * counts the rest.
+ */
+#define THREAD_STACK_BUCKETS 6
+
+/**
+ * The number of threads running a function that must exit before its stack
+ * size is learned.
+ */
+#define THREAD_STACK_LEARN_SAMPLES 8
+
+/**
+ * The stack use of the threads that ran one function.
+ */
+typedef struct
+{
+  void (*f)(void*);
+  // Threads measured, and the most stack any of them used, in bytes
+  long threads;
+  long max_used;
+  long histogram[THREAD_STACK_BUCKETS];
+  // The size ThreadCreate gives new stacks for f in THREAD_STACK_LEARN mode
+  size_t stack_size;
+} ThreadStackProfile;
+
+/**
+ * Set how stacks of threads created from now on are sized and prepared.
+ *
+ * Painting writes the whole stack when the thread is created, so a painted
+ * stack is fully resident. In THREAD_STACK_LEARN mode, once
+ * THREAD_STACK_LEARN_SAMPLES threads running a function have exited, new
+ * threads running it get the most stack any of them used, plus half again and
+ * 4 KiB for signal frames, rounded up to a page and capped at
+ * THREAD_STACK_SIZE. A function whose thread ever filled its stack always gets
+ * THREAD_STACK_SIZE. A thread created with ThreadCreateInPlace gets at least
+ * twice the bytes it reserves. The margin is a heuristic: a thread that goes deeper than
+ * any thread measured before it can overflow its stack.
+ */
+void
+ThreadSetStackMode(ThreadStackMode mode);
+
+/**
+ * Measure the most stack the thread identified by tid has used so far.
+ *
+ * This function may fail if:
+ *  - tid is invalid (ERROR_TID_INVALID), or
+ *  - no thread has the identifier tid (ERROR_SYS_THREAD), or
+ *  - the thread's stack is not painted, as for the initial thread
+ * (ERROR_OTHER)
+ *
+ * @return If successful, the high-water mark in bytes. Otherwise, the
+ * appropriate error code.
+ */
+long
+ThreadStackHighWater(Tid tid);
+
+/**
+ * Copy up to max per-function stack profiles into profiles, in the order the
+ * functions were first measured.
+ *
+ * @return The number of profiles copied.
+ *
+ * @pre profiles is not NULL
+ */
+int
+ThreadStackGetProfiles(ThreadStackProfile* profiles, int max);
+
+//****************************************************************************
+// Shared stacks
+//****************************************************************************
+
+/**
+ * The number of stacks the threads created with ThreadCreateShared share, and
+ * the size of each.
+ */
+#define THREAD_SHARED_STACKS 4
+#define THREAD_SHARED_STACK_SIZE (256 * 1024)
+
+/**
+ * Like ThreadCreate, but the new thread runs on one of THREAD_SHARED_STACKS
+ * shared stacks, the one with the fewest threads, rather than on a stack of
+ * its own. A shared stack holds the stack of one of its threads at a time.
+ * When another of its threads is about to run, the live part of the current
+ * one's stack, from its stack pointer up, is copied to a heap buffer sized to
+ * fit, and the other's is copied back in.
+ *
+ * This suits large numbers of threads that are parked most of the time: each
+ * costs about as much memory as the stack it is actually using, typically a
+ * few hundred bytes to a few KiB, instead of THREAD_STACK_SIZE. In exchange,
+ * switching to a thread whose stack is not in place costs two copies of live
+ * stack.
+ *
+ * While such a thread is parked, its local variables are not at their
+ * addresses, so other threads must not use pointers to them. The library's
+ * own blocking calls move what other threads need, such as channel messages,
+ * to the heap for the wait, so they may also fail with ERROR_SYS_MEM.
+ * ThreadRead, ThreadWrite, ThreadReadv, ThreadFsync and ThreadOffload
+ * complete synchronously on such a thread, blocking every thread meanwhile,
+ * since neither the kernel nor a helper thread may write to its stack.
+ *
+ * This function may fail if:
+ *  - no more threads can be created (ERROR_SYS_THREAD), or
+ *  - there is no more memory available (ERROR_SYS_MEM), or
+ *  - something unexpected failed (ERROR_OTHER)
+ *
+ * @param f A pointer to the function that this thread will execute.
+ * @param arg The argument passed to f.
+ *
+ * @return If successful, the new thread's identifier. Otherwise, the
+ * appropriate error code.
+ */
+Tid
+ThreadCreateShared(void (*f)(void*), void* arg);
+
+//****************************************************************************
+// Stack arenas
+//****************************************************************************
+
+/**
+ * Where ThreadCreate allocates stacks.
+ */
+typedef enum
+{
+  // Each stack is allocated from the heap
+  THREAD_STACK_ARENA_NONE = 0,
+  // Stacks are slots of 2 MiB regions of small pages, each with an
+  // inaccessible guard page below it, so that overflowing a stack faults
+  // instead of corrupting its neighbour
+  THREAD_STACK_ARENA_GUARDED = 1,
+  // Stacks are slots of 2 MiB aligned regions advised to be backed by
+  // transparent huge pages, without guard pages, which would split them
+  THREAD_STACK_ARENA_HUGE = 2,
+  // As THREAD_STACK_ARENA_HUGE, but backed by hugetlbfs pages, reserved
+  // through /proc/sys/vm/nr_hugepages. Once none are left, transparent huge
+  // pages are used instead.
+  THREAD_STACK_ARENA_HUGETLB = 3
+} ThreadStackArena;
+
+/**
+ * Set where the stacks of threads created from now on are allocated. Stacks
+ * already allocated stay where they are.
+ *
+ * Every switch lands on a different stack, so with many threads on small
+ * pages, switches tend to miss in the data TLB. Carving the stacks out of
+ * huge pages lets 64 stacks share one TLB entry. The cost is memory: a
+ * region is backed by a whole 2 MiB page as soon as one of its stacks is
+ * touched, where small pages back only the parts of stacks in use. Every
+ * arena stack takes a full THREAD_STACK_SIZE slot, even when a smaller size
+ * was learned (see ThreadSetStackMode). When a region cannot be mapped,
+ * stacks are allocated from the heap.
+ *
+ * This function may fail if:
+ *  - arena is not a ThreadStackArena (ERROR_OTHER)
+ *
+ * @return If successful, 0. Otherwise, the appropriate error code.
+ */
+int
+ThreadSetStackArena(ThreadStackArena arena);
+
+//****************************************************************************
+// Thread-local storage
+//****************************************************************************
+
+/**
+ * A key to a value each thread holds separately.
+ */
+typedef int ThreadKey;
+
+/**
+ * The most keys that can be created.
+ */
+#define THREAD_KEYS_MAX 64
+
+/**
+ * The most times destructors are run over a thread's values, should they set
+ * values again.
+ */
+#define THREAD_KEY_DESTRUCTOR_PASSES 4
+
+/**
+ * Create a key, for which every thread holds NULL until it sets a value.
+ *
+ * When a thread exits, destructor, if not NULL, is called with each non-NULL
+ * value it holds for the key, which is reset to NULL first. Destructors run on
+ * the exiting thread, before it exits, and again while any of them set values.
+ * The values of a killed thread are destroyed when its resources are
+ * reclaimed, by whichever thread reclaims them, with interrupts disabled;
+ * those destructors must not block.
+ *
+ * This function may fail if:
+ *  - THREAD_KEYS_MAX keys already exist (ERROR_OTHER)
+ *
+ * @return If successful, the new key. Otherwise, the appropriate error code.
+ */
+ThreadKey
+ThreadKeyCreate(void (*destructor)(void*));
+
+/**
+ * @return The calling thread's value for key, or NULL if it set none or key
+ * was not created. The first few keys created are read from the thread's
+ * control block, the rest from an array it allocates the first time it sets
+ * one of them; either way, in constant time without locking.
+ */
+void*
+ThreadGetSpecific(ThreadKey key);
+
+/**
+ * Set the calling thread's value for key to value.
+ *
+ * This function may fail if:
+ *  - key was not created (ERROR_OTHER), or
+ *  - there is no more memory available (ERROR_SYS_MEM)
+ *
+ * @return If successful, 0. Otherwise, the appropriate error code.
+ */
+int
+ThreadSetSpecific(ThreadKey key, void* value);
+
+//****************************************************************************
+// Per-thread arenas
+//****************************************************************************
+
+/**
+ * The size of the chunks a thread's arena allocates from, including their
+ * header. Larger allocations get a chunk of their own.
+ */
+#define THREAD_ARENA_CHUNK_SIZE (16 * 1024)
+
+/**
+ * The most free chunks kept for reuse by other threads' arenas.
+ */
+#define THREAD_ARENA_POOL_MAX 64
+
+/**
+ * Allocate size bytes from the calling thread's arena, aligned for any type.
+ * The memory cannot be freed on its own: all of it is freed at once when the
+ * thread exits, after its thread-local storage destructors have run, or when
+ * it is reclaimed after being killed. Until then, other threads may use it.
+ *
+ * Allocations are carved off the thread's current chunk, without locking.
+ * Chunks come from a pool that exiting threads return theirs to, and from the
+ * heap only when it is empty.
+ *
+ * @return The allocated memory, or NULL if there is no more memory available.
+ */
+void*
+ThreadArenaAlloc(size_t size);
+
+//****************************************************************************
+// Cancellation
+//****************************************************************************
+
+/**
+ * The most cleanup handlers a thread can have pushed at once.
+ */
+#define THREAD_CLEANUP_MAX 8
+
+/**
+ * Ask the thread whose identifier is tid to exit, as ThreadKill does, but at
+ * a point of its own choosing: the next time it calls ThreadYield or
+ * ThreadYieldTo, is preempted, or calls ThreadSleep or ThreadJoin. A thread
+ * already asleep in either is woken to exit. There, instead of returning, the
+ * thread runs its cleanup handlers and exits with EXIT_CODE_KILL, as if it had
+ * called ThreadExit, so its thread-local storage destructors run as well and
+ * its stack is reclaimed as soon as it has switched away.
+ *
+ * Waits in the library's synchronization primitives and channels are not
+ * cancellation points, nor are preemptions in the middle of taking or
+ * releasing a primitive, so that no primitive is left half acquired: a thread
+ * cancelled while blocked in one exits once the wait completes and the thread
+ * reaches one of the points above. Cancelling a thread more than once, or
+ * while it is exiting, has no further effect. A thread may cancel itself.
+ *
+ * This function may fail if:
+ *  - the identifier is invalid (ERROR_TID_INVALID), or
+ *  - the thread is invalid (ERROR_SYS_THREAD)
+ *
+ * @return If successful, tid. Otherwise, the appropriate error code.
+ */
+Tid
+ThreadCancel(Tid tid);
+
+/**
+ * Push routine onto the calling thread's cleanup handlers, to be called with
+ * arg, last pushed first, when the thread exits or is cancelled, unless it is
+ * popped before then. Handlers run on the exiting thread, before its
+ * thread-local storage destructors; a killed thread never runs them.
+ *
+ * This function may fail if:
+ *  - THREAD_CLEANUP_MAX handlers are already pushed (ERROR_OTHER)
+ *
+ * @return If successful, 0. Otherwise, the appropriate error code.
+ */
+int
+ThreadCleanupPush(void (*routine)(void*), void* arg);
+
+/**
+ * Pop the cleanup handler the calling thread pushed last, calling it if
+ * execute is non-zero.
+ *
+ * This function may fail if:
+ *  - no handler is pushed (ERROR_OTHER)
+ *
+ * @return If successful, 0. Otherwise, the appropriate error code.
+ */
+int
+ThreadCleanupPop(int execute);
+
+//****************************************************************************
+// Tasks
+//****************************************************************************
+
+/**
+ * Queue fn to be called with arg as a task: a unit of work that runs to
+ * completion on one of a few worker threads, back to back with other tasks,
+ * without a stack or context switch of its own. Tasks spawned are started in
+ * the order they were spawned in, once the spawning thread yields, sleeps or
+ * is preempted.
+ *
+ * A task may block, e.g. on a mutex or channel, and then keeps the worker it
+ * runs on as a full thread until it returns, while the tasks queued behind it
+ * move to another worker, created if none is free. A task must return rather
+ * than exit its thread, and is neither cancelled nor killed on its own.
+ *
+ * Spawning takes no system call and no lock once the first worker is running
+ * and records for tasks have been allocated, which they are in blocks that are
+ * recycled.
+ *
+ * This function may fail if:
+ *  - there is no more memory available (ERROR_SYS_MEM), or
+ *  - no worker is running and none can be created (the error from
+ *    ThreadCreate)
+ *
+ * @return If successful, 0. Otherwise, the appropriate error code.
+ */
+int
+TaskSpawn(void (*fn)(void*), void* arg);
+
+/**
+ * Suspend the calling thread until every task spawned so far, and every task
+ * those spawned, has returned.
+ *
+ * This function may fail if:
+ *  - it is called from a task (ERROR_THREAD_BAD), or
+ *  - no thread can run the remaining tasks (ERROR_SYS_THREAD)
+ *
+ * @return If successful, 0. Otherwise, the appropriate error code.
+ */
+int
+TaskWaitAll(void);
+
+//****************************************************************************
+// Asynchronous Waits
+//****************************************************************************
+
+/**
+ * Wait on queue without suspending the calling thread: the wait is queued like
+ * a sleeping thread, and once ThreadWakeNext or ThreadWakeAll reaches it,
+ * resume is called with arg and a status of 0, as a task (see TaskSpawn). No
+ * thread or stack is held while the wait is pending, which is what lets
+ * stackless coroutines suspend on the library's primitives.
+ *
+ * Waking an asynchronous wait counts as waking a thread, but
+ * ThreadWakeNextAndSwitch has no thread to switch to and returns at once.
+ *
+ * This function may fail if:
+ *  - there is no more memory available (ERROR_SYS_MEM)
+ *
+ * @return If successful, 0. Otherwise, the appropriate error code.
+ *
+ * @pre queue and resume are not NULL
+ */
+int
+ThreadSleepAsync(WaitQueue* queue, void (*resume)(void*, int), void* arg);
+
+/**
+ * Like ThreadJoin, without suspending the calling thread: once the thread with
+ * identifier tid exits or is killed, resume is called as a task with arg and
+ * the exit code of that thread.
+ *
+ * This function may fail if:
+ *  - the identifier is invalid (ERROR_TID_INVALID), or
+ *  - the thread is invalid (ERROR_SYS_THREAD), or
+ *  - tid is the calling thread (ERROR_THREAD_BAD), or
+ *  - there is no more memory available (ERROR_SYS_MEM)
+ *
+ * @return If successful, 0. Otherwise, the appropriate error code.
+ *
+ * @pre resume is not NULL
+ */
+int
+ThreadJoinAsync(Tid tid, void (*resume)(void*, int), void* arg);
+
+/**
+ * Like ThreadWaitFd without a timeout, without suspending the calling thread:
+ * once fd is ready for any of events, resume is called as a task with arg and
+ * the events fd is ready for.
+ *
+ * This function may fail if:
+ *  - fd is negative or events is empty (ERROR_OTHER), or
+ *  - fd cannot be polled (ERROR_OTHER), or
+ *  - there is no more memory available (ERROR_SYS_MEM)
+ *
+ * @return If successful, 0. Otherwise, the appropriate error code.
+ *
+ * @pre resume is not NULL
+ */
+int
+ThreadWaitFdAsync(int fd, int events, void (*resume)(void*, int), void* arg);
+
+//****************************************************************************
+// Futures
+//****************************************************************************
+
+/**
+ * The writing end of a value computed once, by one thread or task, and read by
+ * any number of others through its future. Both share one allocation, freed
+ * once the promise, its future and everything chained from the future with
+ * ThreadFutureThen are destroyed or have run.
+ */
+typedef struct thread_promise_t ThreadPromise;
+
+/**
+ * The reading end of a promise.
+ */
+typedef struct thread_future_t ThreadFuture;
+
+/**
+ * Where a continuation added with ThreadFutureThen runs once its future is
+ * set.
+ */
+typedef enum
+{
+  // On the thread that sets the future, before ThreadPromiseSet returns
+  THREAD_THEN_INLINE = 0,
+  // As a task (see TaskSpawn), or inline if no task can be spawned
+  THREAD_THEN_TASK = 1
+} ThreadThenPolicy;
+
+/**
+ * Create a promise for a value of elem_size bytes, whose future is pending.
+ *
+ * The promise created by this function must be freed using
+ * ThreadPromiseDestroy, and its future using ThreadFutureDestroy.
+ *
+ * @return If successful, a pointer to the newly allocated promise. Otherwise,
+ * NULL.
+ */
+ThreadPromise*
+ThreadPromiseCreate(int elem_size);
+
+/**
+ * @return The future of the promise.
+ *
+ * @pre promise is not NULL
+ */
+ThreadFuture*
+ThreadPromiseFuture(ThreadPromise* promise);
+
+/**
+ * Set the future of the promise to the elem_size bytes at value. Every thread
+ * waiting in ThreadFutureGet is made ready with one splice of the future's
+ * wait queue, and the continuations added with ThreadFutureThen are run or
+ * spawned in the order they were added. Continuations that run inline set
+ * their own futures in turn, so a chain of them runs to its end before this
+ * function returns, in constant stack space.
+ *
+ * This function may fail if:
+ *  - the future is already set (ERROR_OTHER)
+ *
+ * @return If successful, 0. Otherwise, the appropriate error code.
+ *
+ * @pre promise is not NULL
+ */
+int
+ThreadPromiseSet(ThreadPromise* promise, const void* value);
+
+/**
+ * Destroy the promise. If its future is not set, it is broken: its waiters get
+ * ERROR_CLOSED, and so do the futures chained from it, without their
+ * continuations being called.
+ *
+ * @return 0.
+ *
+ * @pre promise is not NULL
+ */
+int
+ThreadPromiseDestroy(ThreadPromise* promise);
+
+/**
+ * Suspend the calling thread until the future is set, then copy its value to
+ * value, unless value is NULL.
+ *
+ * This function may fail if:
+ *  - the promise was destroyed without setting the future (ERROR_CLOSED), or
+ *  - the future is not set and there are no other threads that can run
+ * (ERROR_SYS_THREAD)
+ *
+ * @return If successful, 0. Otherwise, the appropriate error code.
+ *
+ * @pre future is not NULL
+ */
+int
+ThreadFutureGet(ThreadFuture* future, void* value);
+
+/**
+ * @return Whether the future is set or broken, so that ThreadFutureGet would
+ * return without waiting.
+ *
+ * @pre future is not NULL
+ */
+int
+ThreadFutureIsReady(ThreadFuture* future);
+
+/**
+ * Chain a continuation from the future: once the future is set, fn is called
+ * with arg, the future's value as in, and the value of the future returned as
+ * out, which is set when fn returns. No thread is created for it; it runs as
+ * policy says, or right away on the calling thread or as a task if the future
+ * is already set.
+ *
+ * The future returned is owned by the caller, like that of a promise, and must
+ * be freed using ThreadFutureDestroy.
+ *
+ * @param elem_size The size, in bytes, of the value fn produces.
+ *
+ * @return If successful, the future of fn's value. Otherwise, NULL.
+ *
+ * @pre future and fn are not NULL
+ */
+ThreadFuture*
+ThreadFutureThen(ThreadFuture* future,
+                 int elem_size,
+                 void (*fn)(void* arg, const void* in, void* out),
+                 void* arg,
+                 ThreadThenPolicy policy);
+
+/**
+ * Destroy the future. Continuations chained from it still run.
+ *
+ * This function may fail if:
+ *  - threads are waiting on the future (ERROR_OTHER)
+ *
+ * @return If successful, 0. Otherwise, the appropriate error code.
+ *
+ * @pre future is not NULL
+ */
+int
+ThreadFutureDestroy(ThreadFuture* future);
+
+#ifdef __cplusplus
+}
+#endif
+
 #endif /* THREAD_H */
@@ -0,0 +1,425 @@
+/**
+ *
+ * @file Defines a C++17 interface to the Thread Library: Fiber, a handle to a
+ * thread running any callable, and the typed wrappers Mutex, CondVar and
+ * Channel<T>.
+ *
+ * Errors the C functions report as codes are thrown as thread::Error, except
+ * those a caller is expected to handle, such as a closed channel.
+ *
+ * Header-only; include it from C++17 code linked against the library.
+ */
+#ifndef THREAD_HPP
+#define THREAD_HPP
+
+#include <cstring>
+#include <functional>
+#include <mutex>
+#include <new>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+
+#include "interrupts.h"
+#include "thread.h"
+
+namespace thread {
+
+/**
+ * An error code returned by the library.
+ */
+class Error : public std::runtime_error
+{
+public:
+  explicit Error(int code)
+    : std::runtime_error("thread library error " + std::to_string(code))
+    , code_(code)
+  {
+  }
+
+  int code() const noexcept { return code_; }
+
+private:
+  int code_;
+};
+
+namespace detail {
+
+/**
+ * @return ret, unless it is an error code, which is thrown.
+ */
+inline int
+check(int ret)
+{
+  if (ret < 0) {
+    throw Error(ret);
+  }
+  return ret;
+}
+
+/**
+ * Interrupts disabled for the lifetime of the object, as around allocations:
+ * a thread preempted inside malloc must not be reentered.
+ */
+class InterruptsOff
+{
+public:
+  InterruptsOff() noexcept
+    : enabled_(InterruptsDisable())
+  {
+  }
+
+  ~InterruptsOff() { InterruptsSet(enabled_); }
+
+  InterruptsOff(const InterruptsOff&) = delete;
+  InterruptsOff& operator=(const InterruptsOff&) = delete;
+
+private:
+  InterruptsState enabled_;
+};
+
+/**
+ * A callable and its arguments, constructed at the top of the stack of the
+ * thread that calls it.
+ */
+template<typename F, typename... Args>
+struct Closure
+{
+  std::tuple<F, Args...> parts;
+
+  template<typename Forwarded>
+  explicit Closure(Forwarded&& forwarded)
+    : parts(std::forward<Forwarded>(forwarded))
+  {
+  }
+
+  /**
+   * Move-construct the closure at where from the tuple of references at
+   * forwarded, for ThreadCreateInPlace.
+   */
+  template<typename Forwarded>
+  static void construct(void* where, void* forwarded) noexcept
+  {
+    ::new (where) Closure(std::move(*static_cast<Forwarded*>(forwarded)));
+  }
+
+  /**
+   * The function of the thread: call the closure at where and destroy it. As
+   * with std::thread, an exception escaping the callable terminates the
+   * process.
+   */
+  static void run(void* where) noexcept
+  {
+    Closure* const closure = static_cast<Closure*>(where);
+    std::apply([](auto&... part) { std::invoke(std::move(part)...); },
+               closure->parts);
+    closure->~Closure();
+  }
+};
+
+} // namespace detail
+
+/**
+ * A move-only handle to a thread, which is joined when the handle is
+ * destroyed or assigned to unless it was detached. The handle keeps the
+ * thread's serial as well as its identifier, so it never joins another thread
+ * that was later given the same identifier, however the fiber exited.
+ */
+class Fiber
+{
+public:
+  Fiber() noexcept = default;
+
+  /**
+   * Create a thread that calls f with args, which are moved or copied into
+   * storage at the top of the thread's own stack rather than on the heap.
+   * A thread that exits or is killed before f returns skips destroying them.
+   *
+   * Throws Error with the code from ThreadCreateInPlace if the thread cannot
+   * be created.
+   */
+  template<typename F, typename... Args>
+  static Fiber spawn(F&& f, Args&&... args)
+  {
+    using Closure = detail::Closure<std::decay_t<F>, std::decay_t<Args>...>;
+    static_assert(alignof(Closure) <= 16, "over-aligned captures");
+    auto forwarded =
+      std::forward_as_tuple(std::forward<F>(f), std::forward<Args>(args)...);
+    // The thread cannot run, exit and be replaced before its serial is read
+    detail::InterruptsOff off;
+    Tid const tid =
+      ThreadCreateInPlace(&Closure::run,
+                          sizeof(Closure),
+                          &Closure::template construct<decltype(forwarded)>,
+                          &forwarded);
+    detail::check(tid);
+    return Fiber(tid, ThreadSerial(tid));
+  }
+
+  Fiber(Fiber&& other) noexcept
+    : tid_(std::exchange(other.tid_, -1))
+    , serial_(other.serial_)
+  {
+  }
+
+  Fiber& operator=(Fiber&& other)
+  {
+    if (this != &other) {
+      if (joinable()) {
+        join();
+      }
+      tid_ = std::exchange(other.tid_, -1);
+      serial_ = other.serial_;
+    }
+    return *this;
+  }
+
+  ~Fiber()
+  {
+    if (joinable()) {
+      ThreadJoinSerial(tid_, serial_, nullptr);
+    }
+  }
+
+  /**
+   * @return Whether the handle still stands for a thread to join.
+   */
+  bool joinable() const noexcept { return tid_ >= 0; }
+
+  /**
+   * @return The identifier of the thread, or -1 once joined or detached.
+   */
+  Tid id() const noexcept { return tid_; }
+
+  /**
+   * Suspend the calling thread until the thread exits, which it may already
+   * have. Throws Error with ERROR_THREAD_BAD if it is the calling thread.
+   */
+  void join()
+  {
+    int const ret = ThreadJoinSerial(tid_, serial_, nullptr);
+    if (ret == ERROR_THREAD_BAD) {
+      throw Error(ret);
+    }
+    tid_ = -1;
+  }
+
+  /**
+   * Let the thread run on its own; the handle no longer stands for it.
+   */
+  void detach() noexcept { tid_ = -1; }
+
+private:
+  Fiber(Tid tid, long serial) noexcept
+    : tid_(tid)
+    , serial_(serial)
+  {
+  }
+
+  Tid tid_ = -1;
+  long serial_ = 0;
+};
+
+/**
+ * A mutex, usable with std::lock_guard and std::unique_lock.
+ */
+class Mutex
+{
+public:
+  Mutex()
+    : mutex_(ThreadMutexCreate())
+  {
+    if (mutex_ == nullptr) {
+      throw Error(ERROR_SYS_MEM);
+    }
+  }
+
+  ~Mutex() { ThreadMutexDestroy(mutex_); }
+
+  Mutex(const Mutex&) = delete;
+  Mutex& operator=(const Mutex&) = delete;
+
+  void lock() { detail::check(ThreadMutexLock(mutex_)); }
+
+  bool try_lock() { return ThreadMutexTryLock(mutex_) == 0; }
+
+  void unlock() { detail::check(ThreadMutexUnlock(mutex_)); }
+
+  ThreadMutex* native_handle() const noexcept { return mutex_; }
+
+private:
+  ThreadMutex* mutex_;
+};
+
+/**
+ * A condition variable waited on with a Mutex held in a std::unique_lock.
+ */
+class CondVar
+{
+public:
+  CondVar()
+    : cond_(ThreadCondCreate())
+  {
+    if (cond_ == nullptr) {
+      throw Error(ERROR_SYS_MEM);
+    }
+  }
+
+  ~CondVar() { ThreadCondDestroy(cond_); }
+
+  CondVar(const CondVar&) = delete;
+  CondVar& operator=(const CondVar&) = delete;
+
+  void wait(std::unique_lock<Mutex>& lock)
+  {
+    detail::check(ThreadCondWait(cond_, lock.mutex()->native_handle()));
+  }
+
+  template<typename Predicate>
+  void wait(std::unique_lock<Mutex>& lock, Predicate ready)
+  {
+    while (!ready()) {
+      wait(lock);
+    }
+  }
+
+  void notify_one() { detail::check(ThreadCondSignal(cond_)); }
+
+  void notify_all() { detail::check(ThreadCondBroadcast(cond_)); }
+
+  ThreadCond* native_handle() const noexcept { return cond_; }
+
+private:
+  ThreadCond* cond_;
+};
+
+/**
+ * A channel of T. A trivially copyable T is carried by value, copied by the
+ * library straight into the receiver or the buffer. Any other T is moved into
+ * a box on the heap, and the channel carries a pointer to the box.
+ */
+template<typename T>
+class Channel
+{
+public:
+  // Whether messages are carried by value rather than boxed
+  static constexpr bool by_value = std::is_trivially_copyable_v<T>;
+
+  /**
+   * Create an open channel buffering up to capacity messages, or none.
+   */
+  explicit Channel(int capacity = 0)
+    : chan_(ThreadChanCreate(sizeof(Slot), capacity))
+  {
+    if (chan_ == nullptr) {
+      throw Error(ERROR_SYS_MEM);
+    }
+  }
+
+  ~Channel()
+  {
+    if constexpr (!by_value) {
+      // Closing makes receiving buffered boxes the only thing left to do
+      ThreadChanClose(chan_);
+      Slot box;
+      while (ThreadChanRecv(chan_, &box) == 0) {
+        detail::InterruptsOff off;
+        delete box;
+      }
+    }
+    ThreadChanDestroy(chan_);
+  }
+
+  Channel(const Channel&) = delete;
+  Channel& operator=(const Channel&) = delete;
+
+  /**
+   * Send value, suspending the calling thread until it is buffered or taken
+   * by a receiver.
+   *
+   * @return true if sent, false if the channel is closed, in which case value
+   * is discarded.
+   */
+  bool send(T value)
+  {
+    if constexpr (by_value) {
+      return sent(ThreadChanSend(chan_, &value));
+    } else {
+      Slot box;
+      {
+        detail::InterruptsOff off;
+        box = new T(std::move(value));
+      }
+      if (sent(ThreadChanSend(chan_, &box))) {
+        return true;
+      }
+      detail::InterruptsOff off;
+      delete box;
+      return false;
+    }
+  }
+
+  /**
+   * Receive a message, suspending the calling thread until one is available.
+   *
+   * @return The message, or nothing if the channel is closed and empty.
+   */
+  std::optional<T> recv()
+  {
+    if constexpr (by_value) {
+      // Storage for the bytes the library copies in, without constructing a T
+      union
+      {
+        char none;
+        T value;
+      } slot{};
+      if (!sent(ThreadChanRecv(chan_, &slot.value))) {
+        return std::nullopt;
+      }
+      return slot.value;
+    } else {
+      Slot box;
+      if (!sent(ThreadChanRecv(chan_, &box))) {
+        return std::nullopt;
+      }
+      std::optional<T> message(std::move(*box));
+      detail::InterruptsOff off;
+      delete box;
+      return message;
+    }
+  }
+
+  /**
+   * Close the channel, waking up its waiting senders and receivers.
+   *
+   * @return false if it was already closed.
+   */
+  bool close() { return ThreadChanClose(chan_) == 0; }
+
+  ThreadChan* native_handle() const noexcept { return chan_; }
+
+private:
+  using Slot = std::conditional_t<by_value, T, T*>;
+
+  /**
+   * @return Whether a send or receive that returned ret completed, or false if
+   * the channel is closed. Any other error is thrown.
+   */
+  static bool sent(int ret)
+  {
+    if (ret == ERROR_CLOSED) {
+      return false;
+    }
+    detail::check(ret);
+    return true;
+  }
+
+  ThreadChan* chan_;
+};
+
+} // namespace thread
+
+#endif /* THREAD_HPP */
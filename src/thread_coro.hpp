@@ -0,0 +1,463 @@
+/**
+ *
+ * @file Defines C++20 coroutines scheduled by the Thread Library: task<T>,
+ * which runs on the library's task workers, and awaitables that suspend a
+ * coroutine on a wait queue, a thread's exit or a file descriptor's readiness.
+ *
+ * A suspended coroutine holds no thread and no stack, only its frame, which is
+ * typically a few hundred bytes against a thread's THREAD_STACK_SIZE. Its wait
+ * is queued with ThreadSleepAsync and the like, and it is resumed as a task
+ * (see TaskSpawn) once woken, interleaved with the threads in the ready queue.
+ *
+ * Header-only; include it from C++20 code linked against the library.
+ */
+#ifndef THREAD_CORO_HPP
+#define THREAD_CORO_HPP
+
+#include <coroutine>
+#include <cstdlib>
+#include <exception>
+#include <new>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <utility>
+
+#include "interrupts.h"
+#include "thread.h"
+
+namespace thread_coro {
+
+/**
+ * Thrown by sync_wait when the task it waits for can never finish, with the
+ * library's error code.
+ */
+class error : public std::runtime_error
+{
+public:
+  explicit error(int code)
+    : std::runtime_error("thread library error " + std::to_string(code))
+    , code_(code)
+  {
+  }
+
+  int code() const noexcept { return code_; }
+
+private:
+  int code_;
+};
+
+template<typename T = void>
+class task;
+
+namespace detail {
+
+/**
+ * Resume the coroutine at address, as a task.
+ */
+inline void
+resume_address(void* address)
+{
+  std::coroutine_handle<>::from_address(address).resume();
+}
+
+/**
+ * What every task's promise holds besides its result.
+ */
+struct promise_base
+{
+  // The coroutine awaiting the task, resumed once it returns
+  std::coroutine_handle<> continuation;
+  // Whether spawn started the task, which then destroys itself once it returns
+  bool detached = false;
+  // Where sync_wait sleeps until done is set
+  WaitQueue* done_queue = nullptr;
+  volatile bool done = false;
+  std::exception_ptr exception;
+
+  struct final_awaiter
+  {
+    bool await_ready() const noexcept { return false; }
+
+    template<typename Promise>
+    std::coroutine_handle<> await_suspend(
+      std::coroutine_handle<Promise> handle) noexcept
+    {
+      promise_base& promise = handle.promise();
+      if (promise.continuation) {
+        return promise.continuation;
+      }
+      if (promise.detached) {
+        if (promise.exception) {
+          // Nobody is left to rethrow it to, as with std::thread
+          std::terminate();
+        }
+        handle.destroy();
+      } else if (promise.done_queue != nullptr) {
+        // Nothing in the frame is touched once the sleeper may run
+        InterruptsState enabled = InterruptsDisable();
+        promise.done = true;
+        ThreadWakeNext(promise.done_queue);
+        InterruptsSet(enabled);
+      }
+      return std::noop_coroutine();
+    }
+
+    void await_resume() const noexcept {}
+  };
+
+  // Frames are allocated with interrupts disabled, like the library's own
+  // memory, as a thread preempted inside malloc must not be reentered
+  static void* operator new(std::size_t size)
+  {
+    InterruptsState enabled = InterruptsDisable();
+    void* const frame = std::malloc(size);
+    InterruptsSet(enabled);
+    if (frame == nullptr) {
+      throw std::bad_alloc();
+    }
+    return frame;
+  }
+
+  static void operator delete(void* frame) noexcept
+  {
+    InterruptsState enabled = InterruptsDisable();
+    std::free(frame);
+    InterruptsSet(enabled);
+  }
+
+  std::suspend_always initial_suspend() const noexcept { return {}; }
+  final_awaiter final_suspend() const noexcept { return {}; }
+  void unhandled_exception() noexcept
+  {
+    exception = std::current_exception();
+  }
+
+  void rethrow() const
+  {
+    if (exception) {
+      std::rethrow_exception(exception);
+    }
+  }
+};
+
+template<typename T>
+struct promise : promise_base
+{
+  std::optional<T> value;
+
+  task<T> get_return_object() noexcept;
+
+  template<typename U>
+  void return_value(U&& result)
+  {
+    value.emplace(std::forward<U>(result));
+  }
+
+  T result()
+  {
+    rethrow();
+    return std::move(*value);
+  }
+};
+
+template<>
+struct promise<void> : promise_base
+{
+  task<void> get_return_object() noexcept;
+
+  void return_void() const noexcept {}
+
+  void result() const { rethrow(); }
+};
+
+/**
+ * An awaitable that suspends the coroutine in an asynchronous wait of the
+ * library, from the frame it lives in.
+ */
+class async_wait
+{
+public:
+  bool await_ready() const noexcept { return false; }
+
+protected:
+  /**
+   * The callback for ThreadSleepAsync and the like, run as a task.
+   */
+  static void resume(void* arg, int status)
+  {
+    async_wait* const wait = static_cast<async_wait*>(arg);
+    wait->status_ = status;
+    wait->handle_.resume();
+  }
+
+  /**
+   * Suspend handle in the wait queued by start(resume, this), unless start
+   * fails with an error code, which becomes the status instead.
+   *
+   * @return Whether handle was suspended.
+   */
+  template<typename Start>
+  bool suspend(std::coroutine_handle<> handle, Start start) noexcept
+  {
+    handle_ = handle;
+    int const err = start(&async_wait::resume, this);
+    if (err < 0) {
+      status_ = err;
+      failed_ = true;
+      return false;
+    }
+    // Another thread may already have resumed the coroutine, and even
+    // destroyed this, so nothing in the frame is touched from here on
+    return true;
+  }
+
+  std::coroutine_handle<> handle_;
+  int status_ = 0;
+  // Whether status_ is the error the wait failed to be queued with
+  bool failed_ = false;
+};
+
+} // namespace detail
+
+/**
+ * A coroutine returning T, started when awaited, spawned or passed to
+ * sync_wait. Awaiting it resumes the awaiting coroutine once it returns, on
+ * the same worker, and yields its result or rethrows its exception.
+ */
+template<typename T>
+class [[nodiscard]] task
+{
+public:
+  using promise_type = detail::promise<T>;
+  using handle_type = std::coroutine_handle<promise_type>;
+
+  task(task&& other) noexcept
+    : handle_(std::exchange(other.handle_, {}))
+  {
+  }
+
+  task& operator=(task&& other) noexcept
+  {
+    if (this != &other) {
+      if (handle_) {
+        handle_.destroy();
+      }
+      handle_ = std::exchange(other.handle_, {});
+    }
+    return *this;
+  }
+
+  ~task()
+  {
+    if (handle_) {
+      handle_.destroy();
+    }
+  }
+
+  auto operator co_await() && noexcept
+  {
+    struct awaiter
+    {
+      handle_type handle;
+
+      bool await_ready() const noexcept { return false; }
+
+      std::coroutine_handle<> await_suspend(
+        std::coroutine_handle<> awaiting) noexcept
+      {
+        handle.promise().continuation = awaiting;
+        return handle;
+      }
+
+      T await_resume() { return handle.promise().result(); }
+    };
+    return awaiter{ handle_ };
+  }
+
+  /**
+   * @return The coroutine, which the task no longer owns.
+   */
+  handle_type release() noexcept { return std::exchange(handle_, {}); }
+
+  /**
+   * @return The coroutine, which the task still owns.
+   */
+  handle_type handle() const noexcept { return handle_; }
+
+private:
+  friend promise_type;
+
+  explicit task(handle_type handle) noexcept
+    : handle_(handle)
+  {
+  }
+
+  handle_type handle_;
+};
+
+namespace detail {
+
+template<typename T>
+task<T>
+promise<T>::get_return_object() noexcept
+{
+  return task<T>(task<T>::handle_type::from_promise(*this));
+}
+
+inline task<void>
+promise<void>::get_return_object() noexcept
+{
+  return task<void>(task<void>::handle_type::from_promise(*this));
+}
+
+} // namespace detail
+
+/**
+ * Start t as a task of its own, which destroys itself once it returns. Its
+ * result is discarded, and an exception escaping it terminates the process.
+ *
+ * @return If successful, 0. Otherwise, the error code from TaskSpawn.
+ */
+template<typename T>
+int
+spawn(task<T>&& t)
+{
+  auto handle = t.release();
+  handle.promise().detached = true;
+  int const err = TaskSpawn(detail::resume_address, handle.address());
+  if (err < 0) {
+    handle.destroy();
+  }
+  return err;
+}
+
+/**
+ * Run t on the calling thread until it first suspends, then suspend the
+ * calling thread until t returns.
+ *
+ * @return The result of t, whose exception is rethrown. If no thread can run
+ * and t has not returned, error is thrown with ERROR_SYS_THREAD.
+ */
+template<typename T>
+T
+sync_wait(task<T>&& t)
+{
+  auto const handle = t.handle();
+  WaitQueue* const queue = WaitQueueCreate();
+  handle.promise().done_queue = queue;
+  handle.resume();
+
+  InterruptsState enabled = InterruptsDisable();
+  int err = 0;
+  while (!handle.promise().done && err >= 0) {
+    err = ThreadSleep(queue);
+  }
+  InterruptsSet(enabled);
+  WaitQueueDestroy(queue);
+  if (err < 0) {
+    // The frame stays suspended in its wait, so it is leaked rather than freed
+    t.release();
+    throw error(err);
+  }
+  return handle.promise().result();
+}
+
+/**
+ * Suspend the coroutine until ThreadWakeNext or ThreadWakeAll reaches it on
+ * queue. co_await yields 0, or the error code from ThreadSleepAsync.
+ */
+class sleep_on : public detail::async_wait
+{
+public:
+  explicit sleep_on(WaitQueue* queue) noexcept
+    : queue_(queue)
+  {
+  }
+
+  bool await_suspend(std::coroutine_handle<> handle) noexcept
+  {
+    WaitQueue* const queue = queue_;
+    return suspend(handle, [queue](void (*resume)(void*, int), void* arg) {
+      return ThreadSleepAsync(queue, resume, arg);
+    });
+  }
+
+  int await_resume() const noexcept { return status_; }
+
+private:
+  WaitQueue* queue_;
+};
+
+/**
+ * Suspend the coroutine until the thread with identifier tid exits, like
+ * ThreadJoin, copying its exit code to exit_code unless it is NULL. co_await
+ * yields tid, or the error code from ThreadJoinAsync.
+ */
+class join : public detail::async_wait
+{
+public:
+  explicit join(Tid tid, int* exit_code = nullptr) noexcept
+    : tid_(tid)
+    , exit_code_(exit_code)
+  {
+  }
+
+  bool await_suspend(std::coroutine_handle<> handle) noexcept
+  {
+    Tid const tid = tid_;
+    return suspend(handle, [tid](void (*resume)(void*, int), void* arg) {
+      return ThreadJoinAsync(tid, resume, arg);
+    });
+  }
+
+  int await_resume() const noexcept
+  {
+    // The status is otherwise an exit code, which may be negative
+    if (failed_) {
+      return status_;
+    }
+    if (exit_code_ != nullptr) {
+      *exit_code_ = status_;
+    }
+    return tid_;
+  }
+
+private:
+  Tid tid_;
+  int* exit_code_;
+};
+
+/**
+ * Suspend the coroutine until fd is ready for any of events, a combination of
+ * ThreadFdEvent values. co_await yields the events fd is ready for, or the
+ * error code from ThreadWaitFdAsync.
+ */
+class wait_fd : public detail::async_wait
+{
+public:
+  wait_fd(int fd, int events) noexcept
+    : fd_(fd)
+    , events_(events)
+  {
+  }
+
+  bool await_suspend(std::coroutine_handle<> handle) noexcept
+  {
+    int const fd = fd_;
+    int const events = events_;
+    return suspend(handle, [fd, events](void (*resume)(void*, int), void* arg) {
+      return ThreadWaitFdAsync(fd, events, resume, arg);
+    });
+  }
+
+  int await_resume() const noexcept { return status_; }
+
+private:
+  int fd_;
+  int events_;
+};
+
+} // namespace thread_coro
+
+#endif /* THREAD_CORO_HPP */
@@ -0,0 +1,1008 @@
+/**
+ *
+ * @file Defines the internal state of the Thread Library shared between its
+ * translation units. Nothing in here is part of the public interface.
+ */
+#ifndef THREAD_PRIVATE_H
+#define THREAD_PRIVATE_H
+
+#include <signal.h>
+#include <time.h>
+#include <ucontext.h>
+#include <unistd.h>
+
+#include "thread.h"
+
+/**
+ * The Thread States
+ */
+typedef enum
+{
+  READY = 1,
+  RUNNING = 2,
+  EXITED = 3,
+  EMPTY = 4,
+  KILLED = 5,
+  BLOCKED = 6
+} State;
+
+/**
+ * Per-thread scheduler accounting. Times are in stats_clock ticks.
+ */
+typedef struct accounting
+{
+  long voluntary_switches;
+  long preempted_switches;
+  long wakeups;
+  long long run;
+  long long ready;
+  long long blocked;
+  // When the thread last started running, stopped running, and became ready
+  long long switched_in_at;
+  long long switched_out_at;
+  long long ready_since;
+  long stack_high_water;
+} Accounting;
+
+/**
+ * How far a thread is from exiting on its own.
+ */
+typedef enum
+{
+  CANCEL_NONE = 0,
+  // ThreadCancel was called, to be acted on at the next cancellation point
+  CANCEL_PENDING = 1,
+  // The thread is in ThreadExit, running its handlers and destructors
+  CANCEL_EXITING = 2
+} CancelState;
+
+/**
+ * A handler pushed by ThreadCleanupPush.
+ */
+typedef struct cleanup_handler
+{
+  void (*routine)(void*);
+  void* arg;
+} CleanupHandler;
+
+/**
+ * The number of keys whose values are held in the TCB itself.
+ */
+#define THREAD_KEYS_INLINE 8
+
+/**
+ * The Thread Control Block.
+ */
+typedef struct
+{
+  Tid thread_id;
+  // Unique to this thread among all those created, unlike thread_id
+  long serial;
+  ucontext_t context;
+  State state;
+  void* sp;
+  ExitCode exit_code;
+  // The wait queue the thread is blocked on, or NULL
+  struct wait_queue_t* waiting_on;
+  // The select the thread is blocked in, or NULL
+  struct select_state* select;
+  // The wait group counting the thread, or NULL
+  struct thread_wait_group_t* group;
+  // Asynchronous operations in flight on the thread's behalf. Until they
+  // complete, the thread's stack, which they may write to, is not freed.
+  int io_pending;
+  Accounting acct;
+  // The function the thread runs, and the size of its stack, which is
+  // THREAD_STACK_SIZE unless a smaller size was learned for the function
+  void (*entry)(void*);
+  size_t stack_size;
+  // Whether the stack was painted, so its high-water mark can be measured
+  int stack_painted;
+  // The shared stack the thread runs on, or NULL if sp is its own. Whenever
+  // another thread's stack is on it, the live part of this thread's stack is
+  // in saved, saved_size bytes of a buffer of saved_capacity.
+  struct shared_stack* shared;
+  void* saved;
+  size_t saved_size;
+  size_t saved_capacity;
+  // Values of the first THREAD_KEYS_INLINE keys, and of the others, once one
+  // is set, in an array of THREAD_KEYS_MAX - THREAD_KEYS_INLINE
+  void* specific[THREAD_KEYS_INLINE];
+  void** specific_overflow;
+  // The chunks of the thread's arena, the one allocated from first
+  struct bump_chunk* arena;
+  CancelState cancel;
+  // Whether the thread sleeps in ThreadSleep, where ThreadCancel wakes it
+  int sleep_cancellable;
+  // How deep the thread is in steps of a primitive taken with interrupts
+  // enabled, during which it does not act on a cancellation when preempted
+  volatile int cancel_deferred;
+  // The cleanup handlers pushed, the last one on top
+  CleanupHandler cleanup[THREAD_CLEANUP_MAX];
+  int cleanup_count;
+  // While the thread runs tasks, where the rest of its batch is, so that it
+  // can be handed to another worker should a task block, and whether one did
+  struct task** tasks;
+  int task_promoted;
+  // Free task records the thread took for TaskSpawn
+  struct task* task_cache;
+} TCB;
+
+/**
+ * A stack of THREAD_SHARED_STACK_SIZE bytes that threads created with
+ * ThreadCreateShared take turns running on.
+ */
+typedef struct shared_stack
+{
+  char* base;
+  // The thread whose stack is on it, or NULL
+  TCB* owner;
+  // The threads assigned to it
+  int threads;
+} SharedStack;
+
+/**
+ * The record of what a thread waits for on one wait queue, owned by the
+ * blocked thread and attached to its node.
+ */
+typedef struct waiter
+{
+  // A channel message to send, or where to store the message received
+  void* elem;
+  // Set by the thread that completes the wait: 0 or an error code
+  int status;
+  // The select this wait is one case of, or NULL
+  struct select_state* select;
+  // The index of that case
+  int index;
+  // The size of elem, for stack_waiters_to_heap
+  size_t size;
+} Waiter;
+
+/**
+ * The Node in a Queue.
+ */
+typedef struct node
+{
+  // The waiting thread, or NULL for an asynchronous wait, whose waiter is that
+  // of an Await
+  TCB* thread;
+  // What the thread waits for, or NULL
+  Waiter* waiter;
+  struct node* next;
+  struct node* prev;
+} node;
+
+/**
+ * A wait queue.
+ */
+typedef struct wait_queue_t
+{
+  node* head;
+  // The last node, valid only while head is not NULL
+  node* tail;
+} WaitQueue;
+
+// Current Running Thread
+extern TCB* running_thread;
+
+// Static Global Array of Threads
+extern TCB threads[MAX_THREADS];
+
+// Ready Queue of Threads
+extern WaitQueue rq;
+
+// Static Global Array of Waiting Queues
+extern WaitQueue wait_queues[MAX_THREADS];
+
+/**
+ * @return A timestamp for scheduler accounting: the time stamp counter where
+ * there is one, which is much cheaper to read than any clock_gettime.
+ */
+static inline long long
+stats_clock(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+  return (long long)__builtin_ia32_rdtsc();
+#else
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (long long)now.tv_sec * 1000000000 + now.tv_nsec;
+#endif
+}
+
+// Counters for ThreadGetGlobalStats, idle in stats_clock ticks
+extern long stats_voluntary_switches;
+extern long stats_preempted_switches;
+extern long stats_wakeups;
+extern long long stats_idle;
+
+// Set by the preemption signal handler while it yields
+extern int stats_preempting;
+
+/**
+ * Start accounting for a thread created at now.
+ */
+void
+stats_start(TCB* thread, long long now);
+
+/**
+ * Account for switching from the running thread to next, which is about to
+ * run.
+ *
+ * @pre interrupts are disabled
+ */
+void
+stats_switch(TCB* next);
+
+/**
+ * @return ticks of stats_clock in nanoseconds, where now is the current time.
+ */
+long long
+stats_ns(long long ticks, long long now);
+
+// Whether ThreadTraceStart is recording events
+extern int trace_enabled;
+
+/**
+ * Append a record of event to the trace ring.
+ *
+ * @pre interrupts are disabled
+ */
+void
+trace_append(long long now, ThreadTraceEvent event, int tid, int arg);
+
+/**
+ * Record event at now if tracing is on. When it is off, this is one branch.
+ *
+ * @pre interrupts are disabled
+ */
+static inline void
+trace_event_at(long long now, ThreadTraceEvent event, int tid, int arg)
+{
+  if (__builtin_expect(trace_enabled, 0)) {
+    trace_append(now, event, tid, arg);
+  }
+}
+
+/**
+ * Record event if tracing is on.
+ *
+ * @pre interrupts are disabled
+ */
+static inline void
+trace_event(ThreadTraceEvent event, int tid, int arg)
+{
+  if (__builtin_expect(trace_enabled, 0)) {
+    trace_append(stats_clock(), event, tid, arg);
+  }
+}
+
+/**
+ * Account for the running thread waking thread up at now.
+ */
+static inline void
+stats_wakeup(TCB* thread, long long now)
+{
+  thread->acct.ready_since = now;
+  thread->acct.wakeups++;
+  stats_wakeups++;
+  trace_event_at(
+    now, THREAD_TRACE_WAKE, running_thread->thread_id, thread->thread_id);
+}
+
+/**
+ * Exit the running thread, which was cancelled, with EXIT_CODE_KILL.
+ */
+void
+cancel_exit(void);
+
+/**
+ * Exit the running thread if it was cancelled, unless it is between the steps
+ * of a primitive. Otherwise, this is one branch.
+ */
+static inline void
+cancel_point(void)
+{
+  if (__builtin_expect(running_thread->cancel == CANCEL_PENDING, 0) &&
+      running_thread->cancel_deferred == 0) {
+    cancel_exit();
+  }
+}
+
+/**
+ * Keep the running thread from acting on a cancellation when preempted, until
+ * the matching cancel_resume. Primitives whose fast paths take several atomic
+ * steps with interrupts enabled call it, so that no primitive is left half
+ * acquired or released. These nest.
+ */
+static inline void
+cancel_defer(void)
+{
+  running_thread->cancel_deferred++;
+}
+
+/**
+ * Undo a cancel_defer. A pending cancellation is acted on at the next
+ * cancellation point.
+ */
+static inline void
+cancel_resume(void)
+{
+  running_thread->cancel_deferred--;
+}
+
+/**
+ * Pop and call every cleanup handler of the running thread, which is exiting.
+ */
+void
+cleanup_run(void);
+
+/**
+ * Hand the rest of the batch of tasks thread is running to another worker,
+ * as the current task is about to block, creating that worker if need be.
+ *
+ * @pre interrupts are disabled and thread->tasks is not NULL
+ */
+void
+task_blocking(TCB* thread);
+
+/**
+ * Return the free task records thread holds, as it is exiting.
+ */
+void
+task_release(TCB* thread);
+
+/**
+ * Run the destructors of thread's values for the keys, and free what holds
+ * them, leaving every value NULL.
+ */
+void
+specific_release(TCB* thread);
+
+/**
+ * Free every allocation from thread's arena, returning its chunks to the pool.
+ *
+ * @pre interrupts are disabled
+ */
+void
+bump_release(TCB* thread);
+
+/**
+ * @return The size of stack to allocate for a thread running f, with reserved
+ * bytes taken at its top. In THREAD_STACK_LEARN mode, it is at least twice
+ * reserved, up to THREAD_STACK_SIZE.
+ */
+size_t
+stack_size_for(void (*f)(void*), size_t reserved);
+
+/**
+ * Allocate a stack of size bytes, from a slot of the arena ThreadSetStackArena
+ * selected if there is one, or from the heap.
+ *
+ * @pre interrupts are disabled
+ *
+ * @return The lowest address of the stack, or NULL if out of memory.
+ */
+void*
+arena_alloc(size_t size);
+
+/**
+ * Free a stack allocated by arena_alloc.
+ *
+ * @pre interrupts are disabled
+ */
+void
+arena_free(void* stack);
+
+/**
+ * Fill the freshly allocated stack of thread with the canary pattern if the
+ * stack mode calls for it.
+ */
+void
+stack_paint(TCB* thread);
+
+/**
+ * @return The most stack the thread has used, in bytes.
+ *
+ * @pre the thread's stack is painted
+ */
+long
+stack_measure(const TCB* thread);
+
+/**
+ * Record how much stack thread used against its function, before the stack is
+ * freed.
+ *
+ * @pre interrupts are disabled
+ */
+void
+stack_retire(TCB* thread);
+
+/**
+ * Assign thread, which is being created, to the shared stack with the fewest
+ * threads, setting its sp and stack_size to the whole of that stack.
+ *
+ * @pre interrupts are disabled
+ *
+ * @return 0 if successful, ERROR_SYS_MEM if the stack could not be allocated,
+ * or ERROR_OTHER.
+ */
+int
+stack_share(TCB* thread);
+
+/**
+ * Free the stack of thread, which has exited or been killed, after recording
+ * its use with stack_retire.
+ *
+ * @pre interrupts are disabled
+ */
+void
+stack_free(TCB* thread);
+
+/**
+ * Resume next, which has just been made running_thread, from its saved
+ * context. If next runs on a shared stack that holds another thread's stack,
+ * that stack is copied out and next's copied back in first, from a stack that
+ * is not shared.
+ *
+ * @pre interrupts are disabled
+ *
+ * @return Only if the context could not be restored, -1.
+ */
+int
+stack_switch(TCB* next);
+
+/**
+ * Copy count waiters, and the size bytes at each one's elem, to the heap, for
+ * a thread on a shared stack about to wait: other threads use them while its
+ * stack is copied out.
+ *
+ * @return The copies, pointing to the copied elems, or NULL if out of memory.
+ */
+Waiter*
+stack_waiters_to_heap(const Waiter* waiters, int count);
+
+/**
+ * Copy the outcome of a wait from the copies made by stack_waiters_to_heap
+ * back to waiters and their elems, and free the copies.
+ */
+void
+stack_waiters_from_heap(Waiter* waiters, Waiter* copies, int count);
+
+/**
+ * Add thread to the tail of queue.
+ */
+void
+insert_into_queue(WaitQueue* queue, TCB* thread);
+
+/**
+ * Add thread to the tail of queue with the record of what it waits for.
+ *
+ * @return The node holding thread, for unlink_node.
+ */
+node*
+enqueue_waiter(WaitQueue* queue, TCB* thread, Waiter* waiter);
+
+/**
+ * Remove thread_node from queue in constant time and free it.
+ */
+void
+unlink_node(WaitQueue* queue, node* thread_node);
+
+/**
+ * Dequeue the thread at the head of queue.
+ *
+ * @pre queue is not empty
+ */
+TCB*
+extract_from_queue(WaitQueue* queue);
+
+/**
+ * Remove the thread with thread ID tid from queue, if present.
+ */
+void
+remove_from_queue(WaitQueue* queue, Tid tid);
+
+/**
+ * Dequeue the thread at the head of queue and move it to the ready queue. A
+ * thread woken out of a select is removed from its other queues as well.
+ *
+ * @return The woken thread, or NULL if queue was empty.
+ */
+TCB*
+wake_first(WaitQueue* queue);
+
+/**
+ * Move every thread in src to the tail of dst in one splice, leaving src
+ * empty. Threads moved to the ready queue become READY, all others become
+ * BLOCKED on dst.
+ *
+ * @return The number of threads moved.
+ */
+int
+splice_queue(WaitQueue* dst, WaitQueue* src);
+
+/**
+ * Suspend the running thread, which the caller has marked BLOCKED and placed on
+ * the queues it waits on, and run the next ready thread. While no thread is
+ * ready but timers are armed, wait for the earliest of them.
+ *
+ * @pre interrupts are disabled
+ *
+ * @return The identifier of the thread that ran once the caller is woken up.
+ * Otherwise, ERROR_SYS_THREAD if no thread can become ready, in which case the
+ * caller is still on its queues.
+ */
+int
+thread_block(void);
+
+/**
+ * ThreadYieldTo, without acting on a cancellation, for waits inside the
+ * library.
+ */
+int
+thread_yield_to(Tid tid);
+
+/**
+ * Like ThreadSleep, attaching waiter to the calling thread's node in queue. On
+ * a shared stack, waiter is moved to the heap for the wait, which fails with
+ * ERROR_SYS_MEM if it cannot be.
+ *
+ * @pre interrupts are disabled
+ */
+int
+sleep_with_waiter(WaitQueue* queue, Waiter* waiter);
+
+/**
+ * A one-shot timer, owned by the caller while armed.
+ */
+typedef struct timer
+{
+  // Expiry time, in microseconds on the timer_now clock
+  long long deadline;
+  // Called with interrupts disabled once the deadline has passed
+  void (*fire)(struct timer* timer);
+  struct timer* next;
+  // The pointer to this timer in the list, so it can be cancelled in O(1)
+  struct timer** link;
+} Timer;
+
+/**
+ * @return The current time in microseconds on a monotonic clock.
+ */
+long long
+timer_now(void);
+
+/**
+ * Arm timer, which must not already be armed. This walks the armed timers to
+ * keep them sorted by deadline.
+ *
+ * @pre interrupts are disabled
+ */
+void
+timer_add(Timer* timer);
+
+/**
+ * Disarm timer in constant time.
+ *
+ * @pre interrupts are disabled and timer is armed
+ */
+void
+timer_cancel(Timer* timer);
+
+/**
+ * Fire every timer whose deadline has passed. This is a single branch when no
+ * timer is armed.
+ *
+ * @pre interrupts are disabled
+ */
+void
+timers_expire(void);
+
+/**
+ * Wait until the earliest armed timer's deadline, or until a file descriptor
+ * threads wait on becomes ready, and fire the expired timers.
+ *
+ * @pre interrupts are disabled
+ *
+ * @return 1 if a timer was armed or a thread waits on a file descriptor, 0
+ * otherwise.
+ */
+int
+timers_wait(void);
+
+/**
+ * Wake the threads waiting on file descriptors that are ready, and poll every
+ * poll source, waiting up to timeout microseconds for a descriptor or source
+ * to be ready, or without a limit if timeout is negative. The wait is skipped
+ * once a thread is ready. This is a single branch when nothing is being
+ * polled.
+ *
+ * @pre interrupts are disabled
+ *
+ * @return 1 if anything was polled, 0 otherwise.
+ */
+int
+fds_poll(long long timeout);
+
+/**
+ * A descriptor polled on the library's own behalf, such as the completion
+ * queue of an asynchronous I/O backend.
+ */
+typedef struct poll_source
+{
+  int fd;
+  // Submit queued work and complete finished work, with interrupts disabled.
+  // signalled is 1 when fd was reported readable, 0 on every other poll.
+  void (*poll)(struct poll_source* source, int signalled);
+} PollSource;
+
+// Number of operations outstanding on poll sources. Sources are polled at
+// every scheduler tick while it is positive.
+extern int poll_busy;
+
+/**
+ * Register source, whose descriptor is then watched for readability.
+ *
+ * @pre interrupts are disabled
+ *
+ * @return 0 if successful, ERROR_SYS_MEM otherwise.
+ */
+int
+poll_source_add(PollSource* source);
+
+/**
+ * Record the exit code of thread, which is exiting or being killed, in its wait
+ * group and count it done.
+ *
+ * @pre interrupts are disabled and thread->group is not NULL
+ */
+void
+wait_group_exited(TCB* thread);
+
+/**
+ * A thread suspended until an operation completes outside of any user thread,
+ * e.g. in the kernel or on a helper thread, typically on the thread's stack.
+ */
+typedef struct async_wait
+{
+  TCB* thread;
+  WaitQueue waiters;
+  int completed;
+} AsyncWait;
+
+/**
+ * Mark the running thread as waiting for an operation about to be started.
+ * Until async_complete, the thread's stack outlives the thread.
+ *
+ * @pre interrupts are disabled
+ */
+void
+async_begin(AsyncWait* wait);
+
+/**
+ * Suspend the running thread until the operation completes.
+ *
+ * @pre interrupts are disabled
+ */
+void
+async_wait(AsyncWait* wait);
+
+/**
+ * Complete the operation, waking its thread unless it was killed. wait may be
+ * freed with the thread's stack as soon as this returns.
+ *
+ * @pre interrupts are disabled
+ */
+void
+async_complete(AsyncWait* wait);
+
+/**
+ * Work run on a helper kernel thread, for operations that would otherwise
+ * block the kernel thread all user threads share.
+ */
+typedef struct pool_job
+{
+  // Run on a helper thread, which must not touch the library's state
+  void (*run)(struct pool_job* job);
+  // Run by the scheduler, with interrupts disabled, once run has returned
+  void (*done)(struct pool_job* job);
+  struct pool_job* next;
+  // When the job was submitted, started and finished, on the timer_now clock
+  long long submitted_at;
+  long long started_at;
+  long long finished_at;
+} PoolJob;
+
+/**
+ * Queue job for the helper threads, starting them on first use. Jobs queued
+ * between two scheduler ticks are handed over together.
+ *
+ * @pre interrupts are disabled
+ *
+ * @return 0 if successful, ERROR_SYS_MEM if the helper threads could not be
+ * started.
+ */
+int
+pool_submit(PoolJob* job);
+
+/**
+ * Contention statistics shared by the primitives created at one call site, or
+ * given one name by ThreadProfileSetName. Times are in stats_clock ticks.
+ */
+typedef struct profile_site
+{
+  const char* kind;
+  // The return address of the create call, or NULL for a named site
+  const void* caller;
+  const char* name;
+  long acquisitions;
+  long contended;
+  long long total_wait;
+  long long max_wait;
+  // Total wait by each thread slot
+  long long thread_wait[MAX_THREADS];
+} ProfileSite;
+
+/**
+ * @return The site for a primitive of the given kind created by caller, or
+ * NULL if the profiler is off or has no room for another site.
+ */
+ProfileSite*
+profile_site(const char* kind, const void* caller);
+
+// Set by the profiler's report signal, for the next yield to write the report
+extern volatile sig_atomic_t profile_dump_pending;
+
+/**
+ * Write the report the profiler's report signal asked for, if any. The signal
+ * handler only sets a flag, as it may interrupt the profiler itself.
+ *
+ * @pre interrupts are disabled
+ */
+static inline void
+profile_poll(void)
+{
+  if (__builtin_expect(profile_dump_pending, 0)) {
+    profile_dump_pending = 0;
+    ThreadProfileDump(STDERR_FILENO);
+  }
+}
+
+/**
+ * Count an acquisition that did not wait. Off the profiler, this is one
+ * branch.
+ */
+static inline void
+profile_acquired(ProfileSite* site)
+{
+  if (__builtin_expect(site != NULL, 0)) {
+    __sync_fetch_and_add(&site->acquisitions, 1);
+  }
+}
+
+/**
+ * @return The time a wait on a primitive with site started, or 0 if it is not
+ * profiled.
+ */
+static inline long long
+profile_wait_start(ProfileSite* site)
+{
+  return __builtin_expect(site != NULL, 0) ? stats_clock() : 0;
+}
+
+/**
+ * Count an acquisition by the running thread that waited since start.
+ *
+ * @pre site is not NULL
+ */
+void
+profile_record_wait(ProfileSite* site, long long start);
+
+/**
+ * Count an acquisition by the running thread that waited since start, if the
+ * primitive with site is profiled.
+ */
+static inline void
+profile_waited(ProfileSite* site, long long start)
+{
+  if (__builtin_expect(site != NULL, 0)) {
+    profile_record_wait(site, start);
+  }
+}
+
+/**
+ * The values of a mutex's lock word.
+ */
+typedef enum
+{
+  MUTEX_UNLOCKED = 0,
+  MUTEX_LOCKED = 1,
+  // Locked, and the wait queue may be non-empty
+  MUTEX_CONTENDED = 2
+} MutexState;
+
+/**
+ * Tid stored as the owner of a mutex no thread holds.
+ */
+#define MUTEX_NO_OWNER -1
+
+/**
+ * A mutex.
+ */
+typedef struct thread_mutex_t
+{
+  // Every profiled primitive starts with its site, so that
+  // ThreadProfileSetName can find it
+  ProfileSite* site;
+  volatile int state;
+  volatile Tid owner;
+  WaitQueue* waiters;
+} ThreadMutex;
+
+/**
+ * Release a mutex owned by the running thread, handing it to the first waiter
+ * if there is one.
+ *
+ * @pre interrupts are disabled
+ */
+void
+mutex_release(ThreadMutex* mutex);
+
+/**
+ * Make thread the owner of mutex if it is unlocked, moving thread to the ready
+ * queue. Otherwise, enqueue thread on the mutex's wait queue so that it
+ * receives the mutex on a later release.
+ *
+ * @pre interrupts are disabled and thread is not on any queue
+ */
+void
+mutex_requeue(ThreadMutex* mutex, TCB* thread);
+
+/**
+ * A channel.
+ */
+typedef struct thread_chan_t
+{
+  ProfileSite* site;
+  int elem_size;
+  int capacity;
+  // Ring buffer of capacity messages, count of them starting at head
+  char* buffer;
+  int head;
+  int count;
+  int closed;
+  WaitQueue* senders;
+  WaitQueue* receivers;
+} ThreadChan;
+
+/**
+ * Send the message at elem if that can be done without blocking.
+ *
+ * @pre interrupts are disabled
+ *
+ * @return 0 if sent, ERROR_CLOSED if the channel is closed, or ERROR_OTHER if
+ * the sender would have to wait.
+ */
+int
+chan_try_send(ThreadChan* chan, const void* elem);
+
+/**
+ * Receive a message into elem if that can be done without blocking.
+ *
+ * @pre interrupts are disabled
+ *
+ * @return 0 if received, ERROR_CLOSED if the channel is closed and empty, or
+ * ERROR_OTHER if the receiver would have to wait.
+ */
+int
+chan_try_recv(ThreadChan* chan, void* elem);
+
+/**
+ * The case index recorded when a select's timer fires.
+ */
+#define SELECT_TIMED_OUT -1
+
+/**
+ * The state of a thread blocked waiting on several queues at once, on its
+ * stack.
+ */
+typedef struct select_state
+{
+  TCB* thread;
+  int count;
+  // The record, queue and node of each case, so that every case can be
+  // removed in O(1) once one of them fires
+  Waiter* waiters;
+  WaitQueue** queues;
+  node** nodes;
+  Timer timer;
+  int timer_armed;
+  // The case that completed, or SELECT_TIMED_OUT
+  int fired;
+  // What the caller allocated for the select, or NULL. A killed thread never
+  // returns from the select to free it, so select_cancel does
+  void* owned;
+  // Whether the state and its waiters were moved to the heap, for a thread on
+  // a shared stack
+  int on_heap;
+} SelectState;
+
+/**
+ * Enqueue the running thread on each of select's count queues, with the
+ * matching waiter, and block until one of them wakes it or timeout
+ * microseconds pass. The caller fills in count, waiters[i].elem, queues and
+ * provides room for nodes.
+ *
+ * @pre interrupts are disabled
+ *
+ * @return The index of the case that fired, ERROR_TIMEOUT, ERROR_SYS_THREAD
+ * if no thread can become ready, or ERROR_SYS_MEM if the calling thread is on
+ * a shared stack and its wait could not be moved to the heap.
+ */
+int
+select_block(SelectState* select, int timeout);
+
+/**
+ * Complete the select that waiter belongs to with waiter's case: remove the
+ * selecting thread from all its queues and disarm its timer in constant time
+ * per case, then move it to the ready queue.
+ *
+ * @pre interrupts are disabled
+ */
+void
+select_fire(Waiter* waiter);
+
+/**
+ * Abandon the select thread is blocked in without waking it, because it was
+ * killed, and free what the select owns.
+ *
+ * @pre interrupts are disabled
+ */
+void
+select_cancel(TCB* thread);
+
+/**
+ * A wait with no thread behind it, queued by ThreadSleepAsync and the like.
+ * Once woken, its callback is run as a task.
+ */
+typedef struct await
+{
+  Waiter waiter;
+  void (*resume)(void* arg, int status);
+  void* arg;
+  // The thread joined, whose exit code becomes the status, or -1
+  Tid joined;
+  // The events awaited on a descriptor, which waiter.elem points to
+  int events;
+} Await;
+
+/**
+ * @return A wait that calls resume with arg once woken, or NULL if out of
+ * memory.
+ *
+ * @pre interrupts are disabled
+ */
+Await*
+await_new(void (*resume)(void* arg, int status), void* arg);
+
+/**
+ * Complete the asynchronous wait whose waiter is waiter, spawning the task
+ * that calls its callback. Its node must already be unlinked.
+ *
+ * @pre interrupts are disabled
+ */
+void
+await_fire(Waiter* waiter);
+
+/**
+ * Complete every asynchronous wait in awaits, leaving it empty. The status of
+ * each is taken before any of their tasks is spawned.
+ *
+ * @pre interrupts are disabled
+ */
+void
+await_fire_all(WaitQueue* awaits);
+
+#endif /* THREAD_PRIVATE_H */
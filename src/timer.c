@@ -0,0 +1,84 @@
+#include <assert.h>
+#include <errno.h>
+#include <stddef.h>
+#include <time.h>
+
+#include "interrupts.h"
+#include "thread_private.h"
+
+// Armed timers, soonest deadline first
+static Timer* timers = NULL;
+
+long long
+timer_now(void)
+{
+  struct timespec now;
+  int const ret = clock_gettime(CLOCK_MONOTONIC, &now);
+  assert(!ret);
+  return (long long)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+void
+timer_add(Timer* timer)
+{
+  Timer** link = &timers;
+  while (*link != NULL && (*link)->deadline <= timer->deadline) {
+    link = &(*link)->next;
+  }
+  timer->next = *link;
+  if (timer->next != NULL) {
+    timer->next->link = &timer->next;
+  }
+  timer->link = link;
+  *link = timer;
+}
+
+void
+timer_cancel(Timer* timer)
+{
+  *timer->link = timer->next;
+  if (timer->next != NULL) {
+    timer->next->link = timer->link;
+  }
+}
+
+void
+timers_expire(void)
+{
+  if (timers == NULL) {
+    return;
+  }
+  long long const now = timer_now();
+  while (timers != NULL && timers->deadline <= now) {
+    Timer* expired = timers;
+    timers = expired->next;
+    if (timers != NULL) {
+      timers->link = &timers;
+    }
+    expired->fire(expired);
+  }
+}
+
+int
+timers_wait(void)
+{
+  // Only called with no thread to run, so all of this is idle time
+  long long const idle_start = stats_clock();
+  if (timers == NULL) {
+    int const busy = fds_poll(-1);
+    stats_idle += stats_clock() - idle_start;
+    return busy;
+  }
+
+  long long const delay = timers->deadline - timer_now();
+  if (!fds_poll(delay > 0 ? delay : 0) && delay > 0) {
+    struct timespec request = { delay / 1000000, (delay % 1000000) * 1000 };
+    // A preemption signal stays pending while interrupts are disabled, so
+    // this sleep is only ever cut short by other signals
+    while (nanosleep(&request, &request) == -1 && errno == EINTR)
+      ;
+  }
+  stats_idle += stats_clock() - idle_start;
+  timers_expire();
+  return 1;
+}
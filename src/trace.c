@@ -0,0 +1,97 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "interrupts.h"
+#include "thread.h"
+#include "thread_private.h"
+
+// Records in the chunks ThreadTraceDump converts and writes
+#define TRACE_DUMP_CHUNK 256
+
+int trace_enabled = 0;
+
+// The ring, with times in stats_clock ticks rather than nanoseconds
+static ThreadTraceRecord* trace_ring = NULL;
+static unsigned long trace_mask = 0;
+// Records appended since the trace started; the next one goes to
+// trace_ring[trace_next & trace_mask]
+static unsigned long trace_next = 0;
+static long long trace_started_at = 0;
+
+void
+trace_append(long long now, ThreadTraceEvent event, int tid, int arg)
+{
+  // Records are only appended with interrupts disabled, on the one kernel
+  // thread that runs the scheduler, so reserving a slot needs no atomics
+  ThreadTraceRecord* record = &trace_ring[trace_next++ & trace_mask];
+  record->time = (uint64_t)(now - trace_started_at);
+  record->event = (uint16_t)event;
+  record->tid = (uint16_t)tid;
+  record->arg = arg;
+}
+
+int
+ThreadTraceStart(int capacity)
+{
+  if (capacity <= 0) {
+    return ERROR_OTHER;
+  }
+  unsigned long size = 1;
+  while (size < (unsigned long)capacity) {
+    size <<= 1;
+  }
+  ThreadTraceRecord* ring = malloc(size * sizeof(ThreadTraceRecord));
+  if (ring == NULL) {
+    return ERROR_SYS_MEM;
+  }
+
+  InterruptsState enabled = InterruptsDisable();
+  free(trace_ring);
+  trace_ring = ring;
+  trace_mask = size - 1;
+  trace_next = 0;
+  trace_started_at = stats_clock();
+  trace_enabled = 1;
+  InterruptsSet(enabled);
+  return 0;
+}
+
+void
+ThreadTraceStop(void)
+{
+  InterruptsState enabled = InterruptsDisable();
+  trace_enabled = 0;
+  InterruptsSet(enabled);
+}
+
+int
+ThreadTraceDump(int fd)
+{
+  InterruptsState enabled = InterruptsDisable();
+  if (trace_ring == NULL) {
+    InterruptsSet(enabled);
+    return ERROR_OTHER;
+  }
+
+  unsigned long const first =
+    trace_next > trace_mask + 1 ? trace_next - (trace_mask + 1) : 0;
+  long long const now = stats_clock();
+  ThreadTraceRecord chunk[TRACE_DUMP_CHUNK];
+  int written = 0;
+  for (unsigned long i = first; i < trace_next;) {
+    int n = 0;
+    for (; n < TRACE_DUMP_CHUNK && i < trace_next; n++, i++) {
+      chunk[n] = trace_ring[i & trace_mask];
+      chunk[n].time = stats_ns(chunk[n].time, now);
+    }
+    size_t const size = n * sizeof(ThreadTraceRecord);
+    if (write(fd, chunk, size) != (ssize_t)size) {
+      InterruptsSet(enabled);
+      return ERROR_OTHER;
+    }
+    written += n;
+  }
+  InterruptsSet(enabled);
+  return written;
+}
@@ -0,0 +1,233 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "interrupts.h"
+#include "thread.h"
+#include "thread_private.h"
+
+/**
+ * A wait group.
+ */
+typedef struct thread_wait_group_t
+{
+  int count;
+  WaitQueue* waiters;
+  // Threads added to the group that have not exited yet
+  int members;
+  // Exit records of member threads not yet collected, in exit order. Room for
+  // one record per member is reserved when it is added, so exiting never
+  // allocates.
+  Tid* tids;
+  int* exit_codes;
+  int exited;
+  int capacity;
+} ThreadWaitGroup;
+
+ThreadWaitGroup*
+ThreadWaitGroupCreate(void)
+{
+  ThreadWaitGroup* wg = malloc(sizeof(ThreadWaitGroup));
+  if (wg == NULL) {
+    return NULL;
+  }
+  wg->waiters = WaitQueueCreate();
+  if (wg->waiters == NULL) {
+    free(wg);
+    return NULL;
+  }
+  wg->count = 0;
+  wg->members = 0;
+  wg->tids = NULL;
+  wg->exit_codes = NULL;
+  wg->exited = 0;
+  wg->capacity = 0;
+  return wg;
+}
+
+int
+ThreadWaitGroupDestroy(ThreadWaitGroup* wg)
+{
+  assert(wg != NULL);
+  InterruptsState enabled = InterruptsDisable();
+  if (wg->waiters->head != NULL || wg->members > 0) {
+    InterruptsSet(enabled);
+    return ERROR_OTHER;
+  }
+  WaitQueueDestroy(wg->waiters);
+  free(wg->tids);
+  free(wg->exit_codes);
+  free(wg);
+  InterruptsSet(enabled);
+  return 0;
+}
+
+/**
+ * Add delta to the count, waking every waiter if it reaches zero.
+ *
+ * @pre interrupts are disabled
+ */
+static int
+wait_group_add(ThreadWaitGroup* wg, int delta)
+{
+  if (wg->count + delta < 0) {
+    return ERROR_OTHER;
+  }
+  wg->count += delta;
+  if (wg->count > 0 || wg->waiters->head == NULL) {
+    return 0;
+  }
+  return splice_queue(&rq, wg->waiters);
+}
+
+int
+ThreadWaitGroupAdd(ThreadWaitGroup* wg, int delta)
+{
+  assert(wg != NULL);
+  InterruptsState enabled = InterruptsDisable();
+  int const ret = wait_group_add(wg, delta);
+  InterruptsSet(enabled);
+  return ret;
+}
+
+int
+ThreadWaitGroupDone(ThreadWaitGroup* wg)
+{
+  return ThreadWaitGroupAdd(wg, -1);
+}
+
+/**
+ * Make room for one more exit record.
+ *
+ * @pre interrupts are disabled
+ *
+ * @return 1 if successful, 0 if out of memory.
+ */
+static int
+wait_group_reserve(ThreadWaitGroup* wg)
+{
+  int const needed = wg->exited + wg->members + 1;
+  if (needed <= wg->capacity) {
+    return 1;
+  }
+  int const capacity = wg->capacity == 0 ? 16 : 2 * wg->capacity;
+  Tid* tids = realloc(wg->tids, capacity * sizeof(Tid));
+  if (tids == NULL) {
+    return 0;
+  }
+  wg->tids = tids;
+  int* exit_codes = realloc(wg->exit_codes, capacity * sizeof(int));
+  if (exit_codes == NULL) {
+    return 0;
+  }
+  wg->exit_codes = exit_codes;
+  wg->capacity = capacity;
+  return 1;
+}
+
+/**
+ * Make thread a member of the wait group.
+ *
+ * @pre interrupts are disabled
+ */
+static int
+wait_group_join(ThreadWaitGroup* wg, TCB* thread)
+{
+  if (thread->group != NULL) {
+    return ERROR_OTHER;
+  }
+  if (!wait_group_reserve(wg)) {
+    return ERROR_SYS_MEM;
+  }
+  thread->group = wg;
+  wg->members++;
+  wg->count++;
+  return 0;
+}
+
+Tid
+ThreadWaitGroupSpawn(ThreadWaitGroup* wg, void (*f)(void*), void* arg)
+{
+  assert(wg != NULL);
+  InterruptsState enabled = InterruptsDisable();
+  // Reserve first, so the new thread never has to be taken back
+  if (!wait_group_reserve(wg)) {
+    InterruptsSet(enabled);
+    return ERROR_SYS_MEM;
+  }
+  // Interrupts stay disabled, so the thread cannot run, let alone exit, before
+  // it joins the group
+  Tid const tid = ThreadCreate(f, arg);
+  if (tid >= 0) {
+    wait_group_join(wg, &threads[tid]);
+  }
+  InterruptsSet(enabled);
+  return tid;
+}
+
+int
+ThreadWaitGroupAddThread(ThreadWaitGroup* wg, Tid tid)
+{
+  assert(wg != NULL);
+  if (tid < 0 || tid >= MAX_THREADS) {
+    return ERROR_TID_INVALID;
+  }
+
+  InterruptsState enabled = InterruptsDisable();
+  State const state = threads[tid].state;
+  if (state == EMPTY || state == KILLED || state == EXITED) {
+    InterruptsSet(enabled);
+    return ERROR_SYS_THREAD;
+  }
+  int const ret = wait_group_join(wg, &threads[tid]);
+  InterruptsSet(enabled);
+  return ret;
+}
+
+void
+wait_group_exited(TCB* thread)
+{
+  ThreadWaitGroup* wg = thread->group;
+  thread->group = NULL;
+  wg->members--;
+  wg->tids[wg->exited] = thread->thread_id;
+  wg->exit_codes[wg->exited] = thread->exit_code;
+  wg->exited++;
+  wait_group_add(wg, -1);
+}
+
+int
+ThreadWaitGroupWait(ThreadWaitGroup* wg)
+{
+  assert(wg != NULL);
+  InterruptsState enabled = InterruptsDisable();
+  if (wg->count == 0) {
+    InterruptsSet(enabled);
+    return 0;
+  }
+  int const ret = sleep_with_waiter(wg->waiters, NULL);
+  InterruptsSet(enabled);
+  return ret < 0 ? ret : 0;
+}
+
+int
+ThreadWaitGroupExitCodes(ThreadWaitGroup* wg,
+                         Tid* tids,
+                         int* exit_codes,
+                         int max)
+{
+  assert(wg != NULL);
+  assert(tids != NULL);
+  assert(exit_codes != NULL);
+  InterruptsState enabled = InterruptsDisable();
+  int const n = max < wg->exited ? max : wg->exited;
+  if (n > 0) {
+    memcpy(tids, wg->tids, n * sizeof(Tid));
+    memcpy(exit_codes, wg->exit_codes, n * sizeof(int));
+    wg->exited -= n;
+    memmove(wg->tids, wg->tids + n, wg->exited * sizeof(Tid));
+    memmove(wg->exit_codes, wg->exit_codes + n, wg->exited * sizeof(int));
+  }
+  InterruptsSet(enabled);
+  return n;
+}
@@ -0,0 +1,2351 @@
+#include "check.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <malloc.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "interrupts.h"
+#include "thread.h"
+
+// Number of threads used by the contention tests
+#define WORKER_COUNT 8
+// Number of critical sections each worker runs
+#define WORKER_ITERATIONS 50
+
+// Shared state for the functions passed to ThreadCreate
+ThreadMutex* mutex;
+ThreadCond* cond;
+ThreadSem* sem;
+ThreadRWLock* rwlock;
+ThreadBarrier* barrier;
+ThreadLatch* latch;
+ThreadChan* chan;
+WaitQueue* queue;
+ThreadFuture* future;
+volatile int in_critical_section;
+volatile int readers_inside;
+volatile long counter;
+volatile int ready;
+int pipe_fds[2];
+int file_fd;
+
+// Functions to pass to ThreadCreate
+void
+f_lock_and_count(void)
+{
+  for (int i = 0; i < WORKER_ITERATIONS; i++) {
+    ck_assert_int_eq(ThreadMutexLock(mutex), 0);
+    ck_assert_int_eq(in_critical_section, 0);
+    in_critical_section = 1;
+
+    // Hold the lock across a preemption
+    ThreadSpin(INTERRUPTS_SIGNAL_INTERVAL / 4);
+    counter++;
+
+    in_critical_section = 0;
+    ck_assert_int_eq(ThreadMutexUnlock(mutex), 0);
+  }
+}
+
+void
+f_unlock_unowned(void)
+{
+  ck_assert_int_eq(ThreadMutexUnlock(mutex), ERROR_THREAD_BAD);
+}
+
+void
+f_wait_for_ready(void)
+{
+  ck_assert_int_eq(ThreadMutexLock(mutex), 0);
+  while (!ready) {
+    ck_assert_int_eq(ThreadCondWait(cond, mutex), 0);
+  }
+  ck_assert_int_eq(in_critical_section, 0);
+  counter++;
+  ck_assert_int_eq(ThreadMutexUnlock(mutex), 0);
+}
+
+void
+f_sem_wait(void)
+{
+  ck_assert_int_eq(ThreadSemWait(sem), 0);
+  counter++;
+}
+
+void
+f_read_lock(void)
+{
+  ck_assert_int_eq(ThreadRWLockReadLock(rwlock), 0);
+  counter++;
+  ck_assert_int_eq(ThreadRWLockReadUnlock(rwlock), 0);
+}
+
+void
+f_read_contend(void)
+{
+  for (int i = 0; i < WORKER_ITERATIONS; i++) {
+    ck_assert_int_eq(ThreadRWLockReadLock(rwlock), 0);
+    __sync_fetch_and_add(&readers_inside, 1);
+    ck_assert_int_eq(in_critical_section, 0);
+    ThreadSpin(INTERRUPTS_SIGNAL_INTERVAL / 8);
+    ck_assert_int_eq(in_critical_section, 0);
+    __sync_fetch_and_sub(&readers_inside, 1);
+    ck_assert_int_eq(ThreadRWLockReadUnlock(rwlock), 0);
+  }
+}
+
+void
+f_write_contend(void)
+{
+  for (int i = 0; i < WORKER_ITERATIONS; i++) {
+    ck_assert_int_eq(ThreadRWLockWriteLock(rwlock), 0);
+    ck_assert_int_eq(in_critical_section, 0);
+    ck_assert_int_eq(readers_inside, 0);
+    in_critical_section = 1;
+
+    // Hold the lock across a preemption
+    ThreadSpin(INTERRUPTS_SIGNAL_INTERVAL / 4);
+    ck_assert_int_eq(readers_inside, 0);
+    counter++;
+
+    in_critical_section = 0;
+    ck_assert_int_eq(ThreadRWLockWriteUnlock(rwlock), 0);
+  }
+}
+
+void
+f_write_lock(void)
+{
+  ck_assert_int_eq(ThreadRWLockWriteLock(rwlock), 0);
+  ck_assert_int_eq(counter, 0);
+  in_critical_section = 1;
+  ThreadYield();
+  in_critical_section = 0;
+  ck_assert_int_eq(ThreadRWLockWriteUnlock(rwlock), 0);
+}
+
+void
+f_barrier_phases(void)
+{
+  for (int phase = 0; phase < WORKER_ITERATIONS; phase++) {
+    // Nobody may start this phase before everyone finished the previous one
+    ck_assert_int_ge(counter, phase * WORKER_COUNT);
+    ck_assert_int_lt(counter, (phase + 1) * WORKER_COUNT);
+    __sync_fetch_and_add(&counter, 1);
+    ck_assert_int_ge(ThreadBarrierWait(barrier), 0);
+  }
+}
+
+void
+f_latch_wait(void)
+{
+  ck_assert_int_eq(ThreadLatchWait(latch), 0);
+  __sync_fetch_and_add(&counter, 1);
+}
+
+void
+f_chan_send_all(void)
+{
+  for (long i = 0; i < WORKER_ITERATIONS; i++) {
+    ck_assert_int_eq(ThreadChanSend(chan, &i), 0);
+  }
+  ck_assert_int_eq(ThreadChanClose(chan), 0);
+}
+
+void
+f_chan_recv_closed(void)
+{
+  long message;
+  ck_assert_int_eq(ThreadChanRecv(chan, &message), ERROR_CLOSED);
+  counter++;
+}
+
+void
+f_select_chan_or_wake(void)
+{
+  long message;
+  ThreadSelectCase cases[2] = {
+    { THREAD_SELECT_RECV, chan, NULL, &message, 0 },
+    { THREAD_SELECT_WAKE, NULL, queue, NULL, 0 },
+  };
+  ck_assert_int_eq(ThreadSelect(cases, 2, THREAD_SELECT_FOREVER), 1);
+  ck_assert_int_eq(cases[1].result, 0);
+  counter++;
+}
+
+// Functions to run before/after every test
+/**
+ * Run f without being preempted until it first blocks.
+ */
+void
+f_unpreempted(void (*f)(void))
+{
+  InterruptsDisable();
+  f();
+}
+
+/**
+ * Create a thread running f and switch to it, so that it has blocked by the
+ * time this returns. Preemption is kept off until then, since a tick in
+ * between would let the thread block before ThreadYieldTo, or let this
+ * thread run on before the other one blocks.
+ */
+Tid
+create_and_park(void (*f)(void))
+{
+  InterruptsState enabled = InterruptsDisable();
+  Tid const tid = ThreadCreate((void (*)(void*))f_unpreempted, (void*)f);
+  ck_assert_int_gt(tid, 0);
+  ck_assert_int_eq(ThreadYieldTo(tid), tid);
+  InterruptsSet(enabled);
+  return tid;
+}
+
+void
+f_sleep_then_exit(long exit_code)
+{
+  // Park and exit without being preempted, so that workers exit in the order
+  // they are woken
+  InterruptsDisable();
+  ready++;
+  ThreadSleep(queue);
+  ThreadExit((int)exit_code);
+}
+
+void
+f_join_any(const Tid* tids)
+{
+  Tid which;
+  int exit_value;
+  // Killed while it waits, so this never returns
+  ThreadJoinAny(tids, WORKER_COUNT, &which, &exit_value);
+}
+
+void
+f_wait_readable(void)
+{
+  // Park without being preempted, so every reader counted in ready is waiting
+  InterruptsDisable();
+  ready++;
+  char c;
+  while (read(pipe_fds[0], &c, 1) != 1) {
+    ck_assert_int_eq(
+      ThreadWaitFd(pipe_fds[0], THREAD_FD_READ, THREAD_SELECT_FOREVER),
+      THREAD_FD_READ);
+  }
+  counter++;
+}
+
+void
+f_read_block(long block)
+{
+  char buf[64], expected[64];
+  memset(expected, 'a' + block, sizeof(expected));
+  ck_assert_int_eq(ThreadRead(file_fd, buf, sizeof(buf), block * sizeof(buf)),
+                   sizeof(buf));
+  ck_assert(memcmp(buf, expected, sizeof(buf)) == 0);
+  counter++;
+}
+
+void
+f_count_until_ready(void)
+{
+  while (!ready) {
+    counter++;
+    ThreadYield();
+  }
+}
+
+/**
+ * Offloaded: record the kernel thread it runs on and block it for a while.
+ */
+void
+f_blocking_call(long* tid)
+{
+  *tid = syscall(SYS_gettid);
+  usleep(20000);
+}
+
+void
+f_park_then_spin(void)
+{
+  InterruptsDisable();
+  ready = 1;
+  ThreadSemWait(sem);
+  InterruptsEnable();
+  ThreadSpin(2000);
+}
+
+/**
+ * Use at least bytes of stack, then wait for the semaphore.
+ */
+void
+f_use_stack(long bytes)
+{
+  char buf[bytes];
+  memset(buf, 1, bytes);
+  // Keep the buffer from being optimized away
+  __asm__ volatile("" : : "r"(buf) : "memory");
+  ready++;
+  ThreadSemWait(sem);
+}
+
+void
+f_spin(void)
+{
+  ThreadSpin(10000);
+}
+
+// Keys for the thread-local storage tests, the second past the inline ones
+ThreadKey inline_key;
+ThreadKey overflow_key;
+volatile long destroyed;
+
+void
+destroy_value(void* value)
+{
+  destroyed += (long)value;
+}
+
+/**
+ * Set both keys to values of its own, check they are unaffected by other
+ * threads doing the same, then wait for the semaphore.
+ */
+void
+f_set_specific(long id)
+{
+  ck_assert(ThreadGetSpecific(inline_key) == NULL);
+  ck_assert(ThreadGetSpecific(overflow_key) == NULL);
+  ck_assert_int_eq(ThreadSetSpecific(inline_key, (void*)id), 0);
+  ck_assert_int_eq(ThreadSetSpecific(overflow_key, (void*)(id * 100)), 0);
+  ThreadYield();
+  ck_assert(ThreadGetSpecific(inline_key) == (void*)id);
+  ck_assert(ThreadGetSpecific(overflow_key) == (void*)(id * 100));
+  ready++;
+  ThreadSemWait(sem);
+}
+
+// The first allocation from each arena thread's arena
+void* volatile first_allocated;
+
+/**
+ * Allocate from the arena, fill what was allocated, then check it was left
+ * alone while yielding, and record the first allocation.
+ */
+void
+f_arena_alloc(long count)
+{
+  long* allocated[64] = { NULL };
+  for (long i = 0; i < count; i++) {
+    allocated[i] = ThreadArenaAlloc(1000);
+    ck_assert(allocated[i] != NULL);
+    ck_assert_int_eq((uintptr_t)allocated[i] % _Alignof(max_align_t), 0);
+    for (int j = 0; j < 1000 / (int)sizeof(long); j++) {
+      allocated[i][j] = i;
+    }
+  }
+  first_allocated = allocated[0];
+  ready++;
+  ThreadYield();
+  for (long i = 0; i < count; i++) {
+    for (int j = 0; j < 1000 / (int)sizeof(long); j++) {
+      ck_assert_int_eq(allocated[i][j], i);
+    }
+  }
+  ThreadSemWait(sem);
+}
+
+/**
+ * Shift a digit into counter, recording the order handlers ran in.
+ */
+void
+record_cleanup(long digit)
+{
+  counter = counter * 10 + digit;
+}
+
+void
+unlock_mutex(void* unused)
+{
+  (void)unused;
+  ck_assert_int_eq(ThreadMutexUnlock(mutex), 0);
+}
+
+/**
+ * Push handlers, one of them popped unrun, then take the mutex and sleep
+ * until cancelled.
+ */
+void
+f_cancel_sleeping(void)
+{
+  ck_assert_int_eq(
+    ThreadCleanupPush((void (*)(void*))record_cleanup, (void*)1), 0);
+  ck_assert_int_eq(
+    ThreadCleanupPush((void (*)(void*))record_cleanup, (void*)2), 0);
+  ck_assert_int_eq(
+    ThreadCleanupPush((void (*)(void*))record_cleanup, (void*)9), 0);
+  ck_assert_int_eq(ThreadCleanupPop(0), 0);
+  ck_assert_int_eq(ThreadMutexLock(mutex), 0);
+  ck_assert_int_eq(ThreadCleanupPush(unlock_mutex, NULL), 0);
+  ready = 1;
+  ThreadSleep(queue);
+  ck_assert_msg(0, "This thread should have exited.");
+}
+
+void
+f_cancel_running(long yield)
+{
+  ck_assert_int_eq(
+    ThreadCleanupPush((void (*)(void*))record_cleanup, (void*)3), 0);
+  ready = 1;
+  while (1) {
+    if (yield) {
+      ThreadYield();
+    }
+  }
+}
+
+/**
+ * Count, then yield, in a critical section entered without a cancellation
+ * point in between.
+ */
+void
+f_cancel_locked(void)
+{
+  InterruptsDisable();
+  ck_assert_int_eq(ThreadMutexLock(mutex), 0);
+  counter++;
+  ck_assert_int_eq(ThreadMutexUnlock(mutex), 0);
+  InterruptsEnable();
+  while (1) {
+    ThreadYield();
+  }
+}
+
+/**
+ * A cleanup handler: release whichever of the mutex and the write lock the
+ * cancelled thread holds.
+ */
+void
+unlock_all(void* unused)
+{
+  (void)unused;
+  ThreadMutexUnlock(mutex);
+  ThreadRWLockWriteUnlock(rwlock);
+}
+
+/**
+ * Take and release the mutex and the write lock until cancelled, which only
+ * preemption can act on.
+ */
+void
+f_cancel_lock_loop(void)
+{
+  ck_assert_int_eq(ThreadCleanupPush(unlock_all, NULL), 0);
+  ready = 1;
+  while (1) {
+    ck_assert_int_eq(ThreadMutexLock(mutex), 0);
+    ck_assert_int_eq(ThreadMutexUnlock(mutex), 0);
+    ck_assert_int_eq(ThreadRWLockWriteLock(rwlock), 0);
+    ck_assert_int_eq(ThreadRWLockWriteUnlock(rwlock), 0);
+  }
+}
+
+/**
+ * Sleep on the queue, then record that this thread ran, as digit 1.
+ */
+void
+f_sleep_then_record(void)
+{
+  ThreadSleep(queue);
+  counter = counter * 10 + 1;
+}
+
+/**
+ * Wait for the semaphore, then record that this thread ran, as digit 2.
+ */
+void
+f_sem_then_record(void)
+{
+  ck_assert_int_eq(ThreadSemWait(sem), 0);
+  counter = counter * 10 + 2;
+}
+
+/**
+ * Check that the tasks before this one ran, in order, and count this one.
+ */
+void
+t_count_in_order(void* index)
+{
+  ck_assert_int_eq(counter, (long)index);
+  ck_assert_int_eq(TaskWaitAll(), ERROR_THREAD_BAD);
+  counter++;
+}
+
+void
+t_sem_wait(void* unused)
+{
+  (void)unused;
+  ck_assert_int_eq(ThreadSemWait(sem), 0);
+  counter += 100;
+}
+
+void
+t_count(void* unused)
+{
+  (void)unused;
+  counter++;
+}
+
+void
+t_spawn_count(void* unused)
+{
+  (void)unused;
+  ck_assert_int_eq(TaskSpawn(t_count, NULL), 0);
+  counter++;
+}
+
+/**
+ * Fill in the data of a thread created with ThreadCreateInPlace.
+ */
+void
+init_in_place(void* data, void* value)
+{
+  *(long*)data = (long)value;
+}
+
+void
+f_in_place(void* data)
+{
+  // The data is at the top of this thread's own stack
+  long here;
+  ck_assert((char*)data > (char*)&here);
+  ck_assert_int_eq((uintptr_t)data % 16, 0);
+  counter += *(long*)data;
+}
+
+/**
+ * The callback of an asynchronous wait: append its digit to counter and keep
+ * its status in ready.
+ */
+void
+a_record(void* digit, int status)
+{
+  counter = counter * 10 + (long)digit;
+  ready = status;
+}
+
+void
+f_future_get(void)
+{
+  long value;
+  ck_assert_int_eq(ThreadFutureGet(future, &value), 0);
+  counter += value;
+}
+
+void
+f_future_broken(void)
+{
+  ck_assert_int_eq(ThreadFutureGet(future, NULL), ERROR_CLOSED);
+  counter++;
+}
+
+/**
+ * A continuation: add arg to the value, and count the call in counter.
+ */
+void
+then_add(void* arg, const void* in, void* out)
+{
+  *(long*)out = *(const long*)in + (long)arg;
+  counter++;
+}
+
+/**
+ * Fill a buffer on the stack with a pattern of its own, and check that it
+ * survives switches to threads that share the stack, voluntary and preempted.
+ */
+void
+f_check_shared_stack(long id)
+{
+  char buf[2048];
+  memset(buf, (int)id, sizeof(buf));
+  for (int i = 0; i < 20; i++) {
+    ThreadYield();
+    ThreadSpin(300);
+    for (size_t j = 0; j < sizeof(buf); j++) {
+      ck_assert_int_eq(buf[j], (char)id);
+    }
+  }
+  counter++;
+}
+
+/**
+ * Receive a message into a local, wait on the pipe and for a select to time
+ * out, then send back twice the message from another local.
+ */
+void
+f_shared_echo(void)
+{
+  long message;
+  ck_assert_int_eq(ThreadChanRecv(chan, &message), 0);
+  ck_assert_int_eq(
+    ThreadWaitFd(pipe_fds[0], THREAD_FD_READ, THREAD_SELECT_FOREVER),
+    THREAD_FD_READ);
+  long unused;
+  ThreadSelectCase never = { .op = THREAD_SELECT_RECV,
+                             .chan = chan,
+                             .elem = &unused };
+  ck_assert_int_eq(ThreadSelect(&never, 1, 1000), ERROR_TIMEOUT);
+  long const reply = message * 2;
+  ck_assert_int_eq(ThreadChanSend(chan, &reply), 0);
+}
+
+void
+set_up(void)
+{
+  ck_assert_int_eq(ThreadInit(), 0);
+  InterruptsInit();
+  mutex = ThreadMutexCreate();
+  ck_assert(mutex != NULL);
+  cond = ThreadCondCreate();
+  ck_assert(cond != NULL);
+  sem = ThreadSemCreate(0);
+  ck_assert(sem != NULL);
+  rwlock = ThreadRWLockCreate();
+  ck_assert(rwlock != NULL);
+  barrier = ThreadBarrierCreate(WORKER_COUNT);
+  ck_assert(barrier != NULL);
+  latch = ThreadLatchCreate(2);
+  ck_assert(latch != NULL);
+  chan = ThreadChanCreate(sizeof(long), 0);
+  ck_assert(chan != NULL);
+  queue = WaitQueueCreate();
+  ck_assert(queue != NULL);
+  in_critical_section = 0;
+  readers_inside = 0;
+  counter = 0;
+  ready = 0;
+}
+
+void
+tear_down(void)
+{}
+
+
+START_TEST(test_mutex_lock_unlock)
+{
+  ck_assert_int_eq(ThreadMutexLock(mutex), 0);
+  ck_assert_int_eq(ThreadMutexLock(mutex), ERROR_THREAD_BAD);
+  ck_assert_int_eq(ThreadMutexTryLock(mutex), ERROR_OTHER);
+  ck_assert_int_eq(ThreadMutexDestroy(mutex), ERROR_OTHER);
+  ck_assert_int_eq(ThreadMutexUnlock(mutex), 0);
+  ck_assert_int_eq(ThreadMutexUnlock(mutex), ERROR_THREAD_BAD);
+
+  ck_assert_int_eq(ThreadMutexTryLock(mutex), 0);
+  ck_assert_int_eq(ThreadMutexUnlock(mutex), 0);
+  ck_assert_int_eq(ThreadMutexDestroy(mutex), 0);
+}
+END_TEST
+
+START_TEST(test_mutex_unlock_by_non_owner)
+{
+  ck_assert_int_eq(ThreadMutexLock(mutex), 0);
+
+  Tid const tid = ThreadCreate((void (*)(void*))f_unlock_unowned, NULL);
+  ck_assert_int_gt(tid, 0);
+
+  int exit_value;
+  ck_assert_int_eq(ThreadJoin(tid, &exit_value), tid);
+  ck_assert_int_eq(ThreadMutexUnlock(mutex), 0);
+}
+END_TEST
+
+START_TEST(test_mutex_mutual_exclusion)
+{
+  Tid tids[WORKER_COUNT];
+  for (int i = 0; i < WORKER_COUNT; i++) {
+    tids[i] = ThreadCreate((void (*)(void*))f_lock_and_count, NULL);
+    ck_assert_int_gt(tids[i], 0);
+  }
+
+  // Workers that already exited cannot be joined
+  for (int i = 0; i < WORKER_COUNT; i++) {
+    int exit_value;
+    ThreadJoin(tids[i], &exit_value);
+  }
+
+  ck_assert_int_eq(counter, WORKER_COUNT * WORKER_ITERATIONS);
+  ck_assert_int_eq(ThreadMutexDestroy(mutex), 0);
+}
+END_TEST
+
+START_TEST(test_cond_wait_without_mutex)
+{
+  ck_assert_int_eq(ThreadCondWait(cond, mutex), ERROR_THREAD_BAD);
+  ck_assert_int_eq(ThreadCondSignal(cond), 0);
+  ck_assert_int_eq(ThreadCondBroadcast(cond), 0);
+  ck_assert_int_eq(ThreadCondDestroy(cond), 0);
+}
+END_TEST
+
+START_TEST(test_cond_signal)
+{
+  Tid const tid = create_and_park(f_wait_for_ready);
+  ck_assert_int_eq(ThreadCondDestroy(cond), ERROR_OTHER);
+
+  ck_assert_int_eq(ThreadMutexLock(mutex), 0);
+  ready = 1;
+  ck_assert_int_eq(ThreadCondSignal(cond), 1);
+  // The waiter cannot run until we release the mutex
+  in_critical_section = 1;
+  ThreadSpin(INTERRUPTS_SIGNAL_INTERVAL * 2);
+  ck_assert_int_eq(counter, 0);
+  in_critical_section = 0;
+  ck_assert_int_eq(ThreadMutexUnlock(mutex), 0);
+
+  int exit_value;
+  ThreadJoin(tid, &exit_value);
+  ck_assert_int_eq(counter, 1);
+  ck_assert_int_eq(ThreadCondDestroy(cond), 0);
+}
+END_TEST
+
+START_TEST(test_cond_broadcast)
+{
+  Tid tids[WORKER_COUNT];
+  for (int i = 0; i < WORKER_COUNT; i++) {
+    tids[i] = create_and_park(f_wait_for_ready);
+  }
+
+  ck_assert_int_eq(ThreadMutexLock(mutex), 0);
+  ready = 1;
+  ck_assert_int_eq(ThreadCondBroadcast(cond), WORKER_COUNT);
+  ck_assert_int_eq(ThreadMutexUnlock(mutex), 0);
+
+  for (int i = 0; i < WORKER_COUNT; i++) {
+    int exit_value;
+    ThreadJoin(tids[i], &exit_value);
+  }
+  ck_assert_int_eq(counter, WORKER_COUNT);
+  ck_assert_int_eq(ThreadMutexDestroy(mutex), 0);
+}
+END_TEST
+
+START_TEST(test_sem_count)
+{
+  ThreadSem* two = ThreadSemCreate(2);
+  ck_assert(two != NULL);
+  ck_assert_int_eq(ThreadSemTryWait(two), 0);
+  ck_assert_int_eq(ThreadSemWait(two), 0);
+  ck_assert_int_eq(ThreadSemTryWait(two), ERROR_OTHER);
+  ck_assert_int_eq(ThreadSemWait(two), ERROR_SYS_THREAD);
+  ck_assert_int_eq(ThreadSemPost(two), 0);
+  ck_assert_int_eq(ThreadSemTryWait(two), 0);
+  ck_assert_int_eq(ThreadSemDestroy(two), 0);
+}
+END_TEST
+
+START_TEST(test_sem_post_wakes_waiters)
+{
+  Tid tids[WORKER_COUNT];
+  for (int i = 0; i < WORKER_COUNT; i++) {
+    tids[i] = ThreadCreate((void (*)(void*))f_sem_wait, NULL);
+    ck_assert_int_gt(tids[i], 0);
+  }
+  ThreadSpin(INTERRUPTS_SIGNAL_INTERVAL * 4);
+  ck_assert_int_eq(counter, 0);
+
+  for (int i = 0; i < WORKER_COUNT; i++) {
+    ThreadSemPost(sem);
+  }
+  for (int i = 0; i < WORKER_COUNT; i++) {
+    int exit_value;
+    ThreadJoin(tids[i], &exit_value);
+  }
+  ck_assert_int_eq(counter, WORKER_COUNT);
+  ck_assert_int_eq(ThreadSemDestroy(sem), 0);
+}
+END_TEST
+
+START_TEST(test_rwlock_shared_readers)
+{
+  ck_assert_int_eq(ThreadRWLockReadLock(rwlock), 0);
+  ck_assert_int_eq(ThreadRWLockReadLock(rwlock), 0);
+  ck_assert_int_eq(ThreadRWLockDestroy(rwlock), ERROR_OTHER);
+
+  Tid const tid = ThreadCreate((void (*)(void*))f_read_lock, NULL);
+  ck_assert_int_gt(tid, 0);
+  int exit_value;
+  ck_assert_int_eq(ThreadJoin(tid, &exit_value), tid);
+  ck_assert_int_eq(counter, 1);
+
+  ck_assert_int_eq(ThreadRWLockReadUnlock(rwlock), 0);
+  ck_assert_int_eq(ThreadRWLockReadUnlock(rwlock), 0);
+  ck_assert_int_eq(ThreadRWLockWriteUnlock(rwlock), ERROR_THREAD_BAD);
+  ck_assert_int_eq(ThreadRWLockWriteLock(rwlock), 0);
+  ck_assert_int_eq(ThreadRWLockWriteLock(rwlock), ERROR_THREAD_BAD);
+  ck_assert_int_eq(ThreadRWLockWriteUnlock(rwlock), 0);
+  ck_assert_int_eq(ThreadRWLockDestroy(rwlock), 0);
+}
+END_TEST
+
+START_TEST(test_rwlock_writer_preference)
+{
+  ck_assert_int_eq(ThreadRWLockReadLock(rwlock), 0);
+
+  // The writer queues behind our read lock
+  Tid const writer = create_and_park(f_write_lock);
+
+  // Readers arriving now queue behind the writer
+  Tid readers[WORKER_COUNT];
+  for (int i = 0; i < WORKER_COUNT; i++) {
+    readers[i] = create_and_park(f_read_lock);
+  }
+  ck_assert_int_eq(counter, 0);
+
+  ck_assert_int_eq(ThreadRWLockReadUnlock(rwlock), 0);
+  int exit_value;
+  ThreadJoin(writer, &exit_value);
+  for (int i = 0; i < WORKER_COUNT; i++) {
+    ThreadJoin(readers[i], &exit_value);
+  }
+  ck_assert_int_eq(counter, WORKER_COUNT);
+  ck_assert_int_eq(ThreadRWLockDestroy(rwlock), 0);
+}
+END_TEST
+
+START_TEST(test_rwlock_mutual_exclusion)
+{
+  // Writers are preempted both inside the lock and on their way in and out,
+  // while readers and other writers contend for it
+  Tid tids[2 * WORKER_COUNT];
+  for (int i = 0; i < 2 * WORKER_COUNT; i++) {
+    tids[i] = ThreadCreate(
+      (void (*)(void*))(i % 2 == 0 ? f_write_contend : f_read_contend), NULL);
+    ck_assert_int_gt(tids[i], 0);
+  }
+  for (int i = 0; i < 2 * WORKER_COUNT; i++) {
+    int exit_value;
+    ThreadJoin(tids[i], &exit_value);
+  }
+  ck_assert_int_eq(counter, WORKER_COUNT * WORKER_ITERATIONS);
+  ck_assert_int_eq(ThreadRWLockDestroy(rwlock), 0);
+}
+END_TEST
+
+START_TEST(test_barrier_phases)
+{
+  Tid tids[WORKER_COUNT];
+  for (int i = 0; i < WORKER_COUNT; i++) {
+    tids[i] = ThreadCreate((void (*)(void*))f_barrier_phases, NULL);
+    ck_assert_int_gt(tids[i], 0);
+  }
+  for (int i = 0; i < WORKER_COUNT; i++) {
+    int exit_value;
+    ThreadJoin(tids[i], &exit_value);
+  }
+  ck_assert_int_eq(counter, WORKER_COUNT * WORKER_ITERATIONS);
+  ck_assert_int_eq(ThreadBarrierDestroy(barrier), 0);
+}
+END_TEST
+
+START_TEST(test_barrier_serial)
+{
+  ThreadBarrier* single = ThreadBarrierCreate(1);
+  ck_assert(single != NULL);
+  ck_assert_int_eq(ThreadBarrierWait(single), THREAD_BARRIER_SERIAL);
+  ck_assert_int_eq(ThreadBarrierWait(single), THREAD_BARRIER_SERIAL);
+  ck_assert_int_eq(ThreadBarrierDestroy(single), 0);
+
+  ck_assert_int_eq(ThreadBarrierWait(barrier), ERROR_SYS_THREAD);
+}
+END_TEST
+
+START_TEST(test_latch_count_down)
+{
+  Tid tids[WORKER_COUNT];
+  for (int i = 0; i < WORKER_COUNT; i++) {
+    tids[i] = create_and_park(f_latch_wait);
+  }
+  ck_assert_int_eq(ThreadLatchDestroy(latch), ERROR_OTHER);
+
+  ck_assert_int_eq(ThreadLatchCountDown(latch), 0);
+  ck_assert_int_eq(counter, 0);
+  ck_assert_int_eq(ThreadLatchCountDown(latch), WORKER_COUNT);
+  ck_assert_int_eq(ThreadLatchCountDown(latch), 0);
+
+  for (int i = 0; i < WORKER_COUNT; i++) {
+    int exit_value;
+    ThreadJoin(tids[i], &exit_value);
+  }
+  ck_assert_int_eq(counter, WORKER_COUNT);
+  ck_assert_int_eq(ThreadLatchWait(latch), 0);
+  ck_assert_int_eq(ThreadLatchDestroy(latch), 0);
+}
+END_TEST
+
+START_TEST(test_chan_unbuffered_in_order)
+{
+  Tid const tid = ThreadCreate((void (*)(void*))f_chan_send_all, NULL);
+  ck_assert_int_gt(tid, 0);
+
+  long message;
+  for (long i = 0; i < WORKER_ITERATIONS; i++) {
+    ck_assert_int_eq(ThreadChanRecv(chan, &message), 0);
+    ck_assert_int_eq(message, i);
+  }
+  ck_assert_int_eq(ThreadChanRecv(chan, &message), ERROR_CLOSED);
+  ck_assert_int_eq(ThreadChanSend(chan, &message), ERROR_CLOSED);
+  ck_assert_int_eq(ThreadChanClose(chan), ERROR_CLOSED);
+  ck_assert_int_eq(ThreadChanDestroy(chan), 0);
+}
+END_TEST
+
+START_TEST(test_chan_buffered)
+{
+  ThreadChan* buffered = ThreadChanCreate(sizeof(int), 2);
+  ck_assert(buffered != NULL);
+
+  int message = 1;
+  ck_assert_int_eq(ThreadChanSend(buffered, &message), 0);
+  message = 2;
+  ck_assert_int_eq(ThreadChanSend(buffered, &message), 0);
+  // The buffer is full and nothing else can run
+  ck_assert_int_eq(ThreadChanSend(buffered, &message), ERROR_SYS_THREAD);
+
+  ck_assert_int_eq(ThreadChanClose(buffered), 0);
+  ck_assert_int_eq(ThreadChanRecv(buffered, &message), 0);
+  ck_assert_int_eq(message, 1);
+  ck_assert_int_eq(ThreadChanRecv(buffered, &message), 0);
+  ck_assert_int_eq(message, 2);
+  ck_assert_int_eq(ThreadChanRecv(buffered, &message), ERROR_CLOSED);
+  ck_assert_int_eq(ThreadChanDestroy(buffered), 0);
+}
+END_TEST
+
+START_TEST(test_chan_close_wakes_receivers)
+{
+  Tid tids[WORKER_COUNT];
+  for (int i = 0; i < WORKER_COUNT; i++) {
+    tids[i] = create_and_park(f_chan_recv_closed);
+  }
+  ck_assert_int_eq(ThreadChanDestroy(chan), ERROR_OTHER);
+  ck_assert_int_eq(ThreadChanClose(chan), 0);
+
+  for (int i = 0; i < WORKER_COUNT; i++) {
+    int exit_value;
+    ThreadJoin(tids[i], &exit_value);
+  }
+  ck_assert_int_eq(counter, WORKER_COUNT);
+  ck_assert_int_eq(ThreadChanDestroy(chan), 0);
+}
+END_TEST
+
+START_TEST(test_select_ready_case)
+{
+  ThreadChan* buffered = ThreadChanCreate(sizeof(long), 1);
+  ck_assert(buffered != NULL);
+
+  long in = 42, out = 0;
+  ThreadSelectCase cases[2] = {
+    { THREAD_SELECT_RECV, chan, NULL, &out, 0 },
+    { THREAD_SELECT_RECV, buffered, NULL, &out, 0 },
+  };
+  ck_assert_int_eq(ThreadSelect(cases, 2, 0), ERROR_TIMEOUT);
+  ck_assert_int_eq(ThreadSelect(cases, 0, 0), ERROR_OTHER);
+
+  ck_assert_int_eq(ThreadChanSend(buffered, &in), 0);
+  ck_assert_int_eq(ThreadSelect(cases, 2, THREAD_SELECT_FOREVER), 1);
+  ck_assert_int_eq(cases[1].result, 0);
+  ck_assert_int_eq(out, 42);
+
+  ck_assert_int_eq(ThreadChanClose(chan), 0);
+  ck_assert_int_eq(ThreadSelect(cases, 2, THREAD_SELECT_FOREVER), 0);
+  ck_assert_int_eq(cases[0].result, ERROR_CLOSED);
+  ck_assert_int_eq(ThreadChanDestroy(buffered), 0);
+}
+END_TEST
+
+START_TEST(test_select_timeout)
+{
+  long out;
+  ThreadSelectCase cases[2] = {
+    { THREAD_SELECT_RECV, chan, NULL, &out, 0 },
+    { THREAD_SELECT_WAKE, NULL, queue, NULL, 0 },
+  };
+  struct timeval start, end, diff;
+  gettimeofday(&start, NULL);
+  // Nothing else can run, so the thread idles until the deadline
+  ck_assert_int_eq(ThreadSelect(cases, 2, 2000), ERROR_TIMEOUT);
+  gettimeofday(&end, NULL);
+  timersub(&end, &start, &diff);
+  ck_assert_int_ge(diff.tv_sec * 1000000 + diff.tv_usec, 2000);
+
+  // Both cases were cancelled
+  ck_assert_int_eq(ThreadChanDestroy(chan), 0);
+  ck_assert_int_eq(WaitQueueDestroy(queue), 0);
+}
+END_TEST
+
+START_TEST(test_select_first_source_wins)
+{
+  Tid tids[WORKER_COUNT];
+  for (int i = 0; i < WORKER_COUNT; i++) {
+    tids[i] = create_and_park(f_select_chan_or_wake);
+  }
+
+  ck_assert_int_eq(ThreadWakeAll(queue), WORKER_COUNT);
+  // No selecting thread is left waiting on the channel
+  ck_assert_int_eq(ThreadChanDestroy(chan), 0);
+
+  for (int i = 0; i < WORKER_COUNT; i++) {
+    int exit_value;
+    ThreadJoin(tids[i], &exit_value);
+  }
+  ck_assert_int_eq(counter, WORKER_COUNT);
+}
+END_TEST
+
+START_TEST(test_join_any)
+{
+  Tid tids[WORKER_COUNT];
+  for (long i = 0; i < WORKER_COUNT; i++) {
+    tids[i] = ThreadCreate((void (*)(void*))f_sleep_then_exit, (void*)(100 + i));
+    ck_assert_int_gt(tids[i], 0);
+  }
+  while (ready < WORKER_COUNT) {
+    ThreadYield();
+  }
+
+  Tid which;
+  int exit_value;
+  ck_assert_int_eq(ThreadJoinAny(tids, 0, &which, &exit_value), ERROR_OTHER);
+  Tid const bad[2] = { tids[0], ThreadId() };
+  ck_assert_int_eq(ThreadJoinAny(bad, 2, &which, &exit_value),
+                   ERROR_THREAD_BAD);
+
+  // Each wake lets exactly one worker exit, in FIFO order. Wake and join
+  // without being preempted, so the worker cannot exit before we join it.
+  for (int i = 0; i < WORKER_COUNT; i++) {
+    InterruptsState enabled = InterruptsDisable();
+    ck_assert_int_eq(ThreadWakeNext(queue), 1);
+    ck_assert_int_eq(ThreadJoinAny(tids, WORKER_COUNT, &which, &exit_value), i);
+    InterruptsSet(enabled);
+    ck_assert_int_eq(which, tids[i]);
+    ck_assert_int_eq(exit_value, 100 + i);
+  }
+  ck_assert_int_eq(ThreadJoinAny(tids, WORKER_COUNT, &which, &exit_value),
+                   ERROR_SYS_THREAD);
+}
+END_TEST
+
+START_TEST(test_join_any_killed)
+{
+  Tid tids[WORKER_COUNT];
+  for (long i = 0; i < WORKER_COUNT; i++) {
+    tids[i] = ThreadCreate((void (*)(void*))f_sleep_then_exit, (void*)i);
+    ck_assert_int_gt(tids[i], 0);
+  }
+  while (ready < WORKER_COUNT) {
+    ThreadYield();
+  }
+
+  // Killing a thread while it waits frees its wait, on its own stack or a
+  // shared one. The first round of each sizes what is kept between rounds
+  int allocated = 0;
+  for (int round = 0; round < 10; round++) {
+    Tid const joiner =
+      round % 2 == 0
+        ? ThreadCreate((void (*)(void*))f_join_any, tids)
+        : ThreadCreateShared((void (*)(void*))f_join_any, tids);
+    ck_assert_int_gt(joiner, 0);
+    ThreadYieldTo(joiner);
+    ck_assert_int_eq(ThreadKill(joiner), joiner);
+    // The killed thread is freed once another thread runs
+    ThreadYield();
+    if (round == 1) {
+      allocated = mallinfo().uordblks;
+    } else if (round > 1) {
+      ck_assert_int_eq(mallinfo().uordblks, allocated);
+    }
+  }
+  ThreadWakeAll(queue);
+  for (int i = 0; i < WORKER_COUNT; i++) {
+    ThreadJoin(tids[i], NULL);
+  }
+}
+END_TEST
+
+START_TEST(test_wait_group_count)
+{
+  ThreadWaitGroup* wg = ThreadWaitGroupCreate();
+  ck_assert(wg != NULL);
+  ck_assert_int_eq(ThreadWaitGroupWait(wg), 0);
+  ck_assert_int_eq(ThreadWaitGroupDone(wg), ERROR_OTHER);
+  ck_assert_int_eq(ThreadWaitGroupAdd(wg, 2), 0);
+  ck_assert_int_eq(ThreadWaitGroupDone(wg), 0);
+  // Nothing else can run
+  ck_assert_int_eq(ThreadWaitGroupWait(wg), ERROR_SYS_THREAD);
+  ck_assert_int_eq(ThreadWaitGroupDone(wg), 0);
+  ck_assert_int_eq(ThreadWaitGroupWait(wg), 0);
+  ck_assert_int_eq(ThreadWaitGroupDestroy(wg), 0);
+}
+END_TEST
+
+START_TEST(test_wait_group_exit_codes)
+{
+  ThreadWaitGroup* wg = ThreadWaitGroupCreate();
+  ck_assert(wg != NULL);
+  Tid tids[WORKER_COUNT];
+  for (long i = 0; i < WORKER_COUNT; i++) {
+    tids[i] = ThreadWaitGroupSpawn(
+      wg, (void (*)(void*))f_sleep_then_exit, (void*)(100 + i));
+    ck_assert_int_gt(tids[i], 0);
+  }
+  while (ready < WORKER_COUNT) {
+    ThreadYield();
+  }
+  ck_assert_int_eq(ThreadWaitGroupAddThread(wg, tids[0]), ERROR_OTHER);
+  ck_assert_int_eq(ThreadWaitGroupDestroy(wg), ERROR_OTHER);
+
+  // A killed member counts as done, with the kill exit code
+  ck_assert_int_eq(ThreadKill(tids[0]), tids[0]);
+  ck_assert_int_eq(ThreadWakeAll(queue), WORKER_COUNT - 1);
+  ck_assert_int_eq(ThreadWaitGroupWait(wg), 0);
+
+  Tid exited[WORKER_COUNT];
+  int exit_values[WORKER_COUNT];
+  ck_assert_int_eq(ThreadWaitGroupExitCodes(wg, exited, exit_values, 1), 1);
+  ck_assert_int_eq(exited[0], tids[0]);
+  ck_assert_int_eq(exit_values[0], EXIT_CODE_KILL);
+  ck_assert_int_eq(
+    ThreadWaitGroupExitCodes(wg, exited, exit_values, WORKER_COUNT),
+    WORKER_COUNT - 1);
+  for (int i = 1; i < WORKER_COUNT; i++) {
+    ck_assert_int_eq(exited[i - 1], tids[i]);
+    ck_assert_int_eq(exit_values[i - 1], 100 + i);
+  }
+  ck_assert_int_eq(ThreadWaitGroupDestroy(wg), 0);
+}
+END_TEST
+
+START_TEST(test_wait_fd_readable)
+{
+  ck_assert_int_eq(pipe2(pipe_fds, O_NONBLOCK), 0);
+  ck_assert_int_eq(ThreadWaitFd(pipe_fds[0], THREAD_FD_READ, 0), ERROR_TIMEOUT);
+  ck_assert_int_eq(ThreadWaitFd(pipe_fds[1], THREAD_FD_WRITE, 0),
+                   THREAD_FD_WRITE);
+  ck_assert_int_eq(ThreadWaitFd(-1, THREAD_FD_READ, 0), ERROR_OTHER);
+
+  Tid tids[WORKER_COUNT];
+  for (int i = 0; i < WORKER_COUNT; i++) {
+    tids[i] = ThreadCreate((void (*)(void*))f_wait_readable, NULL);
+    ck_assert_int_gt(tids[i], 0);
+  }
+  while (ready < WORKER_COUNT) {
+    ThreadYield();
+  }
+  ck_assert_int_eq(counter, 0);
+
+  // Each byte lets one reader through; the others wait again
+  for (int i = 0; i < WORKER_COUNT; i++) {
+    ck_assert_int_eq(write(pipe_fds[1], "x", 1), 1);
+  }
+  for (int i = 0; i < WORKER_COUNT; i++) {
+    int exit_value;
+    ThreadJoin(tids[i], &exit_value);
+  }
+  ck_assert_int_eq(counter, WORKER_COUNT);
+  close(pipe_fds[0]);
+  close(pipe_fds[1]);
+}
+END_TEST
+
+START_TEST(test_wait_fd_timeout)
+{
+  ck_assert_int_eq(pipe2(pipe_fds, O_NONBLOCK), 0);
+  struct timeval start, end, diff;
+  gettimeofday(&start, NULL);
+  // Nothing else can run, so the thread idles in the poller until the deadline
+  ck_assert_int_eq(ThreadWaitFd(pipe_fds[0], THREAD_FD_READ, 2000),
+                   ERROR_TIMEOUT);
+  gettimeofday(&end, NULL);
+  timersub(&end, &start, &diff);
+  ck_assert_int_ge(diff.tv_sec * 1000000 + diff.tv_usec, 2000);
+
+  // Closing the write end hangs up the read end, which makes it ready
+  close(pipe_fds[1]);
+  ck_assert_int_eq(
+    ThreadWaitFd(pipe_fds[0], THREAD_FD_READ, THREAD_SELECT_FOREVER),
+    THREAD_FD_READ);
+  close(pipe_fds[0]);
+}
+END_TEST
+
+/**
+ * Write WORKER_COUNT blocks of 64 bytes to a temporary file, then read them
+ * back with one worker per block and a vectored read.
+ */
+void
+check_file_io(void)
+{
+  char path[] = "/tmp/check_thread_io_XXXXXX";
+  file_fd = mkstemp(path);
+  ck_assert_int_ge(file_fd, 0);
+  unlink(path);
+
+  char block[64];
+  for (int i = 0; i < WORKER_COUNT; i++) {
+    memset(block, 'a' + i, sizeof(block));
+    ck_assert_int_eq(ThreadWrite(file_fd, block, sizeof(block), -1),
+                     sizeof(block));
+  }
+  ck_assert_int_eq(ThreadFsync(file_fd), 0);
+
+  Tid tids[WORKER_COUNT];
+  for (long i = 0; i < WORKER_COUNT; i++) {
+    tids[i] = ThreadCreate((void (*)(void*))f_read_block, (void*)i);
+    ck_assert_int_gt(tids[i], 0);
+  }
+  for (int i = 0; i < WORKER_COUNT; i++) {
+    int exit_value;
+    ThreadJoin(tids[i], &exit_value);
+  }
+  ck_assert_int_eq(counter, WORKER_COUNT);
+
+  // The last 16 bytes of block 1 and the first 32 of block 2
+  char first[16], second[32];
+  struct iovec iov[2] = { { first, sizeof(first) },
+                          { second, sizeof(second) } };
+  ck_assert_int_eq(ThreadReadv(file_fd, iov, 2, 112), 48);
+  ck_assert_int_eq(first[0], 'b');
+  ck_assert_int_eq(first[15], 'b');
+  ck_assert_int_eq(second[0], 'c');
+
+  close(file_fd);
+  ck_assert_int_eq(ThreadRead(file_fd, block, sizeof(block), 0), -1);
+  ck_assert_int_eq(errno, EBADF);
+}
+
+START_TEST(test_file_io)
+{
+  check_file_io();
+}
+END_TEST
+
+START_TEST(test_file_io_helper_threads)
+{
+  setenv("THREAD_IO_BACKEND", "threads", 1);
+  check_file_io();
+}
+END_TEST
+
+START_TEST(test_offload)
+{
+  Tid const tid = ThreadCreate((void (*)(void*))f_count_until_ready, NULL);
+  ck_assert_int_gt(tid, 0);
+
+  long helper = 0;
+  ck_assert_int_eq(ThreadOffload((void (*)(void*))f_blocking_call, &helper), 0);
+  ck_assert_int_ne(helper, 0);
+  ck_assert_int_ne(helper, syscall(SYS_gettid));
+  // The other thread kept running during the call
+  ck_assert_int_gt(counter, 0);
+
+  ready = 1;
+  int exit_value;
+  ThreadJoin(tid, &exit_value);
+
+  ThreadOffloadStats stats;
+  ThreadOffloadGetStats(&stats);
+  ck_assert_int_eq(stats.submitted, 1);
+  ck_assert_int_eq(stats.completed, 1);
+  ck_assert_int_eq(stats.queued, 0);
+  ck_assert_int_eq(stats.running, 0);
+  ck_assert_int_eq(stats.max_queued, 1);
+  ck_assert_int_ge(stats.total_run_us, 20000);
+  ck_assert_int_ge(stats.max_latency_us, stats.total_run_us);
+}
+END_TEST
+
+START_TEST(test_stats_blocked_and_woken)
+{
+  Tid const tid = ThreadCreate((void (*)(void*))f_park_then_spin, NULL);
+  ck_assert_int_gt(tid, 0);
+  while (!ready) {
+    ThreadYield();
+  }
+  // The worker is now blocked on the semaphore
+  ThreadSpin(2000);
+  ck_assert_int_eq(ThreadSemPost(sem), 1);
+
+  ThreadStats stats;
+  ck_assert_int_eq(ThreadGetStats(tid, &stats), 0);
+  ck_assert_int_eq(stats.wakeups, 1);
+  ck_assert_int_ge(stats.voluntary_switches, 1);
+  ck_assert_int_ge(stats.blocked_ns, 1500000);
+  ck_assert_int_gt(stats.stack_high_water, 0);
+  ck_assert_int_lt(stats.stack_high_water, THREAD_STACK_SIZE);
+
+  ck_assert_int_eq(ThreadGetStats(ThreadId(), &stats), 0);
+  ck_assert_int_ge(stats.run_ns, 1500000);
+  ck_assert_int_eq(stats.blocked_ns, 0);
+
+  ck_assert_int_eq(ThreadGetStats(-1, &stats), ERROR_TID_INVALID);
+  ck_assert_int_eq(ThreadGetStats(MAX_THREADS - 1, &stats), ERROR_SYS_THREAD);
+
+  int exit_value;
+  ThreadJoin(tid, &exit_value);
+  ThreadGlobalStats global;
+  ThreadGetGlobalStats(&global);
+  ck_assert_int_ge(global.voluntary_switches, 3);
+  ck_assert_int_ge(global.wakeups, 2);
+}
+END_TEST
+
+START_TEST(test_stats_preempted)
+{
+  Tid tids[2];
+  for (int i = 0; i < 2; i++) {
+    tids[i] = ThreadCreate((void (*)(void*))f_spin, NULL);
+    ck_assert_int_gt(tids[i], 0);
+  }
+  for (int i = 0; i < 2; i++) {
+    int exit_value;
+    ThreadJoin(tids[i], &exit_value);
+  }
+
+  ThreadGlobalStats global;
+  ThreadGetGlobalStats(&global);
+  ck_assert_int_gt(global.preempted_switches, 0);
+  // This thread can be preempted before it joins, so some of the time the
+  // spinners ran may have been spent ready rather than blocked
+  ThreadStats stats;
+  ck_assert_int_eq(ThreadGetStats(ThreadId(), &stats), 0);
+  ck_assert_int_gt(stats.blocked_ns, 0);
+  ck_assert_int_ge(stats.blocked_ns + stats.ready_ns, 10000000);
+}
+END_TEST
+
+/**
+ * Dump the trace to a temporary file and read it back into records.
+ *
+ * @return The number of records read.
+ */
+int
+read_trace(ThreadTraceRecord* records, int max)
+{
+  char path[] = "/tmp/check_thread_trace_XXXXXX";
+  int const fd = mkstemp(path);
+  ck_assert_int_ge(fd, 0);
+  unlink(path);
+  int const count = ThreadTraceDump(fd);
+  ck_assert_int_ge(count, 0);
+  ck_assert_int_le(count, max);
+  ck_assert_int_eq(pread(fd, records, max * sizeof(*records), 0),
+                   count * sizeof(*records));
+  close(fd);
+  return count;
+}
+
+START_TEST(test_trace_create_switch_exit)
+{
+  ThreadTraceRecord records[64];
+  ck_assert_int_eq(ThreadTraceDump(-1), ERROR_OTHER);
+  ck_assert_int_eq(ThreadTraceStart(0), ERROR_OTHER);
+  ck_assert_int_eq(ThreadTraceStart(64), 0);
+
+  Tid const tid = ThreadCreate((void (*)(void*))f_park_then_spin, NULL);
+  ck_assert_int_gt(tid, 0);
+  while (!ready) {
+    ThreadYield();
+  }
+  ck_assert_int_eq(ThreadSemPost(sem), 1);
+  int exit_value;
+  ThreadJoin(tid, &exit_value);
+  ThreadTraceStop();
+  // Nothing is recorded once the trace stops
+  ThreadYield();
+
+  int const count = read_trace(records, 64);
+  ck_assert_int_gt(count, 0);
+  int created = 0, switched_to = 0, slept = 0, woken = 0, joined = 0;
+  int exited = 0;
+  for (int i = 0; i < count; i++) {
+    if (i > 0) {
+      ck_assert(records[i].time >= records[i - 1].time);
+    }
+    switch (records[i].event) {
+      case THREAD_TRACE_CREATE:
+        created += records[i].tid == 0 && records[i].arg == tid;
+        break;
+      case THREAD_TRACE_SWITCH:
+        switched_to += records[i].arg == tid;
+        break;
+      case THREAD_TRACE_SLEEP:
+        slept += records[i].tid == tid;
+        break;
+      case THREAD_TRACE_WAKE:
+        woken += records[i].tid == 0 && records[i].arg == tid;
+        break;
+      case THREAD_TRACE_JOIN:
+        joined += records[i].tid == 0 && records[i].arg == tid;
+        break;
+      case THREAD_TRACE_EXIT:
+        exited += records[i].tid == tid;
+        break;
+    }
+  }
+  ck_assert_int_eq(created, 1);
+  ck_assert_int_ge(switched_to, 1);
+  ck_assert_int_ge(slept, 1);
+  ck_assert_int_ge(woken, 1);
+  ck_assert_int_eq(joined, 1);
+  ck_assert_int_eq(exited, 1);
+  ck_assert_int_eq(read_trace(records, 64), count);
+}
+END_TEST
+
+START_TEST(test_trace_ring_wraps)
+{
+  ThreadTraceRecord records[8];
+  // Rounded up to 8 records
+  ck_assert_int_eq(ThreadTraceStart(5), 0);
+  for (int i = 0; i < 4; i++) {
+    Tid const tid = ThreadCreate((void (*)(void*))f_count_until_ready, NULL);
+    ck_assert_int_gt(tid, 0);
+  }
+  for (int i = 0; i < 100; i++) {
+    ThreadYield();
+  }
+  ThreadTraceStop();
+  ck_assert_int_eq(read_trace(records, 8), 8);
+  // Only the latest records are kept, and the threads were created long ago
+  for (int i = 0; i < 8; i++) {
+    ck_assert_int_ne(records[i].event, THREAD_TRACE_CREATE);
+  }
+  ready = 1;
+}
+END_TEST
+
+/**
+ * Run WORKER_COUNT threads contending for mutex.
+ */
+void
+contend_for_mutex(void)
+{
+  Tid tids[WORKER_COUNT];
+  for (int i = 0; i < WORKER_COUNT; i++) {
+    tids[i] = ThreadCreate((void (*)(void*))f_lock_and_count, NULL);
+    ck_assert_int_gt(tids[i], 0);
+  }
+  for (int i = 0; i < WORKER_COUNT; i++) {
+    int exit_value;
+    ThreadJoin(tids[i], &exit_value);
+  }
+}
+
+START_TEST(test_profile_mutex)
+{
+  // Created before the profiler started
+  ck_assert_int_eq(ThreadProfileSetName(mutex, "early"), ERROR_OTHER);
+  ck_assert_int_eq(ThreadProfileStart(0), 0);
+  ThreadMutex* unprofiled = mutex;
+  mutex = ThreadMutexCreate();
+  ck_assert(mutex != NULL);
+  ck_assert_int_eq(ThreadProfileSetName(mutex, "hot"), 0);
+  contend_for_mutex();
+  ck_assert_int_eq(ThreadMutexDestroy(unprofiled), 0);
+
+  ThreadProfileEntry entries[4];
+  ck_assert_int_eq(ThreadProfileGet(entries, 4), 1);
+  ck_assert_str_eq(entries[0].kind, "mutex");
+  ck_assert_str_eq(entries[0].name, "hot");
+  ck_assert_int_eq(entries[0].acquisitions, WORKER_COUNT * WORKER_ITERATIONS);
+  ck_assert_int_gt(entries[0].contended, 0);
+  ck_assert_int_le(entries[0].contended, entries[0].acquisitions);
+  ck_assert_int_gt(entries[0].max_wait_ns, 0);
+  ck_assert_int_ge(entries[0].total_wait_ns, entries[0].max_wait_ns);
+  ck_assert_int_gt(entries[0].top_waiters[0], 0);
+  long long total = 0;
+  for (int i = 0; i < THREAD_PROFILE_TOP_WAITERS; i++) {
+    if (i > 0) {
+      ck_assert_int_le(entries[0].top_wait_ns[i], entries[0].top_wait_ns[i - 1]);
+    }
+    total += entries[0].top_wait_ns[i];
+  }
+  ck_assert_int_le(total, entries[0].total_wait_ns);
+}
+END_TEST
+
+/**
+ * Not inlined, so that every semaphore it creates has the same creation site.
+ */
+__attribute__((noinline)) ThreadSem*
+create_sem(void)
+{
+  ThreadSem* sem = ThreadSemCreate(1);
+  ck_assert(sem != NULL);
+  return sem;
+}
+
+START_TEST(test_profile_sites_and_dump)
+{
+  ck_assert_int_eq(ThreadProfileStart(SIGUSR2), 0);
+  for (int i = 0; i < 2; i++) {
+    ThreadSem* sem = create_sem();
+    ck_assert_int_eq(ThreadSemWait(sem), 0);
+  }
+  ThreadProfileEntry entries[4];
+  ck_assert_int_eq(ThreadProfileGet(entries, 4), 1);
+  ck_assert_str_eq(entries[0].kind, "sem");
+  ck_assert(entries[0].name == NULL);
+  ck_assert(entries[0].caller != NULL);
+  ck_assert_int_eq(entries[0].acquisitions, 2);
+  ck_assert_int_eq(entries[0].contended, 0);
+  ck_assert_int_eq(entries[0].top_waiters[0], THREAD_NONE);
+
+  // The signal asks for the report, which the next yield writes to standard
+  // error
+  char path[] = "/tmp/check_thread_profile_XXXXXX";
+  int const fd = mkstemp(path);
+  ck_assert_int_ge(fd, 0);
+  unlink(path);
+  int const saved_stderr = dup(STDERR_FILENO);
+  dup2(fd, STDERR_FILENO);
+  raise(SIGUSR2);
+  ThreadYield();
+  dup2(saved_stderr, STDERR_FILENO);
+  close(saved_stderr);
+
+  char report[512];
+  ssize_t const n = pread(fd, report, sizeof(report) - 1, 0);
+  close(fd);
+  ck_assert_int_gt(n, 0);
+  report[n] = '\0';
+  ck_assert(strstr(report, "sem") == report);
+  ck_assert(strstr(report, "acquired 2 contended 0") != NULL);
+}
+END_TEST
+
+START_TEST(test_stack_high_water)
+{
+  ck_assert_int_eq(ThreadStackHighWater(-1), ERROR_TID_INVALID);
+  ck_assert_int_eq(ThreadStackHighWater(MAX_THREADS - 1), ERROR_SYS_THREAD);
+  // The initial thread runs on the process stack
+  ck_assert_int_eq(ThreadStackHighWater(0), ERROR_OTHER);
+
+  Tid const unpainted = ThreadCreate((void (*)(void*))f_use_stack, (void*)64);
+  ck_assert_int_gt(unpainted, 0);
+  ThreadSetStackMode(THREAD_STACK_PAINT);
+  Tid const painted = ThreadCreate((void (*)(void*))f_use_stack, (void*)8192);
+  ck_assert_int_gt(painted, 0);
+  while (ready < 2) {
+    ThreadYield();
+  }
+
+  ck_assert_int_eq(ThreadStackHighWater(unpainted), ERROR_OTHER);
+  long const used = ThreadStackHighWater(painted);
+  ck_assert_int_ge(used, 8192);
+  ck_assert_int_lt(used, THREAD_STACK_SIZE);
+  ThreadStats stats;
+  ck_assert_int_eq(ThreadGetStats(painted, &stats), 0);
+  ck_assert_int_eq(stats.stack_high_water, used);
+
+  ck_assert_int_eq(ThreadSemPost(sem), 1);
+  ck_assert_int_eq(ThreadSemPost(sem), 1);
+  int exit_value;
+  ThreadJoin(unpainted, &exit_value);
+  ThreadJoin(painted, &exit_value);
+}
+END_TEST
+
+START_TEST(test_stack_learn)
+{
+  ThreadSetStackMode(THREAD_STACK_LEARN);
+  Tid tids[THREAD_STACK_LEARN_SAMPLES];
+  for (int i = 0; i < THREAD_STACK_LEARN_SAMPLES; i++) {
+    tids[i] = ThreadCreate((void (*)(void*))f_use_stack, (void*)2048);
+    ck_assert_int_gt(tids[i], 0);
+  }
+  while (ready < THREAD_STACK_LEARN_SAMPLES) {
+    ThreadYield();
+  }
+  for (int i = 0; i < THREAD_STACK_LEARN_SAMPLES; i++) {
+    ck_assert_int_eq(ThreadSemPost(sem), 1);
+  }
+  for (int i = 0; i < THREAD_STACK_LEARN_SAMPLES; i++) {
+    int exit_value;
+    ThreadJoin(tids[i], &exit_value);
+  }
+  // Exited threads are measured when their stacks are freed
+  ThreadYield();
+
+  ThreadStackProfile profiles[4];
+  ck_assert_int_eq(ThreadStackGetProfiles(profiles, 4), 1);
+  ck_assert(profiles[0].f == (void (*)(void*))f_use_stack);
+  ck_assert_int_eq(profiles[0].threads, THREAD_STACK_LEARN_SAMPLES);
+  ck_assert_int_ge(profiles[0].max_used, 2048);
+  long total = 0;
+  for (int i = 0; i < THREAD_STACK_BUCKETS; i++) {
+    total += profiles[0].histogram[i];
+  }
+  ck_assert_int_eq(total, THREAD_STACK_LEARN_SAMPLES);
+  ck_assert_int_gt(profiles[0].stack_size, profiles[0].max_used);
+  ck_assert_int_lt(profiles[0].stack_size, THREAD_STACK_SIZE);
+  ck_assert_int_eq(profiles[0].stack_size % 4096, 0);
+
+  // A thread on a learned stack is still measured
+  ready = 0;
+  Tid const tid = ThreadCreate((void (*)(void*))f_use_stack, (void*)2048);
+  ck_assert_int_gt(tid, 0);
+  while (ready < 1) {
+    ThreadYield();
+  }
+  long const used = ThreadStackHighWater(tid);
+  ck_assert_int_ge(used, 2048);
+  ck_assert_int_le(used, profiles[0].max_used + 1024);
+  ck_assert_int_eq(ThreadSemPost(sem), 1);
+  int exit_value;
+  ThreadJoin(tid, &exit_value);
+}
+END_TEST
+
+START_TEST(test_shared_stack_switches)
+{
+  Tid tids[3 * THREAD_SHARED_STACKS];
+  int const count = sizeof(tids) / sizeof(tids[0]);
+  for (int i = 0; i < count; i++) {
+    tids[i] =
+      ThreadCreateShared((void (*)(void*))f_check_shared_stack, (void*)(long)i);
+    ck_assert_int_gt(tids[i], 0);
+  }
+  for (int i = 0; i < count; i++) {
+    int exit_value;
+    ThreadJoin(tids[i], &exit_value);
+  }
+  ck_assert_int_eq(counter, count);
+}
+END_TEST
+
+START_TEST(test_shared_stack_waits)
+{
+  ck_assert_int_eq(pipe2(pipe_fds, O_NONBLOCK), 0);
+  Tid tids[2 * THREAD_SHARED_STACKS];
+  int const count = sizeof(tids) / sizeof(tids[0]);
+  for (int i = 0; i < count; i++) {
+    tids[i] = ThreadCreateShared((void (*)(void*))f_shared_echo, NULL);
+    ck_assert_int_gt(tids[i], 0);
+  }
+  // Each message lands in a local of a thread whose stack is copied out
+  for (long i = 1; i <= count; i++) {
+    ck_assert_int_eq(ThreadChanSend(chan, &i), 0);
+  }
+  ck_assert_int_eq(write(pipe_fds[1], "x", 1), 1);
+  long total = 0;
+  for (int i = 0; i < count; i++) {
+    long reply;
+    ck_assert_int_eq(ThreadChanRecv(chan, &reply), 0);
+    total += reply;
+  }
+  ck_assert_int_eq(total, count * (count + 1));
+  for (int i = 0; i < count; i++) {
+    int exit_value;
+    ThreadJoin(tids[i], &exit_value);
+  }
+  close(pipe_fds[0]);
+  close(pipe_fds[1]);
+}
+END_TEST
+
+START_TEST(test_stack_arena)
+{
+  ck_assert_int_eq(ThreadSetStackArena(THREAD_STACK_ARENA_HUGETLB + 1),
+                   ERROR_OTHER);
+  ThreadSetStackMode(THREAD_STACK_PAINT);
+  for (int arena = THREAD_STACK_ARENA_GUARDED;
+       arena <= THREAD_STACK_ARENA_HUGETLB;
+       arena++) {
+    ck_assert_int_eq(ThreadSetStackArena(arena), 0);
+    ready = 0;
+    Tid tids[WORKER_COUNT];
+    for (int i = 0; i < WORKER_COUNT; i++) {
+      tids[i] = ThreadCreate((void (*)(void*))f_use_stack, (void*)8192);
+      ck_assert_int_gt(tids[i], 0);
+    }
+    while (ready < WORKER_COUNT) {
+      ThreadYield();
+    }
+    for (int i = 0; i < WORKER_COUNT; i++) {
+      ck_assert_int_ge(ThreadStackHighWater(tids[i]), 8192);
+      ck_assert_int_eq(ThreadSemPost(sem), 1);
+    }
+    for (int i = 0; i < WORKER_COUNT; i++) {
+      int exit_value;
+      ThreadJoin(tids[i], &exit_value);
+    }
+  }
+
+  // Overflowing a guarded stack faults rather than running on
+  pid_t const pid = fork();
+  ck_assert_int_ge(pid, 0);
+  if (pid == 0) {
+    ThreadSetStackArena(THREAD_STACK_ARENA_GUARDED);
+    ThreadCreate((void (*)(void*))f_use_stack, (void*)(THREAD_STACK_SIZE * 2));
+    ThreadYield();
+    _exit(0);
+  }
+  int status;
+  // Not interrupted by the preemption signal
+  InterruptsDisable();
+  ck_assert_int_eq(waitpid(pid, &status, 0), pid);
+  InterruptsEnable();
+  ck_assert(WIFSIGNALED(status));
+  ck_assert_int_eq(WTERMSIG(status), SIGSEGV);
+}
+END_TEST
+
+/**
+ * Create keys until one past the inline keys.
+ */
+void
+create_keys(void)
+{
+  inline_key = ThreadKeyCreate(destroy_value);
+  ck_assert_int_eq(inline_key, 0);
+  do {
+    overflow_key = ThreadKeyCreate(destroy_value);
+    ck_assert_int_ge(overflow_key, 0);
+  } while (overflow_key < 8);
+  destroyed = 0;
+}
+
+START_TEST(test_specific_values)
+{
+  ck_assert(ThreadGetSpecific(0) == NULL);
+  ck_assert_int_eq(ThreadSetSpecific(0, NULL), ERROR_OTHER);
+  create_keys();
+  ck_assert(ThreadGetSpecific(-1) == NULL);
+  ck_assert(ThreadGetSpecific(THREAD_KEYS_MAX) == NULL);
+  ck_assert_int_eq(ThreadSetSpecific(overflow_key + 1, NULL), ERROR_OTHER);
+
+  ck_assert_int_eq(ThreadSetSpecific(inline_key, (void*)7), 0);
+  Tid tids[WORKER_COUNT];
+  for (long i = 0; i < WORKER_COUNT; i++) {
+    tids[i] = ThreadCreate((void (*)(void*))f_set_specific, (void*)(i + 1));
+    ck_assert_int_gt(tids[i], 0);
+  }
+  while (ready < WORKER_COUNT) {
+    ThreadYield();
+  }
+  ck_assert(ThreadGetSpecific(inline_key) == (void*)7);
+  ck_assert(ThreadGetSpecific(overflow_key) == NULL);
+  for (int i = 0; i < WORKER_COUNT; i++) {
+    ck_assert_int_eq(ThreadSemPost(sem), 1);
+  }
+  for (int i = 0; i < WORKER_COUNT; i++) {
+    int exit_value;
+    ThreadJoin(tids[i], &exit_value);
+  }
+  // Each exiting thread destroyed both its values
+  long const ids = WORKER_COUNT * (WORKER_COUNT + 1) / 2;
+  ck_assert_int_eq(destroyed, ids * 101);
+}
+END_TEST
+
+START_TEST(test_specific_killed)
+{
+  create_keys();
+  Tid const tid = ThreadCreate((void (*)(void*))f_set_specific, (void*)3);
+  ck_assert_int_gt(tid, 0);
+  while (ready < 1) {
+    ThreadYield();
+  }
+  ck_assert_int_eq(ThreadKill(tid), tid);
+  ck_assert_int_eq(destroyed, 0);
+  // Killed threads are reclaimed, and their values destroyed, on the next
+  // scheduler call
+  ThreadYield();
+  ck_assert_int_eq(destroyed, 303);
+}
+END_TEST
+
+START_TEST(test_arena_alloc)
+{
+  // More than a chunk each, from threads interleaving
+  Tid tids[WORKER_COUNT];
+  for (int i = 0; i < WORKER_COUNT; i++) {
+    tids[i] = ThreadCreate((void (*)(void*))f_arena_alloc, (void*)40);
+    ck_assert_int_gt(tids[i], 0);
+  }
+  while (ready < WORKER_COUNT) {
+    ThreadYield();
+  }
+  for (int i = 0; i < WORKER_COUNT; i++) {
+    ck_assert_int_ge(ThreadSemPost(sem), 0);
+  }
+  for (int i = 0; i < WORKER_COUNT; i++) {
+    int exit_value;
+    ThreadJoin(tids[i], &exit_value);
+  }
+
+  // Larger than a chunk, then carrying on in the current chunk
+  char* const small = ThreadArenaAlloc(16);
+  char* const large = ThreadArenaAlloc(THREAD_ARENA_CHUNK_SIZE * 2);
+  ck_assert(large != NULL);
+  memset(large, 1, THREAD_ARENA_CHUNK_SIZE * 2);
+  ck_assert(ThreadArenaAlloc(16) == small + 16);
+  ck_assert(ThreadArenaAlloc(0) != NULL);
+}
+END_TEST
+
+START_TEST(test_arena_recycled)
+{
+  ready = 0;
+  Tid tid = ThreadCreate((void (*)(void*))f_arena_alloc, (void*)1);
+  ck_assert_int_gt(tid, 0);
+  while (ready < 1) {
+    ThreadYield();
+  }
+  ck_assert_int_ge(ThreadSemPost(sem), 0);
+  int exit_value;
+  ThreadJoin(tid, &exit_value);
+  void* const exited = first_allocated;
+
+  // The chunk the exited thread returned is the next one taken
+  tid = ThreadCreate((void (*)(void*))f_arena_alloc, (void*)1);
+  ck_assert_int_gt(tid, 0);
+  while (ready < 2) {
+    ThreadYield();
+  }
+  ck_assert(first_allocated == exited);
+
+  // So is a killed thread's, once it is reclaimed
+  ck_assert_int_eq(ThreadKill(tid), tid);
+  ThreadYield();
+  tid = ThreadCreate((void (*)(void*))f_arena_alloc, (void*)1);
+  ck_assert_int_gt(tid, 0);
+  while (ready < 3) {
+    ThreadYield();
+  }
+  ck_assert(first_allocated == exited);
+  ck_assert_int_ge(ThreadSemPost(sem), 0);
+  ThreadJoin(tid, &exit_value);
+}
+END_TEST
+
+START_TEST(test_cancel_sleeping)
+{
+  Tid const tid = ThreadCreate((void (*)(void*))f_cancel_sleeping, NULL);
+  ck_assert_int_gt(tid, 0);
+  while (!ready) {
+    ThreadYield();
+  }
+  ck_assert_int_eq(ThreadCancel(tid), tid);
+  ck_assert_int_eq(ThreadCancel(tid), tid);
+  int exit_value;
+  ck_assert_int_eq(ThreadJoin(tid, &exit_value), tid);
+  ck_assert_int_eq(exit_value, EXIT_CODE_KILL);
+  // Last pushed first, and the mutex released by a handler
+  ck_assert_int_eq(counter, 21);
+  ck_assert_int_eq(ThreadMutexLock(mutex), 0);
+  ck_assert_int_eq(ThreadMutexUnlock(mutex), 0);
+  ck_assert_int_eq(ThreadCancel(tid), ERROR_SYS_THREAD);
+}
+END_TEST
+
+START_TEST(test_cancel_running)
+{
+  // At a yield, then at a preemption
+  for (long yield = 1; yield >= 0; yield--) {
+    counter = 0;
+    ready = 0;
+    Tid const tid = ThreadCreate((void (*)(void*))f_cancel_running,
+                                 (void*)yield);
+    ck_assert_int_gt(tid, 0);
+    while (!ready) {
+      ThreadYield();
+    }
+    ck_assert_int_eq(ThreadCancel(tid), tid);
+    int exit_value;
+    ck_assert_int_eq(ThreadJoin(tid, &exit_value), tid);
+    ck_assert_int_eq(exit_value, EXIT_CODE_KILL);
+    ck_assert_int_eq(counter, 3);
+  }
+}
+END_TEST
+
+START_TEST(test_cancel_not_in_mutex_wait)
+{
+  ck_assert_int_eq(ThreadMutexLock(mutex), 0);
+  Tid const tid = ThreadCreate((void (*)(void*))f_cancel_locked, NULL);
+  ck_assert_int_gt(tid, 0);
+  ThreadYield();
+  ck_assert_int_eq(ThreadCancel(tid), tid);
+  for (int i = 0; i < 10; i++) {
+    ThreadYield();
+  }
+  // Still waiting for the mutex, which it gets before exiting
+  ck_assert_int_eq(counter, 0);
+  // Joined before it can run, and exit
+  InterruptsDisable();
+  ck_assert_int_eq(ThreadMutexUnlock(mutex), 0);
+  int exit_value;
+  ck_assert_int_eq(ThreadJoin(tid, &exit_value), tid);
+  InterruptsEnable();
+  ck_assert_int_eq(exit_value, EXIT_CODE_KILL);
+  ck_assert_int_eq(counter, 1);
+}
+END_TEST
+
+START_TEST(test_cancel_lock_loop)
+{
+  // Cancelled at a different point of its loop each round
+  for (int i = 0; i < 100; i++) {
+    ready = 0;
+    Tid const tid = ThreadCreate((void (*)(void*))f_cancel_lock_loop, NULL);
+    ck_assert_int_gt(tid, 0);
+    while (!ready) {
+      ThreadYield();
+    }
+    ThreadSpin(INTERRUPTS_SIGNAL_INTERVAL + i * 37 % 500);
+    InterruptsState enabled = InterruptsDisable();
+    ck_assert_int_eq(ThreadCancel(tid), tid);
+    int exit_value;
+    ck_assert_int_eq(ThreadJoin(tid, &exit_value), tid);
+    InterruptsSet(enabled);
+    ck_assert_int_eq(exit_value, EXIT_CODE_KILL);
+
+    // Neither lock was left half taken or half released
+    ck_assert_int_eq(ThreadMutexTryLock(mutex), 0);
+    ck_assert_int_eq(ThreadMutexUnlock(mutex), 0);
+    ck_assert_int_eq(ThreadRWLockWriteLock(rwlock), 0);
+    ck_assert_int_eq(ThreadRWLockWriteUnlock(rwlock), 0);
+  }
+}
+END_TEST
+
+START_TEST(test_cancel_errors)
+{
+  ck_assert_int_eq(ThreadCancel(-1), ERROR_TID_INVALID);
+  ck_assert_int_eq(ThreadCancel(MAX_THREADS), ERROR_TID_INVALID);
+  ck_assert_int_eq(ThreadCancel(MAX_THREADS - 1), ERROR_SYS_THREAD);
+  ck_assert_int_eq(ThreadCleanupPop(1), ERROR_OTHER);
+  for (int i = 0; i < THREAD_CLEANUP_MAX; i++) {
+    ck_assert_int_eq(
+      ThreadCleanupPush((void (*)(void*))record_cleanup, (void*)1), 0);
+  }
+  ck_assert_int_eq(
+    ThreadCleanupPush((void (*)(void*))record_cleanup, (void*)1), ERROR_OTHER);
+  ck_assert_int_eq(ThreadCleanupPop(1), 0);
+  ck_assert_int_eq(counter, 1);
+  for (int i = 1; i < THREAD_CLEANUP_MAX; i++) {
+    ck_assert_int_eq(ThreadCleanupPop(0), 0);
+  }
+  ck_assert_int_eq(counter, 1);
+}
+END_TEST
+
+START_TEST(test_wake_and_switch)
+{
+  // Not preempted, so every switch is one of ours
+  InterruptsState enabled = InterruptsDisable();
+  ck_assert_int_eq(ThreadWakeNextAndSwitch(queue, THREAD_SWITCH_CALLER_FIRST),
+                   0);
+  for (int first = 1; first >= 0; first--) {
+    counter = 0;
+    create_and_park(f_sleep_then_record);
+    // Made ready while parked, so it cannot be preempted once it runs
+    create_and_park(f_sem_then_record);
+    ck_assert_int_eq(ThreadSemPost(sem), 1);
+    // The woken thread runs ahead of the one already ready
+    ck_assert_int_eq(
+      ThreadWakeNextAndSwitch(queue,
+                              first ? THREAD_SWITCH_CALLER_FIRST
+                                    : THREAD_SWITCH_CALLER_LAST),
+      1);
+    counter = counter * 10 + 3;
+    while (counter < 100) {
+      ThreadYield();
+    }
+    ck_assert_int_eq(counter, first ? 132 : 123);
+  }
+  InterruptsSet(enabled);
+}
+END_TEST
+
+START_TEST(test_task_spawn)
+{
+  ck_assert_int_eq(TaskWaitAll(), 0);
+  for (long i = 0; i < 1000; i++) {
+    ck_assert_int_eq(TaskSpawn(t_count_in_order, (void*)i), 0);
+  }
+  ck_assert_int_eq(TaskWaitAll(), 0);
+  ck_assert_int_eq(counter, 1000);
+
+  // Tasks spawned by tasks are waited for as well
+  counter = 0;
+  for (int i = 0; i < 10; i++) {
+    ck_assert_int_eq(TaskSpawn(t_spawn_count, NULL), 0);
+  }
+  ck_assert_int_eq(TaskWaitAll(), 0);
+  ck_assert_int_eq(counter, 20);
+}
+END_TEST
+
+START_TEST(test_task_blocking)
+{
+  ck_assert_int_eq(TaskSpawn(t_sem_wait, NULL), 0);
+  for (int i = 0; i < 10; i++) {
+    ck_assert_int_eq(TaskSpawn(t_count, NULL), 0);
+  }
+  // The tasks behind the blocked one run on another worker
+  while (counter < 10) {
+    ThreadYield();
+  }
+  ck_assert_int_eq(counter, 10);
+  ck_assert_int_eq(ThreadSemPost(sem), 1);
+  ck_assert_int_eq(TaskWaitAll(), 0);
+  ck_assert_int_eq(counter, 110);
+}
+END_TEST
+
+START_TEST(test_sleep_async)
+{
+  ck_assert_int_eq(ThreadSleepAsync(queue, a_record, (void*)1), 0);
+  ck_assert_int_eq(ThreadSleepAsync(queue, a_record, (void*)2), 0);
+  ck_assert_int_eq(ThreadSleepAsync(queue, a_record, (void*)3), 0);
+  ck_assert_int_eq(ThreadWakeNext(queue), 1);
+  // There is no thread to switch to
+  ck_assert_int_eq(
+    ThreadWakeNextAndSwitch(queue, THREAD_SWITCH_CALLER_LAST), 1);
+  ck_assert_int_eq(ThreadWakeAll(queue), 1);
+  ck_assert_int_eq(ThreadWakeAll(queue), 0);
+  ck_assert_int_eq(TaskWaitAll(), 0);
+  ck_assert_int_eq(counter, 123);
+  ck_assert_int_eq(ready, 0);
+}
+END_TEST
+
+START_TEST(test_join_async)
+{
+  ck_assert_int_eq(ThreadJoinAsync(MAX_THREADS, a_record, NULL),
+                   ERROR_TID_INVALID);
+  ck_assert_int_eq(ThreadJoinAsync(MAX_THREADS - 1, a_record, NULL),
+                   ERROR_SYS_THREAD);
+  ck_assert_int_eq(ThreadJoinAsync(ThreadId(), a_record, NULL),
+                   ERROR_THREAD_BAD);
+
+  Tid const tid = create_and_park(f_sem_wait);
+  ck_assert_int_eq(ThreadJoinAsync(tid, a_record, (void*)1), 0);
+  ck_assert_int_eq(ThreadJoinAsync(tid, a_record, (void*)2), 0);
+  ck_assert_int_eq(ThreadKill(tid), tid);
+  ck_assert_int_eq(TaskWaitAll(), 0);
+  ck_assert_int_eq(counter, 12);
+  ck_assert_int_eq(ready, EXIT_CODE_KILL);
+}
+END_TEST
+
+START_TEST(test_create_in_place)
+{
+  InterruptsState enabled = InterruptsDisable();
+  Tid const tid =
+    ThreadCreateInPlace(f_in_place, sizeof(long), init_in_place, (void*)42);
+  ck_assert_int_gt(tid, 0);
+  ck_assert_int_eq(ThreadJoin(tid, NULL), tid);
+  InterruptsSet(enabled);
+  ck_assert_int_eq(counter, 42);
+
+  ck_assert_int_eq(
+    ThreadCreateInPlace(f_in_place, THREAD_STACK_SIZE, init_in_place, NULL),
+    ERROR_OTHER);
+}
+END_TEST
+
+START_TEST(test_create_in_place_learned)
+{
+  ThreadSetStackMode(THREAD_STACK_LEARN);
+  for (int i = 0; i < THREAD_STACK_LEARN_SAMPLES; i++) {
+    Tid const tid =
+      ThreadCreateInPlace(f_in_place, sizeof(long), init_in_place, (void*)1);
+    ck_assert_int_gt(tid, 0);
+    ThreadJoin(tid, NULL);
+  }
+  // Exited threads are measured when their stacks are freed
+  ThreadYield();
+  ThreadStackProfile profile;
+  ck_assert_int_eq(ThreadStackGetProfiles(&profile, 1), 1);
+  size_t const reserved = THREAD_STACK_SIZE / 2 - 64;
+  ck_assert_int_lt(profile.stack_size, 2 * reserved);
+
+  // More data than the learned stack has room for gets a bigger stack
+  Tid const tid =
+    ThreadCreateInPlace(f_in_place, reserved, init_in_place, (void*)1);
+  ck_assert_int_gt(tid, 0);
+  ck_assert_int_eq(ThreadJoin(tid, NULL), tid);
+  ck_assert_int_eq(counter, THREAD_STACK_LEARN_SAMPLES + 1);
+}
+END_TEST
+
+START_TEST(test_future_get)
+{
+  ThreadPromise* const promise = ThreadPromiseCreate(sizeof(long));
+  ck_assert(promise != NULL);
+  future = ThreadPromiseFuture(promise);
+  Tid const first = create_and_park(f_future_get);
+  Tid const second = create_and_park(f_future_get);
+  ck_assert_int_eq(ThreadFutureIsReady(future), 0);
+  ck_assert_int_eq(ThreadFutureDestroy(future), ERROR_OTHER);
+
+  long const value = 21;
+  ck_assert_int_eq(ThreadPromiseSet(promise, &value), 0);
+  ck_assert_int_eq(ThreadPromiseSet(promise, &value), ERROR_OTHER);
+  ck_assert_int_eq(ThreadFutureIsReady(future), 1);
+  ThreadJoin(first, NULL);
+  ThreadJoin(second, NULL);
+  ck_assert_int_eq(counter, 42);
+
+  // Already set, so the value is there without waiting
+  long got = 0;
+  ck_assert_int_eq(ThreadFutureGet(future, &got), 0);
+  ck_assert_int_eq(got, 21);
+  ck_assert_int_eq(ThreadPromiseDestroy(promise), 0);
+  ck_assert_int_eq(ThreadFutureDestroy(future), 0);
+}
+END_TEST
+
+START_TEST(test_future_broken)
+{
+  ThreadPromise* const promise = ThreadPromiseCreate(sizeof(long));
+  ck_assert(promise != NULL);
+  future = ThreadPromiseFuture(promise);
+  Tid const tid = create_and_park(f_future_broken);
+  ThreadFuture* const chained = ThreadFutureThen(
+    future, sizeof(long), then_add, (void*)1, THREAD_THEN_INLINE);
+  ck_assert(chained != NULL);
+
+  ck_assert_int_eq(ThreadPromiseDestroy(promise), 0);
+  ck_assert_int_eq(ThreadJoin(tid, NULL), tid);
+  // The waiter was woken, and the continuation was never called
+  ck_assert_int_eq(counter, 1);
+  ck_assert_int_eq(ThreadFutureGet(chained, NULL), ERROR_CLOSED);
+  ck_assert_int_eq(ThreadFutureDestroy(chained), 0);
+  ck_assert_int_eq(ThreadFutureDestroy(future), 0);
+}
+END_TEST
+
+START_TEST(test_future_then)
+{
+  ThreadPromise* const promise = ThreadPromiseCreate(sizeof(long));
+  ck_assert(promise != NULL);
+  ThreadFuture* const root = ThreadPromiseFuture(promise);
+  ThreadFuture* stages[5];
+  ThreadFuture* from = root;
+  for (int i = 0; i < 5; i++) {
+    // Inline stages first, then stages that run as tasks
+    stages[i] = ThreadFutureThen(from,
+                                 sizeof(long),
+                                 then_add,
+                                 (void*)1,
+                                 i < 3 ? THREAD_THEN_INLINE : THREAD_THEN_TASK);
+    ck_assert(stages[i] != NULL);
+    from = stages[i];
+  }
+
+  long value = 10;
+  ck_assert_int_eq(ThreadPromiseSet(promise, &value), 0);
+  // The inline stages ran before the promise was set
+  ck_assert_int_eq(ThreadFutureIsReady(stages[2]), 1);
+  ck_assert_int_eq(ThreadFutureGet(stages[4], &value), 0);
+  ck_assert_int_eq(value, 15);
+  ck_assert_int_eq(counter, 5);
+
+  // Chained from a future already set, it runs right away
+  ThreadFuture* const late = ThreadFutureThen(
+    stages[0], sizeof(long), then_add, (void*)100, THREAD_THEN_INLINE);
+  ck_assert(late != NULL);
+  ck_assert_int_eq(ThreadFutureIsReady(late), 1);
+  ck_assert_int_eq(ThreadFutureGet(late, &value), 0);
+  ck_assert_int_eq(value, 111);
+
+  ck_assert_int_eq(ThreadFutureDestroy(late), 0);
+  for (int i = 0; i < 5; i++) {
+    ck_assert_int_eq(ThreadFutureDestroy(stages[i]), 0);
+  }
+  ck_assert_int_eq(ThreadPromiseDestroy(promise), 0);
+  ck_assert_int_eq(ThreadFutureDestroy(root), 0);
+}
+END_TEST
+
+int
+main(void)
+{
+  TCase* mutex_case = tcase_create("Mutex Case");
+  tcase_add_checked_fixture(mutex_case, set_up, tear_down);
+  tcase_add_test(mutex_case, test_mutex_lock_unlock);
+  tcase_add_test(mutex_case, test_mutex_unlock_by_non_owner);
+  tcase_add_test(mutex_case, test_mutex_mutual_exclusion);
+
+  TCase* cond_case = tcase_create("Condition Variable Case");
+  tcase_add_checked_fixture(cond_case, set_up, tear_down);
+  tcase_add_test(cond_case, test_cond_wait_without_mutex);
+  tcase_add_test(cond_case, test_cond_signal);
+  tcase_add_test(cond_case, test_cond_broadcast);
+
+  TCase* sem_case = tcase_create("Semaphore Case");
+  tcase_add_checked_fixture(sem_case, set_up, tear_down);
+  tcase_add_test(sem_case, test_sem_count);
+  tcase_add_test(sem_case, test_sem_post_wakes_waiters);
+
+  TCase* rwlock_case = tcase_create("Reader-Writer Lock Case");
+  tcase_add_checked_fixture(rwlock_case, set_up, tear_down);
+  tcase_add_test(rwlock_case, test_rwlock_shared_readers);
+  tcase_add_test(rwlock_case, test_rwlock_writer_preference);
+  tcase_add_test(rwlock_case, test_rwlock_mutual_exclusion);
+
+  TCase* barrier_case = tcase_create("Barrier and Latch Case");
+  tcase_add_checked_fixture(barrier_case, set_up, tear_down);
+  tcase_add_test(barrier_case, test_barrier_phases);
+  tcase_add_test(barrier_case, test_barrier_serial);
+  tcase_add_test(barrier_case, test_latch_count_down);
+
+  TCase* chan_case = tcase_create("Channel Case");
+  tcase_add_checked_fixture(chan_case, set_up, tear_down);
+  tcase_add_test(chan_case, test_chan_unbuffered_in_order);
+  tcase_add_test(chan_case, test_chan_buffered);
+  tcase_add_test(chan_case, test_chan_close_wakes_receivers);
+
+  TCase* select_case = tcase_create("Select Case");
+  tcase_add_checked_fixture(select_case, set_up, tear_down);
+  tcase_add_test(select_case, test_select_ready_case);
+  tcase_add_test(select_case, test_select_timeout);
+  tcase_add_test(select_case, test_select_first_source_wins);
+
+  TCase* join_case = tcase_create("Join Any and Wait Group Case");
+  tcase_add_checked_fixture(join_case, set_up, tear_down);
+  tcase_add_test(join_case, test_join_any);
+  tcase_add_test(join_case, test_join_any_killed);
+  tcase_add_test(join_case, test_wait_group_count);
+  tcase_add_test(join_case, test_wait_group_exit_codes);
+
+  TCase* fd_case = tcase_create("File Descriptor Case");
+  tcase_add_checked_fixture(fd_case, set_up, tear_down);
+  tcase_add_test(fd_case, test_wait_fd_readable);
+  tcase_add_test(fd_case, test_wait_fd_timeout);
+
+  TCase* io_case = tcase_create("Asynchronous I/O Case");
+  tcase_add_checked_fixture(io_case, set_up, tear_down);
+  tcase_add_test(io_case, test_file_io);
+  tcase_add_test(io_case, test_file_io_helper_threads);
+  tcase_add_test(io_case, test_offload);
+
+  TCase* stats_case = tcase_create("Statistics Case");
+  tcase_add_checked_fixture(stats_case, set_up, tear_down);
+  tcase_add_test(stats_case, test_stats_blocked_and_woken);
+  tcase_add_test(stats_case, test_stats_preempted);
+
+  TCase* trace_case = tcase_create("Tracing Case");
+  tcase_add_checked_fixture(trace_case, set_up, tear_down);
+  tcase_add_test(trace_case, test_trace_create_switch_exit);
+  tcase_add_test(trace_case, test_trace_ring_wraps);
+
+  TCase* profile_case = tcase_create("Contention Profiling Case");
+  tcase_add_checked_fixture(profile_case, set_up, tear_down);
+  tcase_add_test(profile_case, test_profile_mutex);
+  tcase_add_test(profile_case, test_profile_sites_and_dump);
+
+  TCase* stack_case = tcase_create("Stack Sizing Case");
+  tcase_add_checked_fixture(stack_case, set_up, tear_down);
+  tcase_add_test(stack_case, test_stack_high_water);
+  tcase_add_test(stack_case, test_stack_learn);
+  tcase_add_test(stack_case, test_stack_arena);
+
+  TCase* shared_stack_case = tcase_create("Shared Stack Case");
+  tcase_add_checked_fixture(shared_stack_case, set_up, tear_down);
+  tcase_add_test(shared_stack_case, test_shared_stack_switches);
+  tcase_add_test(shared_stack_case, test_shared_stack_waits);
+
+  TCase* specific_case = tcase_create("Thread-Local Storage Case");
+  tcase_add_checked_fixture(specific_case, set_up, tear_down);
+  tcase_add_test(specific_case, test_specific_values);
+  tcase_add_test(specific_case, test_specific_killed);
+
+  TCase* arena_case = tcase_create("Thread Arena Case");
+  tcase_add_checked_fixture(arena_case, set_up, tear_down);
+  tcase_add_test(arena_case, test_arena_alloc);
+  tcase_add_test(arena_case, test_arena_recycled);
+
+  TCase* cancel_case = tcase_create("Cancellation Case");
+  tcase_add_checked_fixture(cancel_case, set_up, tear_down);
+  tcase_add_test(cancel_case, test_cancel_sleeping);
+  tcase_add_test(cancel_case, test_cancel_running);
+  tcase_add_test(cancel_case, test_cancel_not_in_mutex_wait);
+  tcase_add_test(cancel_case, test_cancel_lock_loop);
+  tcase_add_test(cancel_case, test_cancel_errors);
+
+  TCase* handoff_case = tcase_create("Direct Handoff Case");
+  tcase_add_checked_fixture(handoff_case, set_up, tear_down);
+  tcase_add_test(handoff_case, test_wake_and_switch);
+
+  TCase* task_case = tcase_create("Task Case");
+  tcase_add_checked_fixture(task_case, set_up, tear_down);
+  tcase_add_test(task_case, test_task_spawn);
+  tcase_add_test(task_case, test_task_blocking);
+
+  TCase* in_place_case = tcase_create("Creation In Place Case");
+  tcase_add_checked_fixture(in_place_case, set_up, tear_down);
+  tcase_add_test(in_place_case, test_create_in_place);
+  tcase_add_test(in_place_case, test_create_in_place_learned);
+
+  TCase* async_case = tcase_create("Asynchronous Wait Case");
+  tcase_add_checked_fixture(async_case, set_up, tear_down);
+  tcase_add_test(async_case, test_sleep_async);
+  tcase_add_test(async_case, test_join_async);
+
+  TCase* future_case = tcase_create("Future Case");
+  tcase_add_checked_fixture(future_case, set_up, tear_down);
+  tcase_add_test(future_case, test_future_get);
+  tcase_add_test(future_case, test_future_broken);
+  tcase_add_test(future_case, test_future_then);
+
+  Suite* suite = suite_create("Synchronization Test Suite");
+  suite_add_tcase(suite, mutex_case);
+  suite_add_tcase(suite, cond_case);
+  suite_add_tcase(suite, sem_case);
+  suite_add_tcase(suite, rwlock_case);
+  suite_add_tcase(suite, barrier_case);
+  suite_add_tcase(suite, chan_case);
+  suite_add_tcase(suite, select_case);
+  suite_add_tcase(suite, join_case);
+  suite_add_tcase(suite, fd_case);
+  suite_add_tcase(suite, io_case);
+  suite_add_tcase(suite, stats_case);
+  suite_add_tcase(suite, trace_case);
+  suite_add_tcase(suite, profile_case);
+  suite_add_tcase(suite, stack_case);
+  suite_add_tcase(suite, shared_stack_case);
+  suite_add_tcase(suite, specific_case);
+  suite_add_tcase(suite, arena_case);
+  suite_add_tcase(suite, cancel_case);
+  suite_add_tcase(suite, handoff_case);
+  suite_add_tcase(suite, task_case);
+  suite_add_tcase(suite, in_place_case);
+  suite_add_tcase(suite, async_case);
+  suite_add_tcase(suite, future_case);
+
+  SRunner* suite_runner = srunner_create(suite);
+  srunner_run_all(suite_runner, CK_VERBOSE);
+
+  srunner_ntests_failed(suite_runner);
+  srunner_free(suite_runner);
+
+  return EXIT_SUCCESS;
+}
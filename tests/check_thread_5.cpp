@@ -0,0 +1,388 @@
+#include "check.h"
+
+#include <cstdlib>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <utility>
+
+#include "interrupts.h"
+#include "thread.h"
+#include "thread.hpp"
+#include "thread_coro.hpp"
+
+// Number of times the identifier of an exited fiber is given to a new thread
+#define REUSE_ROUNDS 100
+
+// Number of messages sent through each channel
+#define MESSAGE_COUNT 16
+
+// Shared state for the functions passed to ThreadCreate
+volatile int finished;
+WaitQueue* queue;
+
+/**
+ * A message that is not trivially copyable, so that channels box it, and that
+ * counts its live instances.
+ */
+struct Counted
+{
+  static int live;
+  int value;
+
+  explicit Counted(int value)
+    : value(value)
+  {
+    live++;
+  }
+
+  Counted(const Counted& other)
+    : value(other.value)
+  {
+    live++;
+  }
+
+  ~Counted() { live--; }
+};
+
+int Counted::live = 0;
+
+// Functions to pass to ThreadCreate
+void
+f_yield_then_finish(void*)
+{
+  for (int i = 0; i < 1000; i++) {
+    ThreadYield();
+  }
+  finished = 1;
+}
+
+void
+f_wake_until_finished(void*)
+{
+  while (!finished) {
+    ThreadWakeAll(queue);
+    ThreadYield();
+  }
+}
+
+void
+f_exit_42(void*)
+{
+  ThreadYield();
+  ThreadExit(42);
+}
+
+// Coroutines to pass to sync_wait
+thread_coro::task<int>
+doubled(int value)
+{
+  ck_assert_int_eq(co_await thread_coro::sleep_on(queue), 0);
+  co_return value * 2;
+}
+
+thread_coro::task<int>
+sum_of_doubled(int a, int b)
+{
+  int const first = co_await doubled(a);
+  int const second = co_await doubled(b);
+  co_return first + second;
+}
+
+thread_coro::task<void>
+nested_void()
+{
+  ck_assert_int_eq(co_await sum_of_doubled(1, 2), 6);
+}
+
+thread_coro::task<int>
+throw_after_suspending()
+{
+  co_await thread_coro::sleep_on(queue);
+  throw std::runtime_error("after");
+}
+
+thread_coro::task<int>
+rethrow_nested()
+{
+  co_return co_await throw_after_suspending();
+}
+
+thread_coro::task<int>
+throw_at_once()
+{
+  throw std::runtime_error("at once");
+  co_return 0;
+}
+
+thread_coro::task<int>
+join_exit_code(Tid tid, int* exit_code)
+{
+  co_return co_await thread_coro::join(tid, exit_code);
+}
+
+void
+set_up(void)
+{
+  ck_assert_int_eq(ThreadInit(), 0);
+  InterruptsInit();
+  InterruptsSetLogLevel(INTERRUPTS_QUIET);
+  finished = 0;
+  Counted::live = 0;
+  queue = WaitQueueCreate();
+  ck_assert(queue != NULL);
+}
+
+void
+tear_down(void)
+{}
+
+START_TEST(test_fiber_tid_reuse)
+{
+  for (int round = 0; round < REUSE_ROUNDS; round++) {
+    volatile int ran = 0;
+    // Whether the fiber returns or exits, its handle outlives it
+    thread::Fiber fiber = thread::Fiber::spawn([&ran, round] {
+      ran = 1;
+      if (round % 2 == 1) {
+        ThreadExit(0);
+      }
+    });
+    Tid const tid = fiber.id();
+    while (!ran) {
+      ThreadYield();
+    }
+    ThreadYield();
+
+    // The fiber is cleaned up, so the next thread takes its identifier
+    finished = 0;
+    Tid const other = ThreadCreate(f_yield_then_finish, NULL);
+    ck_assert_int_eq(other, tid);
+    fiber.join();
+    ck_assert_int_eq(finished, 0);
+    ck_assert(!fiber.joinable());
+    ck_assert_int_eq(ThreadJoin(other, NULL), other);
+  }
+}
+END_TEST
+
+START_TEST(test_fiber_join)
+{
+  long sum = 0;
+  thread::Fiber fiber = thread::Fiber::spawn(
+    [&sum](int a, std::string b) {
+      ThreadYield();
+      sum = a + (long)b.size();
+    },
+    40,
+    std::string("ab"));
+  ck_assert(fiber.joinable());
+  ck_assert_int_gt(fiber.id(), 0);
+  fiber.join();
+  ck_assert(!fiber.joinable());
+  ck_assert_int_eq(sum, 42);
+
+  // A fiber cannot join itself
+  int code = 0;
+  thread::Fiber self;
+  self = thread::Fiber::spawn([&self, &code] {
+    try {
+      self.join();
+    } catch (const thread::Error& e) {
+      code = e.code();
+    }
+  });
+  self.join();
+  ck_assert_int_eq(code, ERROR_THREAD_BAD);
+}
+END_TEST
+
+START_TEST(test_fiber_detach)
+{
+  thread::Fiber fiber = thread::Fiber::spawn([] {
+    ThreadYield();
+    finished = 1;
+  });
+  fiber.detach();
+  ck_assert(!fiber.joinable());
+  while (!finished) {
+    ThreadYield();
+  }
+}
+END_TEST
+
+START_TEST(test_fiber_move)
+{
+  volatile int first = 0;
+  volatile int second = 0;
+  thread::Fiber a = thread::Fiber::spawn([&first] {
+    for (int i = 0; i < 100; i++) {
+      ThreadYield();
+    }
+    first = 1;
+  });
+  Tid const tid = a.id();
+  thread::Fiber b = std::move(a);
+  ck_assert(!a.joinable());
+  ck_assert_int_eq(b.id(), tid);
+
+  // Assigning to a joinable fiber joins it first
+  b = thread::Fiber::spawn([&second] { second = 1; });
+  ck_assert_int_eq(first, 1);
+  ck_assert(b.joinable());
+  b.join();
+  ck_assert_int_eq(second, 1);
+}
+END_TEST
+
+START_TEST(test_fiber_destructor)
+{
+  {
+    thread::Fiber fiber = thread::Fiber::spawn([] {
+      for (int i = 0; i < 100; i++) {
+        ThreadYield();
+      }
+      finished = 1;
+    });
+  }
+  ck_assert_int_eq(finished, 1);
+}
+END_TEST
+
+START_TEST(test_channel_by_value)
+{
+  static_assert(thread::Channel<long>::by_value);
+  thread::Channel<long> channel;
+  thread::Fiber sender = thread::Fiber::spawn([&channel] {
+    for (long i = 0; i < MESSAGE_COUNT; i++) {
+      ck_assert(channel.send(i));
+    }
+    channel.close();
+  });
+  for (long i = 0; i < MESSAGE_COUNT; i++) {
+    std::optional<long> const message = channel.recv();
+    ck_assert(message.has_value());
+    ck_assert_int_eq(*message, i);
+  }
+  ck_assert(!channel.recv().has_value());
+  ck_assert(!channel.send(0));
+  sender.join();
+}
+END_TEST
+
+START_TEST(test_channel_boxed)
+{
+  static_assert(!thread::Channel<Counted>::by_value);
+  {
+    thread::Channel<Counted> channel(MESSAGE_COUNT);
+    thread::Fiber sender = thread::Fiber::spawn([&channel] {
+      for (int i = 0; i < MESSAGE_COUNT; i++) {
+        ck_assert(channel.send(Counted(i)));
+      }
+    });
+    sender.join();
+    for (int i = 0; i < MESSAGE_COUNT / 2; i++) {
+      std::optional<Counted> const message = channel.recv();
+      ck_assert(message.has_value());
+      ck_assert_int_eq(message->value, i);
+    }
+    ck_assert_int_eq(Counted::live, MESSAGE_COUNT / 2);
+
+    // A closed channel frees what it is sent
+    ck_assert(channel.close());
+    ck_assert(!channel.send(Counted(-1)));
+    ck_assert_int_eq(Counted::live, MESSAGE_COUNT / 2);
+  }
+  // The messages left in the buffer are freed with the channel
+  ck_assert_int_eq(Counted::live, 0);
+}
+END_TEST
+
+START_TEST(test_task_nested)
+{
+  Tid const waker = ThreadCreate(f_wake_until_finished, NULL);
+  ck_assert_int_gt(waker, 0);
+  ck_assert_int_eq(thread_coro::sync_wait(sum_of_doubled(3, 4)), 14);
+  thread_coro::sync_wait(nested_void());
+  finished = 1;
+  ck_assert_int_eq(ThreadJoin(waker, NULL), waker);
+}
+END_TEST
+
+START_TEST(test_sync_wait_rethrows)
+{
+  Tid const waker = ThreadCreate(f_wake_until_finished, NULL);
+  ck_assert_int_gt(waker, 0);
+  const char* what = "";
+  try {
+    thread_coro::sync_wait(rethrow_nested());
+  } catch (const std::runtime_error& e) {
+    what = e.what();
+  }
+  ck_assert_str_eq(what, "after");
+  finished = 1;
+  ck_assert_int_eq(ThreadJoin(waker, NULL), waker);
+
+  // Thrown before the coroutine first suspends
+  what = "";
+  try {
+    thread_coro::sync_wait(throw_at_once());
+  } catch (const std::runtime_error& e) {
+    what = e.what();
+  }
+  ck_assert_str_eq(what, "at once");
+}
+END_TEST
+
+START_TEST(test_join_exit_code)
+{
+  Tid const tid = ThreadCreate(f_exit_42, NULL);
+  ck_assert_int_gt(tid, 0);
+  int exit_code = 0;
+  ck_assert_int_eq(thread_coro::sync_wait(join_exit_code(tid, &exit_code)),
+                   tid);
+  ck_assert_int_eq(exit_code, 42);
+
+  // A failed join yields its error code and leaves exit_code alone
+  exit_code = 0;
+  ck_assert_int_eq(thread_coro::sync_wait(join_exit_code(-1, &exit_code)),
+                   ERROR_TID_INVALID);
+  ck_assert_int_eq(exit_code, 0);
+}
+END_TEST
+
+int
+main(void)
+{
+  TCase* fiber_case = tcase_create("Fiber Case");
+  tcase_add_checked_fixture(fiber_case, set_up, tear_down);
+  tcase_add_test(fiber_case, test_fiber_join);
+  tcase_add_test(fiber_case, test_fiber_detach);
+  tcase_add_test(fiber_case, test_fiber_move);
+  tcase_add_test(fiber_case, test_fiber_destructor);
+  tcase_add_test(fiber_case, test_fiber_tid_reuse);
+
+  TCase* channel_case = tcase_create("Channel Case");
+  tcase_add_checked_fixture(channel_case, set_up, tear_down);
+  tcase_add_test(channel_case, test_channel_by_value);
+  tcase_add_test(channel_case, test_channel_boxed);
+
+  TCase* coroutine_case = tcase_create("Coroutine Case");
+  tcase_add_checked_fixture(coroutine_case, set_up, tear_down);
+  tcase_add_test(coroutine_case, test_task_nested);
+  tcase_add_test(coroutine_case, test_sync_wait_rethrows);
+  tcase_add_test(coroutine_case, test_join_exit_code);
+
+  Suite* suite = suite_create("C++ Interface Test Suite");
+  suite_add_tcase(suite, fiber_case);
+  suite_add_tcase(suite, channel_case);
+  suite_add_tcase(suite, coroutine_case);
+
+  SRunner* suite_runner = srunner_create(suite);
+  srunner_run_all(suite_runner, CK_VERBOSE);
+
+  srunner_ntests_failed(suite_runner);
+  srunner_free(suite_runner);
+
+  return EXIT_SUCCESS;
+}
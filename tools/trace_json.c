@@ -0,0 +1,122 @@
+/**
+ * @file Convert a trace written by ThreadTraceDump to the Chrome trace event
+ * format, for Perfetto (ui.perfetto.dev) or chrome://tracing.
+ *
+ * Each thread gets its own track, with a slice for every stretch of time it
+ * held the CPU, and instant events for everything else the trace recorded.
+ *
+ * Usage: trace_json TRACE > trace.json
+ */
+#include <stdio.h>
+
+#include "thread.h"
+
+static const char* const event_names[] = {
+  [THREAD_TRACE_CREATE] = "create", [THREAD_TRACE_SWITCH] = "switch",
+  [THREAD_TRACE_SLEEP] = "sleep",   [THREAD_TRACE_WAKE] = "wake",
+  [THREAD_TRACE_JOIN] = "join",     [THREAD_TRACE_KILL] = "kill",
+  [THREAD_TRACE_EXIT] = "exit",     [THREAD_TRACE_PREEMPT] = "preempt",
+};
+
+// Which threads appeared in the trace, to name their tracks
+static int seen[MAX_THREADS];
+// When each thread started running, or -1 if it is not running
+static long long running_since[MAX_THREADS];
+
+static int first_event = 1;
+
+/**
+ * Start a new element of the traceEvents array.
+ */
+static void
+begin_event(void)
+{
+  printf(first_event ? "\n  " : ",\n  ");
+  first_event = 0;
+}
+
+static void
+print_slice(int tid, long long start, long long end)
+{
+  begin_event();
+  printf("{\"name\": \"running\", \"ph\": \"X\", \"pid\": 1, \"tid\": %d, "
+         "\"ts\": %.3f, \"dur\": %.3f}",
+         tid,
+         start / 1000.0,
+         (end - start) / 1000.0);
+}
+
+int
+main(int argc, char* argv[])
+{
+  if (argc != 2) {
+    fprintf(stderr, "usage: %s TRACE\n", argv[0]);
+    return 1;
+  }
+  FILE* in = fopen(argv[1], "rb");
+  if (in == NULL) {
+    perror(argv[1]);
+    return 1;
+  }
+
+  for (int i = 0; i < MAX_THREADS; i++) {
+    running_since[i] = -1;
+  }
+  printf("{\"displayTimeUnit\": \"ns\", \"traceEvents\": [");
+
+  ThreadTraceRecord record;
+  long long last = 0;
+  while (fread(&record, sizeof(record), 1, in) == 1) {
+    if (record.tid >= MAX_THREADS ||
+        record.event > THREAD_TRACE_PREEMPT) {
+      fprintf(stderr, "%s: not a trace\n", argv[1]);
+      return 1;
+    }
+    long long const time = (long long)record.time;
+    last = time;
+    seen[record.tid] = 1;
+
+    if (record.event == THREAD_TRACE_SWITCH) {
+      int const next = record.arg;
+      if (next < 0 || next >= MAX_THREADS) {
+        fprintf(stderr, "%s: not a trace\n", argv[1]);
+        return 1;
+      }
+      // The trace may start while the thread is running, so its first slice
+      // starts at the beginning of the trace
+      long long const start =
+        running_since[record.tid] >= 0 ? running_since[record.tid] : 0;
+      if (record.tid != next) {
+        print_slice(record.tid, start, time);
+        running_since[record.tid] = -1;
+      }
+      running_since[next] = time;
+      seen[next] = 1;
+      continue;
+    }
+
+    begin_event();
+    printf("{\"name\": \"%s\", \"ph\": \"i\", \"s\": \"t\", \"pid\": 1, "
+           "\"tid\": %d, \"ts\": %.3f, \"args\": {\"arg\": %d}}",
+           event_names[record.event],
+           record.tid,
+           time / 1000.0,
+           record.arg);
+  }
+  fclose(in);
+
+  for (int i = 0; i < MAX_THREADS; i++) {
+    if (running_since[i] >= 0) {
+      print_slice(i, running_since[i], last);
+    }
+    if (seen[i]) {
+      begin_event();
+      printf("{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, "
+             "\"tid\": %d, \"args\": {\"name\": \"thread %d\"}}",
+             i,
+             i);
+    }
+  }
+  printf("\n]}\n");
+  return 0;
+}